@@ -0,0 +1,328 @@
+/* hal-capture.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Captures incoming transactions to a file, and replays them against an
+ * implementation without binder.
+ *
+ * A capture starts with a CaptureHeader, followed by a CaptureRecord for
+ * every transaction, each one followed by the interface name and the
+ * payload. Everything is in native byte order. The payload is either
+ * flattened by the implementation, or the raw parcel data if the
+ * implementation can't flatten it; only the former can be replayed.
+ */
+
+#define G_LOG_DOMAIN "droid-hal-capture"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "hal-capture.h"
+
+#define CAPTURE_MAGIC          "LDHC"
+#define CAPTURE_VERSION        1
+
+/* Records replayed in a row before letting the main loop run */
+#define REPLAY_MAX_BURST       64
+
+typedef enum
+{
+  CAPTURE_RECORD_FLAG_FLAT = 1 << 0,
+} CaptureRecordFlags;
+
+typedef struct
+{
+  gchar   magic[4];
+  guint32 version;
+} CaptureHeader;
+
+typedef struct
+{
+  guint64 timestamp;     /* Microseconds since the capture started */
+  guint32 code;
+  guint16 flags;
+  guint16 iface_size;
+  guint32 payload_size;
+  guint32 reserved;
+} CaptureRecord;
+
+struct _DroidHalCapture
+{
+  FILE   *file;
+  gint64  start_time;
+  GMutex  lock;
+};
+
+typedef struct
+{
+  DroidHalImplementation *implementation;
+  GMainLoop              *loop;
+  gchar                  *data;
+  gsize                   size;
+  gsize                   offset;
+  gdouble                 speed;
+  gint64                  start_time;
+
+  guint                   replayed;
+  guint                   skipped;
+  guint                   failed;
+  gint64                  busy_time;
+  GError                 *error;
+} DroidHalReplay;
+
+DroidHalCapture *
+droid_hal_capture_new (const gchar  *path,
+                       GError      **error)
+{
+  DroidHalCapture *capture;
+  CaptureHeader header = { .version = CAPTURE_VERSION };
+  FILE *file;
+
+  file = g_fopen (path, "wb");
+  if (file == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Unable to open %s: %s", path, g_strerror (errno));
+      return NULL;
+    }
+
+  memcpy (header.magic, CAPTURE_MAGIC, sizeof (header.magic));
+  if (fwrite (&header, sizeof (header), 1, file) != 1)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Unable to write to %s: %s", path, g_strerror (errno));
+      fclose (file);
+      return NULL;
+    }
+
+  capture = g_new0 (DroidHalCapture, 1);
+  capture->file       = file;
+  capture->start_time = g_get_monotonic_time ();
+  g_mutex_init (&capture->lock);
+
+  return capture;
+}
+
+void
+droid_hal_capture_free (DroidHalCapture *capture)
+{
+  fclose (capture->file);
+  g_mutex_clear (&capture->lock);
+  g_free (capture);
+}
+
+void
+droid_hal_capture_record (DroidHalCapture        *capture,
+                          DroidHalImplementation *implementation,
+                          GBinderRemoteRequest   *request,
+                          guint                   code)
+{
+  g_autoptr (GBytes) payload = NULL;
+  CaptureRecord record = { 0, };
+  const gchar *iface = gbinder_remote_request_interface (request);
+  GBinderReader reader;
+  gconstpointer data;
+  gsize size;
+
+  record.timestamp = g_get_monotonic_time () - capture->start_time;
+  record.code      = code;
+
+  payload = droid_hal_implementation_capture (implementation, request, code);
+  if (payload != NULL)
+    {
+      record.flags |= CAPTURE_RECORD_FLAG_FLAT;
+    }
+  else
+    {
+      gbinder_remote_request_init_reader (request, &reader);
+      data = gbinder_reader_get_data (&reader, &size);
+      payload = g_bytes_new (data, size);
+    }
+
+  data = g_bytes_get_data (payload, &size);
+  record.iface_size   = iface ? strlen (iface) : 0;
+  record.payload_size = size;
+
+  g_mutex_lock (&capture->lock);
+
+  /* Flushed right away, the service might not get to exit cleanly */
+  if (fwrite (&record, sizeof (record), 1, capture->file) != 1 ||
+      (record.iface_size > 0 && fwrite (iface, record.iface_size, 1, capture->file) != 1) ||
+      (size > 0 && fwrite (data, size, 1, capture->file) != 1) ||
+      fflush (capture->file) != 0)
+    g_warning ("Unable to write capture record: %s", g_strerror (errno));
+
+  g_mutex_unlock (&capture->lock);
+}
+
+static gboolean
+droid_hal_replay_dispatch (gpointer user_data)
+{
+  DroidHalReplay *replay = user_data;
+  g_autoptr (GBytes) payload = NULL;
+  CaptureRecord record;
+  gint64 now, due, started;
+  guint burst = 0;
+
+  while (replay->offset < replay->size)
+    {
+      if (replay->size - replay->offset < sizeof (record))
+        goto truncated;
+
+      memcpy (&record, replay->data + replay->offset, sizeof (record));
+      if (replay->size - replay->offset - sizeof (record) <
+          (gsize) record.iface_size + record.payload_size)
+        goto truncated;
+
+      now = g_get_monotonic_time ();
+      due = replay->start_time;
+      if (replay->speed > 0)
+        due += record.timestamp / replay->speed;
+
+      if (due > now || ++burst > REPLAY_MAX_BURST)
+        {
+          g_timeout_add (MAX (due - now, 0) / 1000, droid_hal_replay_dispatch, replay);
+          return G_SOURCE_REMOVE;
+        }
+
+      replay->offset += sizeof (record) + record.iface_size;
+
+      if (record.flags & CAPTURE_RECORD_FLAG_FLAT)
+        {
+          /* Copied, so that the implementation gets aligned data */
+          payload = g_bytes_new (replay->data + replay->offset, record.payload_size);
+
+          started = g_get_monotonic_time ();
+          if (droid_hal_implementation_replay (replay->implementation, record.code, payload))
+            replay->replayed++;
+          else
+            replay->failed++;
+          replay->busy_time += g_get_monotonic_time () - started;
+
+          g_clear_pointer (&payload, g_bytes_unref);
+        }
+      else
+        {
+          replay->skipped++;
+        }
+
+      replay->offset += record.payload_size;
+    }
+
+  g_main_loop_quit (replay->loop);
+  return G_SOURCE_REMOVE;
+
+truncated:
+  g_set_error (&replay->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+    "Truncated capture at offset %" G_GSIZE_FORMAT, replay->offset);
+  g_main_loop_quit (replay->loop);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Replays the capture at path against the implementation, speed times
+ * faster than it was recorded, or as fast as possible if speed is 0.
+ * The main loop keeps running in the meantime.
+ *
+ * Only the requests are captured: they are applied to the hardware the
+ * implementation drives now, not to the one they were captured on. The
+ * time per record assumes the implementation only returns once the
+ * request has been applied.
+ */
+gboolean
+droid_hal_replay_run (DroidHalImplementation  *implementation,
+                      const gchar             *path,
+                      gdouble                  speed,
+                      GError                 **error)
+{
+  DroidHalReplay replay = { 0, };
+  CaptureHeader header;
+  gdouble elapsed;
+
+  g_return_val_if_fail (DROID_IS_HAL_IMPLEMENTATION (implementation), FALSE);
+
+  if (!g_file_get_contents (path, &replay.data, &replay.size, error))
+    return FALSE;
+
+  if (replay.size < sizeof (header) ||
+      memcmp (replay.data, CAPTURE_MAGIC, sizeof (header.magic)) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+        "%s is not a capture", path);
+      g_free (replay.data);
+      return FALSE;
+    }
+
+  memcpy (&header, replay.data, sizeof (header));
+  if (header.version != CAPTURE_VERSION)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+        "Unsupported capture version %u", header.version);
+      g_free (replay.data);
+      return FALSE;
+    }
+
+  replay.implementation = implementation;
+  replay.loop           = g_main_loop_new (NULL, FALSE);
+  replay.offset         = sizeof (header);
+  replay.speed          = speed;
+  replay.start_time     = g_get_monotonic_time ();
+
+  g_idle_add (droid_hal_replay_dispatch, &replay);
+  g_main_loop_run (replay.loop);
+
+  elapsed = (gdouble) (g_get_monotonic_time () - replay.start_time) / G_USEC_PER_SEC;
+  g_message ("Replayed %u records in %.3fs (%u failed, %u not replayable), "
+             "%.1fus per record on average",
+             replay.replayed, elapsed, replay.failed, replay.skipped,
+             (replay.replayed + replay.failed) ?
+               (gdouble) replay.busy_time / (replay.replayed + replay.failed) : 0);
+
+  g_main_loop_unref (replay.loop);
+  g_free (replay.data);
+
+  if (replay.error != NULL)
+    {
+      g_propagate_error (error, replay.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -39,6 +39,20 @@
 #define G_LOG_DOMAIN "droid-hal-implementation"
 
 #include "hal-implementation.h"
+#include "hal-stats.h"
+
+struct _DroidHalDeferredReply
+{
+  GBinderLocalObject   *object;
+  GBinderRemoteRequest *request;
+  GMainContext         *context;
+  GBinderLocalReply    *reply;
+  int                   status;
+  gint64                start_time;
+};
+
+/* The deferred reply of the request this thread is dispatching, if any */
+static GPrivate dispatching;
 
 G_DEFINE_INTERFACE (DroidHalImplementation, droid_hal_implementation, G_TYPE_OBJECT)
 
@@ -64,3 +78,210 @@ droid_hal_implementation_reply (DroidHalImplementation *self,
 
   return iface->reply (self, object, request, code);
 }
+
+
+/*
+ * Returns the request payload in an implementation-defined form that
+ * droid_hal_implementation_replay() accepts, or NULL if unsupported.
+ */
+GBytes *
+droid_hal_implementation_capture (DroidHalImplementation *self,
+                                  GBinderRemoteRequest   *request,
+                                  guint                   code)
+{
+  DroidHalImplementationInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_HAL_IMPLEMENTATION (self), NULL);
+
+  iface = DROID_HAL_IMPLEMENTATION_GET_IFACE (self);
+  if (iface->capture == NULL)
+    return NULL;
+
+  return iface->capture (self, request, code);
+}
+
+
+/*
+ * Handles a payload from droid_hal_implementation_capture() as if the
+ * request came from binder, minus the reply.
+ */
+gboolean
+droid_hal_implementation_replay (DroidHalImplementation *self,
+                                 guint                   code,
+                                 GBytes                 *payload)
+{
+  DroidHalImplementationInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_HAL_IMPLEMENTATION (self), FALSE);
+
+  iface = DROID_HAL_IMPLEMENTATION_GET_IFACE (self);
+  if (iface->replay == NULL)
+    return FALSE;
+
+  return iface->replay (self, code, payload);
+}
+
+
+/*
+ * Returns whether the implementation has nothing in flight and no state
+ * that would be lost if the process exited, such as a pattern played
+ * in software. Implementations that don't tell are always idle.
+ */
+gboolean
+droid_hal_implementation_is_idle (DroidHalImplementation *self)
+{
+  DroidHalImplementationInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_HAL_IMPLEMENTATION (self), FALSE);
+
+  iface = DROID_HAL_IMPLEMENTATION_GET_IFACE (self);
+  if (iface->is_idle == NULL)
+    return TRUE;
+
+  return iface->is_idle (self);
+}
+
+
+/*
+ * Sets key to what the request changes, e.g. which light, so that a
+ * rate limited request can be dropped in favour of a later one with
+ * the same code and key. Returns FALSE if the request must not be
+ * dropped, which is the default.
+ */
+gboolean
+droid_hal_implementation_coalesce_key (DroidHalImplementation *self,
+                                       GBinderRemoteRequest   *request,
+                                       guint                   code,
+                                       guint                  *key)
+{
+  DroidHalImplementationInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_HAL_IMPLEMENTATION (self), FALSE);
+
+  iface = DROID_HAL_IMPLEMENTATION_GET_IFACE (self);
+  if (iface->coalesce_key == NULL)
+    return FALSE;
+
+  return iface->coalesce_key (self, request, code, key);
+}
+
+
+/*
+ * Runs the reply handler for a request blocked beforehand with
+ * droid_hal_deferred_reply_new(), usually on a worker thread, then
+ * sends the reply. If the handler defers the reply itself, it gets
+ * deferred back and the reply is left to it.
+ */
+void
+droid_hal_implementation_dispatch (DroidHalImplementation *self,
+                                   DroidHalDeferredReply  *deferred,
+                                   guint                   code)
+{
+  GBinderLocalReply *reply;
+
+  g_return_if_fail (DROID_IS_HAL_IMPLEMENTATION (self));
+  g_return_if_fail (deferred != NULL);
+
+  g_private_set (&dispatching, deferred);
+  reply = droid_hal_implementation_reply (self, deferred->object, deferred->request, code);
+
+  if (g_private_get (&dispatching) == NULL)
+    {
+      g_warn_if_fail (reply == NULL);
+      return;
+    }
+
+  g_private_set (&dispatching, NULL);
+  droid_hal_deferred_reply_complete (deferred, reply, GBINDER_STATUS_OK);
+}
+
+
+/*
+ * Blocks the request so that the implementation can return NULL from
+ * its reply handler and send the actual reply later, possibly from
+ * another thread. Must be called from within the reply handler.
+ */
+DroidHalDeferredReply *
+droid_hal_deferred_reply_new (GBinderLocalObject   *object,
+                              GBinderRemoteRequest *request)
+{
+  DroidHalDeferredReply *deferred;
+
+  g_return_val_if_fail (object != NULL, NULL);
+  g_return_val_if_fail (request != NULL, NULL);
+
+  /* Already blocked by droid_hal_implementation_dispatch(), hand it over */
+  deferred = g_private_get (&dispatching);
+  if (deferred != NULL && deferred->request == request)
+    {
+      g_private_set (&dispatching, NULL);
+      return deferred;
+    }
+
+  deferred = g_new0 (DroidHalDeferredReply, 1);
+  deferred->object  = gbinder_local_object_ref (object);
+  deferred->request = gbinder_remote_request_ref (request);
+  deferred->context = g_main_context_ref_thread_default ();
+  deferred->start_time = g_get_monotonic_time ();
+
+  gbinder_remote_request_block (request);
+
+  return deferred;
+}
+
+
+GBinderLocalReply *
+droid_hal_deferred_reply_new_reply (DroidHalDeferredReply *deferred)
+{
+  g_return_val_if_fail (deferred != NULL, NULL);
+
+  return gbinder_local_object_new_reply (deferred->object);
+}
+
+
+static gboolean
+droid_hal_deferred_reply_dispatch (gpointer user_data)
+{
+  DroidHalDeferredReply *deferred = user_data;
+
+  gbinder_remote_request_complete (deferred->request, deferred->reply,
+    deferred->status);
+  droid_hal_stats_record (droid_hal_stats_get_default (), deferred->start_time);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+droid_hal_deferred_reply_free (gpointer user_data)
+{
+  DroidHalDeferredReply *deferred = user_data;
+
+  if (deferred->reply)
+      gbinder_local_reply_unref (deferred->reply);
+
+  gbinder_remote_request_unref (deferred->request);
+  gbinder_local_object_unref (deferred->object);
+  g_main_context_unref (deferred->context);
+  g_free (deferred);
+}
+
+
+/*
+ * Sends the reply and releases the deferred reply. This is thread-safe:
+ * the transaction is completed on the main context that was running the
+ * reply handler.
+ */
+void
+droid_hal_deferred_reply_complete (DroidHalDeferredReply *deferred,
+                                   GBinderLocalReply     *reply,
+                                   int                    status)
+{
+  g_return_if_fail (deferred != NULL);
+
+  deferred->reply  = reply;
+  deferred->status = status;
+
+  g_main_context_invoke_full (deferred->context, G_PRIORITY_HIGH,
+    droid_hal_deferred_reply_dispatch, deferred, droid_hal_deferred_reply_free);
+}
@@ -48,6 +48,8 @@ G_BEGIN_DECLS
 #define DROID_TYPE_HAL_IMPLEMENTATION droid_hal_implementation_get_type()
 G_DECLARE_INTERFACE (DroidHalImplementation, droid_hal_implementation, DROID, HAL_IMPLEMENTATION, GObject)
 
+typedef struct _DroidHalDeferredReply DroidHalDeferredReply;
+
 struct _DroidHalImplementationInterface
 {
   GTypeInterface parent_iface;
@@ -56,12 +58,53 @@ struct _DroidHalImplementationInterface
                                 GBinderLocalObject     *object,
                                 GBinderRemoteRequest   *request,
                                 guint                   code);
+
+  /*
+   * Optional, to capture requests in a form that can be replayed.
+   * replay should only return once the request has been applied.
+   */
+  GBytes *            (*capture) (DroidHalImplementation *self,
+                                  GBinderRemoteRequest   *request,
+                                  guint                   code);
+  gboolean            (*replay)  (DroidHalImplementation *self,
+                                  guint                   code,
+                                  GBytes                 *payload);
+
+  /* Optional, whether the service may exit without losing any state */
+  gboolean            (*is_idle) (DroidHalImplementation *self);
+
+  /* Optional, which rate limited requests supersede each other */
+  gboolean            (*coalesce_key) (DroidHalImplementation *self,
+                                       GBinderRemoteRequest   *request,
+                                       guint                   code,
+                                       guint                  *key);
 };
 
-GBinderLocalReply * droid_hal_implementation_reply (DroidHalImplementation *self,
-                                                    GBinderLocalObject     *object,
-                                                    GBinderRemoteRequest   *request,
-                                                    guint                   code);
+GBinderLocalReply * droid_hal_implementation_reply    (DroidHalImplementation *self,
+                                                       GBinderLocalObject     *object,
+                                                       GBinderRemoteRequest   *request,
+                                                       guint                   code);
+GBytes *            droid_hal_implementation_capture  (DroidHalImplementation *self,
+                                                       GBinderRemoteRequest   *request,
+                                                       guint                   code);
+gboolean            droid_hal_implementation_replay   (DroidHalImplementation *self,
+                                                       guint                   code,
+                                                       GBytes                 *payload);
+void                droid_hal_implementation_dispatch (DroidHalImplementation *self,
+                                                       DroidHalDeferredReply  *deferred,
+                                                       guint                   code);
+gboolean            droid_hal_implementation_is_idle  (DroidHalImplementation *self);
+gboolean            droid_hal_implementation_coalesce_key (DroidHalImplementation *self,
+                                                           GBinderRemoteRequest   *request,
+                                                           guint                   code,
+                                                           guint                  *key);
+
+DroidHalDeferredReply * droid_hal_deferred_reply_new       (GBinderLocalObject    *object,
+                                                            GBinderRemoteRequest  *request);
+GBinderLocalReply *     droid_hal_deferred_reply_new_reply (DroidHalDeferredReply *deferred);
+void                    droid_hal_deferred_reply_complete  (DroidHalDeferredReply *deferred,
+                                                            GBinderLocalReply     *reply,
+                                                            int                    status);
 
 G_END_DECLS
 
@@ -0,0 +1,462 @@
+/* hal-limiter.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Token buckets keeping a single client from flooding the service.
+ * Every client, told apart by its pid and euid, gets one bucket for all
+ * of its transactions and one per method with a rule. Oneway
+ * transactions come without a sender pid, they share a bucket per euid.
+ * Only used from the main loop, so there is no locking.
+ */
+
+#define G_LOG_DOMAIN "droid-hal-limiter"
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "hal-limiter.h"
+
+/* Clients not seen for that long are forgotten, pids get reused */
+#define LIMITER_EXPIRE_USEC (60 * G_USEC_PER_SEC)
+
+#define LIMITER_ANY_METHOD G_MAXUINT
+
+typedef struct
+{
+  guint   code;
+  gdouble rate;
+  gdouble burst;
+} LimiterRule;
+
+typedef struct
+{
+  gdouble tokens;
+  gint64  updated;
+} LimiterBucket;
+
+typedef struct
+{
+  guint         code;
+  LimiterBucket bucket;
+  guint         accepted;
+  guint         limited;
+} LimiterMethod;
+
+typedef struct
+{
+  guint64       key;
+  pid_t         pid;
+  uid_t         uid;
+  gint64        last_seen;
+  LimiterBucket bucket;
+  GArray       *methods;
+
+  guint         accepted;
+  guint         deferred;
+  guint         coalesced;
+  guint         rejected;
+} LimiterClient;
+
+struct _DroidHalLimiter
+{
+  /* The whole client, rate 0 if unlimited */
+  LimiterRule  client_rule;
+  GArray      *method_rules;
+
+  GHashTable  *clients;
+  gint64       last_expire;
+};
+
+static void
+limiter_client_free (LimiterClient *client)
+{
+  g_array_unref (client->methods);
+  g_free (client);
+}
+
+static gboolean
+limiter_parse_rule (const gchar  *spec,
+                    LimiterRule  *rule,
+                    GError      **error)
+{
+  g_auto (GStrv) tokens = g_strsplit (spec, ":", 2);
+  gchar *end = NULL;
+
+  rule->rate = g_ascii_strtod (tokens[0], &end);
+  if (end == tokens[0] || *end != '\0' || rule->rate < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Invalid rate '%s'", tokens[0]);
+      return FALSE;
+    }
+
+  /* A burst of one second worth of requests unless told otherwise */
+  rule->burst = MAX (rule->rate, 1);
+  if (tokens[1] != NULL)
+    {
+      rule->burst = g_ascii_strtod (tokens[1], &end);
+      if (end == tokens[1] || *end != '\0' || rule->burst < 1)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid burst '%s'", tokens[1]);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * spec is a comma separated list of RATE[:BURST], rate in transactions
+ * per second, for everything a client sends and CODE=RATE[:BURST] for
+ * the given transaction code. "*" as the code applies to every method
+ * without a rule of its own. A rate of 0 is unlimited.
+ *
+ * E.g. "50:100,1=10" allows 50 transactions per second per client, up
+ * to 100 at once, of which 10 per second with code 1.
+ */
+DroidHalLimiter *
+droid_hal_limiter_new (const gchar  *spec,
+                       GError      **error)
+{
+  g_autoptr (DroidHalLimiter) limiter = g_new0 (DroidHalLimiter, 1);
+  g_auto (GStrv) items = g_strsplit (spec, ",", -1);
+
+  limiter->method_rules = g_array_new (FALSE, FALSE, sizeof (LimiterRule));
+  limiter->clients = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+    (GDestroyNotify) limiter_client_free);
+
+  for (guint i=0; items[i] != NULL; i++)
+    {
+      gchar *item = g_strstrip (items[i]);
+      gchar *equal = strchr (item, '=');
+      LimiterRule rule = { 0 };
+      guint64 code;
+
+      if (*item == '\0')
+        continue;
+
+      if (equal == NULL)
+        {
+          if (!limiter_parse_rule (item, &limiter->client_rule, error))
+            return NULL;
+          continue;
+        }
+
+      *equal = '\0';
+      if (g_strcmp0 (item, "*") == 0)
+        code = LIMITER_ANY_METHOD;
+      else if (!g_ascii_string_to_unsigned (item, 0, 0, G_MAXUINT - 1, &code, NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid transaction code '%s'", item);
+          return NULL;
+        }
+
+      if (!limiter_parse_rule (equal + 1, &rule, error))
+        return NULL;
+
+      rule.code = (guint) code;
+      g_array_append_val (limiter->method_rules, rule);
+    }
+
+  return g_steal_pointer (&limiter);
+}
+
+void
+droid_hal_limiter_free (DroidHalLimiter *limiter)
+{
+  g_array_unref (limiter->method_rules);
+  g_hash_table_unref (limiter->clients);
+  g_free (limiter);
+}
+
+static const LimiterRule *
+limiter_method_rule (DroidHalLimiter *limiter,
+                     guint            code)
+{
+  const LimiterRule *fallback = NULL;
+
+  for (guint i=0; i < limiter->method_rules->len; i++)
+    {
+      const LimiterRule *rule = &g_array_index (limiter->method_rules, LimiterRule, i);
+
+      if (rule->code == code)
+        return rule;
+      else if (rule->code == LIMITER_ANY_METHOD)
+        fallback = rule;
+    }
+
+  return fallback;
+}
+
+static void
+limiter_bucket_refill (LimiterBucket     *bucket,
+                       const LimiterRule *rule,
+                       gint64             now)
+{
+  bucket->tokens = MIN (rule->burst,
+    bucket->tokens + (now - bucket->updated) * rule->rate / G_USEC_PER_SEC);
+  bucket->updated = now;
+}
+
+/* How long until the bucket has a token, 0 if it has one already */
+static gint64
+limiter_bucket_delay (const LimiterBucket *bucket,
+                      const LimiterRule   *rule)
+{
+  if (rule == NULL || rule->rate == 0 || bucket->tokens >= 1)
+    return 0;
+
+  return (gint64) ((1 - bucket->tokens) * G_USEC_PER_SEC / rule->rate) + 1;
+}
+
+static void
+limiter_expire (DroidHalLimiter *limiter,
+                gint64           now)
+{
+  GHashTableIter iter;
+  LimiterClient *client;
+
+  if (now - limiter->last_expire < LIMITER_EXPIRE_USEC)
+    return;
+
+  limiter->last_expire = now;
+
+  g_hash_table_iter_init (&iter, limiter->clients);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client))
+    {
+      if (now - client->last_seen >= LIMITER_EXPIRE_USEC)
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+/* Oneway transactions have pid 0, which leaves the euid alone */
+static guint64
+limiter_client_key (pid_t pid,
+                    uid_t uid)
+{
+  return ((guint64) uid << 32) | (guint32) pid;
+}
+
+static LimiterClient *
+limiter_find (DroidHalLimiter *limiter,
+              pid_t            pid,
+              uid_t            uid)
+{
+  guint64 key = limiter_client_key (pid, uid);
+
+  return g_hash_table_lookup (limiter->clients, &key);
+}
+
+static LimiterClient *
+limiter_lookup (DroidHalLimiter *limiter,
+                pid_t            pid,
+                uid_t            uid,
+                gint64           now)
+{
+  LimiterClient *client = limiter_find (limiter, pid, uid);
+
+  if (client == NULL)
+    {
+      client = g_new0 (LimiterClient, 1);
+      client->key = limiter_client_key (pid, uid);
+      client->pid = pid;
+      client->uid = uid;
+      client->bucket.tokens  = limiter->client_rule.burst;
+      client->bucket.updated = now;
+      client->methods = g_array_new (FALSE, FALSE, sizeof (LimiterMethod));
+      g_hash_table_insert (limiter->clients, &client->key, client);
+    }
+
+  client->last_seen = now;
+
+  return client;
+}
+
+static LimiterMethod *
+limiter_client_method (LimiterClient     *client,
+                       guint              code,
+                       const LimiterRule *rule,
+                       gint64             now)
+{
+  LimiterMethod method = { 0 };
+
+  for (guint i=0; i < client->methods->len; i++)
+    {
+      if (g_array_index (client->methods, LimiterMethod, i).code == code)
+        return &g_array_index (client->methods, LimiterMethod, i);
+    }
+
+  method.code = code;
+  method.bucket.tokens  = rule != NULL ? rule->burst : 0;
+  method.bucket.updated = now;
+  g_array_append_val (client->methods, method);
+
+  return &g_array_index (client->methods, LimiterMethod, client->methods->len - 1);
+}
+
+/*
+ * Takes a token for a transaction with the given code from the client, if
+ * both the client and the method have one left. Returns FALSE if the
+ * transaction is over the limit, in which case nothing is taken.
+ */
+gboolean
+droid_hal_limiter_admit (DroidHalLimiter *limiter,
+                         pid_t            pid,
+                         uid_t            uid,
+                         guint            code)
+{
+  gint64 now = g_get_monotonic_time ();
+  const LimiterRule *rule = limiter_method_rule (limiter, code);
+  LimiterClient *client;
+  LimiterMethod *method;
+
+  limiter_expire (limiter, now);
+
+  client = limiter_lookup (limiter, pid, uid, now);
+  method = limiter_client_method (client, code, rule, now);
+
+  limiter_bucket_refill (&client->bucket, &limiter->client_rule, now);
+  if (rule != NULL)
+    limiter_bucket_refill (&method->bucket, rule, now);
+
+  if (limiter_bucket_delay (&client->bucket, &limiter->client_rule) > 0 ||
+      limiter_bucket_delay (&method->bucket, rule) > 0)
+    {
+      method->limited++;
+      return FALSE;
+    }
+
+  if (limiter->client_rule.rate > 0)
+    client->bucket.tokens -= 1;
+  if (rule != NULL && rule->rate > 0)
+    method->bucket.tokens -= 1;
+
+  client->accepted++;
+  method->accepted++;
+
+  return TRUE;
+}
+
+/* How long until a transaction with the given code from the client is admitted */
+gint64
+droid_hal_limiter_delay (DroidHalLimiter *limiter,
+                         pid_t            pid,
+                         uid_t            uid,
+                         guint            code)
+{
+  gint64 now = g_get_monotonic_time ();
+  const LimiterRule *rule = limiter_method_rule (limiter, code);
+  LimiterClient *client = limiter_find (limiter, pid, uid);
+  LimiterMethod *method;
+
+  if (client == NULL)
+    return 0;
+
+  method = limiter_client_method (client, code, rule, now);
+
+  limiter_bucket_refill (&client->bucket, &limiter->client_rule, now);
+  if (rule != NULL)
+    limiter_bucket_refill (&method->bucket, rule, now);
+
+  return MAX (limiter_bucket_delay (&client->bucket, &limiter->client_rule),
+              limiter_bucket_delay (&method->bucket, rule));
+}
+
+/* Accounts for what was done with a transaction that wasn't admitted */
+void
+droid_hal_limiter_record (DroidHalLimiter        *limiter,
+                          pid_t                   pid,
+                          uid_t                   uid,
+                          guint                   code,
+                          DroidHalLimiterOutcome  outcome)
+{
+  LimiterClient *client = limiter_find (limiter, pid, uid);
+
+  if (client == NULL)
+    return;
+
+  switch (outcome)
+    {
+    case DROID_HAL_LIMITER_DEFERRED:
+      client->deferred++;
+      break;
+
+    case DROID_HAL_LIMITER_COALESCED:
+      client->coalesced++;
+      break;
+
+    case DROID_HAL_LIMITER_REJECTED:
+      client->rejected++;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+void
+droid_hal_limiter_report (DroidHalLimiter *limiter,
+                          gboolean         reset)
+{
+  GHashTableIter iter;
+  LimiterClient *client;
+
+  g_hash_table_iter_init (&iter, limiter->clients);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client))
+    {
+      g_message ("Client %d (uid %u): %u accepted, %u deferred, %u coalesced, %u rejected",
+        client->pid, client->uid, client->accepted, client->deferred, client->coalesced,
+        client->rejected);
+
+      for (guint i=0; i < client->methods->len; i++)
+        {
+          LimiterMethod *method = &g_array_index (client->methods, LimiterMethod, i);
+
+          g_message ("  code %u: %u accepted, %u over the limit", method->code,
+            method->accepted, method->limited);
+
+          if (reset)
+            method->accepted = method->limited = 0;
+        }
+
+      if (reset)
+        client->accepted = client->deferred = client->coalesced = client->rejected = 0;
+    }
+}
@@ -0,0 +1,76 @@
+/* hal-limiter.h
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DroidHalLimiter DroidHalLimiter;
+
+typedef enum
+{
+  DROID_HAL_LIMITER_DEFERRED,
+  DROID_HAL_LIMITER_COALESCED,
+  DROID_HAL_LIMITER_REJECTED,
+} DroidHalLimiterOutcome;
+
+DroidHalLimiter * droid_hal_limiter_new    (const gchar             *spec,
+                                            GError                 **error);
+void              droid_hal_limiter_free   (DroidHalLimiter         *limiter);
+gboolean          droid_hal_limiter_admit  (DroidHalLimiter         *limiter,
+                                            pid_t                    pid,
+                                            uid_t                    uid,
+                                            guint                    code);
+gint64            droid_hal_limiter_delay  (DroidHalLimiter         *limiter,
+                                            pid_t                    pid,
+                                            uid_t                    uid,
+                                            guint                    code);
+void              droid_hal_limiter_record (DroidHalLimiter         *limiter,
+                                            pid_t                    pid,
+                                            uid_t                    uid,
+                                            guint                    code,
+                                            DroidHalLimiterOutcome   outcome);
+void              droid_hal_limiter_report (DroidHalLimiter         *limiter,
+                                            gboolean                 reset);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DroidHalLimiter, droid_hal_limiter_free)
+
+G_END_DECLS
@@ -0,0 +1,121 @@
+/* hal-notify.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The service manager notification protocol (sd_notify), so that
+ * services can tell systemd when they are ready without depending on
+ * libsystemd.
+ */
+
+#define G_LOG_DOMAIN "droid-hal-notify"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hal-notify.h"
+
+#define NOTIFY_SOCKET_ENV  "NOTIFY_SOCKET"
+#define WATCHDOG_USEC_ENV  "WATCHDOG_USEC"
+#define WATCHDOG_PID_ENV   "WATCHDOG_PID"
+
+/*
+ * Sends state, e.g. "READY=1", to the service manager. Returns FALSE if
+ * not running under one that asked for notifications.
+ */
+gboolean
+droid_hal_notify (const gchar *state)
+{
+  const gchar *path = g_getenv (NOTIFY_SOCKET_ENV);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  gsize path_len, state_len;
+  ssize_t sent;
+  int fd;
+
+  g_return_val_if_fail (state != NULL, FALSE);
+
+  if (path == NULL || (path[0] != '/' && path[0] != '@'))
+    return FALSE;
+
+  path_len = strlen (path);
+  if (path_len >= sizeof (addr.sun_path))
+    return FALSE;
+
+  /* A leading @ stands for the abstract namespace */
+  memcpy (addr.sun_path, path, path_len);
+  if (addr.sun_path[0] == '@')
+    addr.sun_path[0] = '\0';
+
+  fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return FALSE;
+
+  state_len = strlen (state);
+  sent = sendto (fd, state, state_len, MSG_NOSIGNAL, (struct sockaddr *) &addr,
+    offsetof (struct sockaddr_un, sun_path) + path_len);
+  if (sent < 0)
+    g_debug ("Unable to notify %s: %s", state, g_strerror (errno));
+
+  close (fd);
+
+  return sent == (ssize_t) state_len;
+}
+
+/*
+ * Returns the watchdog interval requested by the service manager for
+ * this process, 0 if none. Pings must be sent well within it.
+ */
+guint64
+droid_hal_notify_watchdog_usec (void)
+{
+  const gchar *usec = g_getenv (WATCHDOG_USEC_ENV);
+  const gchar *pid = g_getenv (WATCHDOG_PID_ENV);
+
+  if (usec == NULL)
+    return 0;
+
+  /* Meant for another process, e.g. the one that forked us */
+  if (pid != NULL && g_ascii_strtoull (pid, NULL, 10) != (guint64) getpid ())
+    return 0;
+
+  return g_ascii_strtoull (usec, NULL, 10);
+}
@@ -0,0 +1,135 @@
+/* hal-plugin.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#define G_LOG_DOMAIN "droid-hal-plugin"
+
+#include <gmodule.h>
+
+#include "hal-plugin.h"
+
+#define PLUGIN_KEY "plugin"
+
+static gboolean
+droid_hal_plugin_load (DroidHalService  *service,
+                       GKeyFile         *config,
+                       const gchar      *group,
+                       const gchar      *plugin_dir,
+                       GError          **error)
+{
+  g_autofree gchar *plugin = NULL;
+  g_autofree gchar *path = NULL;
+  DroidHalPluginInitFunc init;
+  GModule *module;
+
+  plugin = g_key_file_get_string (config, group, PLUGIN_KEY, error);
+  if (plugin == NULL)
+    return FALSE;
+
+  if (g_path_is_absolute (plugin))
+    path = g_strdup (plugin);
+  else
+    path = g_strdup_printf ("%s/libdroid-hal-%s.so", plugin_dir, plugin);
+
+  module = g_module_open (path, G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+  if (module == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "Unable to load %s: %s", path, g_module_error ());
+      return FALSE;
+    }
+
+  if (!g_module_symbol (module, DROID_HAL_PLUGIN_INIT, (gpointer *) &init) || init == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        "%s is not a HAL plugin", path);
+      g_module_close (module);
+      return FALSE;
+    }
+
+  /* Plugins register types, so they can't be unloaded */
+  g_module_make_resident (module);
+
+  return init (service, config, group, error);
+}
+
+/*
+ * Loads the plugins listed in the host configuration at path, one per
+ * group. Plugins that fail to load are skipped, this only fails if the
+ * configuration can't be read or none of them could be loaded.
+ */
+gboolean
+droid_hal_plugin_load_config (DroidHalService  *service,
+                              const gchar      *path,
+                              const gchar      *plugin_dir,
+                              GError          **error)
+{
+  g_autoptr (GKeyFile) config = g_key_file_new ();
+  g_auto (GStrv) groups = NULL;
+  guint loaded = 0;
+
+  g_return_val_if_fail (DROID_IS_HAL_SERVICE (service), FALSE);
+
+  if (!g_key_file_load_from_file (config, path, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  groups = g_key_file_get_groups (config, NULL);
+  for (guint i=0; groups[i] != NULL; i++)
+    {
+      g_autoptr (GError) plugin_error = NULL;
+
+      if (droid_hal_plugin_load (service, config, groups[i], plugin_dir, &plugin_error))
+        {
+          g_message ("Loaded HAL %s", groups[i]);
+          loaded++;
+        }
+      else
+        {
+          g_warning ("Unable to load HAL %s: %s", groups[i],
+            plugin_error != NULL ? plugin_error->message : "unknown error");
+        }
+    }
+
+  if (loaded == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+        "No HAL could be loaded from %s", path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -39,14 +39,41 @@
 #define G_LOG_DOMAIN "droid-hal-service"
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <glib.h>
 #include <glib-object.h>
 #include <glib-unix.h>
 #include <gio/gio.h>
 
+#include "hal-capture.h"
+#include "hal-limiter.h"
+#include "hal-notify.h"
 #include "hal-service.h"
+#include "hal-stats.h"
 
 #define DEFAULT_BINDER_DEVICE "/dev/hwbinder"
+#define CAPTURE_ENV           "LIBDROID_HAL_CAPTURE"
+#define LATENCY_ENV           "LIBDROID_HAL_LATENCY"
+#define DISPATCH_ENV          "LIBDROID_HAL_DISPATCH"
+#define IDLE_TIMEOUT_ENV      "LIBDROID_HAL_IDLE_TIMEOUT"
+#define RATE_LIMIT_ENV        "LIBDROID_HAL_RATE_LIMIT"
+
+/* Rate limited requests a single client can have waiting */
+#define RATE_LIMIT_MAX_HELD   16
+
+#define LATENCY_DEFAULT_PRIORITY 10
+#define LATENCY_DEFAULT_NICE     -10
+#define LATENCY_PREFAULT_STACK   (64 * 1024)
+
+/* Only exposed by <sched.h> with _GNU_SOURCE */
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK      0x40000000
+#endif
 
 typedef enum
 {
@@ -59,12 +86,67 @@ typedef enum
 
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
-struct _DroidHalService
+/* Runs the transactions of one implementation in order, off the main loop */
+typedef struct
 {
-  GObject                 parent_instance;
+  DroidHalService        *service;
+  DroidHalImplementation *implementation;
+  GThread                *thread;
+  GMutex                  lock;
+  GCond                   cond;
+  GQueue                  jobs;
+  guint                   max_jobs;
+  gboolean                quit;
+
+  /* Backpressure statistics, reset on SIGUSR1 */
+  guint                   dispatched;
+  guint                   rejected;
+  guint                   max_depth;
+} DroidHalServiceWorker;
+
+typedef struct
+{
+  DroidHalDeferredReply  *deferred;
+  guint                   code;
+} DroidHalServiceJob;
+
+/*
+ * Where an implementation is exported. Those given at construction are
+ * required: failing to register them stops the service.
+ */
+typedef struct
+{
+  DroidHalService        *service;
+  DroidHalImplementation *implementation;
+  gboolean                required;
+  gboolean                added;
+  gboolean                failed;
+  gchar                  *device;
+  gchar                  *iface;
+  gchar                  *name;
 
   GBinderServiceManager  *service_manager;
   GBinderLocalObject     *local_object;
+  gulong                  presence_id;
+  DroidHalServiceWorker  *worker;
+} DroidHalServiceBinding;
+
+/* A request over the rate limit, waiting for its client to get a token */
+typedef struct
+{
+  DroidHalServiceBinding *binding;
+  DroidHalDeferredReply  *deferred;
+  guint                   code;
+  pid_t                   pid;
+  uid_t                   uid;
+  guint                   key;
+} DroidHalServiceHeld;
+
+struct _DroidHalService
+{
+  GObject                 parent_instance;
+
+  GPtrArray              *bindings;
   GMainLoop              *main_loop;
 
   DroidHalImplementation *implementation;
@@ -72,11 +154,258 @@ struct _DroidHalService
   const gchar            *binder_iface;
   const gchar            *binder_name;
 
+  DroidHalCapture        *capture;
+
+  /* One worker per implementation if dispatch_queue is not 0 */
+  guint                   dispatch_queue;
+  GPtrArray              *workers;
+
+  gboolean                latency_mode;
+  int                     latency_policy;
+  int                     latency_priority;
+
+  /* Per client token buckets, and the requests waiting on them */
+  DroidHalLimiter        *limiter;
+  GQueue                  held;
+  guint                   held_source;
+
+  /* Exit after idle_timeout seconds without transactions, if not 0 */
+  guint                   idle_timeout;
+  guint                   idle_source;
+  gint64                  last_activity;
+
+  /* Readiness and watchdog pings for the service manager */
+  gboolean                ready;
+  guint                   watchdog_source;
+
+  /* To measure the time to the first reply after a cold start */
+  gint64                  created_time;
+  gboolean                got_first_request;
+
   guint                   exit_code;
 };
 
 G_DEFINE_FINAL_TYPE (DroidHalService, droid_hal_service, G_TYPE_OBJECT)
 
+/* Bindings on the same device share the service manager connection */
+static GBinderServiceManager *
+droid_hal_service_get_service_manager (DroidHalService *self,
+                                       const gchar     *device)
+{
+  for (guint i=0; i < self->bindings->len; i++)
+    {
+      DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+      if (binding->service_manager != NULL && g_strcmp0 (binding->device, device) == 0)
+        return gbinder_servicemanager_ref (binding->service_manager);
+    }
+
+  return gbinder_servicemanager_new (device);
+}
+
+static DroidHalServiceBinding *
+droid_hal_service_binding_new (DroidHalService        *service,
+                               DroidHalImplementation *implementation,
+                               const gchar            *device,
+                               const gchar            *iface,
+                               const gchar            *name)
+{
+  DroidHalServiceBinding *binding = g_new0 (DroidHalServiceBinding, 1);
+
+  binding->service = service;
+  binding->implementation = g_object_ref (implementation);
+  binding->device  = g_strdup (device);
+  binding->iface   = g_strdup (iface);
+  binding->name    = g_strdup (name);
+  binding->service_manager = droid_hal_service_get_service_manager (service, device);
+
+  return binding;
+}
+
+static void
+droid_hal_service_binding_free (DroidHalServiceBinding *binding)
+{
+  if (binding->presence_id != 0)
+    gbinder_servicemanager_remove_handler (binding->service_manager, binding->presence_id);
+
+  g_clear_object (&binding->service_manager);
+  g_clear_object (&binding->local_object);
+  g_clear_object (&binding->implementation);
+  g_free (binding->device);
+  g_free (binding->iface);
+  g_free (binding->name);
+  g_free (binding);
+}
+
+static gboolean droid_hal_service_apply_scheduling (DroidHalService *self);
+
+static gpointer
+droid_hal_service_worker_run (gpointer user_data)
+{
+  DroidHalServiceWorker *worker = user_data;
+  DroidHalServiceJob *job;
+
+  /* Transactions are handled here rather than on the main thread */
+  if (worker->service->latency_mode && !droid_hal_service_apply_scheduling (worker->service))
+    g_warning ("Unable to change scheduling of the %s worker: %s",
+      G_OBJECT_TYPE_NAME (worker->implementation), g_strerror (errno));
+
+  g_mutex_lock (&worker->lock);
+
+  while (TRUE)
+    {
+      while (!worker->quit && g_queue_is_empty (&worker->jobs))
+        g_cond_wait (&worker->cond, &worker->lock);
+
+      /* Drain whatever is left before quitting */
+      job = g_queue_pop_head (&worker->jobs);
+      if (job == NULL)
+        break;
+
+      g_mutex_unlock (&worker->lock);
+
+      droid_hal_implementation_dispatch (worker->implementation, job->deferred, job->code);
+      g_free (job);
+
+      g_mutex_lock (&worker->lock);
+    }
+
+  g_mutex_unlock (&worker->lock);
+
+  return NULL;
+}
+
+static DroidHalServiceWorker *
+droid_hal_service_worker_new (DroidHalService        *service,
+                              DroidHalImplementation *implementation,
+                              guint                   max_jobs)
+{
+  DroidHalServiceWorker *worker = g_new0 (DroidHalServiceWorker, 1);
+
+  worker->service = service;
+  worker->implementation = g_object_ref (implementation);
+  worker->max_jobs = max_jobs;
+  g_mutex_init (&worker->lock);
+  g_cond_init (&worker->cond);
+  g_queue_init (&worker->jobs);
+  worker->thread = g_thread_new (G_OBJECT_TYPE_NAME (implementation),
+    droid_hal_service_worker_run, worker);
+
+  return worker;
+}
+
+static void
+droid_hal_service_worker_free (DroidHalServiceWorker *worker)
+{
+  g_mutex_lock (&worker->lock);
+  worker->quit = TRUE;
+  g_cond_signal (&worker->cond);
+  g_mutex_unlock (&worker->lock);
+
+  g_thread_join (worker->thread);
+
+  g_mutex_clear (&worker->lock);
+  g_cond_clear (&worker->cond);
+  g_object_unref (worker->implementation);
+  g_free (worker);
+}
+
+/*
+ * Queues the transaction on the worker, blocking the request unless
+ * deferred already does. Returns FALSE if the queue is full: the main
+ * loop must not wait for a slow implementation, so the caller gets an
+ * error instead and can retry.
+ */
+static gboolean
+droid_hal_service_worker_push (DroidHalServiceWorker *worker,
+                               GBinderLocalObject    *object,
+                               GBinderRemoteRequest  *request,
+                               DroidHalDeferredReply *deferred,
+                               guint                  code)
+{
+  DroidHalServiceJob *job;
+  guint depth;
+
+  g_mutex_lock (&worker->lock);
+
+  depth = g_queue_get_length (&worker->jobs);
+  if (depth >= worker->max_jobs)
+    {
+      worker->rejected++;
+      g_mutex_unlock (&worker->lock);
+      return FALSE;
+    }
+
+  job = g_new0 (DroidHalServiceJob, 1);
+  job->deferred = deferred != NULL ? deferred : droid_hal_deferred_reply_new (object, request);
+  job->code = code;
+
+  g_queue_push_tail (&worker->jobs, job);
+  worker->dispatched++;
+  worker->max_depth = MAX (worker->max_depth, depth + 1);
+
+  g_cond_signal (&worker->cond);
+  g_mutex_unlock (&worker->lock);
+
+  return TRUE;
+}
+
+static void
+droid_hal_service_worker_report (DroidHalServiceWorker *worker,
+                                 gboolean               reset)
+{
+  g_mutex_lock (&worker->lock);
+
+  g_message ("%s: %u dispatched, %u rejected, max queue depth %u/%u",
+    G_OBJECT_TYPE_NAME (worker->implementation), worker->dispatched,
+    worker->rejected, worker->max_depth, worker->max_jobs);
+
+  if (reset)
+    {
+      worker->dispatched = 0;
+      worker->rejected   = 0;
+      worker->max_depth  = 0;
+    }
+
+  g_mutex_unlock (&worker->lock);
+}
+
+/* Implementations exported more than once share the same worker */
+static void
+droid_hal_service_start_workers (DroidHalService *self)
+{
+  self->workers = g_ptr_array_new_with_free_func ((GDestroyNotify) droid_hal_service_worker_free);
+
+  for (guint i=0; i < self->bindings->len; i++)
+    {
+      DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+      for (guint j=0; j < self->workers->len && binding->worker == NULL; j++)
+        {
+          DroidHalServiceWorker *worker = g_ptr_array_index (self->workers, j);
+
+          if (worker->implementation == binding->implementation)
+            binding->worker = worker;
+        }
+
+      if (binding->worker == NULL)
+        {
+          binding->worker = droid_hal_service_worker_new (self, binding->implementation,
+            self->dispatch_queue);
+          g_ptr_array_add (self->workers, binding->worker);
+        }
+    }
+}
+
+static void
+droid_hal_service_stop_workers (DroidHalService *self)
+{
+  for (guint i=0; i < self->bindings->len; i++)
+    ((DroidHalServiceBinding *) g_ptr_array_index (self->bindings, i))->worker = NULL;
+
+  g_clear_pointer (&self->workers, g_ptr_array_unref);
+}
+
 static void
 droid_hal_service_constructed (GObject *obj)
 {
@@ -84,8 +413,17 @@ droid_hal_service_constructed (GObject *obj)
 
   G_OBJECT_CLASS (droid_hal_service_parent_class)->constructed (obj);
 
-  self->service_manager = gbinder_servicemanager_new (self->binder_device);
-  self->main_loop       = g_main_loop_new (NULL, TRUE);
+  self->created_time = g_get_monotonic_time ();
+  self->bindings  = g_ptr_array_new_with_free_func ((GDestroyNotify) droid_hal_service_binding_free);
+  self->main_loop = g_main_loop_new (NULL, TRUE);
+
+  /* Hosts start without any implementation, and add them later */
+  if (self->implementation != NULL)
+    {
+      g_ptr_array_add (self->bindings, droid_hal_service_binding_new (self,
+        self->implementation, self->binder_device, self->binder_iface, self->binder_name));
+      ((DroidHalServiceBinding *) g_ptr_array_index (self->bindings, 0))->required = TRUE;
+    }
 }
 
 
@@ -97,8 +435,11 @@ droid_hal_service_dispose (GObject *obj)
   G_OBJECT_CLASS (droid_hal_service_parent_class)->dispose (obj);
 
   g_clear_object (&self->implementation);
-  g_clear_object (&self->service_manager);
-  g_clear_object (&self->local_object);
+  if (self->bindings != NULL)
+    droid_hal_service_stop_workers (self);
+  g_clear_pointer (&self->bindings, g_ptr_array_unref);
+  g_clear_pointer (&self->capture, droid_hal_capture_free);
+  g_clear_pointer (&self->limiter, droid_hal_limiter_free);
 
   g_main_loop_unref (self->main_loop);
 }
@@ -115,8 +456,7 @@ droid_hal_service_set_property (GObject      *object,
     {
     case PROP_IMPLEMENTATION:
       /* This is construct only, so we don't need to handle existing value */
-      self->implementation = g_value_get_object (value);
-      g_object_ref (self->implementation);
+      self->implementation = g_value_dup_object (value);
       break;
 
     case PROP_BINDER_DEVICE:
@@ -237,6 +577,481 @@ droid_hal_service_new (DroidHalImplementation *implementation,
       NULL));
 }
 
+/*
+ * Exports the implementation on another binder device or interface as
+ * well, e.g. both as HIDL and AIDL. The implementation can tell them
+ * apart with gbinder_remote_request_interface(). Must be called before
+ * droid_hal_service_run(); unlike the primary one, failing to register
+ * an additional binding is not fatal.
+ */
+void
+droid_hal_service_add_binding (DroidHalService *self,
+                               const gchar     *binder_device,
+                               const gchar     *binder_iface,
+                               const gchar     *binder_name)
+{
+  g_return_if_fail (DROID_IS_HAL_SERVICE (self));
+  g_return_if_fail (self->implementation != NULL);
+
+  droid_hal_service_add_implementation (self, self->implementation,
+    binder_device, binder_iface, binder_name);
+}
+
+/*
+ * Hosts another implementation in the same process, sharing the main
+ * loop and the service manager connections with the others. Like
+ * additional bindings, it is not fatal if it can't be registered.
+ */
+void
+droid_hal_service_add_implementation (DroidHalService        *self,
+                                      DroidHalImplementation *implementation,
+                                      const gchar            *binder_device,
+                                      const gchar            *binder_iface,
+                                      const gchar            *binder_name)
+{
+  g_return_if_fail (DROID_IS_HAL_SERVICE (self));
+  g_return_if_fail (DROID_IS_HAL_IMPLEMENTATION (implementation));
+
+  g_ptr_array_add (self->bindings, droid_hal_service_binding_new (self,
+    implementation, binder_device, binder_iface, binder_name));
+}
+
+/*
+ * Records every incoming transaction to path, so that it can be
+ * replayed later with droid_hal_replay_run().
+ */
+gboolean
+droid_hal_service_start_capture (DroidHalService  *self,
+                                 const gchar      *path,
+                                 GError          **error)
+{
+  DroidHalCapture *capture;
+
+  g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), FALSE);
+
+  capture = droid_hal_capture_new (path, error);
+  if (capture == NULL)
+    return FALSE;
+
+  g_clear_pointer (&self->capture, droid_hal_capture_free);
+  self->capture = capture;
+  g_message ("Capturing transactions to %s", path);
+
+  return TRUE;
+}
+
+/*
+ * Runs the transactions of every implementation on its own worker
+ * thread, so that a slow one doesn't hold back the others. Up to
+ * queue_length transactions are queued per implementation, further
+ * ones fail until the worker catches up. 0 disables it, which is the
+ * default. Implementations must then be able to handle requests from
+ * any thread. Must be called before droid_hal_service_run().
+ */
+void
+droid_hal_service_set_dispatch (DroidHalService *self,
+                                guint            queue_length)
+{
+  g_return_if_fail (DROID_IS_HAL_SERVICE (self));
+  g_return_if_fail (self->workers == NULL);
+
+  self->dispatch_queue = queue_length;
+}
+
+/*
+ * Makes the service exit once it got no transaction for the given
+ * number of seconds and every implementation is idle, so that it only
+ * runs while used and gets started again on demand (e.g. by libdroid
+ * through systemd). 0, the default, keeps it running.
+ */
+void
+droid_hal_service_set_idle_timeout (DroidHalService *self,
+                                    guint            seconds)
+{
+  g_return_if_fail (DROID_IS_HAL_SERVICE (self));
+
+  self->idle_timeout = seconds;
+}
+
+static gboolean
+droid_hal_service_is_idle (DroidHalService *self)
+{
+  if (!g_queue_is_empty (&self->held))
+    return FALSE;
+
+  for (guint i=0; self->workers != NULL && i < self->workers->len; i++)
+    {
+      DroidHalServiceWorker *worker = g_ptr_array_index (self->workers, i);
+      gboolean empty;
+
+      g_mutex_lock (&worker->lock);
+      empty = g_queue_is_empty (&worker->jobs);
+      g_mutex_unlock (&worker->lock);
+
+      if (!empty)
+        return FALSE;
+    }
+
+  for (guint i=0; i < self->bindings->len; i++)
+    {
+      DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+      if (!droid_hal_implementation_is_idle (binding->implementation))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+droid_hal_service_idle_check (gpointer user_data)
+{
+  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+  gint64 timeout = (gint64) self->idle_timeout * G_USEC_PER_SEC;
+  gint64 elapsed = g_get_monotonic_time () - self->last_activity;
+
+  self->idle_source = 0;
+
+  if (elapsed >= timeout && droid_hal_service_is_idle (self))
+    {
+      g_message ("No transactions for %u seconds, exiting", self->idle_timeout);
+      droid_hal_notify ("STOPPING=1\nSTATUS=Idle, exiting");
+
+      /* Stop taking transactions right away, the registrations go with the process */
+      for (guint i=0; i < self->bindings->len; i++)
+        {
+          DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+          if (binding->local_object != NULL)
+            gbinder_local_object_drop (g_steal_pointer (&binding->local_object));
+        }
+
+      self->exit_code = EXIT_SUCCESS;
+      g_main_loop_quit (self->main_loop);
+      return G_SOURCE_REMOVE;
+    }
+
+  /* Check again once the timeout is over, or a full one later if busy */
+  self->idle_source = g_timeout_add ((elapsed < timeout ? timeout - elapsed : timeout) / 1000,
+    droid_hal_service_idle_check, self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Enables the latency mode, which is applied once the service runs.
+ * mode is one of "fifo", "rr" or "nice", optionally followed by a colon
+ * and the realtime priority or the nice level respectively.
+ */
+gboolean
+droid_hal_service_set_latency_mode (DroidHalService  *self,
+                                    const gchar      *mode,
+                                    GError          **error)
+{
+  g_auto (GStrv) tokens = NULL;
+  gint64 value;
+  int policy;
+  int min, max;
+
+  g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), FALSE);
+  g_return_val_if_fail (mode != NULL, FALSE);
+
+  tokens = g_strsplit (mode, ":", 2);
+
+  if (g_strcmp0 (tokens[0], "fifo") == 0)
+    policy = SCHED_FIFO;
+  else if (g_strcmp0 (tokens[0], "rr") == 0)
+    policy = SCHED_RR;
+  else if (g_strcmp0 (tokens[0], "nice") == 0)
+    policy = SCHED_OTHER;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Unknown latency mode '%s'", mode);
+      return FALSE;
+    }
+
+  if (policy == SCHED_OTHER)
+    {
+      min = -20;
+      max = 19;
+      value = LATENCY_DEFAULT_NICE;
+    }
+  else
+    {
+      min = sched_get_priority_min (policy);
+      max = sched_get_priority_max (policy);
+      value = LATENCY_DEFAULT_PRIORITY;
+    }
+
+  if (tokens[0] != NULL && tokens[1] != NULL &&
+      !g_ascii_string_to_signed (tokens[1], 10, min, max, &value, error))
+    return FALSE;
+
+  self->latency_mode     = TRUE;
+  self->latency_policy   = policy;
+  self->latency_priority = (int) value;
+
+  return TRUE;
+}
+
+/*
+ * Applies the latency scheduling to the calling thread only (on Linux,
+ * the nice value is per thread too): threads it creates afterwards, such
+ * as the binder loopers or thread pools, get the default scheduling back.
+ */
+static gboolean
+droid_hal_service_apply_scheduling (DroidHalService *self)
+{
+  struct sched_param param = { 0 };
+
+  if (self->latency_policy == SCHED_OTHER)
+    return sched_setscheduler (0, SCHED_OTHER | SCHED_RESET_ON_FORK, &param) == 0 &&
+      setpriority (PRIO_PROCESS, 0, self->latency_priority) == 0;
+
+  param.sched_priority = self->latency_priority;
+  return sched_setscheduler (0, self->latency_policy | SCHED_RESET_ON_FORK, &param) == 0;
+}
+
+static void
+droid_hal_service_prefault_stack (void)
+{
+  volatile guint8 stack[LATENCY_PREFAULT_STACK];
+
+  memset ((guint8 *) stack, 0, sizeof (stack));
+}
+
+/*
+ * Keeps the transaction path from page faulting or being preempted by
+ * regular tasks. Every error is only a warning, as the service works
+ * just as well (but slower) without it.
+ */
+static void
+droid_hal_service_apply_latency_mode (DroidHalService *self)
+{
+  /* Don't give memory back to the kernel, it would fault again later */
+  mallopt (M_TRIM_THRESHOLD, -1);
+  mallopt (M_MMAP_MAX, 0);
+
+  /*
+   * Only lock what is actually touched: locking everything upfront would
+   * pin the whole stack of every thread, most of which is never used.
+   */
+  if (mlockall (MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0)
+    g_warning ("Unable to lock memory: %s", g_strerror (errno));
+
+  droid_hal_service_prefault_stack ();
+
+  /* Transactions are handled on the main thread, or on the dispatch workers */
+  if (!droid_hal_service_apply_scheduling (self))
+    g_warning ("Unable to change scheduling: %s", g_strerror (errno));
+
+  g_message ("Latency mode enabled");
+}
+
+/*
+ * Limits every client to its share of transactions, spec being as for
+ * droid_hal_limiter_new(). Over the limit, requests that the
+ * implementation can coalesce wait for the next token, replacing the
+ * one with the same key already waiting if any; the others are
+ * rejected with -EAGAIN. Must be called before droid_hal_service_run().
+ */
+gboolean
+droid_hal_service_set_rate_limit (DroidHalService  *self,
+                                  const gchar      *spec,
+                                  GError          **error)
+{
+  DroidHalLimiter *limiter;
+
+  g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), FALSE);
+  g_return_val_if_fail (spec != NULL, FALSE);
+
+  limiter = droid_hal_limiter_new (spec, error);
+  if (limiter == NULL)
+    return FALSE;
+
+  g_clear_pointer (&self->limiter, droid_hal_limiter_free);
+  self->limiter = limiter;
+
+  return TRUE;
+}
+
+static void
+droid_hal_service_held_free (DroidHalServiceHeld *held)
+{
+  if (held->deferred != NULL)
+    droid_hal_deferred_reply_complete (held->deferred, NULL, -EAGAIN);
+
+  g_free (held);
+}
+
+static void
+droid_hal_service_release (DroidHalService     *self,
+                           DroidHalServiceHeld *held)
+{
+  DroidHalServiceBinding *binding = held->binding;
+  DroidHalDeferredReply *deferred = g_steal_pointer (&held->deferred);
+
+  if (binding->worker == NULL)
+    droid_hal_implementation_dispatch (binding->implementation, deferred, held->code);
+  else if (!droid_hal_service_worker_push (binding->worker, NULL, NULL, deferred, held->code))
+    droid_hal_deferred_reply_complete (deferred, NULL, -EAGAIN);
+
+  droid_hal_service_held_free (held);
+}
+
+static gboolean droid_hal_service_release_held (gpointer user_data);
+
+static void
+droid_hal_service_schedule_held (DroidHalService *self)
+{
+  gint64 delay = G_MAXINT64;
+
+  if (self->held_source != 0 || g_queue_is_empty (&self->held))
+    return;
+
+  for (GList *l = self->held.head; l != NULL; l = l->next)
+    {
+      DroidHalServiceHeld *held = l->data;
+
+      delay = MIN (delay, droid_hal_limiter_delay (self->limiter, held->pid, held->uid,
+        held->code));
+    }
+
+  self->held_source = g_timeout_add ((guint) MAX ((delay + 999) / 1000, 1),
+    droid_hal_service_release_held, self);
+}
+
+/* Releases, in order, whatever got a token in the meantime */
+static gboolean
+droid_hal_service_release_held (gpointer user_data)
+{
+  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+  GList *l = self->held.head;
+
+  self->held_source = 0;
+
+  while (l != NULL)
+    {
+      DroidHalServiceHeld *held = l->data;
+      GList *next = l->next;
+
+      if (droid_hal_limiter_admit (self->limiter, held->pid, held->uid, held->code))
+        {
+          g_queue_delete_link (&self->held, l);
+          droid_hal_service_release (self, held);
+        }
+
+      l = next;
+    }
+
+  droid_hal_service_schedule_held (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Returns the request of the client waiting with the same code and, if
+ * given, the same key, and how many requests of the client are waiting
+ * in total.
+ */
+static DroidHalServiceHeld *
+droid_hal_service_find_held (DroidHalService        *self,
+                             DroidHalServiceBinding *binding,
+                             pid_t                   pid,
+                             uid_t                   uid,
+                             guint                   code,
+                             const guint            *key,
+                             guint                  *n_client)
+{
+  DroidHalServiceHeld *found = NULL;
+
+  *n_client = 0;
+
+  for (GList *l = self->held.head; l != NULL; l = l->next)
+    {
+      DroidHalServiceHeld *held = l->data;
+
+      if (held->pid != pid || held->uid != uid)
+        continue;
+
+      (*n_client)++;
+
+      /* Codes only mean something within the same interface */
+      if (found == NULL && held->binding == binding && held->code == code &&
+          (key == NULL || held->key == *key))
+        found = held;
+    }
+
+  return found;
+}
+
+/*
+ * Returns TRUE if the request can go through right away. Otherwise it's
+ * held back or rejected, with status set accordingly.
+ */
+static gboolean
+droid_hal_service_admit (DroidHalService        *self,
+                         DroidHalServiceBinding *binding,
+                         GBinderLocalObject     *object,
+                         GBinderRemoteRequest   *request,
+                         guint                   code,
+                         int                    *status)
+{
+  pid_t pid = gbinder_remote_request_sender_pid (request);
+  uid_t uid = gbinder_remote_request_sender_euid (request);
+  DroidHalServiceHeld *held;
+  guint n_client;
+  guint key;
+
+  /* Nothing may overtake requests of the same kind already waiting */
+  if (droid_hal_service_find_held (self, binding, pid, uid, code, NULL, &n_client) == NULL &&
+      droid_hal_limiter_admit (self->limiter, pid, uid, code))
+    return TRUE;
+
+  *status = GBINDER_STATUS_OK;
+
+  if (!droid_hal_implementation_coalesce_key (binding->implementation, request, code, &key))
+    {
+      g_debug ("Rejecting code %u from %d, over the limit", code, pid);
+      droid_hal_limiter_record (self->limiter, pid, uid, code, DROID_HAL_LIMITER_REJECTED);
+      *status = -EAGAIN;
+      return FALSE;
+    }
+
+  held = droid_hal_service_find_held (self, binding, pid, uid, code, &key, &n_client);
+  if (held != NULL)
+    {
+      /* The newer request wins, the caller of the older one gets an error */
+      droid_hal_deferred_reply_complete (held->deferred, NULL, -EAGAIN);
+      held->deferred = droid_hal_deferred_reply_new (object, request);
+      droid_hal_limiter_record (self->limiter, pid, uid, code, DROID_HAL_LIMITER_COALESCED);
+      return FALSE;
+    }
+
+  if (n_client >= RATE_LIMIT_MAX_HELD)
+    {
+      g_debug ("Rejecting code %u from %d, too many requests waiting", code, pid);
+      droid_hal_limiter_record (self->limiter, pid, uid, code, DROID_HAL_LIMITER_REJECTED);
+      *status = -EAGAIN;
+      return FALSE;
+    }
+
+  held = g_new0 (DroidHalServiceHeld, 1);
+  held->binding  = binding;
+  held->deferred = droid_hal_deferred_reply_new (object, request);
+  held->code     = code;
+  held->pid      = pid;
+  held->uid      = uid;
+  held->key      = key;
+  g_queue_push_tail (&self->held, held);
+
+  droid_hal_limiter_record (self->limiter, pid, uid, code, DROID_HAL_LIMITER_DEFERRED);
+  droid_hal_service_schedule_held (self);
+
+  return FALSE;
+}
+
 static GBinderLocalReply *
 droid_hal_service_reply (GBinderLocalObject   *object,
                          GBinderRemoteRequest *request,
@@ -245,17 +1060,44 @@ droid_hal_service_reply (GBinderLocalObject   *object,
                          int                  *status,
                          void                 *user_data)
 {
-  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+  DroidHalServiceBinding *binding = user_data;
+  DroidHalService *self = binding->service;
   GBinderLocalReply *result = NULL;
   const char *binder_iface = gbinder_remote_request_interface (request);
+  gint64 start_time = g_get_monotonic_time ();
 
   g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), NULL);
 
   g_debug ("Called interface %s, code %d", binder_iface, code);
-  if (g_strcmp0 (binder_iface, self->binder_iface) == 0)
+
+  self->last_activity = start_time;
+  if (!self->got_first_request)
+    {
+      self->got_first_request = TRUE;
+      g_message ("First transaction %" G_GINT64_FORMAT "ms after start",
+        (start_time - self->created_time) / 1000);
+    }
+
+  if (self->capture != NULL)
+    droid_hal_capture_record (self->capture, binding->implementation, request, code);
+
+  if (g_strcmp0 (binder_iface, binding->iface) == 0 && self->limiter != NULL &&
+      !droid_hal_service_admit (self, binding, object, request, code, status))
+    {
+      /* Held back until the client gets a token, or rejected */
+      return NULL;
+    }
+  else if (g_strcmp0 (binder_iface, binding->iface) == 0 && binding->worker != NULL)
+    {
+      /* The reply is sent by the worker */
+      *status = droid_hal_service_worker_push (binding->worker, object, request, NULL, code) ?
+        GBINDER_STATUS_OK : -EAGAIN;
+    }
+  else if (g_strcmp0 (binder_iface, binding->iface) == 0)
     {
       *status = 0; /* FIXME? */
-      result = droid_hal_implementation_reply ((DroidHalImplementation *) self->implementation,
+      /* A NULL reply is fine if the implementation deferred it */
+      result = droid_hal_implementation_reply (binding->implementation,
         object, request, code);
     }
   else
@@ -263,45 +1105,120 @@ droid_hal_service_reply (GBinderLocalObject   *object,
       *status = -1;
     }
 
+  /* Deferred replies are accounted for when completed */
+  if (result != NULL)
+    droid_hal_stats_record (droid_hal_stats_get_default (), start_time);
+
   return result;
 }
 
+/*
+ * Units ordered after ours can start once every required service is
+ * registered and the others are registered or given up on, so that
+ * clients don't look them up too early.
+ */
+static void
+droid_hal_service_notify_added (DroidHalService *self)
+{
+  g_autofree gchar *state = NULL;
+  gboolean ready = TRUE;
+  guint n_added = 0;
+  guint i;
+
+  for (i = 0; i < self->bindings->len; i++)
+    {
+      DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+      if (binding->added)
+        n_added++;
+      else if (binding->required || !binding->failed)
+        ready = FALSE;
+    }
+
+  state = g_strdup_printf ("%sSTATUS=Registered %u of %u services",
+    ready && !self->ready ? "READY=1\n" : "", n_added, self->bindings->len);
+  droid_hal_notify (state);
+
+  self->ready = self->ready || ready;
+}
+
+static gboolean
+droid_hal_service_watchdog (gpointer user_data)
+{
+  droid_hal_notify ("WATCHDOG=1");
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 droid_hal_service_added(GBinderServiceManager *service_manager,
                         int                    status,
                         void                  *user_data)
 {
-  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+  DroidHalServiceBinding *binding = user_data;
+  DroidHalService *self = binding->service;
 
   if (status == GBINDER_STATUS_OK)
     {
-      g_message ("Service '%s' added", self->binder_name);
+      g_message ("Service '%s' added %" G_GINT64_FORMAT "ms after start", binding->name,
+        (g_get_monotonic_time () - self->created_time) / 1000);
       self->exit_code = EXIT_SUCCESS;
+      /* Registrations are done again if the service manager restarts */
+      binding->added = TRUE;
+      droid_hal_service_notify_added (self);
     }
-  else
+  else if (binding->required)
     {
-      g_message ("Unable to add '%s': %d", self->binder_name, status);
+      g_message ("Unable to add '%s': %d", binding->name, status);
       g_main_loop_quit (self->main_loop);
     }
+  else
+    {
+      g_warning ("Unable to add '%s': %d", binding->name, status);
+      binding->failed = TRUE;
+      droid_hal_service_notify_added (self);
+    }
 }
 
 static void
 droid_hal_service_presence_handler (GBinderServiceManager *service_manager,
                                     void                  *user_data)
 {
-  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+  DroidHalServiceBinding *binding = user_data;
 
-  if (gbinder_servicemanager_is_present (self->service_manager))
+  if (gbinder_servicemanager_is_present (binding->service_manager))
     {
-      gbinder_servicemanager_add_service(self->service_manager, self->binder_name,
-        self->local_object, droid_hal_service_added, self);
+      gbinder_servicemanager_add_service(binding->service_manager, binding->name,
+        binding->local_object, droid_hal_service_added, binding);
     }
   else
     {
-      g_warning ("Service manager disappeared");
+      g_warning ("Service manager on %s disappeared", binding->device);
+
+      /* Don't hold readiness back, it is added again if it comes back */
+      if (!binding->required && !binding->added)
+        {
+          binding->failed = TRUE;
+          droid_hal_service_notify_added (binding->service);
+        }
     }
 }
 
+static void
+droid_hal_service_export (DroidHalServiceBinding *binding)
+{
+  g_debug ("Creating local object");
+  binding->local_object = gbinder_servicemanager_new_local_object (binding->service_manager,
+    binding->iface, droid_hal_service_reply, binding);
+
+  binding->presence_id = gbinder_servicemanager_add_presence_handler (binding->service_manager,
+    droid_hal_service_presence_handler, binding);
+
+  droid_hal_service_presence_handler (binding->service_manager, binding);
+  g_debug ("Added service %s/%s on device %s", binding->iface,
+    binding->name, binding->device);
+}
+
 static gboolean
 droid_hal_service_signal (gpointer user_data)
 {
@@ -310,43 +1227,153 @@ droid_hal_service_signal (gpointer user_data)
   g_debug ("Caught signal");
   g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), G_SOURCE_REMOVE);
 
+  droid_hal_notify ("STOPPING=1");
+
   g_main_loop_quit (self->main_loop);
   return G_SOURCE_CONTINUE; /* Cleaned up at exit */
 }
 
+static const gchar *
+droid_hal_service_stats_label (DroidHalService *self)
+{
+  return self->latency_mode ? "Latency (latency mode)" : "Latency";
+}
+
+static gboolean
+droid_hal_service_stats_signal (gpointer user_data)
+{
+  DroidHalService *self = DROID_HAL_SERVICE (user_data);
+
+  g_return_val_if_fail (DROID_IS_HAL_SERVICE (self), G_SOURCE_REMOVE);
+
+  droid_hal_stats_report (droid_hal_stats_get_default (),
+    droid_hal_service_stats_label (self));
+  droid_hal_stats_reset (droid_hal_stats_get_default ());
+
+  for (guint i=0; self->workers != NULL && i < self->workers->len; i++)
+    droid_hal_service_worker_report (g_ptr_array_index (self->workers, i), TRUE);
+
+  if (self->limiter != NULL)
+    droid_hal_limiter_report (self->limiter, TRUE);
+
+  return G_SOURCE_CONTINUE;
+}
+
 int
 droid_hal_service_run (DroidHalService *self)
 {
-  gulong presence_id;
+  DroidHalServiceBinding *first;
   guint sigterm = g_unix_signal_add (SIGTERM, droid_hal_service_signal, self);
   guint sigint = g_unix_signal_add (SIGINT, droid_hal_service_signal, self);
+  guint sigusr1 = g_unix_signal_add (SIGUSR1, droid_hal_service_stats_signal, self);
+  const gchar *capture_path = g_getenv (CAPTURE_ENV);
+  const gchar *latency = g_getenv (LATENCY_ENV);
+  const gchar *dispatch = g_getenv (DISPATCH_ENV);
+  const gchar *idle_timeout = g_getenv (IDLE_TIMEOUT_ENV);
+  const gchar *rate_limit = g_getenv (RATE_LIMIT_ENV);
+  g_autoptr (GError) error = NULL;
 
   self->exit_code = EXIT_FAILURE;
+  first = (self->bindings->len > 0) ? g_ptr_array_index (self->bindings, 0) : NULL;
+
+  if (first == NULL)
+    g_warning ("Nothing to export");
+
+  if (self->capture == NULL && capture_path != NULL && *capture_path != '\0' &&
+      !droid_hal_service_start_capture (self, capture_path, &error))
+    g_warning ("Unable to start capture: %s", error->message);
+
+  g_clear_error (&error);
+  if (!self->latency_mode && latency != NULL && *latency != '\0' &&
+      !droid_hal_service_set_latency_mode (self, latency, &error))
+    g_warning ("Unable to set latency mode: %s", error->message);
+
+  if (self->latency_mode)
+    droid_hal_service_apply_latency_mode (self);
+
+  if (self->dispatch_queue == 0 && dispatch != NULL && *dispatch != '\0')
+    self->dispatch_queue = (guint) g_ascii_strtoull (dispatch, NULL, 10);
+
+  /* Workers switch themselves to the latency scheduling when they start */
+  if (self->dispatch_queue > 0)
+    droid_hal_service_start_workers (self);
+
+  if (self->idle_timeout == 0 && idle_timeout != NULL && *idle_timeout != '\0')
+    self->idle_timeout = (guint) g_ascii_strtoull (idle_timeout, NULL, 10);
+
+  g_clear_error (&error);
+  if (self->limiter == NULL && rate_limit != NULL && *rate_limit != '\0' &&
+      !droid_hal_service_set_rate_limit (self, rate_limit, &error))
+    g_warning ("Unable to set rate limit: %s", error->message);
 
   g_debug ("Waiting for service manager...");
-  if (gbinder_servicemanager_wait (self->service_manager, -1))
-    {
-      g_debug ("Creating local object");
-      self->local_object = gbinder_servicemanager_new_local_object (self->service_manager,
-        self->binder_iface, droid_hal_service_reply, self);
+  droid_hal_notify ("STATUS=Waiting for the service manager");
 
-      presence_id = gbinder_servicemanager_add_presence_handler (self->service_manager,
-        droid_hal_service_presence_handler, self);
+  /* Pinged from the main loop, so a stuck loop gets the service restarted */
+  if (droid_hal_notify_watchdog_usec () > 0)
+    self->watchdog_source = g_timeout_add (droid_hal_notify_watchdog_usec () / 2 / 1000,
+      droid_hal_service_watchdog, self);
 
-      droid_hal_service_presence_handler (self->service_manager, (void *)self);
-      g_debug ("Added service %s/%s on device %s", self->binder_iface,
-        self->binder_name, self->binder_device);
+  if (first != NULL && first->service_manager != NULL &&
+      gbinder_servicemanager_wait (first->service_manager, -1))
+    {
+      droid_hal_service_export (first);
+
+      /* The others get registered whenever their service manager shows up */
+      for (guint i=1; i < self->bindings->len; i++)
+        {
+          DroidHalServiceBinding *binding = g_ptr_array_index (self->bindings, i);
+
+          if (binding->service_manager != NULL)
+            {
+              droid_hal_service_export (binding);
+            }
+          else
+            {
+              g_warning ("Unable to open %s, not exporting %s", binding->device, binding->name);
+              binding->failed = TRUE;
+              droid_hal_service_notify_added (self);
+            }
+        }
+
+      self->last_activity = g_get_monotonic_time ();
+      if (self->idle_timeout > 0)
+        self->idle_source = g_timeout_add_seconds (self->idle_timeout,
+          droid_hal_service_idle_check, self);
 
       g_main_loop_run (self->main_loop);
 
-      gbinder_servicemanager_remove_handler (self->service_manager, presence_id);
+      g_clear_handle_id (&self->idle_source, g_source_remove);
     }
 
+  g_clear_handle_id (&self->watchdog_source, g_source_remove);
+
+  if (self->exit_code != EXIT_SUCCESS)
+    droid_hal_notify ("STATUS=Unable to register");
+
   if (sigterm)
       g_source_remove (sigterm);
 
   if (sigint)
       g_source_remove (sigint);
 
+  if (sigusr1)
+      g_source_remove (sigusr1);
+
+  droid_hal_stats_report (droid_hal_stats_get_default (),
+    droid_hal_service_stats_label (self));
+
+  for (guint i=0; self->workers != NULL && i < self->workers->len; i++)
+    droid_hal_service_worker_report (g_ptr_array_index (self->workers, i), FALSE);
+
+  if (self->limiter != NULL)
+    droid_hal_limiter_report (self->limiter, FALSE);
+
+  /* Whoever is still waiting gets an error rather than no reply at all */
+  g_clear_handle_id (&self->held_source, g_source_remove);
+  g_queue_clear_full (&self->held, (GDestroyNotify) droid_hal_service_held_free);
+
+  droid_hal_service_stop_workers (self);
+
   return self->exit_code;
 }
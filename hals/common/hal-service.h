@@ -52,6 +52,35 @@ DroidHalService * droid_hal_service_new (DroidHalImplementation *implementation,
                                          gchar                  *binder_iface,
                                          gchar                  *binder_name);
 
+void droid_hal_service_add_binding (DroidHalService *self,
+                                    const gchar     *binder_device,
+                                    const gchar     *binder_iface,
+                                    const gchar     *binder_name);
+
+void droid_hal_service_add_implementation (DroidHalService        *self,
+                                           DroidHalImplementation *implementation,
+                                           const gchar            *binder_device,
+                                           const gchar            *binder_iface,
+                                           const gchar            *binder_name);
+
+gboolean droid_hal_service_start_capture (DroidHalService  *self,
+                                          const gchar      *path,
+                                          GError          **error);
+
+void droid_hal_service_set_dispatch (DroidHalService *self,
+                                     guint            queue_length);
+
+void droid_hal_service_set_idle_timeout (DroidHalService *self,
+                                         guint            seconds);
+
+gboolean droid_hal_service_set_latency_mode (DroidHalService  *self,
+                                             const gchar      *mode,
+                                             GError          **error);
+
+gboolean droid_hal_service_set_rate_limit (DroidHalService  *self,
+                                           const gchar      *spec,
+                                           GError          **error);
+
 int droid_hal_service_run (DroidHalService *self);
 
 G_END_DECLS
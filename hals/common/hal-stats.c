@@ -0,0 +1,155 @@
+/* hal-stats.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Transaction latency histogram, from the moment the service gets a
+ * request to the moment its reply is sent. Buckets are powers of two
+ * in microseconds, and recording is lock-free so that it can be done
+ * from any thread.
+ */
+
+#define G_LOG_DOMAIN "droid-hal-stats"
+
+#include "hal-stats.h"
+
+#define STATS_BUCKETS 32
+
+struct _DroidHalStats
+{
+  guint  buckets[STATS_BUCKETS];
+  gint64 max;
+};
+
+static guint
+droid_hal_stats_bucket (gint64 latency)
+{
+  guint bucket = 0;
+
+  while (latency > 1 && bucket < STATS_BUCKETS - 1)
+    {
+      latency >>= 1;
+      bucket++;
+    }
+
+  return bucket;
+}
+
+DroidHalStats *
+droid_hal_stats_get_default (void)
+{
+  static DroidHalStats stats;
+
+  return &stats;
+}
+
+/*
+ * Records a transaction that started at start_time, as returned by
+ * g_get_monotonic_time(), and has just been replied to.
+ */
+void
+droid_hal_stats_record (DroidHalStats *stats,
+                        gint64         start_time)
+{
+  gint64 latency = g_get_monotonic_time () - start_time;
+  gint64 max = __atomic_load_n (&stats->max, __ATOMIC_RELAXED);
+
+  g_atomic_int_inc (&stats->buckets[droid_hal_stats_bucket (latency)]);
+
+  while (latency > max &&
+         !__atomic_compare_exchange_n (&stats->max, &max, latency, TRUE,
+           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Upper bound of the bucket where the given fraction of transactions
+ * is: bucket i holds latencies from 2^i up to, excluded, 2^(i+1).
+ */
+static gint64
+droid_hal_stats_percentile (const guint *buckets,
+                            guint        total,
+                            gdouble      fraction)
+{
+  guint target = MAX ((guint) (total * fraction + 0.5), 1);
+  guint count = 0;
+
+  for (guint i=0; i < STATS_BUCKETS; i++)
+    {
+      count += buckets[i];
+      if (count >= target)
+        return (gint64) 1 << (i + 1);
+    }
+
+  return (gint64) 1 << STATS_BUCKETS;
+}
+
+void
+droid_hal_stats_report (DroidHalStats *stats,
+                        const gchar   *label)
+{
+  guint buckets[STATS_BUCKETS];
+  guint total = 0;
+
+  for (guint i=0; i < STATS_BUCKETS; i++)
+    {
+      buckets[i] = g_atomic_int_get (&stats->buckets[i]);
+      total += buckets[i];
+    }
+
+  if (total == 0)
+    {
+      g_message ("%s: no transactions", label);
+      return;
+    }
+
+  g_message ("%s: %u transactions, p50 <%" G_GINT64_FORMAT "us, p90 <%" G_GINT64_FORMAT
+    "us, p99 <%" G_GINT64_FORMAT "us, max %" G_GINT64_FORMAT "us", label, total,
+    droid_hal_stats_percentile (buckets, total, 0.50),
+    droid_hal_stats_percentile (buckets, total, 0.90),
+    droid_hal_stats_percentile (buckets, total, 0.99),
+    __atomic_load_n (&stats->max, __ATOMIC_RELAXED));
+}
+
+void
+droid_hal_stats_reset (DroidHalStats *stats)
+{
+  for (guint i=0; i < STATS_BUCKETS; i++)
+    g_atomic_int_set (&stats->buckets[i], 0);
+
+  __atomic_store_n (&stats->max, 0, __ATOMIC_RELAXED);
+}
@@ -69,7 +69,7 @@ droid_utils_can_write_to (const gchar *path)
 
 gboolean
 droid_utils_write_to_file (const gchar *path,
-                           gchar       *content)
+                           const gchar *content)
 {
   g_autoptr (GError) error = NULL;
 
@@ -43,4 +43,4 @@
 gboolean droid_utils_file_exists   (const gchar *path);
 gboolean droid_utils_can_write_to  (const gchar *path);
 gboolean droid_utils_write_to_file (const gchar *path,
-                                    gchar       *content);
+                                    const gchar *content);
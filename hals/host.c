@@ -0,0 +1,140 @@
+/* host.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Runs every HAL plugin listed in the configuration from a single
+ * process, sharing the main loop and the service manager connections.
+ */
+
+#define G_LOG_DOMAIN "droid-hal-host"
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "config.h"
+
+#include "common/hal-plugin.h"
+#include "common/hal-service.h"
+
+#define HOST_CONFIG_PATH SYSCONFDIR "/libdroid/hal-host.conf"
+
+int
+main (int argc, char** argv)
+{
+  g_autoptr (GError) err = NULL;
+  g_autoptr (GOptionContext) context = NULL;
+  g_autoptr (DroidHalService) service = NULL;
+
+  g_autofree gchar *config = NULL;
+  g_autofree gchar *plugin_dir = NULL;
+  g_autofree gchar *latency = NULL;
+  g_autofree gchar *rate_limit = NULL;
+  gint dispatch = 0;
+  gint idle_timeout = 0;
+  const GOptionEntry entries[] = {
+    {
+      "config", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config,
+      "The host configuration, defaults to " HOST_CONFIG_PATH, NULL,
+    },
+    {
+      "plugin-dir", 'p', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &plugin_dir,
+      "Where to look for plugins, defaults to " HAL_PLUGIN_DIR, NULL,
+    },
+    {
+      "latency", 'l', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &latency,
+      "Enable the latency mode: fifo[:PRIO], rr[:PRIO] or nice[:LEVEL]", NULL,
+    },
+    {
+      "dispatch", 'D', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &dispatch,
+      "Run every HAL on its own thread, queueing up to the given number of transactions", NULL,
+    },
+    {
+      "idle-timeout", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &idle_timeout,
+      "Exit after the given number of seconds without requests, instead of staying around", NULL,
+    },
+    {
+      "rate-limit", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &rate_limit,
+      "Limit transactions per client: RATE[:BURST][,CODE=RATE[:BURST]...]", NULL,
+    },
+    {NULL},
+  };
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries(context, entries, NULL);
+  g_option_context_parse(context, &argc, &argv, &err);
+
+  if (err != NULL)
+    {
+      g_error ("Unable to parse arguments: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (config == NULL)
+      config = g_strdup (HOST_CONFIG_PATH);
+
+  if (plugin_dir == NULL)
+      plugin_dir = g_strdup (HAL_PLUGIN_DIR);
+
+  service = droid_hal_service_new (NULL, NULL, NULL, NULL);
+
+  if (!droid_hal_plugin_load_config (service, config, plugin_dir, &err))
+    {
+      g_warning ("Unable to load HALs: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (latency != NULL && !droid_hal_service_set_latency_mode (service, latency, &err))
+    {
+      g_warning ("Unable to set latency mode: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (dispatch > 0)
+      droid_hal_service_set_dispatch (service, dispatch);
+
+  if (idle_timeout > 0)
+      droid_hal_service_set_idle_timeout (service, idle_timeout);
+
+  if (rate_limit != NULL && !droid_hal_service_set_rate_limit (service, rate_limit, &err))
+    {
+      g_warning ("Unable to set rate limit: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  return droid_hal_service_run (service);
+}
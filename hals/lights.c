@@ -36,12 +36,21 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib-unix.h>
 #include <gudev/gudev.h>
 
+#include "config.h"
+
 #include <libdroid-shared/leds-objects.h>
 
 #include "common/hal-service.h"
 #include "common/hal-implementation.h"
+#include "common/hal-capture.h"
+#include "common/hal-plugin.h"
 #include "common/utils.h"
 
 #define DROID_TYPE_HAL_LIGHTS droid_hal_lights_get_type ()
@@ -49,18 +58,24 @@ G_DECLARE_FINAL_TYPE (DroidHalLights, droid_hal_lights, DROID, HAL_LIGHTS, GObje
 
 #define BINDER_LIGHT_DEVICE "/dev/hwbinder"
 
-#define BINDER_LIGHT_HIDL_IFACE(v) "android.hardware.light@" v "::ILight"
 #define BINDER_LIGHT_HIDL_SLOT_LIBDROID "libdroid"
 
-#define BINDER_LIGHT_HIDL_2_0_IFACE BINDER_LIGHT_HIDL_IFACE("2.0")
+#define BINDER_LIGHT_AIDL_DEVICE "/dev/binder"
+#define BINDER_LIGHT_AIDL_SLOT_DEFAULT "default"
+
+#define FALLBACK_RED_NAME       "red"
+#define FALLBACK_GREEN_NAME     "green"
+#define FALLBACK_BLUE_NAME      "blue"
 
-#define FALLBACK_RED_PATH       "/sys/class/leds/red"
-#define FALLBACK_GREEN_PATH     "/sys/class/leds/green"
-#define FALLBACK_BLUE_PATH      "/sys/class/leds/blue"
+/* Secondary panels looked up when the backlight is not configured */
+#define SECONDARY_PANEL_NAME    "panel%u-backlight"
 
-#define BRIGHTNESS_PATH(p)      p "/brightness"
+#define LIGHTS_CONFIG_PATH      SYSCONFDIR "/libdroid/lights.conf"
 
-#define TO_SYSFS_VALUE(n, max)  n * max / 255
+#define TO_SYSFS_VALUE(n, max)  ((n) * (max) / 255)
+
+#define PATTERN_MAX_KEYFRAMES   64
+#define PATTERN_TICK_MS         50
 
 typedef enum
 {
@@ -69,288 +84,1850 @@ typedef enum
   LIGHT_DEVICE_BLINK_TYPE_BREATH
 } LightDeviceBlinkType;
 
+/* Every light type is made of up to one device per channel */
+typedef enum
+{
+  LIGHT_CHANNEL_WHITE = 0,  /* Driven by the brightness of the color */
+  LIGHT_CHANNEL_RED,
+  LIGHT_CHANNEL_GREEN,
+  LIGHT_CHANNEL_BLUE,
+  LIGHT_CHANNEL_COUNT,
+} LightChannel;
+
+typedef enum
+{
+  PROP_CONFIG_PATH = 1,
+  N_PROPERTIES
+} DroidHalLightsProperty;
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 typedef struct
 {
   GUdevDevice          *device;
   guint                 max;
+  gdouble               scale;
+  guint                 lut[256];   /* 0-255 channel value to sysfs brightness */
+
+  /* Brightness the hardware is at, refreshed when sysfs notifies it */
+  int                   actual_fd;
+  guint                 actual_source;
+  gint                  actual;
+  gint                  actual_stale;
   LightDeviceBlinkType  blink_type;
+  gboolean              has_pattern_trigger;
 } LightDevice;
 
+typedef struct
+{
+  LightKeyframe *keyframes;
+  guint          n_keyframes;
+  gint           repeat;     /* -1 means forever, as the kernel trigger */
+} LightPattern;
+
+/* Where a channel comes from, as in the configuration file */
+typedef struct
+{
+  gchar   *subsystem;
+  gchar   *name;
+  gdouble  scale;
+} LightSource;
+
+/* A panel brightness write, run on the panel pool */
+typedef struct
+{
+  LightDevice *device;
+  gint         value;
+  gboolean     result;
+} PanelWrite;
+
+/* DROID_LIGHT_HIDL_SET_PANEL requests, as flattened in captures */
+typedef struct
+{
+  gint32      panel;
+  LightState  state;
+} CapturedPanel;
+
+/* DROID_LIGHT_HIDL_SET_PATTERN requests, as flattened in captures */
+typedef struct
+{
+  gint32         type;
+  gint32         repeat;
+  LightKeyframe  keyframes[];
+} CapturedPattern;
+
+static const struct
+{
+  const gchar *subsystem;
+  const gchar *name;
+} known_backlights[] = {
+  { "leds",      "lcd-backlight" },
+  { "backlight", "panel0-backlight" },
+};
+
+/* Group names in the configuration file */
+static const gchar * const light_type_names[LIGHT_TYPE_COUNT] = {
+  [LIGHT_TYPE_BACKLIGHT]     = "backlight",
+  [LIGHT_TYPE_KEYBOARD]      = "keyboard",
+  [LIGHT_TYPE_BUTTONS]       = "buttons",
+  [LIGHT_TYPE_BATTERY]       = "battery",
+  [LIGHT_TYPE_NOTIFICATIONS] = "notifications",
+  [LIGHT_TYPE_ATTENTION]     = "attention",
+  [LIGHT_TYPE_BLUETOOTH]     = "bluetooth",
+  [LIGHT_TYPE_WIFI]          = "wifi",
+};
+
+static const struct
+{
+  const gchar *name;
+  guint        shift;
+} light_channels[LIGHT_CHANNEL_COUNT] = {
+  [LIGHT_CHANNEL_WHITE] = { "white", 0 },
+  [LIGHT_CHANNEL_RED]   = { "red",   16 },
+  [LIGHT_CHANNEL_GREEN] = { "green", 8 },
+  [LIGHT_CHANNEL_BLUE]  = { "blue",  0 },
+};
+
 struct _DroidHalLights
 {
   GObject parent_instance;
 
   GUdevClient *udev;
-  LightDevice *backlight_device;
-  LightDevice *red_device;
-  LightDevice *green_device;
-  LightDevice *blue_device;
+  gchar       *config_path;
+  LightSource  sources[LIGHT_TYPE_COUNT][LIGHT_CHANNEL_COUNT];
+  gboolean     backlight_configured;
+  LightDevice *devices[LIGHT_TYPE_COUNT][LIGHT_CHANNEL_COUNT];
+
+  /* The backlight, all panels change together unless addressed */
+  LightSource  panel_sources[LIBDROID_LIGHT_MAX_PANELS];
+  LightDevice *panels[LIBDROID_LIGHT_MAX_PANELS];
+  GThreadPool *panel_pool;
+  GMutex       panel_lock;
+  GCond        panel_cond;
+  guint        panel_jobs;
+
+  /* Held by the worker while writing, and on inventory changes */
+  GMutex       inventory_lock;
+
+  /* I/O worker, requests are coalesced per light type */
+  GThread     *worker;
+  GMutex       queue_lock;
+  GCond        queue_cond;
+  gboolean     quit;
+  guint32      pending_mask;
+  LightState   pending[LIGHT_TYPE_COUNT];
+  guint32      pending_panel_mask;
+  LightState   pending_panels[LIBDROID_LIGHT_MAX_PANELS];
+  GPtrArray   *waiters;
+  gboolean     pattern_job;
+  LightPattern *pending_pattern;
+
+  /* Passes asked for by droid_hal_lights_flush(), and done */
+  GCond        flush_cond;
+  guint        flush_requested;
+  guint        flush_done;
+
+  /* Notification pattern played from the main loop */
+  GMutex       pattern_lock;
+  LightPattern *pattern;
+  guint        pattern_source;
+  guint        pattern_index;
+  gint         pattern_remaining;
+  gint64       pattern_step_start;
+  gboolean     pattern_offloaded;
+
+  /* getLights reply, rebuilt when the inventory changes */
+  GBinderLocalObject *aidl_object;
+  GBinderLocalReply  *aidl_lights_reply;
 };
 
-/* Methods */
-enum
+/* Captures only store the code, AIDL requests are replayed as HIDL ones */
+G_STATIC_ASSERT ((gint) DROID_LIGHT_AIDL_SET_LIGHT_STATE == (gint) DROID_LIGHT_HIDL_SET_LIGHT);
+G_STATIC_ASSERT ((gint) DROID_LIGHT_AIDL_GET_LIGHTS == (gint) DROID_LIGHT_HIDL_GET_SUPPORTED_TYPES);
+
+static void droid_hal_lights_interface_init (DroidHalImplementationInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (DroidHalLights, droid_hal_lights, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (DROID_TYPE_HAL_IMPLEMENTATION,
+                                                droid_hal_lights_interface_init))
+
+static gboolean
+udev_write_string (LightDevice *device,
+                   const gchar *component,
+                   const gchar *content)
+{
+  g_autofree gchar *path = NULL;
+  g_return_val_if_fail (device != NULL, FALSE);
+
+  path = g_build_filename (g_udev_device_get_sysfs_path (device->device), component, NULL);
+
+  return droid_utils_write_to_file (path, content);
+}
+
+static gboolean
+udev_write_int (LightDevice *device,
+                const gchar *component,
+                gint         value)
+{
+  g_autofree gchar *content = g_strdup_printf ("%i", value);
+
+  return udev_write_string (device, component, content);
+}
+
+static gboolean
+udev_blink (LightDevice *device,
+            gboolean     enable)
+{
+  switch (device->blink_type)
+    {
+    case LIGHT_DEVICE_BLINK_TYPE_BREATH:
+      return udev_write_int (device, "breath", enable);
+    case LIGHT_DEVICE_BLINK_TYPE_BLINK:
+      return udev_write_int (device, "blink", enable);
+    case LIGHT_DEVICE_BLINK_TYPE_NONE:
+    default:
+      /* Unsupported */
+      return TRUE;
+    }
+}
+
+static gboolean
+udev_has_trigger (GUdevDevice *device,
+                  const gchar *trigger)
+{
+  g_auto (GStrv) triggers = NULL;
+  const gchar *available = g_udev_device_get_sysfs_attr (device, "trigger");
+
+  if (available == NULL)
+    return FALSE;
+
+  /* e.g. "none timer [pattern]", the active one is in brackets */
+  triggers = g_strsplit_set (available, " []\n", -1);
+
+  return g_strv_contains ((const gchar * const *) triggers, trigger);
+}
+
+/*
+ * Writes the pattern on the colour channel at shift, and starts the
+ * kernel pattern trigger. Step keyframes hold their brightness and jump
+ * to the next one, linear keyframes ramp to it.
+ */
+static gboolean
+udev_write_pattern (LightDevice        *device,
+                    const LightPattern *pattern,
+                    guint               shift)
+{
+  g_autoptr (GString) content = g_string_new (NULL);
+  const LightKeyframe *keyframe;
+  gint value;
+
+  for (guint i=0; i < pattern->n_keyframes; i++)
+    {
+      keyframe = &pattern->keyframes[i];
+      value = device->lut[(keyframe->color >> shift) & 0xff];
+
+      g_string_append_printf (content, "%d %d ", value, keyframe->durationMs);
+      if (keyframe->interpolation == LIGHT_INTERPOLATION_STEP)
+          g_string_append_printf (content, "%d 0 ", value);
+    }
+
+  return (udev_write_string (device, "trigger", "pattern") &&
+          udev_write_int (device, "repeat", pattern->repeat) &&
+          udev_write_string (device, "pattern", content->str));
+}
+
+static void
+droid_hal_lights_pattern_free (LightPattern *pattern)
+{
+  g_free (pattern->keyframes);
+  g_free (pattern);
+}
+
+/* Reads the brightness the hardware is at, in sysfs units */
+static void
+droid_leds_udev_read_actual (LightDevice *light)
+{
+  gchar buffer[16];
+  ssize_t size;
+
+  size = pread (light->actual_fd, buffer, sizeof (buffer) - 1, 0);
+  if (size <= 0)
+    {
+      g_debug ("Unable to read the brightness of %s: %s",
+        g_udev_device_get_sysfs_path (light->device), g_strerror (errno));
+      return;
+    }
+
+  buffer[size] = '\0';
+  g_atomic_int_set (&light->actual, atoi (buffer));
+  g_atomic_int_set (&light->actual_stale, FALSE);
+}
+
+static gboolean
+droid_leds_udev_actual_changed (gint         fd,
+                                GIOCondition condition,
+                                gpointer     user_data)
+{
+  LightDevice *light = user_data;
+
+  /* Reading it again also re-arms the notification */
+  droid_leds_udev_read_actual (light);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Returns the brightness the hardware is at as a 0-255 value, or -1 if
+ * unknown. The cached value is only read again when sysfs notifies a
+ * change, or after we've written to the device.
+ */
+static gint
+droid_leds_udev_get_actual (LightDevice *light)
+{
+  gdouble max = light->max * light->scale;
+
+  if (light->actual_fd < 0 || max <= 0)
+    return -1;
+
+  if (g_atomic_int_get (&light->actual_stale))
+    droid_leds_udev_read_actual (light);
+
+  return MIN ((gint) (g_atomic_int_get (&light->actual) * 255 / max + 0.5), 255);
+}
+
+static LightDevice *
+droid_leds_udev_new_device (GUdevDevice *device,
+                            gdouble      scale)
+{
+  LightDevice *light = g_new0 (LightDevice, 1);
+  g_autofree gchar *actual_path = NULL;
+
+  light->device = device;
+  light->max    = g_udev_device_get_sysfs_attr_as_int (device, "max_brightness");
+  light->scale  = scale;
+
+  for (guint value=0; value < G_N_ELEMENTS (light->lut); value++)
+    light->lut[value] = TO_SYSFS_VALUE (value, light->max) * scale;
+
+  if (g_udev_device_has_sysfs_attr (device, "breath"))
+      light->blink_type = LIGHT_DEVICE_BLINK_TYPE_BREATH;
+  else if (g_udev_device_has_sysfs_attr (device, "blink"))
+      light->blink_type = LIGHT_DEVICE_BLINK_TYPE_BLINK;
+
+  light->has_pattern_trigger = udev_has_trigger (device, "pattern");
+
+  /* Backlights report what they are actually at separately */
+  actual_path = g_build_filename (g_udev_device_get_sysfs_path (device),
+    g_udev_device_has_sysfs_attr (device, "actual_brightness") ?
+      "actual_brightness" : "brightness", NULL);
+  light->actual_fd = open (actual_path, O_RDONLY | O_CLOEXEC);
+  if (light->actual_fd >= 0)
+    {
+      droid_leds_udev_read_actual (light);
+      light->actual_source = g_unix_fd_add (light->actual_fd, G_IO_PRI | G_IO_ERR,
+        droid_leds_udev_actual_changed, light);
+    }
+
+  return light;
+}
+
+static void
+droid_leds_udev_free_device (LightDevice *light)
+{
+  g_clear_handle_id (&light->actual_source, g_source_remove);
+  if (light->actual_fd >= 0)
+    close (light->actual_fd);
+
+  g_clear_object (&light->device);
+  g_free (light);
+}
+
+static gboolean
+droid_hal_lights_has_brightness (GUdevDevice *device)
+{
+  g_autofree gchar *path_to_check = g_build_filename (g_udev_device_get_sysfs_path (device),
+    "brightness", NULL);
+
+  return droid_utils_file_exists (path_to_check);
+}
+
+static gboolean
+droid_hal_lights_is_known_backlight (GUdevDevice *device)
+{
+  const gchar *subsystem = g_udev_device_get_subsystem (device);
+  const gchar *name = g_udev_device_get_name (device);
+
+  for (int i=0; i < G_N_ELEMENTS (known_backlights); i++)
+    {
+      if (g_strcmp0 (subsystem, known_backlights[i].subsystem) == 0 &&
+          g_strcmp0 (name, known_backlights[i].name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+droid_hal_lights_is_backlight (GUdevDevice *device)
+{
+  const gchar *backlight_type;
+
+  if (droid_hal_lights_is_known_backlight (device))
+    return TRUE;
+
+  if (g_strcmp0 (g_udev_device_get_subsystem (device), "backlight") != 0)
+    return FALSE;
+
+  backlight_type = g_udev_device_get_sysfs_attr (device, "type");
+  g_debug ("Fallback to %s type %s (name %s)", g_udev_device_get_sysfs_path (device),
+    backlight_type, g_udev_device_get_name (device));
+
+  return (g_strcmp0 (backlight_type, "firmware") == 0 ||
+          g_strcmp0 (backlight_type, "platform") == 0 ||
+          g_strcmp0 (backlight_type, "raw") == 0);
+}
+
+static LightDevice **
+droid_hal_lights_slot_for_device (DroidHalLights *self,
+                                  GUdevDevice    *device)
+{
+  const gchar *sysfs_path = g_udev_device_get_sysfs_path (device);
+  LightDevice **slot;
+
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      slot = &self->panels[panel];
+      if (*slot != NULL &&
+          g_strcmp0 (g_udev_device_get_sysfs_path ((*slot)->device), sysfs_path) == 0)
+        return slot;
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+        {
+          slot = &self->devices[type][channel];
+          if (*slot != NULL &&
+              g_strcmp0 (g_udev_device_get_sysfs_path ((*slot)->device), sysfs_path) == 0)
+            return slot;
+        }
+    }
+
+  return NULL;
+}
+
+static gboolean
+droid_hal_lights_source_matches (const LightSource *source,
+                                 GUdevDevice       *device)
+{
+  return (source->name != NULL &&
+          g_strcmp0 (source->subsystem, g_udev_device_get_subsystem (device)) == 0 &&
+          g_strcmp0 (source->name, g_udev_device_get_name (device)) == 0);
+}
+
+/*
+ * Returns the first free slot the device is configured for, if any,
+ * and its source.
+ */
+static LightDevice **
+droid_hal_lights_configured_slot (DroidHalLights  *self,
+                                  GUdevDevice     *device,
+                                  LightSource    **source)
+{
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      *source = &self->panel_sources[panel];
+      if (self->panels[panel] == NULL && droid_hal_lights_source_matches (*source, device))
+        return &self->panels[panel];
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+        {
+          *source = &self->sources[type][channel];
+          if (self->devices[type][channel] == NULL &&
+              droid_hal_lights_source_matches (*source, device))
+            return &self->devices[type][channel];
+        }
+    }
+
+  *source = NULL;
+
+  return NULL;
+}
+
+/*
+ * Assigns the device to the first free slot it is suitable for.
+ * Slots already in use are never replaced, so the probe order
+ * decides the priority between candidates.
+ */
+static gboolean
+droid_hal_lights_claim (DroidHalLights *self,
+                        GUdevDevice    *device)
+{
+  LightSource *source;
+  LightDevice **slot;
+
+  /* A device drives a single slot, panels often have more than one name */
+  if (!droid_hal_lights_has_brightness (device) ||
+      droid_hal_lights_slot_for_device (self, device) != NULL)
+    return FALSE;
+
+  slot = droid_hal_lights_configured_slot (self, device, &source);
+
+  if (slot == NULL && !self->backlight_configured && self->panels[0] == NULL &&
+      droid_hal_lights_is_backlight (device))
+    slot = &self->panels[0];
+
+  if (slot == NULL)
+    return FALSE;
+
+  g_debug ("Using %s", g_udev_device_get_sysfs_path (device));
+  *slot = droid_leds_udev_new_device (G_UDEV_DEVICE (g_object_ref (device)),
+    source ? source->scale : 1.0);
+
+  return TRUE;
+}
+
+static void
+droid_hal_lights_claim_by_name (DroidHalLights *self,
+                                const gchar    *subsystem,
+                                const gchar    *name)
+{
+  g_autoptr (GUdevDevice) device = g_udev_client_query_by_subsystem_and_name (self->udev,
+    subsystem, name);
+
+  if (device != NULL)
+    droid_hal_lights_claim (self, device);
+}
+
+static void
+droid_hal_lights_probe (DroidHalLights *self)
+{
+  g_autolist(GUdevDevice) backlight_list = NULL;
+  LightDevice **backlight = &self->panels[0];
+  GList *item;
+
+  if (!self->backlight_configured)
+    {
+      for (int i=0; i < G_N_ELEMENTS (known_backlights); i++)
+        droid_hal_lights_claim_by_name (self, known_backlights[i].subsystem,
+          known_backlights[i].name);
+    }
+
+  if (!self->backlight_configured && *backlight == NULL)
+    {
+      /* Try using udev */
+      backlight_list = g_udev_client_query_by_subsystem (self->udev, "backlight");
+
+      for (item = backlight_list; item != NULL && *backlight == NULL; item = item->next)
+        droid_hal_lights_claim (self, item->data);
+    }
+
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      if (self->panel_sources[panel].name != NULL)
+        droid_hal_lights_claim_by_name (self, self->panel_sources[panel].subsystem,
+          self->panel_sources[panel].name);
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+        {
+          if (self->sources[type][channel].name != NULL)
+            droid_hal_lights_claim_by_name (self, self->sources[type][channel].subsystem,
+              self->sources[type][channel].name);
+        }
+    }
+}
+
+static void
+droid_hal_lights_set_source (LightSource *source,
+                             const gchar *subsystem,
+                             const gchar *name,
+                             gdouble      scale)
+{
+  g_free (source->subsystem);
+  g_free (source->name);
+  source->subsystem = g_strdup (subsystem);
+  source->name      = g_strdup (name);
+  source->scale     = scale;
+}
+
+/* Parses a subsystem/name value */
+static gboolean
+droid_hal_lights_parse_source (LightSource *source,
+                               const gchar *value,
+                               gdouble      scale)
+{
+  g_auto (GStrv) parts = g_strsplit (value, "/", 2);
+
+  if (g_strv_length (parts) != 2)
+    return FALSE;
+
+  droid_hal_lights_set_source (source, parts[0], parts[1], scale);
+
+  return TRUE;
+}
+
+/*
+ * The backlight group lists the panels, with an optional scale to apply
+ * to each of them, e.g.
+ *
+ *   [backlight]
+ *   panels=backlight/panel0-backlight;backlight/panel1-backlight
+ *   scales=1.0;0.8
+ */
+static void
+droid_hal_lights_load_panels (DroidHalLights *self,
+                              GKeyFile       *config)
+{
+  g_auto (GStrv) panels = NULL;
+  g_autofree gdouble *scales = NULL;
+  gsize n_panels = 0, n_scales = 0;
+  gdouble scale;
+
+  panels = g_key_file_get_string_list (config, "backlight", "panels", &n_panels, NULL);
+  scales = g_key_file_get_double_list (config, "backlight", "scales", &n_scales, NULL);
+
+  if (n_panels > LIBDROID_LIGHT_MAX_PANELS)
+    g_warning ("Only %d backlight panels are supported", LIBDROID_LIGHT_MAX_PANELS);
+
+  for (gsize i=0; i < LIBDROID_LIGHT_MAX_PANELS; i++)
+    {
+      droid_hal_lights_set_source (&self->panel_sources[i], NULL, NULL, 1.0);
+      if (i >= n_panels)
+        continue;
+
+      scale = (i < n_scales) ? CLAMP (scales[i], 0.0, 1.0) : 1.0;
+      if (!droid_hal_lights_parse_source (&self->panel_sources[i], panels[i], scale))
+        g_warning ("Invalid backlight panel: %s", panels[i]);
+    }
+}
+
+/*
+ * Loads which devices make up every light type. Each light type is a
+ * group, with a subsystem/name value for its channels, e.g.
+ *
+ *   [keyboard]
+ *   white=leds/kbd_backlight
+ *
+ * A group replaces the defaults for its light type. Without a backlight
+ * group, the backlight is looked up among the known ones, and secondary
+ * panels by name.
+ */
+static void
+droid_hal_lights_load_config (DroidHalLights *self)
+{
+  g_autoptr (GKeyFile) config = g_key_file_new ();
+  g_autoptr (GError) error = NULL;
+  const gchar *group;
+
+  droid_hal_lights_set_source (&self->sources[LIGHT_TYPE_NOTIFICATIONS][LIGHT_CHANNEL_RED],
+    "leds", FALLBACK_RED_NAME, 1.0);
+  droid_hal_lights_set_source (&self->sources[LIGHT_TYPE_NOTIFICATIONS][LIGHT_CHANNEL_GREEN],
+    "leds", FALLBACK_GREEN_NAME, 1.0);
+  droid_hal_lights_set_source (&self->sources[LIGHT_TYPE_NOTIFICATIONS][LIGHT_CHANNEL_BLUE],
+    "leds", FALLBACK_BLUE_NAME, 1.0);
+
+  for (guint panel=1; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      g_autofree gchar *name = g_strdup_printf (SECONDARY_PANEL_NAME, panel);
+
+      droid_hal_lights_set_source (&self->panel_sources[panel], "backlight", name, 1.0);
+    }
+
+  if (!g_key_file_load_from_file (config, self->config_path, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Unable to load %s: %s", self->config_path, error->message);
+      return;
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      group = light_type_names[type];
+      if (!g_key_file_has_group (config, group))
+        continue;
+
+      if (type == LIGHT_TYPE_BACKLIGHT)
+        {
+          self->backlight_configured = TRUE;
+          droid_hal_lights_load_panels (self, config);
+          continue;
+        }
+
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+        {
+          g_autofree gchar *value = g_key_file_get_string (config, group,
+            light_channels[channel].name, NULL);
+
+          droid_hal_lights_set_source (&self->sources[type][channel], NULL, NULL, 1.0);
+          if (value != NULL &&
+              !droid_hal_lights_parse_source (&self->sources[type][channel], value, 1.0))
+            g_warning ("Invalid %s %s light: %s", group, light_channels[channel].name, value);
+        }
+    }
+}
+
+static void
+droid_hal_lights_uevent (GUdevClient *client,
+                         const gchar *action,
+                         GUdevDevice *device,
+                         gpointer     user_data)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  LightDevice **slot = droid_hal_lights_slot_for_device (self, device);
+  gdouble scale;
+
+  g_debug ("uevent: %s %s", action, g_udev_device_get_sysfs_path (device));
+
+  g_mutex_lock (&self->inventory_lock);
+
+  if (g_strcmp0 (action, "remove") == 0)
+    {
+      if (slot == NULL)
+        goto out;
+
+      g_message ("Light %s removed", g_udev_device_get_sysfs_path (device));
+      g_clear_pointer (slot, droid_leds_udev_free_device);
+
+      /* Another device might be able to take over */
+      droid_hal_lights_probe (self);
+    }
+  else if (slot != NULL)
+    {
+      /* Attributes such as max_brightness might have changed */
+      scale = (*slot)->scale;
+      g_clear_pointer (slot, droid_leds_udev_free_device);
+      *slot = droid_leds_udev_new_device (G_UDEV_DEVICE (g_object_ref (device)), scale);
+    }
+  else if (droid_hal_lights_claim (self, device))
+    {
+      g_message ("Light %s added", g_udev_device_get_sysfs_path (device));
+    }
+
+out:
+  g_clear_pointer (&self->aidl_lights_reply, gbinder_local_reply_unref);
+  g_mutex_unlock (&self->inventory_lock);
+}
+
+static gint
+droid_hal_lights_brightness (uint32_t color)
+{
+  return ((77 * ((color >> 16) & 0x00ff)) +
+    (150 * ((color >> 8) & 0x00ff)) + (29 * (color & 0x00ff))) >> 8;
+}
+
+static gboolean
+droid_hal_lights_write_panel (LightDevice *device,
+                              gint         value)
+{
+  gboolean result = udev_write_int (device, "brightness", device->lut[value]);
+
+  /* Not every driver notifies changes it didn't make itself */
+  g_atomic_int_set (&device->actual_stale, TRUE);
+
+  return result;
+}
+
+static void
+droid_hal_lights_panel_write (gpointer data,
+                              gpointer user_data)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  PanelWrite *write = data;
+
+  write->result = droid_hal_lights_write_panel (write->device, write->value);
+
+  g_mutex_lock (&self->panel_lock);
+  self->panel_jobs--;
+  g_cond_signal (&self->panel_cond);
+  g_mutex_unlock (&self->panel_lock);
+}
+
+/*
+ * Sets the brightness of every panel, or of the given one only. Panel
+ * drivers can take a while to apply it, so all of them are written at
+ * the same time: the first one from here, the others from the pool.
+ */
+static gboolean
+droid_hal_lights_set_panels (DroidHalLights *self,
+                             gint            panel,
+                             uint32_t        color)
+{
+  PanelWrite writes[LIBDROID_LIGHT_MAX_PANELS];
+  gint value = droid_hal_lights_brightness (color);
+  guint n_writes = 0;
+  gboolean result = FALSE;
+
+  for (int i=0; i < LIBDROID_LIGHT_MAX_PANELS; i++)
+    {
+      if (self->panels[i] != NULL && (panel < 0 || panel == i))
+        {
+          writes[n_writes].device = self->panels[i];
+          writes[n_writes].value  = value;
+          writes[n_writes].result = FALSE;
+          n_writes++;
+        }
+    }
+
+  g_debug ("backlight: got backlight change request: %d (%u panels)", value, n_writes);
+
+  if (n_writes == 0)
+    return FALSE;
+
+  self->panel_jobs = n_writes - 1;
+  for (guint i=1; i < n_writes; i++)
+    g_thread_pool_push (self->panel_pool, &writes[i], NULL);
+
+  writes[0].result = droid_hal_lights_write_panel (writes[0].device, value);
+
+  g_mutex_lock (&self->panel_lock);
+  while (self->panel_jobs > 0)
+    g_cond_wait (&self->panel_cond, &self->panel_lock);
+  g_mutex_unlock (&self->panel_lock);
+
+  for (guint i=0; i < n_writes; i++)
+    result |= writes[i].result;
+
+  return result;
+}
+
+static gboolean
+droid_hal_lights_set (DroidHalLights *backend,
+                      uint32_t        color,
+                      LightType       light_type,
+                      FlashType       flash_type,
+                      BrightnessType  backlight_type,
+                      int32_t         flash_on_ms,
+                      int32_t         flash_off_ms)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (backend);
+  LightDevice *device;
+  gint value;
+  gboolean result = FALSE;
+
+  g_return_val_if_fail (DROID_IS_HAL_LIGHTS (self), FALSE);
+  g_return_val_if_fail ((gint) light_type >= 0 && light_type < LIGHT_TYPE_COUNT, FALSE);
+
+  if (light_type == LIGHT_TYPE_BACKLIGHT)
+    return droid_hal_lights_set_panels (self, -1, color);
+
+  for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+    {
+      device = self->devices[light_type][channel];
+      if (device == NULL)
+        continue;
+
+      if (channel == LIGHT_CHANNEL_WHITE)
+        value = droid_hal_lights_brightness (color);
+      else
+        value = (color >> light_channels[channel].shift) & 0xff;
+
+      g_debug ("%s: got %s change request: %d", light_type_names[light_type],
+        light_channels[channel].name, value);
+
+      /* Colour channels are the blinking ones */
+      if (udev_write_int (device, "brightness", device->lut[value]) &&
+          (channel == LIGHT_CHANNEL_WHITE || udev_blink (device, (value > 0))))
+        result = TRUE;
+    }
+
+  return result;
+}
+
+static void
+droid_hal_lights_complete (DroidHalDeferredReply *deferred,
+                           gint32                 status)
+{
+  GBinderLocalReply *reply = droid_hal_deferred_reply_new_reply (deferred);
+  GBinderWriter writer;
+
+  gbinder_local_reply_init_writer (reply, &writer);
+  gbinder_writer_append_int32 (&writer, status);
+
+  droid_hal_deferred_reply_complete (deferred, reply, GBINDER_STATUS_OK);
+}
+
+/*
+ * Hands the pattern over to the kernel pattern trigger, or stops the
+ * trigger if pattern is NULL.
+ */
+static void
+droid_hal_lights_offload_pattern (DroidHalLights     *self,
+                                  const LightPattern *pattern)
+{
+  LightDevice **devices = self->devices[LIGHT_TYPE_NOTIFICATIONS];
+
+  for (int channel=LIGHT_CHANNEL_RED; channel < LIGHT_CHANNEL_COUNT; channel++)
+    {
+      if (devices[channel] == NULL)
+          continue;
+
+      if (pattern == NULL)
+          udev_write_string (devices[channel], "trigger", "none");
+      else if (!udev_write_pattern (devices[channel], pattern, light_channels[channel].shift))
+          g_warning ("Unable to offload pattern to %s",
+            g_udev_device_get_sysfs_path (devices[channel]->device));
+    }
+}
+
+static gpointer
+droid_hal_lights_worker (gpointer user_data)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  LightState states[LIGHT_TYPE_COUNT];
+  LightState panel_states[LIBDROID_LIGHT_MAX_PANELS];
+  LightPattern *pattern;
+  GPtrArray *waiters;
+  gboolean pattern_job;
+  guint32 mask, panel_mask;
+  guint flush;
+
+  g_mutex_lock (&self->queue_lock);
+
+  while (TRUE)
+    {
+      while (!self->quit && self->pending_mask == 0 && self->pending_panel_mask == 0 &&
+             self->waiters->len == 0 && !self->pattern_job &&
+             self->flush_done == self->flush_requested)
+          g_cond_wait (&self->queue_cond, &self->queue_lock);
+
+      /* Drain whatever is left before quitting */
+      if (self->pending_mask == 0 && self->pending_panel_mask == 0 &&
+          self->waiters->len == 0 && !self->pattern_job &&
+          self->flush_done == self->flush_requested)
+          break;
+
+      /* Only the latest state for every light type is kept */
+      mask = self->pending_mask;
+      memcpy (states, self->pending, sizeof (states));
+      panel_mask = self->pending_panel_mask;
+      memcpy (panel_states, self->pending_panels, sizeof (panel_states));
+      waiters = g_steal_pointer (&self->waiters);
+      pattern_job = self->pattern_job;
+      pattern = g_steal_pointer (&self->pending_pattern);
+      self->pending_mask = 0;
+      self->pending_panel_mask = 0;
+      self->pattern_job = FALSE;
+      self->waiters = g_ptr_array_new ();
+      flush = self->flush_requested;
+
+      g_mutex_unlock (&self->queue_lock);
+
+      g_mutex_lock (&self->inventory_lock);
+
+      /* Patterns go first, so that later states override them */
+      if (pattern_job)
+          droid_hal_lights_offload_pattern (self, pattern);
+      g_clear_pointer (&pattern, droid_hal_lights_pattern_free);
+
+      for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+        {
+          if (mask & (1 << type))
+              droid_hal_lights_set (self, states[type].color, (LightType) type,
+                states[type].flashMode, states[type].brightnessMode,
+                states[type].flashOnMs, states[type].flashOffMs);
+        }
+
+      /* Single panels go last, as they were requested after the whole backlight */
+      for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+        {
+          if (panel_mask & (1 << panel))
+              droid_hal_lights_set_panels (self, panel, panel_states[panel].color);
+        }
+      g_mutex_unlock (&self->inventory_lock);
+
+      for (guint i=0; i < waiters->len; i++)
+          droid_hal_lights_complete (g_ptr_array_index (waiters, i), GBINDER_STATUS_OK);
+      g_ptr_array_unref (waiters);
+
+      g_mutex_lock (&self->queue_lock);
+
+      self->flush_done = flush;
+      g_cond_broadcast (&self->flush_cond);
+    }
+
+  /* Nothing is going to be applied anymore */
+  self->flush_done = self->flush_requested;
+  g_cond_broadcast (&self->flush_cond);
+
+  g_mutex_unlock (&self->queue_lock);
+
+  return NULL;
+}
+
+/*
+ * Queues the entries in one go, so that they are all applied in the
+ * same worker pass before the reply is sent.
+ */
+static void
+droid_hal_lights_submit (DroidHalLights        *self,
+                         const LightBatchEntry *entries,
+                         guint                  n_entries,
+                         DroidHalDeferredReply *deferred)
+{
+  g_mutex_lock (&self->queue_lock);
+
+  for (guint i=0; i < n_entries; i++)
+    {
+      self->pending[entries[i].type] = entries[i].state;
+      self->pending_mask |= (1 << entries[i].type);
+
+      /* The whole backlight overrides single panels */
+      if (entries[i].type == LIGHT_TYPE_BACKLIGHT)
+          self->pending_panel_mask = 0;
+    }
+
+  if (deferred != NULL)
+      g_ptr_array_add (self->waiters, deferred);
+
+  g_cond_signal (&self->queue_cond);
+  g_mutex_unlock (&self->queue_lock);
+}
+
+/* Waits until what has been submitted so far has been applied */
+static void
+droid_hal_lights_flush (DroidHalLights *self)
+{
+  guint flush;
+
+  g_mutex_lock (&self->queue_lock);
+
+  flush = ++self->flush_requested;
+  g_cond_signal (&self->queue_cond);
+
+  while ((gint) (flush - self->flush_done) > 0)
+      g_cond_wait (&self->flush_cond, &self->queue_lock);
+
+  g_mutex_unlock (&self->queue_lock);
+}
+
+/* Queues the state of a single backlight panel */
+static void
+droid_hal_lights_submit_panel (DroidHalLights        *self,
+                               guint                  panel,
+                               const LightState      *state,
+                               DroidHalDeferredReply *deferred)
+{
+  g_mutex_lock (&self->queue_lock);
+
+  self->pending_panels[panel] = *state;
+  self->pending_panel_mask |= (1 << panel);
+
+  if (deferred != NULL)
+      g_ptr_array_add (self->waiters, deferred);
+
+  g_cond_signal (&self->queue_cond);
+  g_mutex_unlock (&self->queue_lock);
+}
+
+/*
+ * Queues a pattern for the kernel trigger, ownership of the pattern
+ * is transferred. A NULL pattern stops the trigger.
+ */
+static void
+droid_hal_lights_submit_pattern (DroidHalLights        *self,
+                                 LightPattern          *pattern,
+                                 DroidHalDeferredReply *deferred)
+{
+  g_mutex_lock (&self->queue_lock);
+
+  g_clear_pointer (&self->pending_pattern, droid_hal_lights_pattern_free);
+  self->pending_pattern = pattern;
+  self->pattern_job = TRUE;
+
+  /* The pattern supersedes any pending notification state */
+  if (pattern != NULL)
+      self->pending_mask &= ~(1 << LIGHT_TYPE_NOTIFICATIONS);
+
+  if (deferred != NULL)
+      g_ptr_array_add (self->waiters, deferred);
+
+  g_cond_signal (&self->queue_cond);
+  g_mutex_unlock (&self->queue_lock);
+}
+
+static void
+droid_hal_lights_stop_pattern_locked (DroidHalLights *self)
+{
+  g_clear_handle_id (&self->pattern_source, g_source_remove);
+  g_clear_pointer (&self->pattern, droid_hal_lights_pattern_free);
+
+  if (self->pattern_offloaded)
+    {
+      self->pattern_offloaded = FALSE;
+      droid_hal_lights_submit_pattern (self, NULL, NULL);
+    }
+}
+
+static guint32
+droid_hal_lights_interpolate (guint32 from,
+                              guint32 to,
+                              gint64  position,
+                              gint64  duration)
+{
+  guint32 result = 0;
+  gint64 a, b;
+
+  for (guint shift=0; shift < 24; shift += 8)
+    {
+      a = (from >> shift) & 0xff;
+      b = (to >> shift) & 0xff;
+      result |= (guint32) (a + (b - a) * position / duration) << shift;
+    }
+
+  return result;
+}
+
+static void
+droid_hal_lights_stop_pattern (DroidHalLights *self)
+{
+  g_mutex_lock (&self->pattern_lock);
+  droid_hal_lights_stop_pattern_locked (self);
+  g_mutex_unlock (&self->pattern_lock);
+}
+
+static gboolean droid_hal_lights_pattern_tick (gpointer user_data);
+
+/*
+ * Plays the pattern from the main loop. A single timer is armed at any
+ * time: at the end of step keyframes, or every PATTERN_TICK_MS while
+ * ramping through linear keyframes.
+ */
+static void
+droid_hal_lights_pattern_step (DroidHalLights *self)
+{
+  LightPattern *pattern = self->pattern;
+  const LightKeyframe *current, *next;
+  LightBatchEntry entry = { .type = LIGHT_TYPE_NOTIFICATIONS };
+  gint64 elapsed = (g_get_monotonic_time () - self->pattern_step_start) / 1000;
+  gint64 remaining;
+
+  while (elapsed >= pattern->keyframes[self->pattern_index].durationMs)
+    {
+      elapsed -= pattern->keyframes[self->pattern_index].durationMs;
+      self->pattern_step_start += pattern->keyframes[self->pattern_index].durationMs * 1000;
+
+      if (self->pattern_index + 1 < pattern->n_keyframes)
+        {
+          self->pattern_index++;
+        }
+      else if (pattern->repeat < 0 || --self->pattern_remaining > 0)
+        {
+          self->pattern_index = 0;
+        }
+      else
+        {
+          /* Done, the last keyframe stays on as with the kernel trigger */
+          g_clear_pointer (&self->pattern, droid_hal_lights_pattern_free);
+          return;
+        }
+    }
+
+  current = &pattern->keyframes[self->pattern_index];
+  next = &pattern->keyframes[(self->pattern_index + 1) % pattern->n_keyframes];
+  remaining = current->durationMs - elapsed;
+
+  if (current->interpolation == LIGHT_INTERPOLATION_LINEAR)
+    {
+      entry.state.color = droid_hal_lights_interpolate (current->color, next->color,
+        elapsed, current->durationMs);
+      remaining = MIN (remaining, PATTERN_TICK_MS);
+    }
+  else
+    {
+      entry.state.color = current->color;
+    }
+
+  droid_hal_lights_submit (self, &entry, 1, NULL);
+  self->pattern_source = g_timeout_add (remaining, droid_hal_lights_pattern_tick, self);
+}
+
+static gboolean
+droid_hal_lights_pattern_tick (gpointer user_data)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+
+  g_mutex_lock (&self->pattern_lock);
+
+  /* Requests might be handled on another thread, which could have stopped it meanwhile */
+  if (!g_source_is_destroyed (g_main_current_source ()))
+    {
+      self->pattern_source = 0;
+      droid_hal_lights_pattern_step (self);
+    }
+
+  g_mutex_unlock (&self->pattern_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+droid_hal_lights_can_offload_pattern (DroidHalLights *self)
+{
+  LightDevice **devices = self->devices[LIGHT_TYPE_NOTIFICATIONS];
+  gboolean result = FALSE;
+
+  /* The pattern is only written to the colour channels */
+  if (devices[LIGHT_CHANNEL_WHITE] != NULL)
+      return FALSE;
+
+  for (int channel=LIGHT_CHANNEL_RED; channel < LIGHT_CHANNEL_COUNT; channel++)
+    {
+      if (devices[channel] == NULL)
+          continue;
+      else if (!devices[channel]->has_pattern_trigger)
+          return FALSE;
+
+      result = TRUE;
+    }
+
+  return result;
+}
+
+static void
+droid_hal_lights_start_pattern (DroidHalLights        *self,
+                                LightPattern          *pattern,
+                                DroidHalDeferredReply *deferred)
+{
+  gboolean offload;
+
+  g_mutex_lock (&self->inventory_lock);
+  offload = droid_hal_lights_can_offload_pattern (self);
+  g_mutex_unlock (&self->inventory_lock);
+
+  g_mutex_lock (&self->pattern_lock);
+  droid_hal_lights_stop_pattern_locked (self);
+
+  if (offload)
+    {
+      g_debug ("pattern: offloading %u keyframes to the kernel", pattern->n_keyframes);
+      self->pattern_offloaded = TRUE;
+      droid_hal_lights_submit_pattern (self, pattern, deferred);
+    }
+  else
+    {
+      g_debug ("pattern: playing %u keyframes", pattern->n_keyframes);
+      self->pattern = pattern;
+      self->pattern_index = 0;
+      self->pattern_remaining = pattern->repeat;
+      self->pattern_step_start = g_get_monotonic_time ();
+      droid_hal_lights_pattern_step (self);
+
+      /* Reply once the first keyframe has been applied */
+      droid_hal_lights_submit (self, NULL, 0, deferred);
+    }
+
+  g_mutex_unlock (&self->pattern_lock);
+}
+
+/* Client requests touching the notification light stop the pattern */
+static void
+droid_hal_lights_submit_request (DroidHalLights        *self,
+                                 const LightBatchEntry *entries,
+                                 guint                  n_entries,
+                                 DroidHalDeferredReply *deferred)
+{
+  for (guint i=0; i < n_entries; i++)
+    {
+      if (entries[i].type == LIGHT_TYPE_NOTIFICATIONS)
+          droid_hal_lights_stop_pattern (self);
+    }
+
+  droid_hal_lights_submit (self, entries, n_entries, deferred);
+}
+
+
+static gboolean
+droid_hal_lights_valid_entries (const LightBatchEntry *entries,
+                                gsize                  n_entries)
+{
+  for (gsize i=0; i < n_entries; i++)
+    {
+      if ((gint32) entries[i].type < 0 || entries[i].type >= LIGHT_TYPE_COUNT)
+          return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns NULL if the pattern is not valid */
+static LightPattern *
+droid_hal_lights_new_pattern (gint32               light_type,
+                              const LightKeyframe *keyframes,
+                              gsize                n_keyframes,
+                              gint32               repeat)
+{
+  LightPattern *pattern;
+
+  if (light_type != LIGHT_TYPE_NOTIFICATIONS || repeat < 0 ||
+      n_keyframes == 0 || n_keyframes > PATTERN_MAX_KEYFRAMES)
+      return NULL;
+
+  for (gsize i=0; i < n_keyframes; i++)
+    {
+      if (keyframes[i].durationMs <= 0)
+          return NULL;
+    }
+
+  pattern = g_new0 (LightPattern, 1);
+  pattern->keyframes = g_memdup2 (keyframes, n_keyframes * sizeof (LightKeyframe));
+  pattern->n_keyframes = n_keyframes;
+  pattern->repeat = (repeat == 0) ? -1 : repeat;
+
+  return pattern;
+}
+
+static guint
+droid_hal_lights_supported_types (DroidHalLights *self,
+                                  LightType       supported[LIGHT_TYPE_COUNT])
+{
+  guint count = 0;
+
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      if (self->panels[panel] != NULL)
+        {
+          supported[count++] = LIGHT_TYPE_BACKLIGHT;
+          break;
+        }
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+        {
+          if (self->devices[type][channel] != NULL)
+            {
+              supported[count++] = (LightType) type;
+              break;
+            }
+        }
+    }
+
+  return count;
+}
+
+/*
+ * The light list only changes with the inventory, while clients ask for
+ * it every time they probe a light, so the reply is built once and sent
+ * as is until a uevent invalidates it. Called with the inventory lock.
+ */
+static GBinderLocalReply *
+droid_hal_lights_aidl_lights_reply (DroidHalLights     *self,
+                                    GBinderLocalObject *object)
+{
+  LightType supported[LIGHT_TYPE_COUNT];
+  AidlHwLight lights[LIGHT_TYPE_COUNT];
+  guint count;
+
+  if (self->aidl_lights_reply != NULL && self->aidl_object == object)
+    return gbinder_local_reply_ref (self->aidl_lights_reply);
+
+  g_clear_pointer (&self->aidl_lights_reply, gbinder_local_reply_unref);
+  g_clear_pointer (&self->aidl_object, gbinder_local_object_unref);
+
+  count = droid_hal_lights_supported_types (self, supported);
+  for (guint i=0; i < count; i++)
+    {
+      lights[i].id      = supported[i];
+      lights[i].ordinal = 0;
+      lights[i].type    = supported[i];
+    }
+
+  self->aidl_object = gbinder_local_object_ref (object);
+  self->aidl_lights_reply = gbinder_local_object_new_reply (object);
+  droid_light_aidl_write_get_lights_reply (self->aidl_lights_reply, lights, count);
+
+  return gbinder_local_reply_ref (self->aidl_lights_reply);
+}
+
+static GBinderLocalReply *
+droid_hal_lights_set_light (gpointer                          user_data,
+                            GBinderLocalObject               *object,
+                            GBinderRemoteRequest             *request,
+                            const DroidLightHidlSetLightArgs *args)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  LightBatchEntry entry = {
+    .type  = args->type,
+    .state = args->state,
+  };
+
+  if (!droid_hal_lights_valid_entries (&entry, 1))
+    return droid_light_hidl_error_reply (object);
+
+  /* The reply is sent by the worker once the state has been applied */
+  droid_hal_lights_submit_request (self, &entry, 1,
+    droid_hal_deferred_reply_new (object, request));
+
+  return NULL;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_get_supported_types (gpointer                                   user_data,
+                                      GBinderLocalObject                        *object,
+                                      GBinderRemoteRequest                      *request,
+                                      const DroidLightHidlGetSupportedTypesArgs *args)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  GBinderLocalReply *reply = gbinder_local_object_new_reply (object);
+  LightType supported[LIGHT_TYPE_COUNT];
+  guint count;
+
+  g_mutex_lock (&self->inventory_lock);
+  count = droid_hal_lights_supported_types (self, supported);
+  g_mutex_unlock (&self->inventory_lock);
+
+  droid_light_hidl_write_get_supported_types_reply (reply, GBINDER_STATUS_OK, supported, count);
+
+  return reply;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_set_lights (gpointer                           user_data,
+                             GBinderLocalObject                *object,
+                             GBinderRemoteRequest              *request,
+                             const DroidLightHidlSetLightsArgs *args)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+
+  if (!droid_hal_lights_valid_entries (args->entries, args->n_entries))
+    return droid_light_hidl_error_reply (object);
+
+  droid_hal_lights_submit_request (self, args->entries, args->n_entries,
+    droid_hal_deferred_reply_new (object, request));
+
+  return NULL;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_set_panel (gpointer                          user_data,
+                            GBinderLocalObject               *object,
+                            GBinderRemoteRequest             *request,
+                            const DroidLightHidlSetPanelArgs *args)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+
+  if (args->panel < 0 || args->panel >= LIBDROID_LIGHT_MAX_PANELS ||
+      self->panels[args->panel] == NULL)
+    return droid_light_hidl_error_reply (object);
+
+  droid_hal_lights_submit_panel (self, args->panel, &args->state,
+    droid_hal_deferred_reply_new (object, request));
+
+  return NULL;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_get_brightness (gpointer                               user_data,
+                                 GBinderLocalObject                    *object,
+                                 GBinderRemoteRequest                  *request,
+                                 const DroidLightHidlGetBrightnessArgs *args)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  GBinderLocalReply *reply = gbinder_local_object_new_reply (object);
+  gint32 brightness = -1;
+
+  g_mutex_lock (&self->inventory_lock);
+  if (args->panel >= 0 && args->panel < LIBDROID_LIGHT_MAX_PANELS &&
+      self->panels[args->panel] != NULL)
+      brightness = droid_leds_udev_get_actual (self->panels[args->panel]);
+  g_mutex_unlock (&self->inventory_lock);
+
+  droid_light_hidl_write_get_brightness_reply (reply,
+    (brightness >= 0) ? GBINDER_STATUS_OK : GBINDER_STATUS_FAILED, brightness);
+
+  return reply;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_set_pattern (gpointer                            user_data,
+                              GBinderLocalObject                 *object,
+                              GBinderRemoteRequest               *request,
+                              const DroidLightHidlSetPatternArgs *args)
 {
-  /* setLight(Type type, LightState state) generates (Status status); */
-  BINDER_LIGHT_HIDL_2_0_SET_LIGHT = 1,
-  /* getSupportedTypes() generates (vec<Type> types); */
-  BINDER_LIGHT_HIDL_2_0_GET_SUPPORTED_TYPES = 2,
-};
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  LightPattern *pattern;
 
-static void droid_hal_lights_interface_init (DroidHalImplementationInterface *iface);
+  pattern = droid_hal_lights_new_pattern (args->type, args->keyframes, args->n_keyframes,
+    args->repeat);
+  if (pattern == NULL)
+    return droid_light_hidl_error_reply (object);
 
-G_DEFINE_TYPE_WITH_CODE (DroidHalLights, droid_hal_lights, G_TYPE_OBJECT,
-                         G_IMPLEMENT_INTERFACE (DROID_TYPE_HAL_IMPLEMENTATION,
-                                                droid_hal_lights_interface_init))
+  droid_hal_lights_start_pattern (self, pattern,
+    droid_hal_deferred_reply_new (object, request));
 
-static gboolean
-udev_write_int (LightDevice *device,
-                const gchar *component,
-                gint         value)
+  return NULL;
+}
+
+static GBinderLocalReply *
+droid_hal_lights_aidl_set_light_state (gpointer                               user_data,
+                                       GBinderLocalObject                    *object,
+                                       GBinderRemoteRequest                  *request,
+                                       const DroidLightAidlSetLightStateArgs *args)
 {
-  g_autofree gchar *path = NULL;
-  g_autofree gchar *content = NULL;
-  g_return_val_if_fail (device != NULL, FALSE);
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  LightBatchEntry entry = {
+    .type  = (LightType) args->id,
+    .state = args->state,
+  };
 
-  path = g_build_filename (g_udev_device_get_sysfs_path (device->device), component, NULL);
-  content = g_strdup_printf ("%i", value);
+  if (!droid_hal_lights_valid_entries (&entry, 1))
+    return droid_light_aidl_error_reply (object);
 
-  return droid_utils_write_to_file (path, content);
+  /* A zero status from the worker reads as no exception */
+  droid_hal_lights_submit_request (self, &entry, 1,
+    droid_hal_deferred_reply_new (object, request));
+
+  return NULL;
 }
 
-static gboolean
-udev_blink (LightDevice *device,
-            gboolean     enable)
+static GBinderLocalReply *
+droid_hal_lights_aidl_get_lights (gpointer                           user_data,
+                                  GBinderLocalObject                *object,
+                                  GBinderRemoteRequest              *request,
+                                  const DroidLightAidlGetLightsArgs *args)
 {
-  switch (device->blink_type)
-    {
-    case LIGHT_DEVICE_BLINK_TYPE_BREATH:
-      return udev_write_int (device, "breath", enable);
-    case LIGHT_DEVICE_BLINK_TYPE_BLINK:
-      return udev_write_int (device, "blink", enable);
-    case LIGHT_DEVICE_BLINK_TYPE_NONE:
-    default:
-      /* Unsupported */
-      return TRUE;
-    }
+  DroidHalLights *self = DROID_HAL_LIGHTS (user_data);
+  GBinderLocalReply *reply;
+
+  g_mutex_lock (&self->inventory_lock);
+  reply = droid_hal_lights_aidl_lights_reply (self, object);
+  g_mutex_unlock (&self->inventory_lock);
+
+  return reply;
 }
 
-static LightDevice *
-droid_leds_udev_new_device (GUdevDevice *device)
+static const DroidLightHidlHandlers hidl_handlers = {
+  .set_light           = droid_hal_lights_set_light,
+  .get_supported_types = droid_hal_lights_get_supported_types,
+  .set_lights          = droid_hal_lights_set_lights,
+  .set_pattern         = droid_hal_lights_set_pattern,
+  .set_panel           = droid_hal_lights_set_panel,
+  .get_brightness      = droid_hal_lights_get_brightness,
+};
+
+static const DroidLightAidlHandlers aidl_handlers = {
+  .set_light_state = droid_hal_lights_aidl_set_light_state,
+  .get_lights      = droid_hal_lights_aidl_get_lights,
+};
+
+static GBinderLocalReply *
+droid_hal_lights_reply (DroidHalImplementation *implementation,
+                        GBinderLocalObject     *object,
+                        GBinderRemoteRequest   *request,
+                        guint                   code)
 {
-  LightDevice *light = g_new0 (LightDevice, 1);
+  DroidHalLights *self = DROID_HAL_LIGHTS (implementation);
+  GBinderLocalReply *reply;
+  gboolean known;
 
-  light->device = device;
-  light->max    = g_udev_device_get_sysfs_attr_as_int (device, "max_brightness");
+  g_return_val_if_fail (DROID_IS_HAL_LIGHTS (self), NULL);
 
-  if (g_udev_device_has_sysfs_attr (device, "breath"))
-      light->blink_type = LIGHT_DEVICE_BLINK_TYPE_BREATH;
-  else if (g_udev_device_has_sysfs_attr (device, "blink"))
-      light->blink_type = LIGHT_DEVICE_BLINK_TYPE_BLINK;
+  /* The same instance is exported both as HIDL and AIDL */
+  if (g_strcmp0 (gbinder_remote_request_interface (request), DROID_LIGHT_AIDL_IFACE) == 0)
+    reply = droid_light_aidl_dispatch (&aidl_handlers, self, object, request, code, &known);
+  else
+    reply = droid_light_hidl_dispatch (&hidl_handlers, self, object, request, code, &known);
 
-  return light;
+  if (!known)
+    g_warning ("Unknown code %d", code);
+
+  return reply;
 }
 
-static void
-droid_hal_lights_probe (DroidHalLights *self)
+static GBytes *
+droid_hal_lights_capture (DroidHalImplementation *implementation,
+                          GBinderRemoteRequest   *request,
+                          guint                   code)
 {
-  static const gchar *known_backlight_paths[] = {
-    "/sys/class/leds/lcd-backlight",
-    "/sys/class/backlight/panel0-backlight",
-  };
-  g_autolist(GUdevDevice) backlight_list = NULL;
-  GList *item;
-  const gchar *backlight_type;
-  gchar *path_to_check = NULL;
+  GBytes *payload = NULL;
 
-  for (int i=0; i < 2; i++)
+  if (g_strcmp0 (gbinder_remote_request_interface (request), DROID_LIGHT_AIDL_IFACE) == 0)
     {
-      path_to_check = g_build_filename (known_backlight_paths[i], "brightness", NULL);
-      if (droid_utils_file_exists (path_to_check))
-          self->backlight_device = droid_leds_udev_new_device (g_udev_client_query_by_sysfs_path (self->udev,
-            known_backlight_paths[i]));
-      g_free (path_to_check);
-      if (self->backlight_device)
-          break;
+      DroidLightAidlSetLightStateArgs aidl_args;
+      LightBatchEntry aidl_entry;
+
+      if (code == DROID_LIGHT_AIDL_SET_LIGHT_STATE &&
+          droid_light_aidl_read_set_light_state (request, &aidl_args))
+        {
+          aidl_entry.type  = (LightType) aidl_args.id;
+          aidl_entry.state = aidl_args.state;
+          return g_bytes_new (&aidl_entry, sizeof (aidl_entry));
+        }
+      else if (code == DROID_LIGHT_AIDL_GET_LIGHTS)
+        {
+          return g_bytes_new (NULL, 0);
+        }
+
+      return NULL;
     }
 
-  if (!self->backlight_device)
+  switch (code)
     {
-      /* Try using udev */
-      backlight_list = g_udev_client_query_by_subsystem (self->udev, "backlight");
+    case DROID_LIGHT_HIDL_SET_LIGHT:
+      DroidLightHidlSetLightArgs set_light;
+      LightBatchEntry entry;
 
-      for (item = backlight_list; item != NULL; item = item->next)
+      if (droid_light_hidl_read_set_light (request, &set_light))
         {
-          backlight_type = g_udev_device_get_sysfs_attr (item->data, "type");
-          g_debug ("Fallback to %s type %s (name %s)", g_udev_device_get_sysfs_path (item->data),
-            backlight_type, g_udev_device_get_name (item->data));
-          if (g_strcmp0 (backlight_type, "firmware") == 0 ||
-              g_strcmp0 (backlight_type, "platform") == 0 ||
-              g_strcmp0 (backlight_type, "raw") == 0)
-            {
-              path_to_check = g_build_filename (g_udev_device_get_sysfs_path (item->data),
-                "brightness", NULL);
-              if (droid_utils_file_exists (path_to_check))
-                  self->backlight_device = droid_leds_udev_new_device (G_UDEV_DEVICE (g_object_ref (item->data)));
-              g_free (path_to_check);
-              if (self->backlight_device)
-                  break;
-            }
+          entry.type  = set_light.type;
+          entry.state = set_light.state;
+          payload = g_bytes_new (&entry, sizeof (entry));
         }
-    }
+      break;
+
+    case DROID_LIGHT_HIDL_GET_SUPPORTED_TYPES:
+    case DROID_LIGHT_HIDL_GET_BRIGHTNESS:
+      payload = g_bytes_new (NULL, 0);
+      break;
 
+    case DROID_LIGHT_HIDL_SET_LIGHTS:
+      DroidLightHidlSetLightsArgs set_lights;
 
-  if (droid_utils_file_exists (BRIGHTNESS_PATH (FALLBACK_RED_PATH)))
-      self->red_device = droid_leds_udev_new_device (g_udev_client_query_by_sysfs_path (self->udev,
-        FALLBACK_RED_PATH));
+      if (droid_light_hidl_read_set_lights (request, &set_lights))
+          payload = g_bytes_new (set_lights.entries,
+            set_lights.n_entries * sizeof (LightBatchEntry));
+      break;
+
+    case DROID_LIGHT_HIDL_SET_PATTERN:
+      DroidLightHidlSetPatternArgs set_pattern;
+      CapturedPattern *captured;
+      gsize size;
+
+      if (droid_light_hidl_read_set_pattern (request, &set_pattern))
+        {
+          size = sizeof (CapturedPattern) + set_pattern.n_keyframes * sizeof (LightKeyframe);
+          captured = g_malloc (size);
+          captured->type   = set_pattern.type;
+          captured->repeat = set_pattern.repeat;
+          if (set_pattern.n_keyframes > 0)
+            memcpy (captured->keyframes, set_pattern.keyframes,
+              set_pattern.n_keyframes * sizeof (LightKeyframe));
+          payload = g_bytes_new_take (captured, size);
+        }
+      break;
+
+    case DROID_LIGHT_HIDL_SET_PANEL:
+      DroidLightHidlSetPanelArgs set_panel;
+      CapturedPanel captured_panel;
+
+      if (droid_light_hidl_read_set_panel (request, &set_panel))
+        {
+          captured_panel.panel = set_panel.panel;
+          captured_panel.state = set_panel.state;
+          payload = g_bytes_new (&captured_panel, sizeof (captured_panel));
+        }
+      break;
 
-  if (droid_utils_file_exists (BRIGHTNESS_PATH (FALLBACK_GREEN_PATH)))
-      self->green_device = droid_leds_udev_new_device (g_udev_client_query_by_sysfs_path (self->udev,
-        FALLBACK_GREEN_PATH));
+    default:
+      break;
+    }
 
-  if (droid_utils_file_exists (BRIGHTNESS_PATH (FALLBACK_BLUE_PATH)))
-      self->blue_device = droid_leds_udev_new_device (g_udev_client_query_by_sysfs_path (self->udev,
-        FALLBACK_BLUE_PATH));
+  return payload;
 }
 
+/*
+ * Whatever was written to sysfs stays after exit, blinking and offloaded
+ * patterns included. Only patterns played in software would be lost.
+ */
 static gboolean
-droid_hal_lights_set (DroidHalLights *backend,
-                      uint32_t        color,
-                      LightType       light_type,
-                      FlashType       flash_type,
-                      BrightnessType  backlight_type,
-                      int32_t         flash_on_ms,
-                      int32_t         flash_off_ms)
+droid_hal_lights_is_idle (DroidHalImplementation *implementation)
 {
-  DroidHalLights *self = DROID_HAL_LIGHTS (backend);
-  gint value, red, green, blue;
-  gboolean result = FALSE;
+  DroidHalLights *self = DROID_HAL_LIGHTS (implementation);
+  gboolean idle;
 
-  g_return_val_if_fail (DROID_IS_HAL_LIGHTS (self), FALSE);
+  g_mutex_lock (&self->queue_lock);
+  idle = (self->pending_mask == 0 && self->pending_panel_mask == 0 &&
+          self->waiters->len == 0 && !self->pattern_job);
+  g_mutex_unlock (&self->queue_lock);
+
+  g_mutex_lock (&self->pattern_lock);
+  idle = idle && self->pattern == NULL;
+  g_mutex_unlock (&self->pattern_lock);
+
+  return idle;
+}
 
-  if (light_type == LIGHT_TYPE_BACKLIGHT && self->backlight_device != NULL)
+/*
+ * A newer state for the same light or panel makes one still waiting on
+ * the rate limit pointless. Batches may touch any light, so they don't
+ * coalesce, and neither do queries.
+ */
+static gboolean
+droid_hal_lights_coalesce_key (DroidHalImplementation *implementation,
+                               GBinderRemoteRequest   *request,
+                               guint                   code,
+                               guint                  *key)
+{
+  if (g_strcmp0 (gbinder_remote_request_interface (request), DROID_LIGHT_AIDL_IFACE) == 0)
     {
-      value = ((77 * ((color >> 16) & 0x00ff)) +
-        (150 * ((color >> 8) & 0x00ff)) + (29 * (color & 0x00ff))) >> 8;
+      DroidLightAidlSetLightStateArgs aidl_args;
 
-      g_debug ("backlight: got backlight change request: %d", value);
+      if (code != DROID_LIGHT_AIDL_SET_LIGHT_STATE ||
+          !droid_light_aidl_read_set_light_state (request, &aidl_args))
+        return FALSE;
 
-      result = udev_write_int (self->backlight_device, "brightness",
-        TO_SYSFS_VALUE (value, self->backlight_device->max));
+      *key = (guint) aidl_args.id;
+      return TRUE;
     }
-  else if (light_type == LIGHT_TYPE_NOTIFICATIONS)
+
+  switch (code)
     {
-      red = (color >> 16) & 0xff;
-      green = (color >> 8) & 0xff;
-      blue = color & 0xff;
+    case DROID_LIGHT_HIDL_SET_LIGHT:
+      DroidLightHidlSetLightArgs set_light;
 
-      g_debug ("notification: got change request: r %d g %d b %d", red, green, blue);
+      if (!droid_light_hidl_read_set_light (request, &set_light))
+        return FALSE;
 
-      if (self->red_device != NULL &&
-          udev_write_int (self->red_device, "brightness", TO_SYSFS_VALUE (red, self->red_device->max)) &&
-          udev_blink (self->red_device, (red > 0)))
-        {
-          result = TRUE;
-        }
+      *key = (guint) set_light.type;
+      return TRUE;
 
-      if (self->green_device != NULL &&
-          udev_write_int (self->green_device, "brightness", TO_SYSFS_VALUE (green, self->green_device->max)) &&
-          udev_blink (self->green_device, (green > 0)))
-        {
-          result = TRUE;
-        }
+    case DROID_LIGHT_HIDL_SET_LIGHTS:
+      DroidLightHidlSetLightsArgs set_lights;
 
-      if (self->blue_device != NULL &&
-          udev_write_int (self->blue_device, "brightness", TO_SYSFS_VALUE (blue, self->blue_device->max)) &&
-          udev_blink (self->blue_device, (blue > 0)))
+      if (!droid_light_hidl_read_set_lights (request, &set_lights))
+        return FALSE;
+
+      /* A newer batch for the same lights supersedes the older one */
+      *key = 0;
+      for (gsize i=0; i < set_lights.n_entries; i++)
         {
-          result = TRUE;
+          if (set_lights.entries[i].type >= 0 && set_lights.entries[i].type < LIGHT_TYPE_COUNT)
+            *key |= 1u << set_lights.entries[i].type;
         }
-    }
+      return TRUE;
 
-  return result;
-}
+    case DROID_LIGHT_HIDL_SET_PATTERN:
+      DroidLightHidlSetPatternArgs set_pattern;
 
+      if (!droid_light_hidl_read_set_pattern (request, &set_pattern))
+        return FALSE;
 
-static GBinderLocalReply *
-droid_hal_lights_reply (DroidHalImplementation *implementation,
-                        GBinderLocalObject     *object,
-                        GBinderRemoteRequest   *request,
-                        guint                   code)
-{
-  DroidHalLights *self = DROID_HAL_LIGHTS (implementation);
-  GBinderReader reader;
-  GBinderWriter writer;
-  GBinderLocalReply *reply = NULL;
+      *key = (guint) set_pattern.type;
+      return TRUE;
 
-  g_return_val_if_fail (DROID_IS_HAL_LIGHTS (self), NULL);
+    case DROID_LIGHT_HIDL_SET_PANEL:
+      DroidLightHidlSetPanelArgs set_panel;
+
+      if (!droid_light_hidl_read_set_panel (request, &set_panel))
+        return FALSE;
+
+      *key = (guint) set_panel.panel;
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+/* Same as droid_hal_lights_reply(), without deferred replies */
+static gboolean
+droid_hal_lights_replay_request (DroidHalLights *self,
+                                 guint           code,
+                                 GBytes         *payload)
+{
+  gsize size;
+  gconstpointer data = g_bytes_get_data (payload, &size);
 
   switch (code)
     {
-    case BINDER_LIGHT_HIDL_2_0_SET_LIGHT:
-      GBinderBuffer *buf;
-      LightState *notification_state;
-      gint32 light_type;
+    case DROID_LIGHT_HIDL_SET_LIGHT:
+    case DROID_LIGHT_HIDL_SET_LIGHTS:
+      if (size % sizeof (LightBatchEntry) != 0 ||
+          (code == DROID_LIGHT_HIDL_SET_LIGHT && size != sizeof (LightBatchEntry)) ||
+          !droid_hal_lights_valid_entries (data, size / sizeof (LightBatchEntry)))
+          return FALSE;
+
+      droid_hal_lights_submit_request (self, data, size / sizeof (LightBatchEntry), NULL);
+      return TRUE;
 
-      reply = gbinder_local_object_new_reply (object);
-      gbinder_remote_request_init_reader (request, &reader);
-      gbinder_local_reply_init_writer (reply, &writer);
+    case DROID_LIGHT_HIDL_GET_SUPPORTED_TYPES:
+    case DROID_LIGHT_HIDL_GET_BRIGHTNESS:
+      /* Nothing changes */
+      return TRUE;
 
-      if (gbinder_reader_read_int32 (&reader, &light_type) &&
-            (buf = gbinder_reader_read_buffer (&reader)) != NULL)
-        {
-          notification_state = buf->data;
-          gbinder_writer_append_int32(&writer, GBINDER_STATUS_OK);
-          droid_hal_lights_set (self, notification_state->color, (LightType) light_type,
-            notification_state->flashMode, notification_state->brightnessMode,
-            notification_state->flashOnMs, notification_state->flashOffMs);
-        }
-      else
-        {
-          gbinder_writer_append_int32(&writer, GBINDER_STATUS_FAILED);
-        }
-      break;
+    case DROID_LIGHT_HIDL_SET_PATTERN:
+      const CapturedPattern *captured = data;
+      LightPattern *pattern;
 
-    case BINDER_LIGHT_HIDL_2_0_GET_SUPPORTED_TYPES:
-      LightType supported[LIGHT_TYPE_COUNT];
-      gint count = 0;
+      if (size < sizeof (CapturedPattern) ||
+          (size - sizeof (CapturedPattern)) % sizeof (LightKeyframe) != 0)
+          return FALSE;
 
-      reply = gbinder_local_object_new_reply (object);
-      gbinder_local_reply_init_writer (reply, &writer);
+      pattern = droid_hal_lights_new_pattern (captured->type, captured->keyframes,
+        (size - sizeof (CapturedPattern)) / sizeof (LightKeyframe), captured->repeat);
+      if (pattern == NULL)
+          return FALSE;
 
-      if (self->backlight_device != NULL)
-          supported[count++] = LIGHT_TYPE_BACKLIGHT;
+      droid_hal_lights_start_pattern (self, pattern, NULL);
+      return TRUE;
 
-      if (self->red_device != NULL || self->green_device != NULL ||
-        self->blue_device != NULL)
-          supported[count++] = LIGHT_TYPE_NOTIFICATIONS;
+    case DROID_LIGHT_HIDL_SET_PANEL:
+      const CapturedPanel *captured_panel = data;
 
-      gbinder_writer_append_int32(&writer, GBINDER_STATUS_OK);
-      gbinder_writer_append_hidl_vec (&writer, supported, count, sizeof(LightType));
-      break;
+      if (size != sizeof (CapturedPanel) || captured_panel->panel < 0 ||
+          captured_panel->panel >= LIBDROID_LIGHT_MAX_PANELS)
+          return FALSE;
 
-    default:
-      g_warning ("Unknown code %d", code);
-      break;
+      droid_hal_lights_submit_panel (self, captured_panel->panel, &captured_panel->state, NULL);
+      return TRUE;
 
+    default:
+      return FALSE;
     }
+}
 
-  return reply;
+/*
+ * Only returns once the request has been applied, so that replays
+ * measure the actual cost of the sysfs writes.
+ */
+static gboolean
+droid_hal_lights_replay (DroidHalImplementation *implementation,
+                         guint                   code,
+                         GBytes                 *payload)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (implementation);
+  gboolean result = droid_hal_lights_replay_request (self, code, payload);
+
+  droid_hal_lights_flush (self);
+
+  return result;
 }
 
 static void
 droid_hal_lights_constructed (GObject *obj)
 {
+  static const gchar *subsystems[] = { "leds", "backlight", NULL };
   DroidHalLights *self = DROID_HAL_LIGHTS (obj);
 
   G_OBJECT_CLASS (droid_hal_lights_parent_class)->constructed (obj);
 
-  self->udev = g_udev_client_new (NULL);
-  self->backlight_device = NULL;
-  self->red_device = NULL;
-  self->green_device = NULL;
-  self->blue_device = NULL;
+  self->udev = g_udev_client_new (subsystems);
+
+  g_mutex_init (&self->inventory_lock);
+  g_mutex_init (&self->pattern_lock);
+  g_mutex_init (&self->queue_lock);
+  g_cond_init (&self->queue_cond);
+  g_cond_init (&self->flush_cond);
+  g_mutex_init (&self->panel_lock);
+  g_cond_init (&self->panel_cond);
+  self->waiters = g_ptr_array_new ();
+  self->panel_pool = g_thread_pool_new (droid_hal_lights_panel_write, self,
+    LIBDROID_LIGHT_MAX_PANELS - 1, FALSE, NULL);
 
+  droid_hal_lights_load_config (self);
   droid_hal_lights_probe (self);
+
+  self->worker = g_thread_new ("lights-io", droid_hal_lights_worker, self);
+
+  /* Keep the inventory in sync with late-probing or modular drivers */
+  g_signal_connect (self->udev, "uevent", G_CALLBACK (droid_hal_lights_uevent), self);
 }
 
 static void
@@ -360,19 +1937,108 @@ droid_hal_lights_dispose (GObject *obj)
 
   G_OBJECT_CLASS (droid_hal_lights_parent_class)->dispose (obj);
 
+  g_clear_handle_id (&self->pattern_source, g_source_remove);
+  g_clear_pointer (&self->pattern, droid_hal_lights_pattern_free);
+  g_clear_pointer (&self->aidl_lights_reply, gbinder_local_reply_unref);
+  g_clear_pointer (&self->aidl_object, gbinder_local_object_unref);
+
+  if (self->worker != NULL)
+    {
+      g_mutex_lock (&self->queue_lock);
+      self->quit = TRUE;
+      g_cond_signal (&self->queue_cond);
+      g_mutex_unlock (&self->queue_lock);
+
+      g_thread_join (g_steal_pointer (&self->worker));
+      g_clear_pointer (&self->waiters, g_ptr_array_unref);
+      g_clear_pointer (&self->pending_pattern, droid_hal_lights_pattern_free);
+    }
+
+  if (self->panel_pool != NULL)
+      g_thread_pool_free (g_steal_pointer (&self->panel_pool), FALSE, TRUE);
+
+  if (self->udev != NULL)
+      g_signal_handlers_disconnect_by_data (self->udev, self);
+
   g_clear_object (&self->udev);
 
-  if (self->backlight_device != NULL)
-      g_free (self->backlight_device);
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+          g_clear_pointer (&self->devices[type][channel], droid_leds_udev_free_device);
+    }
+
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+      g_clear_pointer (&self->panels[panel], droid_leds_udev_free_device);
+}
+
+static void
+droid_hal_lights_finalize (GObject *obj)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (obj);
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      for (int channel=0; channel < LIGHT_CHANNEL_COUNT; channel++)
+          droid_hal_lights_set_source (&self->sources[type][channel], NULL, NULL, 1.0);
+    }
+
+  for (int panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+      droid_hal_lights_set_source (&self->panel_sources[panel], NULL, NULL, 1.0);
+
+  g_free (self->config_path);
+  g_mutex_clear (&self->inventory_lock);
+  g_mutex_clear (&self->pattern_lock);
+  g_mutex_clear (&self->queue_lock);
+  g_cond_clear (&self->queue_cond);
+  g_cond_clear (&self->flush_cond);
+  g_mutex_clear (&self->panel_lock);
+  g_cond_clear (&self->panel_cond);
+
+  G_OBJECT_CLASS (droid_hal_lights_parent_class)->finalize (obj);
+}
+
+static void
+droid_hal_lights_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (object);
+
+  switch ((DroidHalLightsProperty) property_id)
+    {
+    case PROP_CONFIG_PATH:
+      /* This is construct only, so we don't need to handle existing value */
+      self->config_path = g_value_dup_string (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
 
-  if (self->red_device != NULL)
-      g_free (self->red_device);
+static void
+droid_hal_lights_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  DroidHalLights *self = DROID_HAL_LIGHTS (object);
 
-  if (self->green_device != NULL)
-      g_free (self->green_device);
+  switch ((DroidHalLightsProperty) property_id)
+    {
+    case PROP_CONFIG_PATH:
+      g_value_set_string (value, self->config_path);
+      break;
 
-  if (self->blue_device != NULL)
-      g_free (self->blue_device);
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
 }
 
 static void
@@ -382,13 +2048,29 @@ droid_hal_lights_class_init (DroidHalLightsClass *klass)
 
   object_class->constructed  = droid_hal_lights_constructed;
   object_class->dispose      = droid_hal_lights_dispose;
+  object_class->finalize     = droid_hal_lights_finalize;
+  object_class->set_property = droid_hal_lights_set_property;
+  object_class->get_property = droid_hal_lights_get_property;
+
+  properties[PROP_CONFIG_PATH] =
+    g_param_spec_string ("config-path",
+                         "Configuration path",
+                         "The file mapping light types to devices",
+                         LIGHTS_CONFIG_PATH,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
 }
 
 
 static void
 droid_hal_lights_interface_init (DroidHalImplementationInterface *iface)
 {
-  iface->reply = droid_hal_lights_reply;
+  iface->reply        = droid_hal_lights_reply;
+  iface->capture      = droid_hal_lights_capture;
+  iface->replay       = droid_hal_lights_replay;
+  iface->is_idle      = droid_hal_lights_is_idle;
+  iface->coalesce_key = droid_hal_lights_coalesce_key;
 }
 
 static void
@@ -397,12 +2079,48 @@ droid_hal_lights_init (DroidHalLights *self)
 }
 
 static DroidHalLights *
-droid_hal_lights_new (void)
+droid_hal_lights_new (const gchar *config_path)
 {
   return DROID_HAL_LIGHTS (
-    g_object_new (DROID_TYPE_HAL_LIGHTS, NULL));
+    g_object_new (DROID_TYPE_HAL_LIGHTS, "config-path", config_path, NULL));
+}
+
+#ifdef DROID_HAL_PLUGIN
+
+/*
+ * Settings in the host configuration group are the same as the command
+ * line options: device, iface, name, config and aidl.
+ */
+gboolean
+droid_hal_plugin_init (DroidHalService  *service,
+                       GKeyFile         *config,
+                       const gchar      *group,
+                       GError          **error)
+{
+  g_autoptr (DroidHalLights) lights = NULL;
+  g_autofree gchar *device = g_key_file_get_string (config, group, "device", NULL);
+  g_autofree gchar *iface = g_key_file_get_string (config, group, "iface", NULL);
+  g_autofree gchar *name = g_key_file_get_string (config, group, "name", NULL);
+  g_autofree gchar *config_path = g_key_file_get_string (config, group, "config", NULL);
+  gboolean aidl = !g_key_file_has_key (config, group, "aidl", NULL) ||
+    g_key_file_get_boolean (config, group, "aidl", NULL);
+
+  lights = droid_hal_lights_new (config_path != NULL ? config_path : LIGHTS_CONFIG_PATH);
+
+  droid_hal_service_add_implementation (service, (DroidHalImplementation *) lights,
+    device != NULL ? device : BINDER_LIGHT_DEVICE,
+    iface != NULL ? iface : DROID_LIGHT_HIDL_IFACE,
+    name != NULL ? name : BINDER_LIGHT_HIDL_SLOT_LIBDROID);
+
+  if (aidl)
+    droid_hal_service_add_implementation (service, (DroidHalImplementation *) lights,
+      BINDER_LIGHT_AIDL_DEVICE, DROID_LIGHT_AIDL_IFACE,
+      DROID_LIGHT_AIDL_IFACE "/" BINDER_LIGHT_AIDL_SLOT_DEFAULT);
+
+  return TRUE;
 }
 
+#else
 
 int
 main (int argc, char** argv)
@@ -415,6 +2133,14 @@ main (int argc, char** argv)
   g_autofree gchar *device = NULL;
   g_autofree gchar *iface = NULL;
   g_autofree gchar *name = NULL;
+  g_autofree gchar *config = NULL;
+  g_autofree gchar *capture = NULL;
+  g_autofree gchar *replay = NULL;
+  g_autofree gchar *latency = NULL;
+  g_autofree gchar *rate_limit = NULL;
+  gint idle_timeout = 0;
+  gboolean no_aidl = FALSE;
+  gdouble speed = 1.0;
   const GOptionEntry entries[] = {
     {
       "device", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &device,
@@ -422,12 +2148,45 @@ main (int argc, char** argv)
     },
     {
       "iface", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &iface,
-      "The interface name to use, defaults to " BINDER_LIGHT_HIDL_2_0_IFACE, NULL,
+      "The interface name to use, defaults to " DROID_LIGHT_HIDL_IFACE, NULL,
     },
     {
       "name", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &name,
       "The slot name to use, defaults to " BINDER_LIGHT_HIDL_SLOT_LIBDROID, NULL,
     },
+    {
+      "no-aidl", 'A', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &no_aidl,
+      "Don't export " DROID_LIGHT_AIDL_IFACE "/" BINDER_LIGHT_AIDL_SLOT_DEFAULT
+      " on " BINDER_LIGHT_AIDL_DEVICE, NULL,
+    },
+    {
+      "config", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config,
+      "The light configuration, defaults to " LIGHTS_CONFIG_PATH, NULL,
+    },
+    {
+      "capture", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &capture,
+      "Capture incoming transactions to the given file", NULL,
+    },
+    {
+      "replay", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &replay,
+      "Replay a capture against the lights found on this device, and exit", NULL,
+    },
+    {
+      "speed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE, &speed,
+      "Replay speed multiplier, 0 replays as fast as possible", NULL,
+    },
+    {
+      "latency", 'l', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &latency,
+      "Enable the latency mode: fifo[:PRIO], rr[:PRIO] or nice[:LEVEL]", NULL,
+    },
+    {
+      "idle-timeout", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &idle_timeout,
+      "Exit after the given number of seconds without requests, instead of staying around", NULL,
+    },
+    {
+      "rate-limit", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &rate_limit,
+      "Limit transactions per client: RATE[:BURST][,CODE=RATE[:BURST]...]", NULL,
+    },
     {NULL},
   };
 
@@ -445,14 +2204,57 @@ main (int argc, char** argv)
       device = g_strdup (BINDER_LIGHT_DEVICE);
 
   if (iface == NULL)
-      iface = g_strdup (BINDER_LIGHT_HIDL_2_0_IFACE);
+      iface = g_strdup (DROID_LIGHT_HIDL_IFACE);
 
   if (name == NULL)
       name = g_strdup (BINDER_LIGHT_HIDL_SLOT_LIBDROID);
 
-  lights = droid_hal_lights_new ();
+  if (config == NULL)
+      config = g_strdup (LIGHTS_CONFIG_PATH);
+
+  lights = droid_hal_lights_new (config);
+
+  if (replay != NULL)
+    {
+      if (!droid_hal_replay_run ((DroidHalImplementation *)lights, replay, speed, &err))
+        {
+          g_warning ("Unable to replay %s: %s", replay, err->message);
+          return EXIT_FAILURE;
+        }
+
+      return EXIT_SUCCESS;
+    }
+
   service = droid_hal_service_new ((DroidHalImplementation *)lights,
     device, iface, name);
 
+  /* AIDL clients find us on their first probe, without a HIDL fallback */
+  if (!no_aidl)
+    droid_hal_service_add_binding (service, BINDER_LIGHT_AIDL_DEVICE, DROID_LIGHT_AIDL_IFACE,
+      DROID_LIGHT_AIDL_IFACE "/" BINDER_LIGHT_AIDL_SLOT_DEFAULT);
+
+  if (capture != NULL && !droid_hal_service_start_capture (service, capture, &err))
+    {
+      g_warning ("Unable to start capture: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (latency != NULL && !droid_hal_service_set_latency_mode (service, latency, &err))
+    {
+      g_warning ("Unable to set latency mode: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (idle_timeout > 0)
+      droid_hal_service_set_idle_timeout (service, idle_timeout);
+
+  if (rate_limit != NULL && !droid_hal_service_set_rate_limit (service, rate_limit, &err))
+    {
+      g_warning ("Unable to set rate limit: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
   return droid_hal_service_run (service);
 }
+
+#endif /* DROID_HAL_PLUGIN */
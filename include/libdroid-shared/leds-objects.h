@@ -47,42 +47,12 @@
 
 #include <glib.h>
 
-#define ALIGNED(x) __attribute__ ((aligned(x)))
-
-/* Light types */
-typedef enum light_type {
-  LIGHT_TYPE_BACKLIGHT = 0,
-  LIGHT_TYPE_KEYBOARD = 1,
-  LIGHT_TYPE_BUTTONS = 2,
-  LIGHT_TYPE_BATTERY = 3,
-  LIGHT_TYPE_NOTIFICATIONS = 4,
-  LIGHT_TYPE_ATTENTION = 5,
-  LIGHT_TYPE_BLUETOOTH = 6,
-  LIGHT_TYPE_WIFI = 7,
-  LIGHT_TYPE_COUNT = 8,
-} LightType;
-
-/* Flash types */
-typedef enum flash_type {
-  FLASH_TYPE_NONE = 0,
-  FLASH_TYPE_TIMED = 1,
-  FLASH_TYPE_HARDWARE = 2,
-} FlashType;
-
-/* Brightness types */
-typedef enum brightness_type {
-  BRIGHTNESS_MODE_USER = 0,
-  BRIGHTNESS_MODE_SENSOR = 1,
-  BRIGHTNESS_MODE_LOW_PERSISTENCE = 2,
-} BrightnessType;
+/*
+ * The light types, layouts and binder marshalling are generated from
+ * light.idl.
+ */
+#include <libdroid-shared/light-idl.h>
 
-/* The light state */
-typedef struct light_state {
-  gint32 color;
-  FlashType flashMode ALIGNED(4);
-  gint32 flashOnMs;
-  gint32 flashOffMs;
-  BrightnessType brightnessMode ALIGNED(4);
-} LightState;
-G_STATIC_ASSERT(sizeof(LightState) == 20);
+/* Backlight panels that can be addressed with setPanel */
+#define LIBDROID_LIGHT_MAX_PANELS 4
 
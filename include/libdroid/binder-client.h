@@ -0,0 +1,85 @@
+/* binder-client.h
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <gbinder.h>
+
+G_BEGIN_DECLS
+
+#define DROID_TYPE_BINDER_CLIENT droid_binder_client_get_type ()
+G_DECLARE_FINAL_TYPE (DroidBinderClient, droid_binder_client, DROID, BINDER_CLIENT, GObject)
+
+DroidBinderClient  *droid_binder_client_new                (const char          *device,
+                                                            const char          *iface);
+void                droid_binder_client_set_activation     (DroidBinderClient   *self,
+                                                            const char          *unit,
+                                                            guint                timeout_ms);
+gboolean            droid_binder_client_connect            (DroidBinderClient   *self,
+                                                            const char          *fqname,
+                                                            GError             **error);
+gboolean            droid_binder_client_is_connected       (DroidBinderClient   *self);
+GBinderClient      *droid_binder_client_get_client         (DroidBinderClient   *self);
+
+GBinderRemoteReply *droid_binder_client_transact_sync      (DroidBinderClient   *self,
+                                                            guint32              code,
+                                                            GBinderLocalRequest *request,
+                                                            GError             **error);
+gboolean            droid_binder_client_transact_oneway    (DroidBinderClient   *self,
+                                                            guint32              code,
+                                                            GBinderLocalRequest *request,
+                                                            GError             **error);
+void                droid_binder_client_transact_async     (DroidBinderClient   *self,
+                                                            guint32              code,
+                                                            GBinderLocalRequest *request,
+                                                            GCancellable        *cancellable,
+                                                            GAsyncReadyCallback  callback,
+                                                            gpointer             user_data);
+GBinderRemoteReply *droid_binder_client_transact_finish    (DroidBinderClient   *self,
+                                                            GAsyncResult        *result,
+                                                            GError             **error);
+
+gboolean            droid_binder_client_get_method_stats   (DroidBinderClient   *self,
+                                                            guint32              code,
+                                                            guint               *calls,
+                                                            guint               *failures,
+                                                            gint64              *total_us,
+                                                            gint64              *max_us);
+
+G_END_DECLS
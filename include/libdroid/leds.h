@@ -46,22 +46,105 @@ G_BEGIN_DECLS
 #define DROID_TYPE_LEDS droid_leds_get_type ()
 G_DECLARE_FINAL_TYPE (DroidLeds, droid_leds, DROID, LEDS, GObject)
 
+#define DROID_TYPE_LEDS_BATCH droid_leds_batch_get_type ()
+G_DECLARE_FINAL_TYPE (DroidLedsBatch, droid_leds_batch, DROID, LEDS_BATCH, GObject)
+
+#define DROID_TYPE_LEDS_STATE_READER droid_leds_state_reader_get_type ()
+G_DECLARE_FINAL_TYPE (DroidLedsStateReader, droid_leds_state_reader, DROID, LEDS_STATE_READER, GObject)
+
 typedef enum _DroidLedsKind {
   DROID_LEDS_KIND_BACKLIGHT = 0,
   DROID_LEDS_KIND_NOTIFICATION,
+  DROID_LEDS_KIND_KEYBOARD,
+  DROID_LEDS_KIND_BUTTONS,
+  DROID_LEDS_KIND_BATTERY,
+  DROID_LEDS_KIND_ATTENTION,
+  DROID_LEDS_KIND_BLUETOOTH,
+  DROID_LEDS_KIND_WIFI,
 } DroidLedsKind;
 
+typedef enum _DroidLedsFlags {
+  DROID_LEDS_FLAGS_NONE     = 0,
+  DROID_LEDS_FLAGS_THREADED = 1 << 0,
+  DROID_LEDS_FLAGS_ONEWAY   = 1 << 1,
+  DROID_LEDS_FLAGS_BROKER   = 1 << 2,
+} DroidLedsFlags;
+
+typedef enum _DroidLedsInterpolation {
+  DROID_LEDS_INTERPOLATION_STEP = 0,
+  DROID_LEDS_INTERPOLATION_LINEAR,
+} DroidLedsInterpolation;
+
+/* Last light state set through libdroid, by any process of the user */
+typedef struct _DroidLedsState {
+  uint32_t sequence;                  /* Changes on every update */
+  uint32_t backlight_level;
+  uint32_t notification_color;
+  int32_t  notification_flash_on_ms;
+  int32_t  notification_flash_off_ms;
+  gboolean notification_pattern;      /* Whether a pattern is playing */
+  int64_t  updated_time;              /* Monotonic time of the update, in us */
+} DroidLedsState;
+
+/* State for droid_leds_set_light(), the light flashes if flash_on_ms > 0 */
+typedef struct _DroidLedsLightState {
+  uint32_t color;                     /* ARGB, the brightness for the backlight */
+  int32_t  flash_on_ms;
+  int32_t  flash_off_ms;
+} DroidLedsLightState;
+
+typedef struct _DroidLedsKeyframe {
+  uint32_t               color;
+  uint32_t               duration_ms;
+  DroidLedsInterpolation interpolation;
+} DroidLedsKeyframe;
+
 DroidLeds *droid_leds_new                (void);
+DroidLeds *droid_leds_new_full           (DroidLedsFlags flags);
 gboolean   droid_leds_set_backlight      (DroidLeds *self,
                                           guint      level,
                                           gboolean   save);
 guint      droid_leds_get_backlight      (DroidLeds *self);
+gboolean   droid_leds_read_backlight     (DroidLeds *self,
+                                          guint      panel,
+                                          guint     *level);
 gboolean   droid_leds_set_notification   (DroidLeds *self,
                                           uint32_t   color,
                                           int32_t    flash_on_ms,
                                           int32_t    flash_off_ms);
 gboolean   droid_leds_clear_notification (DroidLeds *self);
+gboolean   droid_leds_set_notification_pattern (DroidLeds               *self,
+                                                const DroidLedsKeyframe *keyframes,
+                                                guint                    n_keyframes,
+                                                guint                    repeat);
+gboolean   droid_leds_set_backlight_panel (DroidLeds *self,
+                                           guint      panel,
+                                           guint      level);
+gboolean   droid_leds_set_light          (DroidLeds                 *self,
+                                          DroidLedsKind              kind,
+                                          const DroidLedsLightState *state);
 gboolean   droid_leds_is_kind_supported  (DroidLeds *self,
                                           DroidLedsKind kind);
+void       droid_leds_flush              (DroidLeds *self);
+gboolean   droid_leds_set_priority       (DroidLeds *self,
+                                          gint       priority);
+
+DroidLedsBatch *droid_leds_batch_new                (DroidLeds      *leds);
+gboolean        droid_leds_batch_set_backlight      (DroidLedsBatch *self,
+                                                     guint           level,
+                                                     gboolean        save);
+gboolean        droid_leds_batch_set_notification   (DroidLedsBatch *self,
+                                                     uint32_t        color,
+                                                     int32_t         flash_on_ms,
+                                                     int32_t         flash_off_ms);
+gboolean        droid_leds_batch_clear_notification (DroidLedsBatch *self);
+gboolean        droid_leds_batch_commit             (DroidLedsBatch *self);
+
+/* Fails with G_IO_ERROR_NOT_FOUND until some process sets a light, retry later */
+DroidLedsStateReader *droid_leds_state_reader_new  (GError               **error);
+gboolean              droid_leds_state_reader_read (DroidLedsStateReader  *self,
+                                                    DroidLedsState        *state);
+gboolean              droid_leds_state_reader_wait (DroidLedsStateReader  *self,
+                                                    int                    timeout_ms);
 
 G_END_DECLS
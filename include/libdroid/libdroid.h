@@ -45,6 +45,8 @@ G_BEGIN_DECLS
 #define LIBDROID_INSIDE
 # include <libdroid/libdroid-version.h>
 # include <libdroid/leds.h>
+# include <libdroid/auto-brightness.h>
+# include <libdroid/binder-client.h>
 #undef LIBDROID_INSIDE
 
 G_END_DECLS
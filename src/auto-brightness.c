@@ -0,0 +1,799 @@
+/* auto-brightness.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Drives the backlight from an IIO ambient light sensor. Samples come
+ * from the buffered interface, so that the driver pushes them at its own
+ * rate, and nothing is read while the display is off. They are averaged
+ * over a sliding window, and the level only follows the average once it
+ * leaves a hysteresis band around the last illuminance used. The
+ * backlight then ramps towards the new level, one update at a time.
+ *
+ * The buffer is only used if nobody else has it enabled, and needs write
+ * access to its sysfs attributes and the device node, which
+ * 60-libdroid-iio.rules gives to the video group and the seat user.
+ *
+ * LIBDROID_IIO_SYSFS_DIR and LIBDROID_IIO_DEV_DIR can point to a fake
+ * sensor: a directory laid out as /sys/bus/iio/devices, and one with
+ * the matching iio:deviceN, a FIFO or a file of recorded samples.
+ */
+
+#define G_LOG_DOMAIN "droid-auto-brightness"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include <libdroid/auto-brightness.h>
+
+#include "leds-private.h"
+#include "settings.h"
+
+#define IIO_SYSFS_DIR                "/sys/bus/iio/devices"
+#define IIO_SYSFS_DIR_ENV            "LIBDROID_IIO_SYSFS_DIR"
+#define IIO_DEV_DIR                  "/dev"
+#define IIO_DEV_DIR_ENV              "LIBDROID_IIO_DEV_DIR"
+#define IIO_CHANNEL                  "in_illuminance"
+#define IIO_BUFFER_LENGTH            "16"
+#define IIO_READ_RECORDS             16
+
+#define WINDOW_SIZE                  32
+#define WINDOW_US                    (2 * G_USEC_PER_SEC)
+
+/* How far the average has to move before the level follows it */
+#define HYSTERESIS_BRIGHTEN          0.10
+#define HYSTERESIS_DARKEN            0.20
+#define HYSTERESIS_MIN_LUX           2.0
+
+/* Every tick covers this fraction of the way to the target */
+#define RAMP_INTERVAL_MS             30
+#define RAMP_DIVISOR                 8
+
+/* The default curve is logarithmic up to direct sunlight */
+#define CURVE_MAX_LUX                10000.0
+#define LEVEL_MIN                    8
+#define LEVEL_MAX                    255
+
+#define AUTO_BRIGHTNESS_CURVE_KEY    "auto-brightness-curve"
+
+typedef enum
+{
+  PROP_LEDS = 1,
+  N_PROPERTIES
+} DroidAutoBrightnessProperty;
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+typedef struct
+{
+  gint64  time;
+  gdouble lux;
+} DroidAutoBrightnessSample;
+
+typedef struct
+{
+  gdouble lux;
+  guint   level;
+} DroidAutoBrightnessPoint;
+
+struct _DroidAutoBrightness
+{
+  GObject    parent_instance;
+
+  DroidLeds *leds;
+
+  /* The sensor, and the layout of its samples */
+  gchar     *sysfs_path;
+  gchar     *dev_path;
+  gboolean   big_endian;
+  gboolean   is_signed;
+  guint      bits;
+  guint      storage_bytes;
+  guint      shift;
+  gdouble    scale;
+  gdouble    offset;
+
+  gint       fd;
+  guint      fd_id;
+  gboolean   display_on;
+
+  DroidAutoBrightnessSample window[WINDOW_SIZE];
+  guint      window_start;
+  guint      window_len;
+
+  GArray    *curve;
+  gboolean   has_lux;
+  gdouble    stable_lux;
+
+  /* The level last set, -1 to jump to the next target */
+  gint       level;
+  guint      target;
+  guint      ramp_id;
+};
+
+static void initable_interface_init (GInitableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (DroidAutoBrightness, droid_auto_brightness, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, initable_interface_init))
+
+
+static gchar *
+droid_auto_brightness_read_attr (const gchar *dir,
+                                 const gchar *name)
+{
+  g_autofree gchar *path = g_build_filename (dir, name, NULL);
+  gchar *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  return g_strstrip (contents);
+}
+
+/* Not g_file_set_contents(), sysfs attributes can't be replaced */
+static gboolean
+droid_auto_brightness_write_attr (const gchar  *dir,
+                                  const gchar  *name,
+                                  const gchar  *value,
+                                  GError      **error)
+{
+  g_autofree gchar *path = g_build_filename (dir, name, NULL);
+  gsize len = strlen (value);
+  gint fd;
+
+  fd = open (path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0 || write (fd, value, len) != (gssize) len)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Unable to write %s: %s", path, g_strerror (saved_errno));
+      if (fd >= 0)
+        close (fd);
+
+      return FALSE;
+    }
+
+  close (fd);
+
+  return TRUE;
+}
+
+static gdouble
+droid_auto_brightness_read_double (const gchar *dir,
+                                   const gchar *name,
+                                   gdouble      fallback)
+{
+  g_autofree gchar *value = droid_auto_brightness_read_attr (dir, name);
+
+  return (value != NULL) ? g_ascii_strtod (value, NULL) : fallback;
+}
+
+/* The first IIO device with a buffered illuminance channel */
+static gchar *
+droid_auto_brightness_find_sensor (const gchar  *sysfs_dir,
+                                   GError      **error)
+{
+  g_autoptr (GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (sysfs_dir, 0, error);
+  if (dir == NULL)
+    return NULL;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (sysfs_dir, name, NULL);
+      g_autofree gchar *enable = g_build_filename (path, "scan_elements",
+                                                   IIO_CHANNEL "_en", NULL);
+
+      if (g_str_has_prefix (name, "iio:device") && g_file_test (enable, G_FILE_TEST_EXISTS))
+        return g_steal_pointer (&path);
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               "No ambient light sensor with a buffer in %s", sysfs_dir);
+
+  return NULL;
+}
+
+/* Parses a scan element type, such as "le:u16/32>>0" */
+static gboolean
+droid_auto_brightness_parse_type (DroidAutoBrightness  *self,
+                                  const gchar          *type,
+                                  GError              **error)
+{
+  gchar endian, sign;
+  guint bits, storage, shift;
+
+  if (type == NULL ||
+      sscanf (type, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage, &shift) != 5 ||
+      (endian != 'l' && endian != 'b') || (sign != 's' && sign != 'u') ||
+      (storage != 8 && storage != 16 && storage != 32 && storage != 64) ||
+      bits == 0 || bits + shift > storage)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unsupported illuminance format %s", type ? type : "(none)");
+      return FALSE;
+    }
+
+  self->big_endian    = (endian == 'b');
+  self->is_signed     = (sign == 's');
+  self->bits          = bits;
+  self->storage_bytes = storage / 8;
+  self->shift         = shift;
+
+  return TRUE;
+}
+
+static gboolean
+droid_auto_brightness_buffer_in_use (DroidAutoBrightness *self)
+{
+  g_autofree gchar *enable = droid_auto_brightness_read_attr (self->sysfs_path, "buffer/enable");
+
+  return g_strcmp0 (enable, "1") == 0;
+}
+
+/*
+ * Makes the illuminance the only channel in the buffer, so that every
+ * record is a single sample, and attaches the device's own trigger if
+ * none is set. Other channels are only turned off on plain light
+ * sensors: on combined ones, they might be someone else's.
+ */
+static gboolean
+droid_auto_brightness_setup_buffer (DroidAutoBrightness  *self,
+                                    GError              **error)
+{
+  g_autofree gchar *scan_dir = g_build_filename (self->sysfs_path, "scan_elements", NULL);
+  g_autofree gchar *type = NULL;
+  g_autofree gchar *trigger = NULL;
+  g_autoptr (GPtrArray) enabled = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GDir) dir = NULL;
+  gboolean light_only = TRUE;
+  const gchar *name;
+
+  /* The scan elements can't change while the buffer is enabled */
+  if (droid_auto_brightness_buffer_in_use (self))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+                   "The buffer of %s is already in use", self->sysfs_path);
+      return FALSE;
+    }
+
+  dir = g_dir_open (scan_dir, 0, error);
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *value = NULL;
+
+      if (!g_str_has_suffix (name, "_en") || g_strcmp0 (name, IIO_CHANNEL "_en") == 0)
+        continue;
+
+      if (!g_str_has_prefix (name, IIO_CHANNEL) && !g_str_has_prefix (name, "in_timestamp"))
+        light_only = FALSE;
+
+      value = droid_auto_brightness_read_attr (scan_dir, name);
+      if (g_strcmp0 (value, "1") == 0)
+        g_ptr_array_add (enabled, g_strdup (name));
+    }
+
+  if (enabled->len > 0 && !light_only)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+                   "%s has other channels enabled, %s among them", self->sysfs_path,
+                   (const gchar *) g_ptr_array_index (enabled, 0));
+      return FALSE;
+    }
+
+  for (guint i=0; i < enabled->len; i++)
+    droid_auto_brightness_write_attr (scan_dir, g_ptr_array_index (enabled, i), "0", NULL);
+
+  if (!droid_auto_brightness_write_attr (scan_dir, IIO_CHANNEL "_en", "1", error))
+    return FALSE;
+
+  type = droid_auto_brightness_read_attr (scan_dir, IIO_CHANNEL "_type");
+  if (!droid_auto_brightness_parse_type (self, type, error))
+    return FALSE;
+
+  self->scale  = droid_auto_brightness_read_double (self->sysfs_path, IIO_CHANNEL "_scale", 1.0);
+  self->offset = droid_auto_brightness_read_double (self->sysfs_path, IIO_CHANNEL "_offset", 0.0);
+
+  trigger = droid_auto_brightness_read_attr (self->sysfs_path, "trigger/current_trigger");
+  if (trigger != NULL && *trigger == '\0')
+    {
+      g_autofree gchar *device_name = droid_auto_brightness_read_attr (self->sysfs_path, "name");
+      g_autofree gchar *basename = g_path_get_basename (self->sysfs_path);
+      g_autofree gchar *own_trigger = g_strdup_printf ("%s-dev%s", device_name,
+                                                       basename + strlen ("iio:device"));
+      g_autoptr (GError) trigger_error = NULL;
+
+      if (device_name == NULL ||
+          !droid_auto_brightness_write_attr (self->sysfs_path, "trigger/current_trigger",
+                                             own_trigger, &trigger_error))
+        g_debug ("No trigger for the sensor, relying on the driver: %s",
+                 trigger_error ? trigger_error->message : "unnamed device");
+    }
+
+  return droid_auto_brightness_write_attr (self->sysfs_path, "buffer/length",
+                                           IIO_BUFFER_LENGTH, error);
+}
+
+static gdouble
+droid_auto_brightness_decode (DroidAutoBrightness *self,
+                              const guint8        *record)
+{
+  guint64 raw = 0;
+  gint64 value;
+
+  for (guint i=0; i < self->storage_bytes; i++)
+    raw = (raw << 8) | record[self->big_endian ? i : self->storage_bytes - 1 - i];
+
+  raw >>= self->shift;
+  if (self->bits < 64)
+    raw &= (G_GUINT64_CONSTANT (1) << self->bits) - 1;
+
+  value = (gint64) raw;
+  if (self->is_signed && self->bits < 64 && (raw & (G_GUINT64_CONSTANT (1) << (self->bits - 1))))
+    value -= (gint64) 1 << self->bits;
+
+  return ((gdouble) value + self->offset) * self->scale;
+}
+
+static guint
+droid_auto_brightness_level_for_lux (DroidAutoBrightness *self,
+                                     gdouble              lux)
+{
+  DroidAutoBrightnessPoint *from, *to;
+  gdouble fraction;
+
+  lux = MAX (lux, 0.0);
+
+  if (self->curve->len < 2)
+    {
+      fraction = log10 (1.0 + lux) / log10 (1.0 + CURVE_MAX_LUX);
+      return LEVEL_MIN + round (CLAMP (fraction, 0.0, 1.0) * (LEVEL_MAX - LEVEL_MIN));
+    }
+
+  from = &g_array_index (self->curve, DroidAutoBrightnessPoint, 0);
+  if (lux <= from->lux)
+    return from->level;
+
+  for (guint i=1; i < self->curve->len; i++)
+    {
+      to = &g_array_index (self->curve, DroidAutoBrightnessPoint, i);
+
+      if (lux <= to->lux)
+        return round (from->level + ((gdouble) to->level - from->level) *
+          (lux - from->lux) / (to->lux - from->lux));
+
+      from = to;
+    }
+
+  return from->level;
+}
+
+static gboolean
+droid_auto_brightness_ramp (gpointer user_data)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (user_data);
+  gint distance = (gint) self->target - self->level;
+  gint step;
+
+  if (distance == 0)
+    {
+      self->ramp_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  step = distance / RAMP_DIVISOR;
+  if (step == 0)
+    step = (distance > 0) ? 1 : -1;
+
+  self->level += step;
+  droid_leds_set_backlight_sensor (self->leds, self->level);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+droid_auto_brightness_set_target (DroidAutoBrightness *self,
+                                  guint                target)
+{
+  g_debug ("%.1f lux, backlight level %u", self->stable_lux, target);
+
+  self->target = target;
+
+  /* Right after the display is turned on, there is nothing to ramp from */
+  if (self->level < 0)
+    {
+      self->level = target;
+      droid_leds_set_backlight_sensor (self->leds, target);
+      return;
+    }
+
+  /* A ramp in progress just heads for the new target */
+  if (self->ramp_id == 0 && (guint) self->level != target)
+    self->ramp_id = g_timeout_add (RAMP_INTERVAL_MS, droid_auto_brightness_ramp, self);
+}
+
+/*
+ * Adds a sample to the window, dropping the ones that are too old, and
+ * follows the average if it is out of the hysteresis band.
+ */
+static void
+droid_auto_brightness_add_sample (DroidAutoBrightness *self,
+                                  gint64               now,
+                                  gdouble              lux)
+{
+  DroidAutoBrightnessSample *sample;
+  gdouble average = 0.0;
+
+  while (self->window_len > 0 &&
+         (self->window_len == WINDOW_SIZE ||
+          now - self->window[self->window_start].time > WINDOW_US))
+    {
+      self->window_start = (self->window_start + 1) % WINDOW_SIZE;
+      self->window_len--;
+    }
+
+  sample = &self->window[(self->window_start + self->window_len) % WINDOW_SIZE];
+  sample->time = now;
+  sample->lux = lux;
+  self->window_len++;
+
+  for (guint i=0; i < self->window_len; i++)
+    average += self->window[(self->window_start + i) % WINDOW_SIZE].lux;
+  average /= self->window_len;
+
+  if (self->has_lux &&
+      average < self->stable_lux * (1.0 + HYSTERESIS_BRIGHTEN) + HYSTERESIS_MIN_LUX &&
+      average > self->stable_lux * (1.0 - HYSTERESIS_DARKEN) - HYSTERESIS_MIN_LUX)
+    return;
+
+  self->has_lux = TRUE;
+  self->stable_lux = average;
+  droid_auto_brightness_set_target (self, droid_auto_brightness_level_for_lux (self, average));
+}
+
+static gboolean
+droid_auto_brightness_readable (gint         fd,
+                                GIOCondition condition,
+                                gpointer     user_data)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (user_data);
+  guint8 buffer[IIO_READ_RECORDS * sizeof (guint64)];
+  gint64 now = g_get_monotonic_time ();
+  gssize n_read;
+
+  n_read = read (fd, buffer, self->storage_bytes * IIO_READ_RECORDS);
+  if (n_read < 0 && (errno == EAGAIN || errno == EINTR))
+    return G_SOURCE_CONTINUE;
+
+  /* A fake sensor backed by a file runs out of samples */
+  if (n_read <= 0)
+    {
+      g_debug ("The sensor stopped: %s", (n_read < 0) ? g_strerror (errno) : "end of file");
+      self->fd_id = 0;
+      close (self->fd);
+      self->fd = -1;
+      droid_auto_brightness_write_attr (self->sysfs_path, "buffer/enable", "0", NULL);
+      return G_SOURCE_REMOVE;
+    }
+
+  for (gsize i=0; i + self->storage_bytes <= (gsize) n_read; i += self->storage_bytes)
+    droid_auto_brightness_add_sample (self, now, droid_auto_brightness_decode (self, buffer + i));
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+droid_auto_brightness_start (DroidAutoBrightness *self)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (self->fd >= 0)
+    return;
+
+  /* Taken by someone else while the display was off */
+  if (droid_auto_brightness_buffer_in_use (self))
+    {
+      g_warning ("Unable to start the sensor: its buffer is in use");
+      return;
+    }
+
+  if (!droid_auto_brightness_write_attr (self->sysfs_path, "buffer/enable", "1", &error))
+    {
+      g_warning ("Unable to start the sensor: %s", error->message);
+      return;
+    }
+
+  self->fd = open (self->dev_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (self->fd < 0)
+    {
+      g_warning ("Unable to open %s: %s", self->dev_path, g_strerror (errno));
+      droid_auto_brightness_write_attr (self->sysfs_path, "buffer/enable", "0", NULL);
+      return;
+    }
+
+  self->level = -1;
+  self->fd_id = g_unix_fd_add (self->fd, G_IO_IN, droid_auto_brightness_readable, self);
+}
+
+static void
+droid_auto_brightness_stop (DroidAutoBrightness *self)
+{
+  g_clear_handle_id (&self->ramp_id, g_source_remove);
+  g_clear_handle_id (&self->fd_id, g_source_remove);
+
+  if (self->fd >= 0)
+    {
+      close (self->fd);
+      self->fd = -1;
+      droid_auto_brightness_write_attr (self->sysfs_path, "buffer/enable", "0", NULL);
+    }
+
+  /* Start over from fresh samples */
+  self->window_len = 0;
+  self->has_lux = FALSE;
+}
+
+static gint
+droid_auto_brightness_compare_points (gconstpointer a,
+                                      gconstpointer b)
+{
+  const DroidAutoBrightnessPoint *point_a = a;
+  const DroidAutoBrightnessPoint *point_b = b;
+
+  return (point_a->lux > point_b->lux) - (point_a->lux < point_b->lux);
+}
+
+static void
+droid_auto_brightness_load_curve (DroidAutoBrightness *self)
+{
+  g_autoptr (GSettings) settings = droid_settings_get_default ();
+  g_autoptr (GVariant) curve = g_settings_get_value (settings, AUTO_BRIGHTNESS_CURVE_KEY);
+  DroidAutoBrightnessPoint point;
+  GVariantIter iter;
+
+  g_variant_iter_init (&iter, curve);
+  while (g_variant_iter_next (&iter, "(du)", &point.lux, &point.level))
+    {
+      point.level = MIN (point.level, LEVEL_MAX);
+      g_array_append_val (self->curve, point);
+    }
+  g_array_sort (self->curve, droid_auto_brightness_compare_points);
+
+  if (self->curve->len == 1)
+    g_warning ("At least two automatic brightness points are needed, ignoring");
+}
+
+static gboolean
+initable_init (GInitable     *initable,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (initable);
+  const gchar *sysfs_dir = g_getenv (IIO_SYSFS_DIR_ENV);
+  const gchar *dev_dir = g_getenv (IIO_DEV_DIR_ENV);
+  g_autofree gchar *basename = NULL;
+
+  if (self->leds == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No DroidLeds given");
+      return FALSE;
+    }
+
+  self->sysfs_path = droid_auto_brightness_find_sensor (sysfs_dir ? sysfs_dir : IIO_SYSFS_DIR,
+                                                        error);
+  if (self->sysfs_path == NULL)
+    return FALSE;
+
+  basename = g_path_get_basename (self->sysfs_path);
+  self->dev_path = g_build_filename (dev_dir ? dev_dir : IIO_DEV_DIR, basename, NULL);
+
+  g_debug ("Using ambient light sensor %s", self->sysfs_path);
+
+  if (!droid_auto_brightness_setup_buffer (self, error))
+    return FALSE;
+
+  droid_auto_brightness_load_curve (self);
+
+  /* The display is assumed to be on until told otherwise */
+  self->display_on = TRUE;
+  droid_auto_brightness_start (self);
+
+  return TRUE;
+}
+
+static void
+droid_auto_brightness_dispose (GObject *obj)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (obj);
+
+  if (self->sysfs_path != NULL)
+    droid_auto_brightness_stop (self);
+
+  g_clear_object (&self->leds);
+
+  G_OBJECT_CLASS (droid_auto_brightness_parent_class)->dispose (obj);
+}
+
+static void
+droid_auto_brightness_finalize (GObject *obj)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (obj);
+
+  g_free (self->sysfs_path);
+  g_free (self->dev_path);
+  g_array_unref (self->curve);
+
+  G_OBJECT_CLASS (droid_auto_brightness_parent_class)->finalize (obj);
+}
+
+static void
+droid_auto_brightness_set_property (GObject      *object,
+                                    guint         property_id,
+                                    const GValue *value,
+                                    GParamSpec   *pspec)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (object);
+
+  switch ((DroidAutoBrightnessProperty) property_id)
+    {
+    case PROP_LEDS:
+      /* This is construct only, so we don't need to handle existing value */
+      self->leds = g_value_dup_object (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+droid_auto_brightness_get_property (GObject    *object,
+                                    guint       property_id,
+                                    GValue     *value,
+                                    GParamSpec *pspec)
+{
+  DroidAutoBrightness *self = DROID_AUTO_BRIGHTNESS (object);
+
+  switch ((DroidAutoBrightnessProperty) property_id)
+    {
+    case PROP_LEDS:
+      g_value_set_object (value, self->leds);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+droid_auto_brightness_class_init (DroidAutoBrightnessClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose      = droid_auto_brightness_dispose;
+  object_class->finalize     = droid_auto_brightness_finalize;
+  object_class->set_property = droid_auto_brightness_set_property;
+  object_class->get_property = droid_auto_brightness_get_property;
+
+  properties[PROP_LEDS] =
+    g_param_spec_object ("leds",
+                         "Leds",
+                         "The DroidLeds to set the backlight with",
+                         DROID_TYPE_LEDS,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+}
+
+static void
+initable_interface_init (GInitableIface *iface)
+{
+  iface->init = initable_init;
+}
+
+static void
+droid_auto_brightness_init (DroidAutoBrightness *self)
+{
+  self->fd = -1;
+  self->level = -1;
+  self->curve = g_array_new (FALSE, FALSE, sizeof (DroidAutoBrightnessPoint));
+}
+
+/*
+ * Starts driving the backlight of leds from the ambient light sensor,
+ * from the default main context. Fails if there is no sensor with
+ * a buffered illuminance channel.
+ */
+DroidAutoBrightness *
+droid_auto_brightness_new (DroidLeds  *leds,
+                           GError    **error)
+{
+  g_return_val_if_fail (DROID_IS_LEDS (leds), NULL);
+
+  return g_initable_new (DROID_TYPE_AUTO_BRIGHTNESS, NULL, error,
+                         "leds", leds,
+                         NULL);
+}
+
+/*
+ * Sampling stops entirely while the display is off. Once it is back on,
+ * the level jumps to the ambient light right away instead of ramping.
+ */
+void
+droid_auto_brightness_set_display_on (DroidAutoBrightness *self,
+                                      gboolean             display_on)
+{
+  g_return_if_fail (DROID_IS_AUTO_BRIGHTNESS (self));
+
+  display_on = !!display_on;
+  if (self->display_on == display_on)
+    return;
+
+  self->display_on = display_on;
+
+  if (display_on)
+    droid_auto_brightness_start (self);
+  else
+    droid_auto_brightness_stop (self);
+}
+
+/* The illuminance the level follows, in lux, or -1 if there is none yet */
+gdouble
+droid_auto_brightness_get_lux (DroidAutoBrightness *self)
+{
+  g_return_val_if_fail (DROID_IS_AUTO_BRIGHTNESS (self), -1.0);
+
+  return self->has_lux ? self->stable_lux : -1.0;
+}
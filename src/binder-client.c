@@ -0,0 +1,753 @@
+/* binder-client.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * A connection to a binder service: looks it up, optionally starting it
+ * through systemd, follows it across deaths and re-registrations and
+ * keeps per-method latency counters for the transactions sent to it.
+ */
+
+#define G_LOG_DOMAIN "binder-client"
+
+#include <errno.h>
+
+#include <libdroid/binder-client.h>
+
+#include "binder.h"
+
+typedef enum
+{
+  PROP_DEVICE = 1,
+  PROP_IFACE,
+  PROP_CONNECTED,
+  N_PROPERTIES
+} DroidBinderClientProperty;
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+typedef struct
+{
+  guint32 code;
+  guint   calls;
+  guint   failures;
+  gint64  total_us;
+  gint64  max_us;
+} DroidBinderMethodStats;
+
+typedef struct
+{
+  DroidBinderClient *self;
+  guint32            code;
+  gint64             start_time;
+} DroidBinderAsyncTransaction;
+
+struct _DroidBinderClient
+{
+  GObject parent_instance;
+
+  gchar                 *device;
+  gchar                 *iface;
+  gchar                 *fqname;
+
+  /* Started through systemd when the service isn't registered */
+  gchar                 *activation_unit;
+  guint                  activation_timeout_ms;
+  gint64                 activation_time;
+
+  GBinderServiceManager *service_manager;
+  gulong                 registration_id;
+
+  /* Replaced on reconnection, transactions take their own reference */
+  GMutex                 lock;
+  GBinderRemoteObject   *remote;
+  GBinderClient         *client;
+  gulong                 death_id;
+
+  /* Requests only depend on the protocol, so this one outlives reconnections */
+  GBinderClient         *request_client;
+
+  GMutex                 stats_lock;
+  GArray                *stats;
+};
+
+G_DEFINE_TYPE (DroidBinderClient, droid_binder_client, G_TYPE_OBJECT)
+
+static void
+droid_binder_client_record (DroidBinderClient *self,
+                            guint32            code,
+                            gint64             start_time,
+                            gboolean           success)
+{
+  gint64 latency = g_get_monotonic_time () - start_time;
+  DroidBinderMethodStats *stats = NULL;
+
+  g_mutex_lock (&self->stats_lock);
+
+  /* Interfaces have a handful of methods, a scan is cheaper than hashing */
+  for (guint i=0; i < self->stats->len && stats == NULL; i++)
+    {
+      if (g_array_index (self->stats, DroidBinderMethodStats, i).code == code)
+        stats = &g_array_index (self->stats, DroidBinderMethodStats, i);
+    }
+
+  if (stats == NULL)
+    {
+      DroidBinderMethodStats empty = { .code = code };
+
+      g_array_append_val (self->stats, empty);
+      stats = &g_array_index (self->stats, DroidBinderMethodStats, self->stats->len - 1);
+    }
+
+  stats->calls++;
+  stats->total_us += latency;
+  stats->max_us = MAX (stats->max_us, latency);
+  if (!success)
+    stats->failures++;
+
+  g_mutex_unlock (&self->stats_lock);
+
+  if (success && self->activation_time != 0)
+    {
+      g_debug ("First reply %" G_GINT64_FORMAT "ms after starting %s",
+        (g_get_monotonic_time () - self->activation_time) / 1000, self->activation_unit);
+      self->activation_time = 0;
+    }
+}
+
+/* Called with the lock */
+static void
+droid_binder_client_drop_remote (DroidBinderClient *self)
+{
+  if (self->remote != NULL && self->death_id != 0)
+    gbinder_remote_object_remove_handler (self->remote, self->death_id);
+
+  self->death_id = 0;
+  g_clear_pointer (&self->client, gbinder_client_unref);
+  g_clear_pointer (&self->remote, gbinder_remote_object_unref);
+}
+
+static void
+droid_binder_client_died (GBinderRemoteObject *remote,
+                          void                *user_data)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (user_data);
+
+  g_debug ("%s died", self->fqname);
+
+  g_mutex_lock (&self->lock);
+  if (self->remote == remote)
+    droid_binder_client_drop_remote (self);
+  g_mutex_unlock (&self->lock);
+
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_CONNECTED]);
+}
+
+static GBinderRemoteObject *
+droid_binder_client_lookup (DroidBinderClient *self)
+{
+  GBinderRemoteObject *remote;
+  gint64 start;
+
+  remote = gbinder_servicemanager_get_service_sync (self->service_manager, self->fqname, NULL);
+  if (remote != NULL || self->activation_unit == NULL)
+    return remote;
+
+  start = g_get_monotonic_time ();
+  if (!binder_activate (self->activation_unit, self->device, self->fqname,
+                        self->activation_timeout_ms))
+    return NULL;
+
+  remote = gbinder_servicemanager_get_service_sync (self->service_manager, self->fqname, NULL);
+  if (remote != NULL)
+    self->activation_time = start;
+
+  return remote;
+}
+
+/* Looks the service up again, unless another thread already did */
+static gboolean
+droid_binder_client_reconnect (DroidBinderClient *self)
+{
+  GBinderRemoteObject *remote;
+  gboolean connected;
+
+  g_mutex_lock (&self->lock);
+  connected = (self->client != NULL);
+  g_mutex_unlock (&self->lock);
+
+  if (connected)
+    return TRUE;
+
+  if (self->fqname == NULL || (remote = droid_binder_client_lookup (self)) == NULL)
+    return FALSE;
+
+  g_mutex_lock (&self->lock);
+  if (self->client == NULL)
+    {
+      /* The service manager keeps the remote only as long as it likes */
+      self->remote = gbinder_remote_object_ref (remote);
+      self->client = gbinder_client_new (self->remote, self->iface);
+      self->death_id = gbinder_remote_object_add_death_handler (self->remote,
+        droid_binder_client_died, self);
+
+      if (self->client == NULL)
+        droid_binder_client_drop_remote (self);
+      else if (self->request_client == NULL)
+        self->request_client = gbinder_client_ref (self->client);
+    }
+  connected = (self->client != NULL);
+  g_mutex_unlock (&self->lock);
+
+  if (!connected)
+    return FALSE;
+
+  g_debug ("Connected to %s", self->fqname);
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_CONNECTED]);
+
+  return TRUE;
+}
+
+static void
+droid_binder_client_registered (GBinderServiceManager *service_manager,
+                                const char            *name,
+                                void                  *user_data)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (user_data);
+
+  if (g_strcmp0 (name, self->fqname) != 0 || droid_binder_client_is_connected (self))
+    return;
+
+  g_debug ("%s registered again", name);
+  droid_binder_client_reconnect (self);
+}
+
+/* Returns a reference to the current client, reconnecting if needed */
+static GBinderClient *
+droid_binder_client_ref_current (DroidBinderClient  *self,
+                                 GError            **error)
+{
+  GBinderClient *client = NULL;
+
+  if (!droid_binder_client_reconnect (self))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                   "%s is not available", self->fqname ? self->fqname : self->iface);
+      return NULL;
+    }
+
+  g_mutex_lock (&self->lock);
+  if (self->client != NULL)
+    client = gbinder_client_ref (self->client);
+  g_mutex_unlock (&self->lock);
+
+  if (client == NULL)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                 "%s went away", self->fqname);
+
+  return client;
+}
+
+/**
+ * droid_binder_client_set_activation:
+ *
+ * Has droid_binder_client_connect() and reconnections start unit and
+ * wait up to timeout_ms for the service to register when it's not
+ * there, for services that exit when idle. A NULL unit disables it.
+ */
+void
+droid_binder_client_set_activation (DroidBinderClient *self,
+                                    const char        *unit,
+                                    guint              timeout_ms)
+{
+  g_return_if_fail (DROID_IS_BINDER_CLIENT (self));
+
+  g_free (self->activation_unit);
+  self->activation_unit = g_strdup (unit);
+  self->activation_timeout_ms = timeout_ms;
+}
+
+/**
+ * droid_binder_client_connect:
+ *
+ * Connects to fqname, dropping any previous connection. The service is
+ * followed from then on: if it dies, the next transaction or its next
+ * registration connects again.
+ */
+gboolean
+droid_binder_client_connect (DroidBinderClient  *self,
+                             const char         *fqname,
+                             GError            **error)
+{
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), FALSE);
+  g_return_val_if_fail (fqname != NULL, FALSE);
+
+  if (self->service_manager == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to init servicemanager on %s", self->device);
+      return FALSE;
+    }
+
+  g_mutex_lock (&self->lock);
+  droid_binder_client_drop_remote (self);
+  g_mutex_unlock (&self->lock);
+
+  g_free (self->fqname);
+  self->fqname = g_strdup (fqname);
+
+  if (self->registration_id != 0)
+    gbinder_servicemanager_remove_handler (self->service_manager, self->registration_id);
+  self->registration_id = gbinder_servicemanager_add_registration_handler (self->service_manager,
+    fqname, droid_binder_client_registered, self);
+
+  if (!droid_binder_client_reconnect (self))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Failed to get hal service remote for %s", fqname);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean
+droid_binder_client_is_connected (DroidBinderClient *self)
+{
+  gboolean connected;
+
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), FALSE);
+
+  g_mutex_lock (&self->lock);
+  connected = (self->client != NULL);
+  g_mutex_unlock (&self->lock);
+
+  return connected;
+}
+
+/**
+ * droid_binder_client_get_client:
+ *
+ * Returns the client to build requests with, NULL if there never was a
+ * connection. It stays valid for the lifetime of self, reconnections
+ * included.
+ */
+GBinderClient *
+droid_binder_client_get_client (DroidBinderClient *self)
+{
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), NULL);
+
+  return self->request_client;
+}
+
+/**
+ * droid_binder_client_transact_sync:
+ *
+ * Sends request, which is consumed, and waits for the reply. Returns
+ * NULL with error set if the transaction failed: G_IO_ERROR_NOT_SUPPORTED
+ * if the service doesn't know the code, G_IO_ERROR_WOULD_BLOCK if it is
+ * busy and the request can be tried again later.
+ */
+GBinderRemoteReply *
+droid_binder_client_transact_sync (DroidBinderClient    *self,
+                                   guint32               code,
+                                   GBinderLocalRequest  *request,
+                                   GError              **error)
+{
+  GBinderClient *client;
+  GBinderRemoteReply *reply;
+  gint64 start = g_get_monotonic_time ();
+  int status = GBINDER_STATUS_FAILED;
+
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), NULL);
+
+  client = droid_binder_client_ref_current (self, error);
+  if (client == NULL)
+    {
+      g_clear_pointer (&request, gbinder_local_request_unref);
+      return NULL;
+    }
+
+  reply = gbinder_client_transact_sync_reply (client, code, request, &status);
+  g_clear_pointer (&request, gbinder_local_request_unref);
+  gbinder_client_unref (client);
+
+  if (status != GBINDER_STATUS_OK)
+    g_clear_pointer (&reply, gbinder_remote_reply_unref);
+
+  droid_binder_client_record (self, code, start, reply != NULL);
+
+  if (reply == NULL)
+    g_set_error (error, G_IO_ERROR,
+                 status == -EBADMSG ? G_IO_ERROR_NOT_SUPPORTED :  /* UNKNOWN_TRANSACTION */
+                 status == -EAGAIN ? G_IO_ERROR_WOULD_BLOCK : G_IO_ERROR_FAILED,
+                 "Transaction %u to %s failed: %d", code, self->fqname, status);
+
+  return reply;
+}
+
+/**
+ * droid_binder_client_transact_oneway:
+ *
+ * Sends request, which is consumed, without waiting for a reply.
+ */
+gboolean
+droid_binder_client_transact_oneway (DroidBinderClient    *self,
+                                     guint32               code,
+                                     GBinderLocalRequest  *request,
+                                     GError              **error)
+{
+  GBinderClient *client;
+  gint64 start = g_get_monotonic_time ();
+  int status;
+
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), FALSE);
+
+  client = droid_binder_client_ref_current (self, error);
+  if (client == NULL)
+    {
+      g_clear_pointer (&request, gbinder_local_request_unref);
+      return FALSE;
+    }
+
+  status = gbinder_client_transact_sync_oneway (client, code, request);
+  g_clear_pointer (&request, gbinder_local_request_unref);
+  gbinder_client_unref (client);
+
+  droid_binder_client_record (self, code, start, status == GBINDER_STATUS_OK);
+
+  if (status != GBINDER_STATUS_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Transaction %u to %s failed: %d", code, self->fqname, status);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+droid_binder_client_async_reply (GBinderClient      *client,
+                                 GBinderRemoteReply *reply,
+                                 int                 status,
+                                 void               *user_data)
+{
+  GTask *task = G_TASK (user_data);
+  DroidBinderAsyncTransaction *transaction = g_task_get_task_data (task);
+  gboolean success = (status == GBINDER_STATUS_OK && reply != NULL);
+
+  droid_binder_client_record (transaction->self, transaction->code, transaction->start_time,
+    success);
+
+  if (success)
+    g_task_return_pointer (task, gbinder_remote_reply_ref (reply),
+                           (GDestroyNotify) gbinder_remote_reply_unref);
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Transaction %u to %s failed: %d", transaction->code,
+                             transaction->self->fqname, status);
+}
+
+/**
+ * droid_binder_client_transact_async:
+ *
+ * Sends request, which is consumed, and calls callback in the thread
+ * default main context once the reply is there. The cancellable is
+ * only checked before sending.
+ */
+void
+droid_binder_client_transact_async (DroidBinderClient   *self,
+                                    guint32              code,
+                                    GBinderLocalRequest *request,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  DroidBinderAsyncTransaction *transaction;
+  GBinderClient *client;
+  GError *error = NULL;
+
+  g_return_if_fail (DROID_IS_BINDER_CLIENT (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, droid_binder_client_transact_async);
+
+  if (g_task_return_error_if_cancelled (task) ||
+      (client = droid_binder_client_ref_current (self, &error)) == NULL)
+    {
+      if (error != NULL)
+        g_task_return_error (task, error);
+      g_clear_pointer (&request, gbinder_local_request_unref);
+      return;
+    }
+
+  transaction = g_new0 (DroidBinderAsyncTransaction, 1);
+  transaction->self = self;
+  transaction->code = code;
+  transaction->start_time = g_get_monotonic_time ();
+  g_task_set_task_data (task, transaction, g_free);
+
+  /* The task, and with it self, is kept until the reply or its failure */
+  if (gbinder_client_transact (client, code, 0, request, droid_binder_client_async_reply,
+                               g_object_unref, g_object_ref (task)) == 0)
+    {
+      droid_binder_client_record (self, code, transaction->start_time, FALSE);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Unable to send transaction %u to %s", code, self->fqname);
+    }
+
+  g_clear_pointer (&request, gbinder_local_request_unref);
+  gbinder_client_unref (client);
+}
+
+GBinderRemoteReply *
+droid_binder_client_transact_finish (DroidBinderClient  *self,
+                                     GAsyncResult       *result,
+                                     GError            **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * droid_binder_client_get_method_stats:
+ *
+ * Returns FALSE if code was never sent. Failures are included in the
+ * latency figures.
+ */
+gboolean
+droid_binder_client_get_method_stats (DroidBinderClient *self,
+                                      guint32            code,
+                                      guint             *calls,
+                                      guint             *failures,
+                                      gint64            *total_us,
+                                      gint64            *max_us)
+{
+  gboolean found = FALSE;
+
+  g_return_val_if_fail (DROID_IS_BINDER_CLIENT (self), FALSE);
+
+  g_mutex_lock (&self->stats_lock);
+  for (guint i=0; i < self->stats->len && !found; i++)
+    {
+      DroidBinderMethodStats *stats = &g_array_index (self->stats, DroidBinderMethodStats, i);
+
+      if (stats->code != code)
+        continue;
+
+      found = TRUE;
+      if (calls)
+        *calls = stats->calls;
+      if (failures)
+        *failures = stats->failures;
+      if (total_us)
+        *total_us = stats->total_us;
+      if (max_us)
+        *max_us = stats->max_us;
+    }
+  g_mutex_unlock (&self->stats_lock);
+
+  return found;
+}
+
+static void
+droid_binder_client_constructed (GObject *obj)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (obj);
+
+  G_OBJECT_CLASS (droid_binder_client_parent_class)->constructed (obj);
+
+  self->service_manager = gbinder_servicemanager_new (self->device);
+  if (self->service_manager == NULL)
+    g_warning ("Failed to init servicemanager on %s", self->device);
+}
+
+static void
+droid_binder_client_dispose (GObject *obj)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (obj);
+
+  for (guint i=0; i < self->stats->len; i++)
+    {
+      DroidBinderMethodStats *stats = &g_array_index (self->stats, DroidBinderMethodStats, i);
+
+      g_debug ("%s code %u: %u calls, %u failed, avg %" G_GINT64_FORMAT "us, max %"
+               G_GINT64_FORMAT "us", self->iface, stats->code, stats->calls, stats->failures,
+               stats->total_us / MAX (stats->calls, 1), stats->max_us);
+    }
+  g_array_set_size (self->stats, 0);
+
+  g_mutex_lock (&self->lock);
+  droid_binder_client_drop_remote (self);
+  g_mutex_unlock (&self->lock);
+
+  g_clear_pointer (&self->request_client, gbinder_client_unref);
+
+  if (self->service_manager != NULL && self->registration_id != 0)
+    gbinder_servicemanager_remove_handler (self->service_manager, self->registration_id);
+  self->registration_id = 0;
+  g_clear_pointer (&self->service_manager, gbinder_servicemanager_unref);
+
+  G_OBJECT_CLASS (droid_binder_client_parent_class)->dispose (obj);
+}
+
+static void
+droid_binder_client_finalize (GObject *obj)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (obj);
+
+  g_free (self->device);
+  g_free (self->iface);
+  g_free (self->fqname);
+  g_free (self->activation_unit);
+  g_array_unref (self->stats);
+  g_mutex_clear (&self->lock);
+  g_mutex_clear (&self->stats_lock);
+
+  G_OBJECT_CLASS (droid_binder_client_parent_class)->finalize (obj);
+}
+
+static void
+droid_binder_client_set_property (GObject      *object,
+                                  guint         property_id,
+                                  const GValue *value,
+                                  GParamSpec   *pspec)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (object);
+
+  switch ((DroidBinderClientProperty) property_id)
+    {
+    case PROP_DEVICE:
+      self->device = g_value_dup_string (value);
+      break;
+
+    case PROP_IFACE:
+      self->iface = g_value_dup_string (value);
+      break;
+
+    case PROP_CONNECTED:
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+droid_binder_client_get_property (GObject    *object,
+                                  guint       property_id,
+                                  GValue     *value,
+                                  GParamSpec *pspec)
+{
+  DroidBinderClient *self = DROID_BINDER_CLIENT (object);
+
+  switch ((DroidBinderClientProperty) property_id)
+    {
+    case PROP_DEVICE:
+      g_value_set_string (value, self->device);
+      break;
+
+    case PROP_IFACE:
+      g_value_set_string (value, self->iface);
+      break;
+
+    case PROP_CONNECTED:
+      g_value_set_boolean (value, droid_binder_client_is_connected (self));
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+droid_binder_client_class_init (DroidBinderClientClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = droid_binder_client_constructed;
+  object_class->dispose      = droid_binder_client_dispose;
+  object_class->finalize     = droid_binder_client_finalize;
+  object_class->set_property = droid_binder_client_set_property;
+  object_class->get_property = droid_binder_client_get_property;
+
+  properties[PROP_DEVICE] =
+    g_param_spec_string ("device",
+                         "Device",
+                         "The binder device the service is on",
+                         NULL,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  properties[PROP_IFACE] =
+    g_param_spec_string ("iface",
+                         "Interface",
+                         "The interface to talk to the service with",
+                         NULL,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  /* Notified from the thread that saw the change */
+  properties[PROP_CONNECTED] =
+    g_param_spec_boolean ("connected",
+                          "Connected",
+                          "Whether the service is there",
+                          FALSE,
+                          G_PARAM_READABLE);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+}
+
+static void
+droid_binder_client_init (DroidBinderClient *self)
+{
+  g_mutex_init (&self->lock);
+  g_mutex_init (&self->stats_lock);
+  self->stats = g_array_new (FALSE, TRUE, sizeof (DroidBinderMethodStats));
+}
+
+DroidBinderClient *
+droid_binder_client_new (const char *device,
+                         const char *iface)
+{
+  return g_object_new (DROID_TYPE_BINDER_CLIENT,
+                       "device", device,
+                       "iface", iface,
+                       NULL);
+}
@@ -52,63 +52,77 @@
 
 #include <errno.h>
 
-gboolean
-binder_status_is_ok (GBinderReader *reader)
-{
-  int status;
-
-  if (gbinder_reader_read_int32 (reader, &status) && status == 0) {
-    return TRUE;
-  }
-
-  return FALSE;
-}
-
-gboolean
-binder_reply_status_is_ok (GBinderRemoteReply *reply)
-{
-  GBinderReader reader;
+#define ACTIVATION_POLL_MS 10
 
-  gbinder_remote_reply_init_reader (reply, &reader);
-
-  return binder_status_is_ok (&reader);
-}
+/* How long to wait before asking again after systemd failed to start it */
+#define ACTIVATION_BACKOFF_US (30 * G_USEC_PER_SEC)
 
+/*
+ * Asks systemd to start unit, for services that exit when idle, and
+ * waits up to timeout_ms for it to register fqname. Not tried again for
+ * a while if the unit can't be started, nor at all without a system bus.
+ */
 gboolean
-binder_init (const char             *device,
-             const char             *iface,
-             const char             *fqname,
-             GBinderServiceManager **service_manager,
-             GBinderRemoteObject   **remote,
-             GBinderClient         **client)
+binder_activate (const char *unit,
+                 const char *device,
+                 const char *fqname,
+                 guint       timeout_ms)
 {
+  static gboolean no_bus = FALSE;
+  static gint64 retry_time = 0;
+  g_autoptr (GDBusConnection) bus = NULL;
+  g_autoptr (GVariant) job = NULL;
+  g_autoptr (GError) error = NULL;
+  GBinderServiceManager *service_manager;
+  GBinderRemoteObject *remote = NULL;
+  gint64 start = g_get_monotonic_time ();
+  gint64 deadline = start + (gint64) timeout_ms * 1000;
+
+  if (g_atomic_int_get (&no_bus) || start < __atomic_load_n (&retry_time, __ATOMIC_RELAXED))
+    return FALSE;
 
+  bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (bus == NULL) {
+    g_debug ("Not starting %s, no system bus: %s", unit, error->message);
+    g_atomic_int_set (&no_bus, TRUE);
+    return FALSE;
+  }
 
-  *service_manager = gbinder_servicemanager_new (device);
-  if (!*service_manager) {
-    g_warning ("Failed to init servicemanager on %s", device);
+  job = g_dbus_connection_call_sync (bus, "org.freedesktop.systemd1",
+                                     "/org/freedesktop/systemd1",
+                                     "org.freedesktop.systemd1.Manager",
+                                     "StartUnit",
+                                     g_variant_new ("(ss)", unit, "replace"),
+                                     G_VARIANT_TYPE ("(o)"),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     timeout_ms, NULL, &error);
+
+  if (job == NULL) {
+    g_warning ("Unable to start %s: %s", unit, error->message);
+    __atomic_store_n (&retry_time, g_get_monotonic_time () + ACTIVATION_BACKOFF_US,
+                      __ATOMIC_RELAXED);
     return FALSE;
   }
 
-  *remote = gbinder_servicemanager_get_service_sync (*service_manager,
-                                                     fqname, NULL);
-  if (!*remote) {
-    g_warning ("Failed to get hal service remote for %s", fqname);
-    g_clear_object (&*service_manager);
-    *service_manager = NULL;
+  service_manager = gbinder_servicemanager_new (device);
+  if (!service_manager)
     return FALSE;
+
+  while (remote == NULL && g_get_monotonic_time () < deadline) {
+    remote = gbinder_servicemanager_get_service_sync (service_manager, fqname, NULL);
+    if (remote == NULL)
+      g_usleep (ACTIVATION_POLL_MS * 1000);
   }
 
-  *client = gbinder_client_new (*remote, iface);
-  if (!*client) {
-    g_warning ("Failed to get hal service client for %s", iface);
-    g_clear_object (&*remote);
-    g_clear_object (&*service_manager);
+  gbinder_servicemanager_unref (service_manager);
+
+  if (remote == NULL) {
+    g_warning ("%s didn't show up after starting %s", fqname, unit);
     return FALSE;
   }
 
-  /* Ensure we keep a reference on the remote */
-  gbinder_remote_object_ref (*remote);
+  g_debug ("%s registered %" G_GINT64_FORMAT "ms after starting %s", fqname,
+           (g_get_monotonic_time () - start) / 1000, unit);
 
   return TRUE;
 }
@@ -59,13 +59,9 @@ enum BinderStability {
   BINDER_STABILITY_VINTF  = 0b111111,
 };
 
-gboolean binder_init (const char             *device,
-                      const char             *iface,
-                      const char             *fqname,
-                      GBinderServiceManager **service_manager,
-                      GBinderRemoteObject   **remote,
-                      GBinderClient         **client);
-gboolean binder_status_is_ok (GBinderReader *reader);
-gboolean binder_reply_status_is_ok (GBinderRemoteReply *reply);
+gboolean binder_activate (const char *unit,
+                          const char *device,
+                          const char *fqname,
+                          guint       timeout_ms);
 
 G_END_DECLS
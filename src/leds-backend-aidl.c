@@ -52,31 +52,23 @@
 #include <gio/gio.h>
 #include <gbinder.h>
 
-#include "binder.h"
+#include <libdroid/binder-client.h>
+
 #include "leds-backend.h"
 #include "leds-backend-aidl.h"
 
 #define BINDER_LIGHT_DEFAULT_AIDL_DEVICE "/dev/binder"
 
-#define BINDER_LIGHT_AIDL_IFACE "android.hardware.light.ILights"
 #define BINDER_LIGHT_AIDL_SLOT "default"
 
-/* Methods */
-enum
-{
-  /* void setLightState(in int id, in android.hardware.light.HwLightState state); */
-  BINDER_LIGHT_AIDL_SET_LIGHT_STATE = 1,
-  /* android.hardware.light.HwLight[] getLights(); */
-  BINDER_LIGHT_AIDL_GET_LIGHTS = 2,
-};
-
 struct _DroidLedsBackendAidl
 {
   GObject parent_instance;
 
-  GBinderServiceManager *service_manager;
-  GBinderRemoteObject   *remote;
-  GBinderClient         *client;
+  DroidBinderClient *binder;
+
+  /* Whether to skip waiting for replies on state changes */
+  gboolean           oneway;
 };
 
 static void initable_interface_init (GInitableIface *iface);
@@ -92,35 +84,31 @@ droid_leds_backend_aidl_is_supported (DroidLedsBackend *backend,
                                       LightType         light_type)
 {
   DroidLedsBackendAidl *self = DROID_LEDS_BACKEND_AIDL (backend);
-  GBinderLocalRequest *req = gbinder_client_new_request (self->client);
+  GBinderLocalRequest *req;
   GBinderRemoteReply *reply;
-  GBinderReader reader;
-  int status;
-  int count = 0;
-  AidlHwLight *light;
-
-  reply = gbinder_client_transact_sync_reply (self->client,
-                                              BINDER_LIGHT_AIDL_GET_LIGHTS,
-                                              req, &status);
-  gbinder_local_request_unref (req);
-
-  gbinder_remote_reply_init_reader (reply, &reader);
-
-  if (status == GBINDER_STATUS_OK && binder_status_is_ok (&reader)) {
-    gbinder_reader_read_int32 (&reader, &count); /* led count */
-
-    for (int i=0; i < count; i++) {
-      light = (AidlHwLight *)gbinder_reader_read_parcelable (&reader, NULL);
-      if (light->type == light_type) {
-        g_debug ("droid LED usable for type %d", light_type);
-        return TRUE;
-      }
-    }
+  g_autofree AidlHwLight *lights = NULL;
+  gsize count = 0;
+  g_autoptr (GError) error = NULL;
+  gboolean result = FALSE;
+
+  req = droid_light_aidl_get_lights_request (droid_binder_client_get_client (self->binder));
+  reply = droid_binder_client_transact_sync (self->binder, DROID_LIGHT_AIDL_GET_LIGHTS, req,
+                                             &error);
+
+  if (reply && droid_light_aidl_read_get_lights_reply (reply, &lights, &count)) {
+    for (gsize i=0; i < count && !result; i++)
+      result = (lights[i].type == light_type);
+
+    if (result)
+      g_debug ("droid LED usable for type %d", light_type);
   } else {
-    g_warning ("Failed to get supported LED types");
+    g_warning ("Failed to get supported LED types: %s", error ? error->message : "bad reply");
   }
 
-  return FALSE;
+  if (reply)
+    gbinder_remote_reply_unref (reply);
+
+  return result;
 }
 
 static gboolean
@@ -133,37 +121,46 @@ droid_leds_backend_aidl_set (DroidLedsBackend *backend,
                              int32_t           flash_off_ms)
 {
   DroidLedsBackendAidl *self = DROID_LEDS_BACKEND_AIDL (backend);
-  GBinderLocalRequest *req = gbinder_client_new_request (self->client);
+  GBinderLocalRequest *req;
   GBinderRemoteReply *reply;
-  GBinderWriter writer;
-  LightState* led_state;
-  int32_t status;
+  LightState led_state = {
+    .color          = color,
+    .flashMode      = flash_type,
+    .flashOnMs      = flash_on_ms,
+    .flashOffMs     = flash_off_ms,
+    .brightnessMode = brightness_type,
+  };
+  gboolean result;
 
   g_debug ("set called");
 
-  gbinder_local_request_init_writer (req, &writer);
-  led_state = gbinder_writer_new0 (&writer, LightState);
-  led_state->color = color;
-  led_state->flashMode = flash_type;
-  led_state->flashOnMs = flash_on_ms;
-  led_state->flashOffMs = flash_off_ms;
-  led_state->brightnessMode = brightness_type;
-
-  gbinder_writer_append_int32 (&writer, light_type);
-  gbinder_writer_append_parcelable (&writer, led_state, sizeof(*led_state));
-  gbinder_writer_append_int32 (&writer, BINDER_STABILITY_VINTF); /* stability */
-
-  reply = gbinder_client_transact_sync_reply (self->client,
-                                              BINDER_LIGHT_AIDL_SET_LIGHT_STATE,
-                                              req, &status);
-  gbinder_local_request_unref (req);
-
-  if (status == GBINDER_STATUS_OK && binder_reply_status_is_ok (reply)) {
-    return TRUE;
-  } else {
+  req = droid_light_aidl_set_light_state_request (droid_binder_client_get_client (self->binder),
+                                                  light_type, &led_state);
+
+  if (self->oneway)
+    return droid_binder_client_transact_oneway (self->binder, DROID_LIGHT_AIDL_SET_LIGHT_STATE,
+                                                req, NULL);
+
+  reply = droid_binder_client_transact_sync (self->binder, DROID_LIGHT_AIDL_SET_LIGHT_STATE, req,
+                                             NULL);
+
+  result = (reply != NULL && droid_light_aidl_read_set_light_state_reply (reply));
+  if (!result)
     g_warning ("Unable to turn to set notification LED");
-    return FALSE;
-  }
+
+  if (reply)
+    gbinder_remote_reply_unref (reply);
+
+  return result;
+}
+
+static void
+droid_leds_backend_aidl_set_oneway (DroidLedsBackend *backend,
+                                    gboolean          oneway)
+{
+  DroidLedsBackendAidl *self = DROID_LEDS_BACKEND_AIDL (backend);
+
+  self->oneway = oneway;
 }
 
 static gboolean
@@ -172,18 +169,18 @@ initable_init (GInitable     *initable,
                GError       **error)
 {
   DroidLedsBackendAidl *self = DROID_LEDS_BACKEND_AIDL (initable);
-  gboolean success;
+  g_autoptr (GError) binder_error = NULL;
 
   g_debug ("Initializing droid leds aidl");
 
-  success = binder_init (BINDER_LIGHT_DEFAULT_AIDL_DEVICE,
-                         BINDER_LIGHT_AIDL_IFACE,
-                         (BINDER_LIGHT_AIDL_IFACE "/" BINDER_LIGHT_AIDL_SLOT),
-                         &self->service_manager,
-                         &self->remote,
-                         &self->client);
+  self->binder = droid_binder_client_new (BINDER_LIGHT_DEFAULT_AIDL_DEVICE,
+                                          DROID_LIGHT_AIDL_IFACE);
+
+  if (!droid_binder_client_connect (self->binder,
+                                    DROID_LIGHT_AIDL_IFACE "/" BINDER_LIGHT_AIDL_SLOT,
+                                    &binder_error)) {
+    g_warning ("%s", binder_error->message);
 
-  if (!success) {
     g_set_error (error,
                  G_IO_ERROR, G_IO_ERROR_FAILED,
                  "Failed to obtain suitable light hal");
@@ -193,18 +190,6 @@ initable_init (GInitable     *initable,
   return TRUE;
 }
 
-static void
-droid_leds_backend_aidl_constructed (GObject *obj)
-{
-  DroidLedsBackendAidl *self = DROID_LEDS_BACKEND_AIDL (obj);
-
-  G_OBJECT_CLASS (droid_leds_backend_aidl_parent_class)->constructed (obj);
-
-  self->service_manager = NULL;
-  self->remote = NULL;
-  self->client = NULL;
-}
-
 static void
 droid_leds_backend_aidl_dispose (GObject *obj)
 {
@@ -212,17 +197,7 @@ droid_leds_backend_aidl_dispose (GObject *obj)
 
   g_debug ("Disposing droid leds aidl");
 
-  if (self->client) {
-    gbinder_client_unref (self->client);
-  }
-
-  if (self->remote) {
-    gbinder_remote_object_unref (self->remote);
-  }
-
-  if (self->service_manager) {
-    gbinder_servicemanager_unref (self->service_manager);
-  }
+  g_clear_object (&self->binder);
 
   G_OBJECT_CLASS (droid_leds_backend_aidl_parent_class)->dispose (obj);
 }
@@ -232,8 +207,7 @@ droid_leds_backend_aidl_class_init (DroidLedsBackendAidlClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
-  object_class->constructed  = droid_leds_backend_aidl_constructed;
-  object_class->dispose      = droid_leds_backend_aidl_dispose;
+  object_class->dispose = droid_leds_backend_aidl_dispose;
 }
 
 static void
@@ -247,6 +221,7 @@ droid_leds_backend_interface_init (DroidLedsBackendInterface *iface)
 {
   iface->is_supported    = droid_leds_backend_aidl_is_supported;
   iface->set             = droid_leds_backend_aidl_set;
+  iface->set_oneway      = droid_leds_backend_aidl_set_oneway;
 }
 
 static void
@@ -52,17 +52,9 @@
 
 G_BEGIN_DECLS
 
-#define ALIGNED(x) __attribute__ ((aligned(x)))
-
 #define DROID_TYPE_LEDS_BACKEND_AIDL droid_leds_backend_aidl_get_type ()
 G_DECLARE_FINAL_TYPE (DroidLedsBackendAidl, droid_leds_backend_aidl, DROID, LEDS_BACKEND_AIDL, GObject)
 
-typedef struct aidl_hw_light {
-  int32_t id;
-  int32_t ordinal;
-  LightType type ALIGNED(4);
-} AidlHwLight;
-
 DroidLedsBackendAidl *droid_leds_backend_aidl_new (GError **error);
 
 G_END_DECLS
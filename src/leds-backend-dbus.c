@@ -0,0 +1,315 @@
+/* leds-backend-dbus.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Talks to libdroid-leds-broker instead of the HAL, so that the clients
+ * of a session share its single connection and capability probe.
+ */
+
+#define G_LOG_DOMAIN "droid-leds-backend-dbus"
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "leds-backend.h"
+#include "leds-backend-dbus.h"
+
+struct _DroidLedsBackendDbus
+{
+  GObject parent_instance;
+
+  GDBusProxy *proxy;
+
+  /* Whether to skip waiting for replies on state changes */
+  gboolean    oneway;
+};
+
+static void initable_interface_init (GInitableIface *iface);
+static void droid_leds_backend_interface_init (DroidLedsBackendInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (DroidLedsBackendDbus, droid_leds_backend_dbus, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, initable_interface_init)
+                         G_IMPLEMENT_INTERFACE (DROID_TYPE_LEDS_BACKEND,
+                                                droid_leds_backend_interface_init))
+
+/*
+ * Calls method, consuming parameters. State changes are sent without
+ * waiting for the reply in oneway mode, the others return it in reply.
+ */
+static gboolean
+droid_leds_backend_dbus_call (DroidLedsBackendDbus  *self,
+                              const gchar           *method,
+                              GVariant              *parameters,
+                              GVariant             **reply)
+{
+  g_autoptr (GError) error = NULL;
+  GVariant *result;
+
+  if (self->oneway && reply == NULL)
+    {
+      g_dbus_proxy_call (self->proxy, method, parameters, G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                         -1, NULL, NULL, NULL);
+      return TRUE;
+    }
+
+  result = g_dbus_proxy_call_sync (self->proxy, method, parameters,
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+  if (result == NULL)
+    {
+      g_debug ("%s failed: %s", method, error->message);
+      return FALSE;
+    }
+
+  if (reply != NULL)
+    *reply = result;
+  else
+    g_variant_unref (result);
+
+  return TRUE;
+}
+
+/* The broker probes the HAL once, for everyone */
+static gboolean
+droid_leds_backend_dbus_is_supported (DroidLedsBackend *backend,
+                                      LightType         light_type)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+  g_autoptr (GVariant) types = g_dbus_proxy_get_cached_property (self->proxy, "SupportedTypes");
+
+  if (types == NULL || !g_variant_is_of_type (types, G_VARIANT_TYPE_UINT32))
+    return FALSE;
+
+  return (g_variant_get_uint32 (types) & (1 << light_type)) != 0;
+}
+
+static gboolean
+droid_leds_backend_dbus_set_batch (DroidLedsBackend      *backend,
+                                   const LightBatchEntry *entries,
+                                   guint                  n_entries)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uuuiiu)"));
+  for (guint i=0; i < n_entries; i++)
+    g_variant_builder_add (&builder, "(uuuiiu)", entries[i].type, entries[i].state.color,
+      entries[i].state.flashMode, entries[i].state.flashOnMs, entries[i].state.flashOffMs,
+      entries[i].state.brightnessMode);
+
+  return droid_leds_backend_dbus_call (self, "SetLights",
+    g_variant_new ("(a(uuuiiu))", &builder), NULL);
+}
+
+static gboolean
+droid_leds_backend_dbus_set (DroidLedsBackend *backend,
+                             uint32_t           color,
+                             LightType         light_type,
+                             FlashType         flash_type,
+                             BrightnessType    brightness_type,
+                             int32_t           flash_on_ms,
+                             int32_t           flash_off_ms)
+{
+  LightBatchEntry entry = {
+    .type = light_type,
+    .state = {
+      .color          = color,
+      .flashMode      = flash_type,
+      .flashOnMs      = flash_on_ms,
+      .flashOffMs     = flash_off_ms,
+      .brightnessMode = brightness_type,
+    },
+  };
+
+  return droid_leds_backend_dbus_set_batch (backend, &entry, 1);
+}
+
+static gboolean
+droid_leds_backend_dbus_set_pattern (DroidLedsBackend    *backend,
+                                     LightType            light_type,
+                                     const LightKeyframe *keyframes,
+                                     guint                n_keyframes,
+                                     guint                repeat)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uuu)"));
+  for (guint i=0; i < n_keyframes; i++)
+    g_variant_builder_add (&builder, "(uuu)", keyframes[i].color, keyframes[i].durationMs,
+      keyframes[i].interpolation);
+
+  return droid_leds_backend_dbus_call (self, "SetPattern",
+    g_variant_new ("(ua(uuu)u)", light_type, &builder, repeat), NULL);
+}
+
+static gboolean
+droid_leds_backend_dbus_set_panel (DroidLedsBackend *backend,
+                                   guint             panel,
+                                   uint32_t          color)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+
+  return droid_leds_backend_dbus_call (self, "SetPanel", g_variant_new ("(uu)", panel, color),
+    NULL);
+}
+
+static gboolean
+droid_leds_backend_dbus_get_brightness (DroidLedsBackend *backend,
+                                        guint             panel,
+                                        guint            *brightness)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+  g_autoptr (GVariant) reply = NULL;
+
+  if (!droid_leds_backend_dbus_call (self, "GetBrightness", g_variant_new ("(u)", panel),
+                                     &reply))
+    return FALSE;
+
+  g_variant_get (reply, "(u)", brightness);
+
+  return TRUE;
+}
+
+static void
+droid_leds_backend_dbus_set_oneway (DroidLedsBackend *backend,
+                                    gboolean          oneway)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+
+  self->oneway = oneway;
+}
+
+static gboolean
+droid_leds_backend_dbus_set_priority (DroidLedsBackend *backend,
+                                      gint              priority)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (backend);
+  g_autoptr (GVariant) reply = NULL;
+
+  /* Asking for the reply waits for it in oneway mode too, to report errors */
+  return droid_leds_backend_dbus_call (self, "SetPriority", g_variant_new ("(i)", priority),
+    &reply);
+}
+
+static gboolean
+initable_init (GInitable     *initable,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (initable);
+  g_autofree gchar *owner = NULL;
+
+  g_debug ("Initializing droid leds dbus");
+
+  self->proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                               G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                                               NULL,
+                                               DROID_LEDS_BROKER_NAME,
+                                               DROID_LEDS_BROKER_PATH,
+                                               DROID_LEDS_BROKER_IFACE,
+                                               cancellable,
+                                               error);
+  if (self->proxy == NULL)
+    return FALSE;
+
+  owner = g_dbus_proxy_get_name_owner (self->proxy);
+  if (owner == NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "The LED broker is not running");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+droid_leds_backend_dbus_dispose (GObject *obj)
+{
+  DroidLedsBackendDbus *self = DROID_LEDS_BACKEND_DBUS (obj);
+
+  g_debug ("Disposing droid leds dbus");
+
+  g_clear_object (&self->proxy);
+
+  G_OBJECT_CLASS (droid_leds_backend_dbus_parent_class)->dispose (obj);
+}
+
+static void
+droid_leds_backend_dbus_class_init (DroidLedsBackendDbusClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = droid_leds_backend_dbus_dispose;
+}
+
+static void
+initable_interface_init (GInitableIface *iface)
+{
+  iface->init = initable_init;
+}
+
+static void
+droid_leds_backend_interface_init (DroidLedsBackendInterface *iface)
+{
+  iface->is_supported    = droid_leds_backend_dbus_is_supported;
+  iface->set             = droid_leds_backend_dbus_set;
+  iface->set_batch       = droid_leds_backend_dbus_set_batch;
+  iface->set_pattern     = droid_leds_backend_dbus_set_pattern;
+  iface->set_oneway      = droid_leds_backend_dbus_set_oneway;
+  iface->set_panel       = droid_leds_backend_dbus_set_panel;
+  iface->get_brightness  = droid_leds_backend_dbus_get_brightness;
+  iface->set_priority    = droid_leds_backend_dbus_set_priority;
+}
+
+static void
+droid_leds_backend_dbus_init (DroidLedsBackendDbus *self)
+{
+}
+
+DroidLedsBackendDbus *
+droid_leds_backend_dbus_new (GError **error)
+{
+  return DROID_LEDS_BACKEND_DBUS (
+    g_initable_new (DROID_TYPE_LEDS_BACKEND_DBUS,
+                    NULL,
+                    error,
+                    NULL));
+}
@@ -53,34 +53,31 @@
 #include <gio/gio.h>
 #include <gbinder.h>
 
-#include "binder.h"
+#include <libdroid/binder-client.h>
+
 #include "leds-backend.h"
 #include "leds-backend-hidl.h"
 
 #define BINDER_LIGHT_DEFAULT_HIDL_DEVICE "/dev/hwbinder"
 
-#define BINDER_LIGHT_HIDL_IFACE(v) "android.hardware.light@" v "::ILight"
 #define BINDER_LIGHT_HIDL_SLOT_DEFAULT "default"
 #define BINDER_LIGHT_HIDL_SLOT_LIBDROID "libdroid"
 
-#define BINDER_LIGHT_HIDL_2_0_IFACE BINDER_LIGHT_HIDL_IFACE("2.0")
-
-/* Methods */
-enum
-{
-  /* setLight(Type type, LightState state) generates (Status status); */
-  BINDER_LIGHT_HIDL_2_0_SET_LIGHT = 1,
-  /* getSupportedTypes() generates (vec<Type> types); */
-  BINDER_LIGHT_HIDL_2_0_GET_SUPPORTED_TYPES = 2,
-};
+/* libdroid-hal-lights can exit when idle, it's then started on demand */
+#define LIBDROID_HAL_LIGHTS_UNIT "libdroid-hal-lights.service"
+#define LIBDROID_HAL_ACTIVATION_TIMEOUT_MS 2000
 
 struct _DroidLedsBackendHidl
 {
   GObject parent_instance;
 
-  GBinderServiceManager *service_manager;
-  GBinderRemoteObject   *remote;
-  GBinderClient         *client;
+  DroidBinderClient *binder;
+
+  /* Whether the libdroid extensions might be available */
+  gboolean           extensions;
+
+  /* Whether to skip waiting for replies on state changes */
+  gboolean           oneway;
 };
 
 static void initable_interface_init (GInitableIface *iface);
@@ -96,34 +93,70 @@ droid_leds_backend_hidl_is_supported (DroidLedsBackend *backend,
                                       LightType         light_type)
 {
   DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
-  GBinderLocalRequest *req = gbinder_client_new_request (self->client);
+  GBinderClient *client = droid_binder_client_get_client (self->binder);
+  GBinderLocalRequest *req;
+  GBinderRemoteReply *reply;
+  g_autoptr (GError) error = NULL;
+  gboolean result = FALSE;
+  gsize count = 0;
+  const LightType *types;
+
+  req = droid_light_hidl_get_supported_types_request (client);
+  reply = droid_binder_client_transact_sync (self->binder, DROID_LIGHT_HIDL_GET_SUPPORTED_TYPES,
+                                             req, &error);
+
+  if (reply && droid_light_hidl_read_get_supported_types_reply (reply, &types, &count)) {
+    for (gsize i = 0; i < count && !result; i++)
+      result = (types[i] == light_type);
+
+    if (result)
+      g_debug ("Type %d usable", light_type);
+    else
+      g_debug ("No suitable Light for type %d found", light_type);
+  } else {
+    g_warning ("Failed to get supported LED types: %s", error ? error->message : "bad reply");
+  }
+
+  if (reply)
+    gbinder_remote_reply_unref (reply);
+
+  return result;
+}
+
+/*
+ * Fails with G_IO_ERROR_NOT_SUPPORTED if the service doesn't know the
+ * method: older libdroid-hal-lights reply without a status.
+ */
+static gboolean
+droid_leds_backend_hidl_transact (DroidLedsBackendHidl  *self,
+                                  guint32                code,
+                                  GBinderLocalRequest   *req,
+                                  GError               **error)
+{
   GBinderRemoteReply *reply;
   GBinderReader reader;
-  int status;
-  gsize count = 0, vecSize = 0;
-  const int32_t *types;
+  gint32 status;
+  gboolean result = FALSE;
 
-  reply = gbinder_client_transact_sync_reply (self->client,
-                                              BINDER_LIGHT_HIDL_2_0_GET_SUPPORTED_TYPES,
-                                              req, &status);
-  gbinder_local_request_unref (req);
+  if (self->oneway)
+    return droid_binder_client_transact_oneway (self->binder, code, req, error);
 
+  reply = droid_binder_client_transact_sync (self->binder, code, req, error);
+  if (reply == NULL)
+    return FALSE;
+
+  /* All of the methods sent this way only reply with a status */
   gbinder_remote_reply_init_reader (reply, &reader);
+  if (!gbinder_reader_read_int32 (&reader, &status))
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Method %u unknown", code);
+  else if (status != 0)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Method %u failed: %d", code, status);
+  else
+    result = TRUE;
 
-  if (status == GBINDER_STATUS_OK && binder_status_is_ok (&reader)) {
-    types = gbinder_reader_read_hidl_vec(&reader, &count, &vecSize);
-    for (int i = 0; i < count; i++) {
-        if (types[i] == light_type) {
-            g_debug ("Type %d usable", light_type);
-            return TRUE;
-        }
-    }
-    g_warning ("No suitable Light for type %d found", light_type);
-  } else {
-    g_warning ("Failed to get supported LED types");
-  }
+  gbinder_remote_reply_unref (reply);
 
-  return FALSE;
+  return result;
 }
 
 static gboolean
@@ -136,30 +169,17 @@ droid_leds_backend_hidl_set (DroidLedsBackend *backend,
                              int32_t           flash_off_ms)
 {
   DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
-  GBinderLocalRequest *req = gbinder_client_new_request (self->client);
-  GBinderRemoteReply *reply;
-  GBinderWriter writer;
-  LightState* notification_state;
-  int32_t status;
-
-  gbinder_local_request_init_writer (req, &writer);
-  notification_state = gbinder_writer_new0 (&writer, LightState);
-  notification_state->color = color;
-  notification_state->flashMode = flash_type;
-  notification_state->flashOnMs = flash_on_ms;
-  notification_state->flashOffMs = flash_off_ms;
-  notification_state->brightnessMode = brightness_type;
-
-  gbinder_writer_append_int32 (&writer, light_type);
-  gbinder_writer_append_buffer_object (&writer, notification_state,
-    sizeof(*notification_state));
-
-  reply = gbinder_client_transact_sync_reply (self->client,
-                                              BINDER_LIGHT_HIDL_2_0_SET_LIGHT,
-                                              req, &status);
-  gbinder_local_request_unref (req);
-
-  if (status == GBINDER_STATUS_OK && binder_reply_status_is_ok (reply)) {
+  LightState notification_state = {
+    .color          = color,
+    .flashMode      = flash_type,
+    .flashOnMs      = flash_on_ms,
+    .flashOffMs     = flash_off_ms,
+    .brightnessMode = brightness_type,
+  };
+  GBinderLocalRequest *req = droid_light_hidl_set_light_request (
+    droid_binder_client_get_client (self->binder), light_type, &notification_state);
+
+  if (droid_leds_backend_hidl_transact (self, DROID_LIGHT_HIDL_SET_LIGHT, req, NULL)) {
     return TRUE;
   } else {
     g_warning ("Unable to turn to set notification LED");
@@ -169,53 +189,191 @@ droid_leds_backend_hidl_set (DroidLedsBackend *backend,
 
 
 static gboolean
-initable_init (GInitable     *initable,
-               GCancellable  *cancellable,
-               GError       **error)
+droid_leds_backend_hidl_set_batch (DroidLedsBackend      *backend,
+                                   const LightBatchEntry *entries,
+                                   guint                  n_entries)
 {
-  static const gchar *slots[] = {
-    BINDER_LIGHT_HIDL_2_0_IFACE "/" BINDER_LIGHT_HIDL_SLOT_LIBDROID,
-    BINDER_LIGHT_HIDL_2_0_IFACE "/" BINDER_LIGHT_HIDL_SLOT_DEFAULT,
-  };
-  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (initable);
-  gboolean success;
-
-  g_debug ("Initializing droid leds hidl");
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
+  GBinderLocalRequest *req;
+  g_autoptr (GError) error = NULL;
+  gboolean result = TRUE;
 
-  for (int i=0; i < 2; i++)
+  if (self->extensions)
     {
-      success = binder_init (BINDER_LIGHT_DEFAULT_HIDL_DEVICE,
-                             BINDER_LIGHT_HIDL_2_0_IFACE,
-                             slots[i],
-                             &self->service_manager,
-                             &self->remote,
-                             &self->client);
-
-      if (success)
-        break;
+      req = droid_light_hidl_set_lights_request (droid_binder_client_get_client (self->binder),
+        entries, n_entries);
+
+      if (droid_leds_backend_hidl_transact (self, DROID_LIGHT_HIDL_SET_LIGHTS, req, &error))
+        return TRUE;
+
+      /* Other errors, such as going over the rate limit, are transient */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_debug ("Batched requests not supported, falling back to setLight");
+          self->extensions = FALSE;
+        }
+      else
+        {
+          g_debug ("Batched request failed, falling back to setLight: %s", error->message);
+        }
     }
 
-  if (!success) {
-    g_set_error (error,
-                 G_IO_ERROR, G_IO_ERROR_FAILED,
-                 "Failed to obtain suitable light hal");
+  for (guint i=0; i < n_entries; i++)
+    result &= droid_leds_backend_hidl_set (backend, entries[i].state.color, entries[i].type,
+      entries[i].state.flashMode, entries[i].state.brightnessMode,
+      entries[i].state.flashOnMs, entries[i].state.flashOffMs);
+
+  return result;
+}
+
+
+static gboolean
+droid_leds_backend_hidl_set_pattern (DroidLedsBackend    *backend,
+                                     LightType            light_type,
+                                     const LightKeyframe *keyframes,
+                                     guint                n_keyframes,
+                                     guint                repeat)
+{
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
+  GBinderLocalRequest *req;
+  gboolean result;
+
+  if (!self->extensions)
     return FALSE;
-  }
+
+  req = droid_light_hidl_set_pattern_request (droid_binder_client_get_client (self->binder),
+    light_type, keyframes, n_keyframes, repeat);
+
+  result = droid_leds_backend_hidl_transact (self, DROID_LIGHT_HIDL_SET_PATTERN, req, NULL);
+  if (!result)
+    g_warning ("Unable to upload LED pattern");
+
+  return result;
+}
+
+
+static gboolean
+droid_leds_backend_hidl_set_panel (DroidLedsBackend *backend,
+                                   guint             panel,
+                                   uint32_t          color)
+{
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
+  LightState state = {
+    .color          = color,
+    .flashMode      = FLASH_TYPE_NONE,
+    .brightnessMode = BRIGHTNESS_MODE_USER,
+  };
+
+  if (!self->extensions)
+    return FALSE;
+
+  return droid_leds_backend_hidl_transact (self, DROID_LIGHT_HIDL_SET_PANEL,
+    droid_light_hidl_set_panel_request (droid_binder_client_get_client (self->binder), panel,
+      &state), NULL);
+}
+
+
+static gboolean
+droid_leds_backend_hidl_get_brightness (DroidLedsBackend *backend,
+                                        guint             panel,
+                                        guint            *brightness)
+{
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
+  GBinderLocalRequest *req;
+  GBinderRemoteReply *reply;
+  gint32 value = -1;
+
+  if (!self->extensions)
+    return FALSE;
+
+  req = droid_light_hidl_get_brightness_request (droid_binder_client_get_client (self->binder),
+    panel);
+
+  /* Never oneway, the reply is the whole point */
+  reply = droid_binder_client_transact_sync (self->binder, DROID_LIGHT_HIDL_GET_BRIGHTNESS, req,
+    NULL);
+
+  if (reply == NULL)
+    return FALSE;
+
+  if (!droid_light_hidl_read_get_brightness_reply (reply, &value))
+    value = -1;
+
+  gbinder_remote_reply_unref (reply);
+
+  if (value < 0)
+    return FALSE;
+
+  *brightness = value;
 
   return TRUE;
 }
 
 
 static void
-droid_leds_backend_hidl_constructed (GObject *obj)
+droid_leds_backend_hidl_set_oneway (DroidLedsBackend *backend,
+                                    gboolean          oneway)
 {
-  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (obj);
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (backend);
+
+  self->oneway = oneway;
+}
 
-  G_OBJECT_CLASS (droid_leds_backend_hidl_parent_class)->constructed (obj);
 
-  self->service_manager = NULL;
-  self->remote = NULL;
-  self->client = NULL;
+/*
+ * Looks for our HAL first, starting it if it's not running, then for
+ * the stock one.
+ */
+static gboolean
+droid_leds_backend_hidl_connect (DroidLedsBackendHidl *self)
+{
+  g_autoptr (GError) error = NULL;
+
+  self->binder = droid_binder_client_new (BINDER_LIGHT_DEFAULT_HIDL_DEVICE,
+                                          DROID_LIGHT_HIDL_IFACE);
+
+  droid_binder_client_set_activation (self->binder, LIBDROID_HAL_LIGHTS_UNIT,
+                                      LIBDROID_HAL_ACTIVATION_TIMEOUT_MS);
+  if (droid_binder_client_connect (self->binder,
+                                   DROID_LIGHT_HIDL_IFACE "/" BINDER_LIGHT_HIDL_SLOT_LIBDROID,
+                                   &error))
+    {
+      self->extensions = TRUE;
+      return TRUE;
+    }
+
+  g_debug ("%s", error->message);
+  g_clear_error (&error);
+
+  droid_binder_client_set_activation (self->binder, NULL, 0);
+  if (droid_binder_client_connect (self->binder,
+                                   DROID_LIGHT_HIDL_IFACE "/" BINDER_LIGHT_HIDL_SLOT_DEFAULT,
+                                   &error))
+    return TRUE;
+
+  g_warning ("%s", error->message);
+
+  return FALSE;
+}
+
+
+static gboolean
+initable_init (GInitable     *initable,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  DroidLedsBackendHidl *self = DROID_LEDS_BACKEND_HIDL (initable);
+
+  g_debug ("Initializing droid leds hidl");
+
+  if (!droid_leds_backend_hidl_connect (self)) {
+    g_set_error (error,
+                 G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to obtain suitable light hal");
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
 
@@ -226,17 +384,7 @@ droid_leds_backend_hidl_dispose (GObject *obj)
 
   g_debug ("Disposing droid leds hidl");
 
-  if (self->client) {
-    gbinder_client_unref (self->client);
-  }
-
-  if (self->remote) {
-    gbinder_remote_object_unref (self->remote);
-  }
-
-  if (self->service_manager) {
-    gbinder_servicemanager_unref (self->service_manager);
-  }
+  g_clear_object (&self->binder);
 
   G_OBJECT_CLASS (droid_leds_backend_hidl_parent_class)->dispose (obj);
 }
@@ -247,8 +395,7 @@ droid_leds_backend_hidl_class_init (DroidLedsBackendHidlClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
-  object_class->constructed  = droid_leds_backend_hidl_constructed;
-  object_class->dispose      = droid_leds_backend_hidl_dispose;
+  object_class->dispose = droid_leds_backend_hidl_dispose;
 }
 
 
@@ -264,6 +411,11 @@ droid_leds_backend_interface_init (DroidLedsBackendInterface *iface)
 {
   iface->is_supported    = droid_leds_backend_hidl_is_supported;
   iface->set             = droid_leds_backend_hidl_set;
+  iface->set_batch       = droid_leds_backend_hidl_set_batch;
+  iface->set_pattern     = droid_leds_backend_hidl_set_pattern;
+  iface->set_oneway      = droid_leds_backend_hidl_set_oneway;
+  iface->set_panel       = droid_leds_backend_hidl_set_panel;
+  iface->get_brightness  = droid_leds_backend_hidl_get_brightness;
 }
 
 
@@ -90,3 +90,132 @@ droid_leds_backend_set (DroidLedsBackend *self,
     flash_on_ms, flash_off_ms);
 }
 
+
+gboolean
+droid_leds_backend_set_batch (DroidLedsBackend      *self,
+                              const LightBatchEntry *entries,
+                              guint                  n_entries)
+{
+  DroidLedsBackendInterface *iface;
+  gboolean result = TRUE;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->set_batch != NULL)
+    return iface->set_batch (self, entries, n_entries);
+
+  /* Fallback to a request per light */
+  for (guint i=0; i < n_entries; i++)
+    result &= droid_leds_backend_set (self, entries[i].state.color, entries[i].type,
+      entries[i].state.flashMode, entries[i].state.brightnessMode,
+      entries[i].state.flashOnMs, entries[i].state.flashOffMs);
+
+  return result;
+}
+
+
+
+gboolean
+droid_leds_backend_set_pattern (DroidLedsBackend    *self,
+                                LightType            light_type,
+                                const LightKeyframe *keyframes,
+                                guint                n_keyframes,
+                                guint                repeat)
+{
+  DroidLedsBackendInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->set_pattern == NULL)
+    return FALSE;
+
+  return iface->set_pattern (self, light_type, keyframes, n_keyframes, repeat);
+}
+
+
+/*
+ * Makes the backend send state changes without waiting for the HAL to
+ * reply, so they can no longer fail.
+ */
+gboolean
+droid_leds_backend_set_oneway (DroidLedsBackend *self,
+                               gboolean          oneway)
+{
+  DroidLedsBackendInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->set_oneway == NULL)
+    return FALSE;
+
+  iface->set_oneway (self, oneway);
+
+  return TRUE;
+}
+
+
+/*
+ * Sets the backlight of a single panel, when the HAL drives more than
+ * one. Returns FALSE if the backend can't address panels.
+ */
+gboolean
+droid_leds_backend_set_panel (DroidLedsBackend *self,
+                              guint             panel,
+                              uint32_t          color)
+{
+  DroidLedsBackendInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->set_panel == NULL)
+    return FALSE;
+
+  return iface->set_panel (self, panel, color);
+}
+
+
+/*
+ * Reads back the brightness a backlight panel is actually at, as a
+ * 0-255 value. Returns FALSE if the backend can't tell.
+ */
+gboolean
+droid_leds_backend_get_brightness (DroidLedsBackend *self,
+                                   guint             panel,
+                                   guint            *brightness)
+{
+  DroidLedsBackendInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->get_brightness == NULL)
+    return FALSE;
+
+  return iface->get_brightness (self, panel, brightness);
+}
+
+
+/*
+ * Sets the priority of the notification light requests made through
+ * this backend, against those of other clients. Returns FALSE if the
+ * backend is the only client of the HAL, and there's nothing to
+ * arbitrate, or if the priority couldn't be set.
+ */
+gboolean
+droid_leds_backend_set_priority (DroidLedsBackend *self,
+                                 gint              priority)
+{
+  DroidLedsBackendInterface *iface;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BACKEND (self), FALSE);
+
+  iface = DROID_LEDS_BACKEND_GET_IFACE (self);
+  if (iface->set_priority == NULL)
+    return FALSE;
+
+  return iface->set_priority (self, priority);
+}
@@ -68,6 +68,24 @@ struct _DroidLedsBackendInterface
                             BrightnessType    brightness_type,
                             int32_t           flash_on_ms,
                             int32_t           flash_off_ms);
+  gboolean (*set_batch)    (DroidLedsBackend      *self,
+                            const LightBatchEntry *entries,
+                            guint                  n_entries);
+  gboolean (*set_pattern)  (DroidLedsBackend      *self,
+                            LightType              light_type,
+                            const LightKeyframe   *keyframes,
+                            guint                  n_keyframes,
+                            guint                  repeat);
+  void     (*set_oneway)   (DroidLedsBackend      *self,
+                            gboolean               oneway);
+  gboolean (*set_panel)    (DroidLedsBackend      *self,
+                            guint                  panel,
+                            uint32_t               color);
+  gboolean (*get_brightness) (DroidLedsBackend    *self,
+                              guint                panel,
+                              guint               *brightness);
+  gboolean (*set_priority) (DroidLedsBackend      *self,
+                            gint                   priority);
 };
 
 gboolean droid_leds_backend_is_supported (DroidLedsBackend *self,
@@ -79,6 +97,24 @@ gboolean droid_leds_backend_set          (DroidLedsBackend *self,
                                           BrightnessType    brightness_type,
                                           int32_t           flash_on_ms,
                                           int32_t           flash_off_ms);
+gboolean droid_leds_backend_set_batch    (DroidLedsBackend      *self,
+                                          const LightBatchEntry *entries,
+                                          guint                  n_entries);
+gboolean droid_leds_backend_set_pattern  (DroidLedsBackend      *self,
+                                          LightType              light_type,
+                                          const LightKeyframe   *keyframes,
+                                          guint                  n_keyframes,
+                                          guint                  repeat);
+gboolean droid_leds_backend_set_oneway   (DroidLedsBackend      *self,
+                                          gboolean               oneway);
+gboolean droid_leds_backend_set_panel    (DroidLedsBackend      *self,
+                                          guint                  panel,
+                                          uint32_t               color);
+gboolean droid_leds_backend_get_brightness (DroidLedsBackend    *self,
+                                            guint                panel,
+                                            guint               *brightness);
+gboolean droid_leds_backend_set_priority (DroidLedsBackend      *self,
+                                          gint                   priority);
 
 G_END_DECLS
 
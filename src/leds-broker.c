@@ -0,0 +1,682 @@
+/* leds-broker.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Session LED broker: owns the only DroidLeds of the session and sets
+ * the lights on behalf of its clients, see DROID_LEDS_FLAGS_BROKER.
+ *
+ * The notification light is arbitrated: the client with the highest
+ * priority is shown, the most recent one on ties, and a client's
+ * notification goes away with it. The other lights are last writer
+ * wins. Requests are coalesced and applied once per main loop
+ * iteration, and they are replied to once applied.
+ */
+
+#define G_LOG_DOMAIN "droid-leds-broker"
+
+#include <stdlib.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <libdroid/leds.h>
+
+#include "leds-backend-dbus.h"
+#include "leds-private.h"
+#include "leds-state.h"
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='" DROID_LEDS_BROKER_IFACE "'>"
+  "    <method name='SetLights'>"
+  "      <arg direction='in' type='a(uuuiiu)' name='lights'/>"
+  "    </method>"
+  "    <method name='SetPattern'>"
+  "      <arg direction='in' type='u' name='type'/>"
+  "      <arg direction='in' type='a(uuu)' name='keyframes'/>"
+  "      <arg direction='in' type='u' name='repeat'/>"
+  "    </method>"
+  "    <method name='SetPanel'>"
+  "      <arg direction='in' type='u' name='panel'/>"
+  "      <arg direction='in' type='u' name='color'/>"
+  "    </method>"
+  "    <method name='GetBrightness'>"
+  "      <arg direction='in' type='u' name='panel'/>"
+  "      <arg direction='out' type='u' name='brightness'/>"
+  "    </method>"
+  "    <method name='SetPriority'>"
+  "      <arg direction='in' type='i' name='priority'/>"
+  "    </method>"
+  "    <property name='SupportedTypes' type='u' access='read'/>"
+  "    <property name='Backlight' type='u' access='read'/>"
+  "    <property name='NotificationColor' type='u' access='read'/>"
+  "    <property name='NotificationPattern' type='b' access='read'/>"
+  "    <property name='NotificationOwner' type='s' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+typedef struct
+{
+  gchar         *sender;
+  guint          watch_id;
+  gint           priority;
+
+  /* Serial of the last notification change, to break priority ties */
+  guint64        serial;
+  gboolean       notification;
+  LightState     state;
+  LightKeyframe *keyframes;
+  guint          n_keyframes;
+  guint          repeat;
+} DroidLedsBrokerClient;
+
+typedef struct
+{
+  GMainLoop           *loop;
+  GDBusConnection     *connection;
+  GDBusNodeInfo       *introspection;
+  guint                registration_id;
+
+  DroidLeds           *leds;
+  DroidLedsBackend    *backend;
+  DroidLedsStateBlock *state;
+  guint                supported_types;
+
+  /* Sender -> DroidLedsBrokerClient */
+  GHashTable          *clients;
+  guint64              serial;
+
+  /* Requested and not yet applied */
+  LightState           lights[LIGHT_TYPE_COUNT];
+  guint                dirty_types;
+  uint32_t             panels[LIBDROID_LIGHT_MAX_PANELS];
+  guint                dirty_panels;
+  gboolean             notification_dirty;
+
+  /* Waiting for the next apply to be replied to */
+  GPtrArray           *invocations;
+  guint                apply_id;
+
+  /* What has been applied, as exposed by the properties */
+  uint32_t             backlight;
+  uint32_t             notification_color;
+  gboolean             notification_pattern;
+  gchar               *notification_owner;
+} DroidLedsBroker;
+
+static void
+droid_leds_broker_client_free (DroidLedsBrokerClient *client)
+{
+  if (client->watch_id > 0)
+    g_bus_unwatch_name (client->watch_id);
+
+  g_free (client->keyframes);
+  g_free (client->sender);
+  g_free (client);
+}
+
+/* The notification of the client with the highest priority, NULL if none */
+static DroidLedsBrokerClient *
+droid_leds_broker_pick_notification (DroidLedsBroker *broker)
+{
+  DroidLedsBrokerClient *best = NULL;
+  DroidLedsBrokerClient *client;
+  GHashTableIter iter;
+
+  g_hash_table_iter_init (&iter, broker->clients);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client))
+    {
+      if (!client->notification)
+        continue;
+
+      if (best == NULL || client->priority > best->priority ||
+          (client->priority == best->priority && client->serial > best->serial))
+        best = client;
+    }
+
+  return best;
+}
+
+static void
+droid_leds_broker_emit_changed (DroidLedsBroker *broker,
+                                GVariantBuilder *changed)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (!g_dbus_connection_emit_signal (broker->connection,
+                                      NULL,
+                                      DROID_LEDS_BROKER_PATH,
+                                      "org.freedesktop.DBus.Properties",
+                                      "PropertiesChanged",
+                                      g_variant_new ("(sa{sv}as)",
+                                                     DROID_LEDS_BROKER_IFACE,
+                                                     changed,
+                                                     NULL),
+                                      &error))
+    g_debug ("Unable to emit PropertiesChanged: %s", error->message);
+}
+
+/* Applies the notification that won, returns whether it changed */
+static gboolean
+droid_leds_broker_apply_notification (DroidLedsBroker *broker,
+                                      LightBatchEntry *entries,
+                                      guint           *n_entries,
+                                      GVariantBuilder *changed)
+{
+  DroidLedsBrokerClient *client = droid_leds_broker_pick_notification (broker);
+  LightState off = { .flashMode = FLASH_TYPE_NONE, .brightnessMode = BRIGHTNESS_MODE_USER };
+  const LightState *state = (client != NULL) ? &client->state : &off;
+  gboolean pattern = (client != NULL && client->keyframes != NULL);
+  const gchar *owner = (client != NULL) ? client->sender : "";
+
+  if (pattern)
+    {
+      if (!droid_leds_backend_set_pattern (broker->backend, LIGHT_TYPE_NOTIFICATIONS,
+            client->keyframes, client->n_keyframes, client->repeat))
+        return FALSE;
+    }
+  else
+    {
+      entries[*n_entries].type  = LIGHT_TYPE_NOTIFICATIONS;
+      entries[*n_entries].state = *state;
+      (*n_entries)++;
+    }
+
+  if (broker->state != NULL)
+    droid_leds_state_block_publish (broker->state, LIGHT_TYPE_NOTIFICATIONS,
+      state, 0, pattern);
+
+  if (broker->notification_color != (uint32_t) state->color)
+    {
+      broker->notification_color = state->color;
+      g_variant_builder_add (changed, "{sv}", "NotificationColor",
+        g_variant_new_uint32 (broker->notification_color));
+    }
+
+  if (broker->notification_pattern != pattern)
+    {
+      broker->notification_pattern = pattern;
+      g_variant_builder_add (changed, "{sv}", "NotificationPattern",
+        g_variant_new_boolean (pattern));
+    }
+
+  if (g_strcmp0 (broker->notification_owner, owner) != 0)
+    {
+      g_free (broker->notification_owner);
+      broker->notification_owner = g_strdup (owner);
+      g_variant_builder_add (changed, "{sv}", "NotificationOwner",
+        g_variant_new_string (owner));
+    }
+
+  return TRUE;
+}
+
+/*
+ * Applies what has been requested since the last time in one batch,
+ * then the panels, and replies to the requests.
+ */
+static gboolean
+droid_leds_broker_apply (gpointer user_data)
+{
+  DroidLedsBroker *broker = user_data;
+  LightBatchEntry entries[LIGHT_TYPE_COUNT];
+  guint n_entries = 0;
+  gboolean ok = TRUE;
+  GVariantBuilder changed;
+
+  broker->apply_id = 0;
+
+  g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+
+  for (guint type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      if (!(broker->dirty_types & (1 << type)) || type == LIGHT_TYPE_NOTIFICATIONS)
+        continue;
+
+      entries[n_entries].type  = type;
+      entries[n_entries].state = broker->lights[type];
+      n_entries++;
+    }
+
+  if (broker->notification_dirty &&
+      !droid_leds_broker_apply_notification (broker, entries, &n_entries, &changed))
+    ok = FALSE;
+
+  if (n_entries > 0 && !droid_leds_backend_set_batch (broker->backend, entries, n_entries))
+    ok = FALSE;
+
+  for (guint panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      if ((broker->dirty_panels & (1 << panel)) &&
+          !droid_leds_backend_set_panel (broker->backend, panel, broker->panels[panel]))
+        ok = FALSE;
+    }
+
+  if ((broker->dirty_types & (1 << LIGHT_TYPE_BACKLIGHT)) &&
+      broker->backlight != (uint32_t) broker->lights[LIGHT_TYPE_BACKLIGHT].color)
+    {
+      broker->backlight = broker->lights[LIGHT_TYPE_BACKLIGHT].color;
+      g_variant_builder_add (&changed, "{sv}", "Backlight",
+        g_variant_new_uint32 (broker->backlight));
+    }
+
+  broker->dirty_types = 0;
+  broker->dirty_panels = 0;
+  broker->notification_dirty = FALSE;
+
+  for (guint i=0; i < broker->invocations->len; i++)
+    {
+      GDBusMethodInvocation *invocation = g_ptr_array_index (broker->invocations, i);
+
+      if (ok)
+        g_dbus_method_invocation_return_value (invocation, NULL);
+      else
+        g_dbus_method_invocation_return_error (invocation,
+          G_IO_ERROR, G_IO_ERROR_FAILED, "Unable to set the lights");
+    }
+  g_ptr_array_set_size (broker->invocations, 0);
+
+  droid_leds_broker_emit_changed (broker, &changed);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Replies to invocation once the pending changes have been applied */
+static void
+droid_leds_broker_schedule (DroidLedsBroker       *broker,
+                            GDBusMethodInvocation *invocation)
+{
+  g_ptr_array_add (broker->invocations, invocation);
+
+  if (broker->apply_id == 0)
+    broker->apply_id = g_idle_add (droid_leds_broker_apply, broker);
+}
+
+static void
+droid_leds_broker_client_vanished (GDBusConnection *connection,
+                                   const gchar     *name,
+                                   gpointer         user_data)
+{
+  DroidLedsBroker *broker = user_data;
+  DroidLedsBrokerClient *client = g_hash_table_lookup (broker->clients, name);
+
+  if (client == NULL)
+    return;
+
+  g_debug ("Client %s went away", name);
+
+  if (client->notification)
+    {
+      broker->notification_dirty = TRUE;
+      if (broker->apply_id == 0)
+        broker->apply_id = g_idle_add (droid_leds_broker_apply, broker);
+    }
+
+  g_hash_table_remove (broker->clients, name);
+}
+
+static DroidLedsBrokerClient *
+droid_leds_broker_get_client (DroidLedsBroker *broker,
+                              const gchar     *sender)
+{
+  DroidLedsBrokerClient *client = g_hash_table_lookup (broker->clients, sender);
+
+  if (client != NULL)
+    return client;
+
+  client = g_new0 (DroidLedsBrokerClient, 1);
+  client->sender = g_strdup (sender);
+  g_hash_table_insert (broker->clients, client->sender, client);
+
+  /* Calls back right away if it is already gone */
+  client->watch_id = g_bus_watch_name_on_connection (broker->connection, sender,
+    G_BUS_NAME_WATCHER_FLAGS_NONE, NULL, droid_leds_broker_client_vanished, broker, NULL);
+
+  return client;
+}
+
+static void
+droid_leds_broker_set_notification (DroidLedsBroker  *broker,
+                                    const gchar      *sender,
+                                    const LightState *state)
+{
+  DroidLedsBrokerClient *client = droid_leds_broker_get_client (broker, sender);
+
+  g_clear_pointer (&client->keyframes, g_free);
+  client->notification = (state->color != 0);
+  client->state = *state;
+  client->serial = ++broker->serial;
+
+  broker->notification_dirty = TRUE;
+}
+
+static void
+droid_leds_broker_set_lights (DroidLedsBroker       *broker,
+                              GDBusMethodInvocation *invocation,
+                              GVariant              *parameters)
+{
+  g_autoptr (GVariant) lights = g_variant_get_child_value (parameters, 0);
+  gsize n_lights = g_variant_n_children (lights);
+  guint type, color, flash_mode, brightness_mode;
+  gint flash_on_ms, flash_off_ms;
+
+  /* All or nothing */
+  for (gsize i=0; i < n_lights; i++)
+    {
+      g_variant_get_child (lights, i, "(uuuiiu)", &type, NULL, NULL, NULL, NULL, NULL);
+      if (type >= LIGHT_TYPE_COUNT)
+        {
+          g_dbus_method_invocation_return_error (invocation,
+            G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unknown light type %u", type);
+          return;
+        }
+    }
+
+  for (gsize i=0; i < n_lights; i++)
+    {
+      LightState state = { 0, };
+
+      g_variant_get_child (lights, i, "(uuuiiu)", &type, &color, &flash_mode,
+                           &flash_on_ms, &flash_off_ms, &brightness_mode);
+
+      state.color          = color;
+      state.flashMode      = flash_mode;
+      state.flashOnMs      = flash_on_ms;
+      state.flashOffMs     = flash_off_ms;
+      state.brightnessMode = brightness_mode;
+
+      if (type == LIGHT_TYPE_NOTIFICATIONS)
+        {
+          droid_leds_broker_set_notification (broker,
+            g_dbus_method_invocation_get_sender (invocation), &state);
+        }
+      else
+        {
+          broker->lights[type] = state;
+          broker->dirty_types |= 1 << type;
+        }
+    }
+
+  droid_leds_broker_schedule (broker, invocation);
+}
+
+static void
+droid_leds_broker_set_pattern (DroidLedsBroker       *broker,
+                               GDBusMethodInvocation *invocation,
+                               GVariant              *parameters)
+{
+  g_autoptr (GVariant) keyframes = NULL;
+  DroidLedsBrokerClient *client;
+  guint type, repeat;
+  gsize n_keyframes;
+
+  g_variant_get (parameters, "(u@a(uuu)u)", &type, &keyframes, &repeat);
+
+  /* Only notifications can be shared sensibly */
+  if (type != LIGHT_TYPE_NOTIFICATIONS)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+        G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Patterns are only supported on notifications");
+      return;
+    }
+
+  n_keyframes = g_variant_n_children (keyframes);
+  if (n_keyframes == 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+        G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No keyframes");
+      return;
+    }
+
+  client = droid_leds_broker_get_client (broker, g_dbus_method_invocation_get_sender (invocation));
+
+  g_free (client->keyframes);
+  client->keyframes = g_new0 (LightKeyframe, n_keyframes);
+  client->n_keyframes = n_keyframes;
+  client->repeat = repeat;
+
+  for (gsize i=0; i < n_keyframes; i++)
+    {
+      guint color, duration_ms, interpolation;
+
+      g_variant_get_child (keyframes, i, "(uuu)", &color, &duration_ms, &interpolation);
+      client->keyframes[i].color         = color;
+      client->keyframes[i].durationMs    = duration_ms;
+      client->keyframes[i].interpolation = interpolation;
+    }
+
+  /* Published as the pattern's first color */
+  client->notification = TRUE;
+  client->state = (LightState) { .color = client->keyframes[0].color };
+  client->serial = ++broker->serial;
+
+  broker->notification_dirty = TRUE;
+  droid_leds_broker_schedule (broker, invocation);
+}
+
+static void
+droid_leds_broker_method_call (GDBusConnection       *connection,
+                               const gchar           *sender,
+                               const gchar           *object_path,
+                               const gchar           *interface_name,
+                               const gchar           *method_name,
+                               GVariant              *parameters,
+                               GDBusMethodInvocation *invocation,
+                               gpointer               user_data)
+{
+  DroidLedsBroker *broker = user_data;
+
+  if (g_strcmp0 (method_name, "SetLights") == 0)
+    {
+      droid_leds_broker_set_lights (broker, invocation, parameters);
+    }
+  else if (g_strcmp0 (method_name, "SetPattern") == 0)
+    {
+      droid_leds_broker_set_pattern (broker, invocation, parameters);
+    }
+  else if (g_strcmp0 (method_name, "SetPanel") == 0)
+    {
+      guint panel, color;
+
+      g_variant_get (parameters, "(uu)", &panel, &color);
+      if (panel >= LIBDROID_LIGHT_MAX_PANELS)
+        {
+          g_dbus_method_invocation_return_error (invocation,
+            G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unknown panel %u", panel);
+          return;
+        }
+
+      broker->panels[panel] = color;
+      broker->dirty_panels |= 1 << panel;
+      droid_leds_broker_schedule (broker, invocation);
+    }
+  else if (g_strcmp0 (method_name, "GetBrightness") == 0)
+    {
+      guint panel, brightness;
+
+      g_variant_get (parameters, "(u)", &panel);
+      if (!droid_leds_backend_get_brightness (broker->backend, panel, &brightness))
+        {
+          g_dbus_method_invocation_return_error (invocation,
+            G_IO_ERROR, G_IO_ERROR_FAILED, "Unable to read the brightness of panel %u", panel);
+          return;
+        }
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", brightness));
+    }
+  else if (g_strcmp0 (method_name, "SetPriority") == 0)
+    {
+      DroidLedsBrokerClient *client = droid_leds_broker_get_client (broker, sender);
+
+      g_variant_get (parameters, "(i)", &client->priority);
+
+      /* It might win or lose the notification light now */
+      broker->notification_dirty = TRUE;
+      droid_leds_broker_schedule (broker, invocation);
+    }
+  else
+    {
+      g_dbus_method_invocation_return_error (invocation,
+        G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method_name);
+    }
+}
+
+static GVariant *
+droid_leds_broker_get_property (GDBusConnection  *connection,
+                                const gchar      *sender,
+                                const gchar      *object_path,
+                                const gchar      *interface_name,
+                                const gchar      *property_name,
+                                GError          **error,
+                                gpointer          user_data)
+{
+  DroidLedsBroker *broker = user_data;
+
+  if (g_strcmp0 (property_name, "SupportedTypes") == 0)
+    return g_variant_new_uint32 (broker->supported_types);
+  else if (g_strcmp0 (property_name, "Backlight") == 0)
+    return g_variant_new_uint32 (broker->backlight);
+  else if (g_strcmp0 (property_name, "NotificationColor") == 0)
+    return g_variant_new_uint32 (broker->notification_color);
+  else if (g_strcmp0 (property_name, "NotificationPattern") == 0)
+    return g_variant_new_boolean (broker->notification_pattern);
+  else if (g_strcmp0 (property_name, "NotificationOwner") == 0)
+    return g_variant_new_string (broker->notification_owner);
+
+  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY,
+               "Unknown property %s", property_name);
+  return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  .method_call  = droid_leds_broker_method_call,
+  .get_property = droid_leds_broker_get_property,
+};
+
+static void
+droid_leds_broker_bus_acquired (GDBusConnection *connection,
+                                const gchar     *name,
+                                gpointer         user_data)
+{
+  g_autoptr (GError) error = NULL;
+  DroidLedsBroker *broker = user_data;
+
+  broker->connection = g_object_ref (connection);
+  broker->registration_id = g_dbus_connection_register_object (connection,
+    DROID_LEDS_BROKER_PATH, broker->introspection->interfaces[0], &interface_vtable,
+    broker, NULL, &error);
+
+  if (broker->registration_id == 0)
+    {
+      g_warning ("Unable to register the broker: %s", error->message);
+      g_main_loop_quit (broker->loop);
+    }
+}
+
+static void
+droid_leds_broker_name_lost (GDBusConnection *connection,
+                             const gchar     *name,
+                             gpointer         user_data)
+{
+  DroidLedsBroker *broker = user_data;
+
+  g_warning ("Unable to own %s, is another broker running?", name);
+  g_main_loop_quit (broker->loop);
+}
+
+int
+main (int argc, char** argv)
+{
+  g_autoptr (GError) err = NULL;
+  DroidLedsBroker broker = { 0, };
+  guint owner_id;
+
+  /* The broker talks to the HAL, not to itself */
+  g_unsetenv (LIBDROID_LEDS_BROKER_ENV);
+
+  broker.leds = droid_leds_new ();
+  broker.backend = droid_leds_get_backend (broker.leds);
+  if (broker.backend == NULL)
+    {
+      g_warning ("Unable to connect to the lights HAL");
+      return EXIT_FAILURE;
+    }
+
+  for (guint type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      if (droid_leds_backend_is_supported (broker.backend, type))
+        broker.supported_types |= 1 << type;
+    }
+
+  broker.state = droid_leds_state_block_map (TRUE, &err);
+  if (broker.state == NULL)
+    {
+      g_debug ("Unable to publish the light state: %s", err->message);
+      g_clear_error (&err);
+    }
+
+  broker.introspection = g_dbus_node_info_new_for_xml (introspection_xml, &err);
+  g_assert_no_error (err);
+
+  broker.clients = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+    (GDestroyNotify) droid_leds_broker_client_free);
+  broker.invocations = g_ptr_array_new ();
+  broker.notification_owner = g_strdup ("");
+  broker.loop = g_main_loop_new (NULL, FALSE);
+
+  owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, DROID_LEDS_BROKER_NAME,
+    G_BUS_NAME_OWNER_FLAGS_NONE, droid_leds_broker_bus_acquired, NULL,
+    droid_leds_broker_name_lost, &broker, NULL);
+
+  g_main_loop_run (broker.loop);
+
+  g_bus_unown_name (owner_id);
+  g_clear_handle_id (&broker.apply_id, g_source_remove);
+  if (broker.registration_id > 0)
+    g_dbus_connection_unregister_object (broker.connection, broker.registration_id);
+
+  g_hash_table_destroy (broker.clients);
+  g_ptr_array_unref (broker.invocations);
+  g_free (broker.notification_owner);
+  g_clear_pointer (&broker.state, droid_leds_state_block_unmap);
+  g_dbus_node_info_unref (broker.introspection);
+  g_clear_object (&broker.connection);
+  g_clear_object (&broker.leds);
+  g_main_loop_unref (broker.loop);
+
+  return EXIT_SUCCESS;
+}
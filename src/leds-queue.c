@@ -0,0 +1,234 @@
+/* leds-queue.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Bounded multi-producer queue, based on Dmitry Vyukov's bounded MPMC
+ * queue. Producers never block nor take locks: pushing to a full queue
+ * simply fails. A single consumer drains it, and sleeps on an eventfd
+ * that producers only signal when the consumer is actually sleeping.
+ */
+
+#define G_LOG_DOMAIN "droid-leds-queue"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "leds-queue.h"
+
+#define CACHELINE_SIZE 64
+
+typedef struct
+{
+  atomic_size_t     sequence;
+  DroidLedsRequest  request;
+} DroidLedsQueueCell;
+
+struct _DroidLedsQueue
+{
+  DroidLedsQueueCell *cells;
+  gsize               mask;
+  int                 eventfd;
+
+  _Alignas (CACHELINE_SIZE) atomic_size_t enqueue_pos;
+  _Alignas (CACHELINE_SIZE) atomic_size_t dequeue_pos;
+  _Alignas (CACHELINE_SIZE) atomic_bool   sleeping;
+};
+
+DroidLedsQueue *
+droid_leds_queue_new (guint capacity)
+{
+  DroidLedsQueue *queue;
+  gsize size = 2;
+  int fd;
+
+  fd = eventfd (0, EFD_CLOEXEC);
+  if (fd < 0)
+    {
+      g_warning ("Unable to create eventfd: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  while (size < capacity)
+    size <<= 1;
+
+  /* g_new0() doesn't honour the cache line alignment of the positions */
+  queue = g_aligned_alloc0 (1, sizeof (DroidLedsQueue), _Alignof (DroidLedsQueue));
+  queue->cells   = g_new0 (DroidLedsQueueCell, size);
+  queue->mask    = size - 1;
+  queue->eventfd = fd;
+
+  for (gsize i=0; i < size; i++)
+    atomic_init (&queue->cells[i].sequence, i);
+
+  atomic_init (&queue->enqueue_pos, 0);
+  atomic_init (&queue->dequeue_pos, 0);
+  atomic_init (&queue->sleeping, FALSE);
+
+  return queue;
+}
+
+void
+droid_leds_queue_free (DroidLedsQueue *queue)
+{
+  DroidLedsRequest request;
+
+  /* Drop whatever the consumer did not get to */
+  while (droid_leds_queue_pop (queue, &request))
+    {
+      g_free (request.keyframes);
+      g_free (request.entries);
+    }
+
+  close (queue->eventfd);
+
+  g_free (queue->cells);
+  g_aligned_free (queue);
+}
+
+gboolean
+droid_leds_queue_push (DroidLedsQueue         *queue,
+                       const DroidLedsRequest *request)
+{
+  DroidLedsQueueCell *cell;
+  gsize pos, sequence;
+  intptr_t diff;
+
+  pos = atomic_load_explicit (&queue->enqueue_pos, memory_order_relaxed);
+
+  for (;;)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      sequence = atomic_load_explicit (&cell->sequence, memory_order_acquire);
+      diff = (intptr_t) sequence - (intptr_t) pos;
+
+      if (diff == 0)
+        {
+          if (atomic_compare_exchange_weak_explicit (&queue->enqueue_pos, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed))
+            break;
+        }
+      else if (diff < 0)
+        {
+          /* Full */
+          return FALSE;
+        }
+      else
+        {
+          pos = atomic_load_explicit (&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+  cell->request = *request;
+  atomic_store_explicit (&cell->sequence, pos + 1, memory_order_release);
+
+  /* Pairs with the fence in droid_leds_queue_wait() */
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (&queue->sleeping, FALSE))
+    droid_leds_queue_wake (queue);
+
+  return TRUE;
+}
+
+static gboolean
+droid_leds_queue_is_empty (DroidLedsQueue *queue)
+{
+  DroidLedsQueueCell *cell;
+  gsize pos;
+
+  pos = atomic_load_explicit (&queue->dequeue_pos, memory_order_relaxed);
+  cell = &queue->cells[pos & queue->mask];
+
+  return atomic_load_explicit (&cell->sequence, memory_order_acquire) != pos + 1;
+}
+
+/*
+ * Must only be called by the consumer.
+ */
+gboolean
+droid_leds_queue_pop (DroidLedsQueue   *queue,
+                      DroidLedsRequest *request)
+{
+  DroidLedsQueueCell *cell;
+  gsize pos;
+
+  if (droid_leds_queue_is_empty (queue))
+    return FALSE;
+
+  pos = atomic_load_explicit (&queue->dequeue_pos, memory_order_relaxed);
+  cell = &queue->cells[pos & queue->mask];
+
+  *request = cell->request;
+  atomic_store_explicit (&queue->dequeue_pos, pos + 1, memory_order_relaxed);
+  atomic_store_explicit (&cell->sequence, pos + queue->mask + 1, memory_order_release);
+
+  return TRUE;
+}
+
+/*
+ * Blocks the consumer until something is pushed, or until
+ * droid_leds_queue_wake() is called.
+ */
+void
+droid_leds_queue_wait (DroidLedsQueue *queue)
+{
+  uint64_t value;
+
+  atomic_store (&queue->sleeping, TRUE);
+  atomic_thread_fence (memory_order_seq_cst);
+
+  if (!droid_leds_queue_is_empty (queue))
+    {
+      atomic_store (&queue->sleeping, FALSE);
+      return;
+    }
+
+  while (read (queue->eventfd, &value, sizeof (value)) < 0 && errno == EINTR)
+    ;
+}
+
+void
+droid_leds_queue_wake (DroidLedsQueue *queue)
+{
+  uint64_t value = 1;
+
+  if (write (queue->eventfd, &value, sizeof (value)) < 0)
+    g_warning ("Unable to wake up the queue consumer: %s", g_strerror (errno));
+}
@@ -0,0 +1,90 @@
+/* leds-queue.h
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <libdroid-shared/leds-objects.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  DROID_LEDS_REQUEST_SET = 0,
+  DROID_LEDS_REQUEST_PATTERN,
+  DROID_LEDS_REQUEST_PANEL,
+  DROID_LEDS_REQUEST_BATCH,
+} DroidLedsRequestKind;
+
+typedef struct
+{
+  DroidLedsRequestKind  kind;
+  LightBatchEntry       entry;
+
+  /* Backlight level, published once applied */
+  guint                 level;
+
+  /* DROID_LEDS_REQUEST_PANEL only */
+  guint                 panel;
+
+  /* Backlight level to save once applied, or -1 */
+  gint                  save_level;
+
+  /* DROID_LEDS_REQUEST_PATTERN only, keyframes are owned by the request */
+  LightKeyframe        *keyframes;
+  guint                 n_keyframes;
+  guint                 repeat;
+
+  /* DROID_LEDS_REQUEST_BATCH only, entries are owned by the request */
+  LightBatchEntry      *entries;
+  guint                 n_entries;
+} DroidLedsRequest;
+
+typedef struct _DroidLedsQueue DroidLedsQueue;
+
+DroidLedsQueue *droid_leds_queue_new  (guint                   capacity);
+void            droid_leds_queue_free (DroidLedsQueue         *queue);
+gboolean        droid_leds_queue_push (DroidLedsQueue         *queue,
+                                       const DroidLedsRequest *request);
+gboolean        droid_leds_queue_pop  (DroidLedsQueue         *queue,
+                                       DroidLedsRequest       *request);
+void            droid_leds_queue_wait (DroidLedsQueue         *queue);
+void            droid_leds_queue_wake (DroidLedsQueue         *queue);
+
+G_END_DECLS
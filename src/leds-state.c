@@ -0,0 +1,465 @@
+/* leds-state.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The last light state is published in a small block shared through
+ * the runtime directory, so that other processes can read it without
+ * talking to the HAL. The block is a seqlock: writers make the sequence
+ * odd while they update it, readers retry if it was odd or has changed
+ * while they were copying. The sequence is also a futex, woken up on
+ * every update. Writers, which can live in different processes, are
+ * serialized by a lock holding the pid of the writer.
+ */
+
+#define G_LOG_DOMAIN "droid-leds-state"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <libdroid/leds.h>
+
+#include "leds-state.h"
+
+#define LIBDROID_STATE_DIR      "libdroid"
+#define LIBDROID_STATE_FILE     "lights-state"
+
+#define STATE_MAGIC             0x4c445354 /* LDST */
+#define STATE_VERSION           1
+
+/* Spins before checking whether the writer died while holding the block */
+#define STATE_WRITER_SPINS      1000
+
+typedef enum
+{
+  STATE_WORD_BACKLIGHT_LEVEL = 0,
+  STATE_WORD_NOTIFICATION_COLOR,
+  STATE_WORD_NOTIFICATION_FLASH_ON,
+  STATE_WORD_NOTIFICATION_FLASH_OFF,
+  STATE_WORD_NOTIFICATION_PATTERN,
+  STATE_WORD_UPDATED_LO,
+  STATE_WORD_UPDATED_HI,
+  STATE_N_WORDS,
+} StateWord;
+
+typedef struct
+{
+  _Atomic uint32_t sequence;
+  uint32_t         magic;
+  uint32_t         version;
+  uint32_t         n_words;
+  _Atomic uint32_t words[16];
+
+  /* Pid of the writer holding the block, 0 if none. After the words, so
+   * that readers see the same layout as before. */
+  _Atomic uint32_t writer;
+} SharedState;
+G_STATIC_ASSERT (STATE_N_WORDS <= 16);
+
+struct _DroidLedsStateBlock
+{
+  SharedState *shared;
+  gboolean     writable;
+};
+
+struct _DroidLedsStateReader
+{
+  GObject              parent_instance;
+
+  DroidLedsStateBlock *block;
+  uint32_t             last_sequence;
+};
+
+static void droid_leds_state_reader_initable_iface_init (GInitableIface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE (DroidLedsStateReader, droid_leds_state_reader, G_TYPE_OBJECT,
+  G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, droid_leds_state_reader_initable_iface_init))
+
+
+/*
+ * Readers fail with G_IO_ERROR_NOT_FOUND until a writer has set the
+ * block up, and with G_IO_ERROR_INVALID_DATA if it has another layout.
+ */
+DroidLedsStateBlock *
+droid_leds_state_block_map (gboolean   writable,
+                            GError   **error)
+{
+  g_autofree gchar *dir = g_build_filename (g_get_user_runtime_dir (), LIBDROID_STATE_DIR, NULL);
+  g_autofree gchar *path = g_build_filename (dir, LIBDROID_STATE_FILE, NULL);
+  DroidLedsStateBlock *block;
+  SharedState *shared;
+  struct stat st;
+  int fd;
+
+  if (writable && g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+        "Unable to create %s: %s", dir, g_strerror (errno));
+      return NULL;
+    }
+
+  fd = g_open (path, writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0600);
+  if (fd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+        "Unable to open %s: %s", path, g_strerror (errno));
+      return NULL;
+    }
+
+  /* A fresh file reads as zeroes, which is a valid empty block */
+  if (writable && ftruncate (fd, sizeof (SharedState)) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+        "Unable to resize %s: %s", path, g_strerror (errno));
+      close (fd);
+      return NULL;
+    }
+
+  /* Reading past the end of the file would fault: the writer might not
+   * have resized it yet */
+  if (!writable && (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (SharedState)))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s is not set up yet", path);
+      close (fd);
+      return NULL;
+    }
+
+  shared = mmap (NULL, sizeof (SharedState), writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+    MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (shared == MAP_FAILED)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+        "Unable to map %s: %s", path, g_strerror (errno));
+      return NULL;
+    }
+
+  if (writable && (shared->magic != STATE_MAGIC || shared->version != STATE_VERSION))
+    {
+      shared->n_words = STATE_N_WORDS;
+      shared->version = STATE_VERSION;
+      /* Readers check the magic first */
+      atomic_thread_fence (memory_order_release);
+      shared->magic   = STATE_MAGIC;
+    }
+  else if (!writable)
+    {
+      uint32_t magic = shared->magic;
+
+      atomic_thread_fence (memory_order_acquire);
+      if (magic != STATE_MAGIC || shared->version != STATE_VERSION ||
+          shared->n_words != STATE_N_WORDS)
+        {
+          if (magic == 0)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s is not set up yet", path);
+          else
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+              "%s has an unknown layout", path);
+          munmap (shared, sizeof (SharedState));
+          return NULL;
+        }
+    }
+
+  block = g_new0 (DroidLedsStateBlock, 1);
+  block->shared   = shared;
+  block->writable = writable;
+
+  return block;
+}
+
+
+void
+droid_leds_state_block_unmap (DroidLedsStateBlock *block)
+{
+  munmap (block->shared, sizeof (SharedState));
+  g_free (block);
+}
+
+
+static void
+droid_leds_state_block_store (DroidLedsStateBlock *block,
+                              StateWord            word,
+                              uint32_t             value)
+{
+  atomic_store_explicit (&block->shared->words[word], value, memory_order_relaxed);
+}
+
+
+/*
+ * Takes the block for writing, making the sequence odd. A writer is only
+ * taken over once its process is gone: one that was merely preempted
+ * still owns the block, and will finish its update.
+ */
+static uint32_t
+droid_leds_state_block_begin (DroidLedsStateBlock *block)
+{
+  uint32_t self_pid = (uint32_t) getpid ();
+  uint32_t owner = 0;
+  uint32_t sequence;
+  guint spins = 0;
+
+  while (!atomic_compare_exchange_weak_explicit (&block->shared->writer, &owner, self_pid,
+           memory_order_acquire, memory_order_relaxed))
+    {
+      if (owner != 0 && ++spins > STATE_WRITER_SPINS)
+        {
+          spins = 0;
+
+          /* The pid is the lock word itself, so only one writer can take over */
+          if (kill ((pid_t) owner, 0) < 0 && errno == ESRCH &&
+              atomic_compare_exchange_strong_explicit (&block->shared->writer, &owner, self_pid,
+                memory_order_acquire, memory_order_relaxed))
+            {
+              g_debug ("Taking over the state block from writer %u, which is gone", owner);
+              break;
+            }
+        }
+
+      if (owner != 0)
+        sched_yield ();
+
+      owner = 0;
+    }
+
+  /* Already odd if the previous writer died midway, readers keep retrying */
+  sequence = atomic_load_explicit (&block->shared->sequence, memory_order_relaxed);
+  sequence += (sequence & 1) ? 2 : 1;
+  atomic_store_explicit (&block->shared->sequence, sequence, memory_order_relaxed);
+
+  return sequence;
+}
+
+
+void
+droid_leds_state_block_publish (DroidLedsStateBlock *block,
+                                LightType            light_type,
+                                const LightState    *state,
+                                guint                backlight_level,
+                                gboolean             pattern)
+{
+  gint64 now = g_get_monotonic_time ();
+  uint32_t sequence;
+
+  g_return_if_fail (block->writable);
+
+  sequence = droid_leds_state_block_begin (block);
+
+  /* The odd sequence must be visible before any of the new words */
+  atomic_thread_fence (memory_order_release);
+
+  /* Other lights aren't published, only the sequence is bumped */
+  if (light_type == LIGHT_TYPE_BACKLIGHT)
+    {
+      droid_leds_state_block_store (block, STATE_WORD_BACKLIGHT_LEVEL, backlight_level);
+    }
+  else if (light_type == LIGHT_TYPE_NOTIFICATIONS)
+    {
+      droid_leds_state_block_store (block, STATE_WORD_NOTIFICATION_COLOR, state->color);
+      droid_leds_state_block_store (block, STATE_WORD_NOTIFICATION_FLASH_ON, state->flashOnMs);
+      droid_leds_state_block_store (block, STATE_WORD_NOTIFICATION_FLASH_OFF, state->flashOffMs);
+      droid_leds_state_block_store (block, STATE_WORD_NOTIFICATION_PATTERN, pattern);
+    }
+
+  droid_leds_state_block_store (block, STATE_WORD_UPDATED_LO, (uint32_t) now);
+  droid_leds_state_block_store (block, STATE_WORD_UPDATED_HI, (uint32_t) (now >> 32));
+
+  atomic_store_explicit (&block->shared->sequence, sequence + 1, memory_order_release);
+  atomic_store_explicit (&block->shared->writer, 0, memory_order_release);
+
+  syscall (SYS_futex, &block->shared->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+static gboolean
+droid_leds_state_reader_initable_init (GInitable     *initable,
+                                       GCancellable  *cancellable,
+                                       GError       **error)
+{
+  DroidLedsStateReader *self = DROID_LEDS_STATE_READER (initable);
+
+  self->block = droid_leds_state_block_map (FALSE, error);
+
+  return self->block != NULL;
+}
+
+
+static void
+droid_leds_state_reader_initable_iface_init (GInitableIface *iface)
+{
+  iface->init = droid_leds_state_reader_initable_init;
+}
+
+
+/*
+ * Fails with G_IO_ERROR_NOT_FOUND while no process has set a light
+ * through libdroid yet, in which case it is worth trying again later.
+ */
+DroidLedsStateReader *
+droid_leds_state_reader_new (GError **error)
+{
+  return g_initable_new (DROID_TYPE_LEDS_STATE_READER, NULL, error, NULL);
+}
+
+
+/*
+ * Copies the last published state, without any IPC. Returns FALSE if
+ * nothing has been published yet.
+ */
+gboolean
+droid_leds_state_reader_read (DroidLedsStateReader *self,
+                              DroidLedsState       *state)
+{
+  SharedState *shared;
+  uint32_t words[STATE_N_WORDS];
+  uint32_t sequence;
+  guint spins = 0;
+
+  g_return_val_if_fail (DROID_IS_LEDS_STATE_READER (self), FALSE);
+  g_return_val_if_fail (state != NULL, FALSE);
+
+  shared = self->block->shared;
+
+  for (;;)
+    {
+      sequence = atomic_load_explicit (&shared->sequence, memory_order_acquire);
+      if (sequence & 1)
+        {
+          /* Writers can't be waited on forever, they might be gone */
+          if (++spins > STATE_WRITER_SPINS)
+            return FALSE;
+
+          sched_yield ();
+          continue;
+        }
+
+      for (guint i=0; i < STATE_N_WORDS; i++)
+        words[i] = atomic_load_explicit (&shared->words[i], memory_order_relaxed);
+
+      /* The copy must be complete before checking the sequence again */
+      atomic_thread_fence (memory_order_acquire);
+      if (atomic_load_explicit (&shared->sequence, memory_order_relaxed) == sequence)
+        break;
+    }
+
+  self->last_sequence = sequence;
+
+  if (sequence == 0 || shared->magic != STATE_MAGIC)
+    return FALSE;
+
+  state->sequence                  = sequence;
+  state->backlight_level           = words[STATE_WORD_BACKLIGHT_LEVEL];
+  state->notification_color        = words[STATE_WORD_NOTIFICATION_COLOR];
+  state->notification_flash_on_ms  = (int32_t) words[STATE_WORD_NOTIFICATION_FLASH_ON];
+  state->notification_flash_off_ms = (int32_t) words[STATE_WORD_NOTIFICATION_FLASH_OFF];
+  state->notification_pattern      = words[STATE_WORD_NOTIFICATION_PATTERN] != 0;
+  state->updated_time              = (int64_t) (((uint64_t) words[STATE_WORD_UPDATED_HI] << 32) |
+                                                words[STATE_WORD_UPDATED_LO]);
+
+  return TRUE;
+}
+
+
+/*
+ * Sleeps until the state changes from what was last read, or timeout_ms
+ * have passed. A negative timeout waits forever. Returns whether the
+ * state has changed.
+ */
+gboolean
+droid_leds_state_reader_wait (DroidLedsStateReader *self,
+                              int                   timeout_ms)
+{
+  struct timespec timeout;
+  _Atomic uint32_t *sequence;
+  uint32_t current;
+
+  g_return_val_if_fail (DROID_IS_LEDS_STATE_READER (self), FALSE);
+
+  sequence = &self->block->shared->sequence;
+  timeout.tv_sec  = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+  for (;;)
+    {
+      current = atomic_load_explicit (sequence, memory_order_acquire);
+      if (current != self->last_sequence && !(current & 1))
+        return TRUE;
+
+      /* Relative timeout, so a spurious wakeup restarts it. Good enough. */
+      if (syscall (SYS_futex, sequence, FUTEX_WAIT, current, timeout_ms < 0 ? NULL : &timeout,
+            NULL, 0) < 0 && errno == ETIMEDOUT)
+        return FALSE;
+    }
+}
+
+
+static void
+droid_leds_state_reader_finalize (GObject *obj)
+{
+  DroidLedsStateReader *self = DROID_LEDS_STATE_READER (obj);
+
+  g_clear_pointer (&self->block, droid_leds_state_block_unmap);
+
+  G_OBJECT_CLASS (droid_leds_state_reader_parent_class)->finalize (obj);
+}
+
+
+static void
+droid_leds_state_reader_class_init (DroidLedsStateReaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = droid_leds_state_reader_finalize;
+}
+
+
+static void
+droid_leds_state_reader_init (DroidLedsStateReader *self)
+{
+}
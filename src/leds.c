@@ -47,6 +47,7 @@
 
 #define G_LOG_DOMAIN "droid-leds"
 
+#include <math.h>
 #include <stdlib.h>
 #include <glib.h>
 #include <glib-object.h>
@@ -58,11 +59,34 @@
 
 #include "leds-backend.h"
 #include "leds-backend-aidl.h"
+#include "leds-backend-dbus.h"
 #include "leds-backend-hidl.h"
+#include "leds-private.h"
+#include "leds-queue.h"
+#include "leds-state.h"
 
 #define BACKLIGHT_MAX                             255
 #define LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY         "backlight-level"
 #define LIBDROID_LEDS_BACKLIGHT_MAX_ALTERNATE_KEY "backlight-max-alternate"
+#define LIBDROID_LEDS_BACKLIGHT_CURVE_KEY         "backlight-curve"
+#define LIBDROID_LEDS_BACKLIGHT_GAMMA_KEY         "backlight-gamma"
+#define LIBDROID_LEDS_BACKLIGHT_CALIBRATION_KEY   "backlight-calibration"
+
+#define DROID_LEDS_QUEUE_SIZE                     64
+
+typedef enum
+{
+  PROP_FLAGS = 1,
+  N_PROPERTIES
+} DroidLedsProperty;
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+typedef struct
+{
+  guint   level;
+  gdouble fraction;
+} DroidLedsCalibrationPoint;
 
 struct _DroidLeds
 {
@@ -70,12 +94,456 @@ struct _DroidLeds
 
   DroidLedsBackend *backend;
   GSettings        *settings;
+  gsize             backlight_loaded;
   guint             backlight_max_alternate;
-  gboolean          backlight_supported;
-  gboolean          notifications_supported;
+  uint32_t          backlight_lut[BACKLIGHT_MAX + 1];
+
+  /* LightType masks, types are probed on first use */
+  guint             probed_types;
+  guint             supported_types;
+
+  DroidLedsFlags    flags;
+  DroidLedsQueue   *queue;
+  GThread          *io_thread;
+  gint              io_quit;
+
+  /* Requests queued and applied, for droid_leds_flush() */
+  guint             queued;
+  guint             applied;
+  GMutex            flush_lock;
+  GCond             flush_cond;
+
+  /* Shared light state, mapped on first use */
+  gsize             state_mapped;
+  DroidLedsStateBlock *state;
+};
+
+struct _DroidLedsBatch
+{
+  GObject          parent_instance;
+
+  DroidLeds       *leds;
+  guint32          mask;
+  LightBatchEntry  entries[LIGHT_TYPE_COUNT];
+  guint            backlight_level;
+  gboolean         backlight_save;
 };
 
 G_DEFINE_FINAL_TYPE (DroidLeds, droid_leds, G_TYPE_OBJECT)
+G_DEFINE_FINAL_TYPE (DroidLedsBatch, droid_leds_batch, G_TYPE_OBJECT)
+
+/* Settings needed to set the backlight, kept in the runtime cache */
+static const gchar * const backlight_cached_keys[] = {
+  LIBDROID_LEDS_BACKLIGHT_MAX_ALTERNATE_KEY,
+  LIBDROID_LEDS_BACKLIGHT_CURVE_KEY,
+  LIBDROID_LEDS_BACKLIGHT_GAMMA_KEY,
+  LIBDROID_LEDS_BACKLIGHT_CALIBRATION_KEY,
+  NULL,
+};
+
+static void droid_leds_load_backlight (DroidLeds *self);
+
+
+static void
+droid_leds_settings_changed (GSettings   *settings,
+                             const gchar *key,
+                             gpointer     user_data)
+{
+  if (g_strv_contains (backlight_cached_keys, key))
+    droid_settings_update_runtime_cache (settings, backlight_cached_keys);
+}
+
+
+/*
+ * Settings are only loaded on first use, so that clients that don't
+ * need them don't pay for loading the schema and connecting to dconf.
+ */
+static GSettings *
+droid_leds_get_settings (DroidLeds *self)
+{
+  GSettings *settings = g_atomic_pointer_get (&self->settings);
+
+  if (settings != NULL)
+    return settings;
+
+  settings = droid_settings_get_default ();
+  if (!g_atomic_pointer_compare_and_exchange (&self->settings, NULL, settings))
+    {
+      /* Another thread got there first */
+      g_object_unref (settings);
+      return g_atomic_pointer_get (&self->settings);
+    }
+
+  g_signal_connect (settings, "changed", G_CALLBACK (droid_leds_settings_changed), self);
+
+  return settings;
+}
+
+
+static uint32_t
+droid_leds_backlight_to_color (DroidLeds *self,
+                               guint      level)
+{
+  if (g_once_init_enter (&self->backlight_loaded))
+    {
+      droid_leds_load_backlight (self);
+      g_once_init_leave (&self->backlight_loaded, TRUE);
+    }
+
+  return self->backlight_lut[MIN(level, BACKLIGHT_MAX)];
+}
+
+
+static gdouble
+droid_leds_backlight_curve (const gchar *curve,
+                            gdouble      gamma,
+                            gdouble      x)
+{
+  gdouble lightness;
+
+  if (g_strcmp0 (curve, "gamma") == 0)
+    {
+      return pow (x, gamma);
+    }
+  else if (g_strcmp0 (curve, "perceptual") == 0)
+    {
+      /* Inverse of the CIE 1931 lightness function */
+      lightness = x * 100.0;
+
+      if (lightness <= 8.0)
+        return lightness / 903.3;
+      else
+        return pow ((lightness + 16.0) / 116.0, 3.0);
+    }
+
+  return x;
+}
+
+
+static gint
+droid_leds_compare_calibration_points (gconstpointer a,
+                                       gconstpointer b)
+{
+  const DroidLedsCalibrationPoint *point_a = a;
+  const DroidLedsCalibrationPoint *point_b = b;
+
+  return (gint) point_a->level - (gint) point_b->level;
+}
+
+
+static gdouble
+droid_leds_backlight_calibrate (GArray *points,
+                                guint   level)
+{
+  DroidLedsCalibrationPoint *from, *to;
+
+  from = &g_array_index (points, DroidLedsCalibrationPoint, 0);
+  if (level <= from->level)
+    return from->fraction;
+
+  for (guint i=1; i < points->len; i++)
+    {
+      to = &g_array_index (points, DroidLedsCalibrationPoint, i);
+
+      if (level <= to->level)
+        return from->fraction + (to->fraction - from->fraction) *
+          (level - from->level) / (to->level - from->level);
+
+      from = to;
+    }
+
+  return from->fraction;
+}
+
+
+/*
+ * Compiles the configured backlight curve (or the calibration points, if
+ * any) into a table of the final values sent to the HAL, so that setting
+ * the backlight stays a plain lookup.
+ */
+static void
+droid_leds_compile_backlight_lut (DroidLeds   *self,
+                                  const gchar *curve,
+                                  gdouble      gamma,
+                                  GVariant    *calibration)
+{
+  g_autoptr (GArray) points = NULL;
+  DroidLedsCalibrationPoint point;
+  GVariantIter iter;
+  gdouble fraction;
+  guint max, value;
+
+  points = g_array_new (FALSE, FALSE, sizeof (DroidLedsCalibrationPoint));
+  g_variant_iter_init (&iter, calibration);
+  while (g_variant_iter_next (&iter, "(ud)", &point.level, &point.fraction))
+    {
+      point.level    = MIN(point.level, BACKLIGHT_MAX);
+      point.fraction = CLAMP(point.fraction, 0.0, 1.0);
+      g_array_append_val (points, point);
+    }
+  g_array_sort (points, droid_leds_compare_calibration_points);
+
+  if (points->len == 1)
+    {
+      g_warning ("At least two backlight calibration points are needed, ignoring");
+      g_array_set_size (points, 0);
+    }
+
+  g_debug ("Compiling backlight curve: %s", (points->len > 0) ? "calibration" : curve);
+
+  /* Use the alternate way (pass the value directly) if configured */
+  max = (self->backlight_max_alternate > 0) ? self->backlight_max_alternate : BACKLIGHT_MAX;
+
+  for (guint level=0; level <= BACKLIGHT_MAX; level++)
+    {
+      if (points->len > 0)
+        fraction = droid_leds_backlight_calibrate (points, level);
+      else
+        fraction = droid_leds_backlight_curve (curve, gamma,
+          (gdouble) level / BACKLIGHT_MAX);
+
+      value = round (fraction * max);
+
+      /* Keep the lowest levels from turning the panel off */
+      if (level > 0 && fraction > 0 && value == 0)
+        value = 1;
+
+      if (self->backlight_max_alternate > 0)
+        self->backlight_lut[level] = value;
+      else
+        self->backlight_lut[level] = (0xff << 24) + (value << 16) + (value << 8) + value;
+    }
+}
+
+
+static GVariant *
+droid_leds_get_cached_setting (DroidLeds          *self,
+                               GKeyFile           *cache,
+                               const gchar        *key,
+                               const GVariantType *type,
+                               gboolean           *from_settings)
+{
+  GVariant *value = NULL;
+
+  if (cache != NULL)
+    value = droid_settings_get_cached_value (cache, key, type);
+
+  if (value == NULL)
+    {
+      value = g_settings_get_value (droid_leds_get_settings (self), key);
+      *from_settings = TRUE;
+    }
+
+  return value;
+}
+
+
+/*
+ * Reads the backlight settings from the runtime cache, falling back to
+ * GSettings for what's missing there, and compiles the curve.
+ */
+static void
+droid_leds_load_backlight (DroidLeds *self)
+{
+  g_autoptr (GKeyFile) cache = droid_settings_load_runtime_cache ();
+  g_autoptr (GVariant) max_alternate = NULL;
+  g_autoptr (GVariant) curve = NULL;
+  g_autoptr (GVariant) gamma = NULL;
+  g_autoptr (GVariant) calibration = NULL;
+  gboolean from_settings = FALSE;
+
+  max_alternate = droid_leds_get_cached_setting (self, cache,
+    LIBDROID_LEDS_BACKLIGHT_MAX_ALTERNATE_KEY, G_VARIANT_TYPE_UINT32, &from_settings);
+  curve = droid_leds_get_cached_setting (self, cache,
+    LIBDROID_LEDS_BACKLIGHT_CURVE_KEY, G_VARIANT_TYPE_STRING, &from_settings);
+  gamma = droid_leds_get_cached_setting (self, cache,
+    LIBDROID_LEDS_BACKLIGHT_GAMMA_KEY, G_VARIANT_TYPE_DOUBLE, &from_settings);
+  calibration = droid_leds_get_cached_setting (self, cache,
+    LIBDROID_LEDS_BACKLIGHT_CALIBRATION_KEY, G_VARIANT_TYPE ("a(ud)"), &from_settings);
+
+  /* Spare the next clients from loading the settings */
+  if (from_settings)
+    droid_settings_update_runtime_cache (droid_leds_get_settings (self),
+      backlight_cached_keys);
+
+  self->backlight_max_alternate = g_variant_get_uint32 (max_alternate);
+  droid_leds_compile_backlight_lut (self, g_variant_get_string (curve, NULL),
+    CLAMP(g_variant_get_double (gamma), 0.1, 5.0), calibration);
+}
+
+
+static gboolean
+droid_leds_push (DroidLeds              *self,
+                 const DroidLedsRequest *request)
+{
+  if (droid_leds_queue_push (self->queue, request))
+    {
+      g_atomic_int_inc (&self->queued);
+      return TRUE;
+    }
+
+  g_debug ("Request queue full, dropping request for light %d", request->entry.type);
+
+  return FALSE;
+}
+
+
+/*
+ * Whether the HAL drives light_type. Only the backlight and the
+ * notification light are probed upfront, the others on first use.
+ */
+static gboolean
+droid_leds_supports (DroidLeds *self,
+                     LightType  light_type)
+{
+  guint bit = 1 << light_type;
+
+  if (!(g_atomic_int_get (&self->probed_types) & bit))
+    {
+      if (self->backend != NULL &&
+          droid_leds_backend_is_supported (self->backend, light_type))
+        g_atomic_int_or (&self->supported_types, bit);
+
+      g_atomic_int_or (&self->probed_types, bit);
+    }
+
+  return (g_atomic_int_get (&self->supported_types) & bit) != 0;
+}
+
+
+/* The backlight level is the brightness of the color, as the HAL sees it */
+static gboolean
+droid_leds_prepare_backlight (DroidLeds                 *self,
+                              const DroidLedsLightState *state,
+                              LightState                *light_state,
+                              guint                     *level)
+{
+  uint32_t color = state->color;
+
+  *level = ((77 * ((color >> 16) & 0xff)) + (150 * ((color >> 8) & 0xff)) +
+    (29 * (color & 0xff))) >> 8;
+
+  light_state->color     = droid_leds_backlight_to_color (self, *level);
+  light_state->flashMode = FLASH_TYPE_NONE;
+
+  return TRUE;
+}
+
+
+static gboolean
+droid_leds_prepare_color (DroidLeds                 *self,
+                          const DroidLedsLightState *state,
+                          LightState                *light_state,
+                          guint                     *level)
+{
+  if (state->flash_on_ms < 0 || state->flash_off_ms < 0)
+    return FALSE;
+
+  light_state->color      = state->color;
+  light_state->flashMode  = (state->flash_on_ms > 0) ? FLASH_TYPE_TIMED : FLASH_TYPE_NONE;
+  light_state->flashOnMs  = state->flash_on_ms;
+  light_state->flashOffMs = state->flash_off_ms;
+
+  return TRUE;
+}
+
+
+/* How every DroidLedsKind maps to the HAL, indexed by kind */
+static const struct
+{
+  LightType   light_type;
+  gboolean  (*prepare) (DroidLeds                 *self,
+                        const DroidLedsLightState *state,
+                        LightState                *light_state,
+                        guint                     *level);
+} kind_table[] = {
+  [DROID_LEDS_KIND_BACKLIGHT]    = { LIGHT_TYPE_BACKLIGHT,     droid_leds_prepare_backlight },
+  [DROID_LEDS_KIND_NOTIFICATION] = { LIGHT_TYPE_NOTIFICATIONS, droid_leds_prepare_color },
+  [DROID_LEDS_KIND_KEYBOARD]     = { LIGHT_TYPE_KEYBOARD,      droid_leds_prepare_color },
+  [DROID_LEDS_KIND_BUTTONS]      = { LIGHT_TYPE_BUTTONS,       droid_leds_prepare_color },
+  [DROID_LEDS_KIND_BATTERY]      = { LIGHT_TYPE_BATTERY,       droid_leds_prepare_color },
+  [DROID_LEDS_KIND_ATTENTION]    = { LIGHT_TYPE_ATTENTION,     droid_leds_prepare_color },
+  [DROID_LEDS_KIND_BLUETOOTH]    = { LIGHT_TYPE_BLUETOOTH,     droid_leds_prepare_color },
+  [DROID_LEDS_KIND_WIFI]         = { LIGHT_TYPE_WIFI,          droid_leds_prepare_color },
+};
+
+
+/*
+ * Publishes a light state that has been applied, for the readers of
+ * the shared state block.
+ */
+static void
+droid_leds_publish (DroidLeds        *self,
+                    LightType         light_type,
+                    const LightState *state,
+                    guint             level,
+                    gboolean          pattern)
+{
+  /* The broker publishes the notification it picked */
+  if (light_type == LIGHT_TYPE_NOTIFICATIONS && DROID_IS_LEDS_BACKEND_DBUS (self->backend))
+    return;
+
+  if (g_once_init_enter (&self->state_mapped))
+    {
+      g_autoptr (GError) error = NULL;
+
+      self->state = droid_leds_state_block_map (TRUE, &error);
+      if (self->state == NULL)
+        g_debug ("Unable to publish the light state: %s", error->message);
+
+      g_once_init_leave (&self->state_mapped, TRUE);
+    }
+
+  if (self->state != NULL)
+    droid_leds_state_block_publish (self->state, light_type, state, level, pattern);
+}
+
+
+/*
+ * Sets the light right away, or queues it for the I/O thread in
+ * threaded mode. level is the backlight level the color comes from,
+ * save_level is the level to save once the light has been set, or -1.
+ */
+static gboolean
+droid_leds_submit (DroidLeds *self,
+                   LightType  light_type,
+                   uint32_t   color,
+                   FlashType  flash_type,
+                   int32_t    flash_on_ms,
+                   int32_t    flash_off_ms,
+                   guint      level,
+                   gint       save_level)
+{
+  DroidLedsRequest request = { 0, };
+
+  request.entry.type                 = light_type;
+  request.entry.state.color          = color;
+  request.entry.state.flashMode      = flash_type;
+  request.entry.state.flashOnMs      = flash_on_ms;
+  request.entry.state.flashOffMs     = flash_off_ms;
+  request.entry.state.brightnessMode = BRIGHTNESS_MODE_USER;
+
+  if (self->queue == NULL)
+    {
+      if (!droid_leds_backend_set (self->backend, color, light_type,
+        flash_type, BRIGHTNESS_MODE_USER, flash_on_ms, flash_off_ms))
+        return FALSE;
+
+      droid_leds_publish (self, light_type, &request.entry.state, level, FALSE);
+
+      if (save_level >= 0)
+        g_settings_set_uint (droid_leds_get_settings (self), LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY,
+          save_level);
+
+      return TRUE;
+    }
+
+  request.kind       = DROID_LEDS_REQUEST_SET;
+  request.level      = level;
+  request.save_level = save_level;
+
+  return droid_leds_push (self, &request);
+}
 
 
 gboolean
@@ -85,25 +553,65 @@ droid_leds_set_backlight (DroidLeds *self,
 {
   uint32_t brightness;
 
-  if (!DROID_IS_LEDS (self) || !self->backlight_supported)
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_BACKLIGHT))
     return FALSE;
 
   level = MIN(level, BACKLIGHT_MAX);
-  if (self->backlight_max_alternate > 0)
-    /* Use the alternate way (pass the value directly) */
-    brightness = level * self->backlight_max_alternate / BACKLIGHT_MAX;
-  else
-    brightness = (0xff << 24) + (level << 16) + (level << 8) + level;
+  brightness = droid_leds_backlight_to_color (self, level);
+
+  return droid_leds_submit (self, LIGHT_TYPE_BACKLIGHT, brightness,
+    FLASH_TYPE_NONE, 0, 0, level, save ? (gint) level : -1);
+}
+
 
-  if (!droid_leds_backend_set (self->backend, brightness, LIGHT_TYPE_BACKLIGHT,
-    FLASH_TYPE_NONE, BRIGHTNESS_MODE_USER, 0, 0))
+/*
+ * Sets the backlight on behalf of DroidAutoBrightness. The level is not
+ * saved as the one chosen by the user. It is sent as a user level: to
+ * stock HALs, the sensor mode means that they handle the sensor.
+ */
+gboolean
+droid_leds_set_backlight_sensor (DroidLeds *self,
+                                 guint      level)
+{
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_BACKLIGHT))
     return FALSE;
 
-  if (save)
-    g_settings_set_uint (self->settings, LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY,
-      level);
+  level = MIN(level, BACKLIGHT_MAX);
 
-  return TRUE;
+  return droid_leds_submit (self, LIGHT_TYPE_BACKLIGHT,
+    droid_leds_backlight_to_color (self, level), FLASH_TYPE_NONE, 0, 0, level, -1);
+}
+
+
+/*
+ * Sets the backlight of a single panel, on devices with more than one
+ * display. The level is not saved, as it is shared by all the panels.
+ */
+gboolean
+droid_leds_set_backlight_panel (DroidLeds *self,
+                                guint      panel,
+                                guint      level)
+{
+  DroidLedsRequest request = { 0, };
+
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_BACKLIGHT) ||
+      panel >= LIBDROID_LIGHT_MAX_PANELS)
+    return FALSE;
+
+  level = MIN(level, BACKLIGHT_MAX);
+
+  if (self->queue == NULL)
+    return droid_leds_backend_set_panel (self->backend, panel,
+      droid_leds_backlight_to_color (self, level));
+
+  request.kind              = DROID_LEDS_REQUEST_PANEL;
+  request.entry.type        = LIGHT_TYPE_BACKLIGHT;
+  request.entry.state.color = droid_leds_backlight_to_color (self, level);
+  request.level             = level;
+  request.panel             = panel;
+  request.save_level        = -1;
+
+  return droid_leds_push (self, &request);
 }
 
 
@@ -112,7 +620,51 @@ droid_leds_get_backlight (DroidLeds *self)
 {
   g_return_val_if_fail (DROID_IS_LEDS (self), BACKLIGHT_MAX);
 
-  return g_settings_get_uint (self->settings, LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY);
+  return g_settings_get_uint (droid_leds_get_settings (self),
+    LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY);
+}
+
+
+/*
+ * Reads the level a backlight panel is actually at from the HAL. Unlike
+ * droid_leds_get_backlight(), this follows changes made by the kernel,
+ * the firmware or other clients. The brightness is mapped back to the
+ * closest level of the configured curve.
+ */
+gboolean
+droid_leds_read_backlight (DroidLeds *self,
+                           guint      panel,
+                           guint     *level)
+{
+  guint brightness, lut_brightness, distance;
+  guint best_distance = G_MAXUINT;
+
+  g_return_val_if_fail (DROID_IS_LEDS (self), FALSE);
+  g_return_val_if_fail (level != NULL, FALSE);
+
+  if (!droid_leds_supports (self, LIGHT_TYPE_BACKLIGHT) ||
+      !droid_leds_backend_get_brightness (self->backend, panel, &brightness))
+    return FALSE;
+
+  /* Make sure the curve is loaded */
+  droid_leds_backlight_to_color (self, 0);
+
+  for (guint i=0; i <= BACKLIGHT_MAX; i++)
+    {
+      if (self->backlight_max_alternate > 0)
+        lut_brightness = self->backlight_lut[i] * BACKLIGHT_MAX / self->backlight_max_alternate;
+      else
+        lut_brightness = self->backlight_lut[i] & 0xff;
+
+      distance = ABS ((gint) lut_brightness - (gint) brightness);
+      if (distance < best_distance)
+        {
+          best_distance = distance;
+          *level = i;
+        }
+    }
+
+  return TRUE;
 }
 
 
@@ -122,22 +674,107 @@ droid_leds_set_notification (DroidLeds *self,
                              int32_t flash_on_ms,
                              int32_t flash_off_ms)
 {
-  if (!DROID_IS_LEDS (self) || !self->notifications_supported)
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_NOTIFICATIONS))
     return FALSE;
 
-  return droid_leds_backend_set (self->backend, color, LIGHT_TYPE_NOTIFICATIONS,
-    FLASH_TYPE_TIMED, BRIGHTNESS_MODE_USER, flash_on_ms, flash_off_ms);
+  return droid_leds_submit (self, LIGHT_TYPE_NOTIFICATIONS, color,
+    FLASH_TYPE_TIMED, flash_on_ms, flash_off_ms, 0, -1);
 }
 
 
 gboolean
 droid_leds_clear_notification (DroidLeds *self)
 {
-  if (!DROID_IS_LEDS (self) || !self->notifications_supported)
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_NOTIFICATIONS))
+    return FALSE;
+
+  return droid_leds_submit (self, LIGHT_TYPE_NOTIFICATIONS, 0,
+    FLASH_TYPE_NONE, 0, 0, 0, -1);
+}
+
+
+/*
+ * Sets any kind of light. The backlight is set to the brightness of
+ * state->color, through the configured curve, and it is not saved.
+ */
+gboolean
+droid_leds_set_light (DroidLeds                 *self,
+                      DroidLedsKind              kind,
+                      const DroidLedsLightState *state)
+{
+  LightState light_state = { 0, };
+  guint level = 0;
+
+  g_return_val_if_fail (state != NULL, FALSE);
+
+  if (!DROID_IS_LEDS (self) || kind >= G_N_ELEMENTS (kind_table) ||
+      !droid_leds_supports (self, kind_table[kind].light_type))
+    return FALSE;
+
+  if (!kind_table[kind].prepare (self, state, &light_state, &level))
+    return FALSE;
+
+  return droid_leds_submit (self, kind_table[kind].light_type, light_state.color,
+    light_state.flashMode, light_state.flashOnMs, light_state.flashOffMs, level, -1);
+}
+
+
+/*
+ * Uploads a keyframe pattern that the HAL plays on its own. The pattern
+ * is played repeat times, or forever if repeat is 0, and it is stopped by
+ * any other change to the notification light.
+ */
+gboolean
+droid_leds_set_notification_pattern (DroidLeds               *self,
+                                     const DroidLedsKeyframe *keyframes,
+                                     guint                    n_keyframes,
+                                     guint                    repeat)
+{
+  g_autofree LightKeyframe *frames = NULL;
+  DroidLedsRequest request = { 0, };
+
+  if (!DROID_IS_LEDS (self) || !droid_leds_supports (self, LIGHT_TYPE_NOTIFICATIONS))
     return FALSE;
 
-  return droid_leds_backend_set (self->backend, 0, LIGHT_TYPE_NOTIFICATIONS,
-    FLASH_TYPE_NONE, BRIGHTNESS_MODE_USER, 0, 0);
+  g_return_val_if_fail (keyframes != NULL && n_keyframes > 0, FALSE);
+
+  frames = g_new0 (LightKeyframe, n_keyframes);
+  for (guint i=0; i < n_keyframes; i++)
+    {
+      frames[i].color         = keyframes[i].color;
+      frames[i].durationMs    = keyframes[i].duration_ms;
+      frames[i].interpolation = (keyframes[i].interpolation == DROID_LEDS_INTERPOLATION_LINEAR) ?
+        LIGHT_INTERPOLATION_LINEAR : LIGHT_INTERPOLATION_STEP;
+    }
+
+  /* Published as the pattern's first color */
+  request.entry.state.color = frames[0].color;
+
+  if (self->queue == NULL)
+    {
+      if (!droid_leds_backend_set_pattern (self->backend, LIGHT_TYPE_NOTIFICATIONS,
+            frames, n_keyframes, repeat))
+        return FALSE;
+
+      droid_leds_publish (self, LIGHT_TYPE_NOTIFICATIONS, &request.entry.state, 0, TRUE);
+
+      return TRUE;
+    }
+
+  request.kind        = DROID_LEDS_REQUEST_PATTERN;
+  request.entry.type  = LIGHT_TYPE_NOTIFICATIONS;
+  request.save_level  = -1;
+  request.keyframes   = frames;
+  request.n_keyframes = n_keyframes;
+  request.repeat      = repeat;
+
+  if (!droid_leds_push (self, &request))
+    return FALSE;
+
+  /* Owned by the request now */
+  frames = NULL;
+
+  return TRUE;
 }
 
 
@@ -147,23 +784,94 @@ droid_leds_is_kind_supported (DroidLeds *self,
 {
   g_return_val_if_fail (DROID_IS_LEDS (self), FALSE);
 
-  switch (kind)
-    {
-    case DROID_LEDS_KIND_BACKLIGHT:
-      return self->backlight_supported;
-    case DROID_LEDS_KIND_NOTIFICATION:
-      return self->notifications_supported;
-    default:
-      return FALSE;
-    }
+  if (kind >= G_N_ELEMENTS (kind_table))
+    return FALSE;
+
+  return droid_leds_supports (self, kind_table[kind].light_type);
+}
+
+/*
+ * Waits until the requests queued so far in threaded mode have been
+ * sent to the HAL. Does nothing otherwise.
+ */
+void
+droid_leds_flush (DroidLeds *self)
+{
+  guint queued;
+
+  g_return_if_fail (DROID_IS_LEDS (self));
+
+  if (self->queue == NULL)
+    return;
+
+  queued = g_atomic_int_get (&self->queued);
+
+  g_mutex_lock (&self->flush_lock);
+  while ((gint) (queued - self->applied) > 0)
+    g_cond_wait (&self->flush_cond, &self->flush_lock);
+  g_mutex_unlock (&self->flush_lock);
+}
+
+/*
+ * Sets the priority of the notifications of this client. Through the
+ * broker, the notification of the client with the highest priority is
+ * shown, the most recent one on ties. Fails when not using the broker,
+ * or when the broker can't be reached.
+ */
+gboolean
+droid_leds_set_priority (DroidLeds *self,
+                         gint       priority)
+{
+  g_return_val_if_fail (DROID_IS_LEDS (self), FALSE);
+
+  if (self->backend == NULL)
+    return FALSE;
+
+  /* Keep it ordered with the requests queued so far */
+  droid_leds_flush (self);
+
+  return droid_leds_backend_set_priority (self->backend, priority);
+}
+
+DroidLedsBackend *
+droid_leds_get_backend (DroidLeds *self)
+{
+  g_return_val_if_fail (DROID_IS_LEDS (self), NULL);
+
+  return self->backend;
+}
+
+/*
+ * Whether to go through the broker: the environment overrides
+ * DROID_LEDS_FLAGS_BROKER both ways.
+ */
+static gboolean
+droid_leds_use_broker (DroidLedsFlags flags)
+{
+  const gchar *env = g_getenv (LIBDROID_LEDS_BROKER_ENV);
+
+  if (env != NULL && *env != '\0')
+    return g_strcmp0 (env, "0") != 0;
+
+  return (flags & DROID_LEDS_FLAGS_BROKER) != 0;
 }
 
 static DroidLedsBackend *
-droid_leds_create_backend (void)
+droid_leds_create_backend (DroidLedsFlags flags)
 {
   g_autoptr (GError) error = NULL;
   DroidLedsBackend *backend;
 
+  if (droid_leds_use_broker (flags))
+    {
+      backend = (DroidLedsBackend *) droid_leds_backend_dbus_new (&error);
+      if (backend)
+        return backend;
+
+      g_debug ("Unable to use the broker, talking to the HAL: %s", error->message);
+      g_clear_error (&error);
+    }
+
   backend = (DroidLedsBackend *) droid_leds_backend_hidl_new (&error);
 
   if (!backend)
@@ -177,6 +885,136 @@ droid_leds_create_backend (void)
   return backend;
 }
 
+/*
+ * Drains the queue, keeping only the latest request for each light, and
+ * applies what is left in a single batch. Single panel requests are
+ * applied afterwards, unless the whole backlight was set after them.
+ */
+static void
+droid_leds_io_apply (DroidLeds *self)
+{
+  DroidLedsRequest pending[LIGHT_TYPE_COUNT];
+  DroidLedsRequest panels[LIBDROID_LIGHT_MAX_PANELS];
+  LightBatchEntry entries[LIGHT_TYPE_COUNT];
+  DroidLedsRequest request;
+  guint32 mask = 0;
+  guint32 panel_mask = 0;
+  guint n_entries = 0;
+  guint n_requests = 0;
+  gint save_level = -1;
+
+  while (droid_leds_queue_pop (self->queue, &request))
+    {
+      n_requests++;
+
+      /* Its entries all end up in the single set_batch below */
+      if (request.kind == DROID_LEDS_REQUEST_BATCH)
+        {
+          for (guint i=0; i < request.n_entries; i++)
+            {
+              LightType type = request.entries[i].type;
+
+              if (type == LIGHT_TYPE_BACKLIGHT)
+                panel_mask = 0;
+
+              if (mask & (1 << type))
+                g_free (pending[type].keyframes);
+
+              pending[type] = (DroidLedsRequest) {
+                .kind       = DROID_LEDS_REQUEST_SET,
+                .entry      = request.entries[i],
+                .level      = request.level,
+                .save_level = (type == LIGHT_TYPE_BACKLIGHT) ? request.save_level : -1,
+              };
+              mask |= (1 << type);
+            }
+
+          g_free (request.entries);
+          continue;
+        }
+      else if (request.kind == DROID_LEDS_REQUEST_PANEL)
+        {
+          panels[request.panel] = request;
+          panel_mask |= (1 << request.panel);
+          continue;
+        }
+      else if (request.entry.type == LIGHT_TYPE_BACKLIGHT)
+        {
+          panel_mask = 0;
+        }
+
+      if (mask & (1 << request.entry.type))
+        g_free (pending[request.entry.type].keyframes);
+
+      pending[request.entry.type] = request;
+      mask |= (1 << request.entry.type);
+    }
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      if (!(mask & (1 << type)))
+        continue;
+
+      if (pending[type].kind == DROID_LEDS_REQUEST_PATTERN)
+        {
+          if (droid_leds_backend_set_pattern (self->backend, type, pending[type].keyframes,
+                pending[type].n_keyframes, pending[type].repeat))
+            droid_leds_publish (self, type, &pending[type].entry.state, 0, TRUE);
+          g_free (pending[type].keyframes);
+          continue;
+        }
+
+      entries[n_entries++] = pending[type].entry;
+      if (pending[type].save_level >= 0)
+        save_level = pending[type].save_level;
+    }
+
+  if (n_entries > 0 &&
+      droid_leds_backend_set_batch (self->backend, entries, n_entries))
+    {
+      for (guint i=0; i < n_entries; i++)
+        droid_leds_publish (self, entries[i].type, &entries[i].state,
+          pending[entries[i].type].level, FALSE);
+
+      if (save_level >= 0)
+        g_settings_set_uint (droid_leds_get_settings (self), LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY,
+          save_level);
+    }
+
+  for (guint panel=0; panel < LIBDROID_LIGHT_MAX_PANELS; panel++)
+    {
+      if (panel_mask & (1 << panel))
+        droid_leds_backend_set_panel (self->backend, panel, panels[panel].entry.state.color);
+    }
+
+  if (n_requests > 0)
+    {
+      g_mutex_lock (&self->flush_lock);
+      self->applied += n_requests;
+      g_cond_broadcast (&self->flush_cond);
+      g_mutex_unlock (&self->flush_lock);
+    }
+}
+
+
+static gpointer
+droid_leds_io_thread (gpointer user_data)
+{
+  DroidLeds *self = DROID_LEDS (user_data);
+
+  while (!g_atomic_int_get (&self->io_quit))
+    {
+      droid_leds_queue_wait (self->queue);
+      droid_leds_io_apply (self);
+    }
+
+  /* Don't lose what was submitted right before disposal */
+  droid_leds_io_apply (self);
+
+  return NULL;
+}
+
+
 static void
 droid_leds_constructed (GObject *obj)
 {
@@ -184,24 +1022,26 @@ droid_leds_constructed (GObject *obj)
 
   G_OBJECT_CLASS (droid_leds_parent_class)->constructed (obj);
 
-  self->settings = droid_settings_get_default ();
-
-  self->backlight_max_alternate = g_settings_get_uint (self->settings,
-    LIBDROID_LEDS_BACKLIGHT_MAX_ALTERNATE_KEY);
-
-  self->backend = droid_leds_create_backend ();
+  self->backend = droid_leds_create_backend (self->flags);
 
   if (self->backend)
     {
-      self->backlight_supported = droid_leds_backend_is_supported (self->backend,
-        LIGHT_TYPE_BACKLIGHT);
-      self->notifications_supported = droid_leds_backend_is_supported (self->backend,
-        LIGHT_TYPE_NOTIFICATIONS);
+      droid_leds_supports (self, LIGHT_TYPE_BACKLIGHT);
+      droid_leds_supports (self, LIGHT_TYPE_NOTIFICATIONS);
+
+      if ((self->flags & DROID_LEDS_FLAGS_ONEWAY) &&
+          !droid_leds_backend_set_oneway (self->backend, TRUE))
+        g_debug ("Backend doesn't support oneway requests");
+
+      if (self->flags & DROID_LEDS_FLAGS_THREADED)
+        self->queue = droid_leds_queue_new (DROID_LEDS_QUEUE_SIZE);
+
+      if (self->queue)
+        self->io_thread = g_thread_new ("droid-leds-io", droid_leds_io_thread, self);
     }
   else
     {
-      self->backlight_supported = FALSE;
-      self->notifications_supported = FALSE;
+      self->probed_types = (1 << LIGHT_TYPE_COUNT) - 1;
     }
 }
 
@@ -213,13 +1053,82 @@ droid_leds_dispose (GObject *obj)
 
   g_debug ("Disposing droid leds");
 
+  if (self->io_thread)
+    {
+      g_atomic_int_set (&self->io_quit, TRUE);
+      droid_leds_queue_wake (self->queue);
+      g_clear_pointer (&self->io_thread, g_thread_join);
+    }
+
+  g_clear_pointer (&self->queue, droid_leds_queue_free);
   g_clear_object (&self->backend);
+  if (self->settings != NULL)
+    g_signal_handlers_disconnect_by_data (self->settings, self);
+
   g_clear_object (&self->settings);
 
   G_OBJECT_CLASS (droid_leds_parent_class)->dispose (obj);
 }
 
 
+static void
+droid_leds_finalize (GObject *obj)
+{
+  DroidLeds *self = DROID_LEDS (obj);
+
+  g_clear_pointer (&self->state, droid_leds_state_block_unmap);
+  g_mutex_clear (&self->flush_lock);
+  g_cond_clear (&self->flush_cond);
+
+  G_OBJECT_CLASS (droid_leds_parent_class)->finalize (obj);
+}
+
+
+static void
+droid_leds_set_property (GObject      *object,
+                         guint         property_id,
+                         const GValue *value,
+                         GParamSpec   *pspec)
+{
+  DroidLeds *self = DROID_LEDS (object);
+
+  switch ((DroidLedsProperty) property_id)
+    {
+    case PROP_FLAGS:
+      /* This is construct only, so we don't need to handle existing value */
+      self->flags = g_value_get_uint (value);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+
+static void
+droid_leds_get_property (GObject    *object,
+                         guint       property_id,
+                         GValue     *value,
+                         GParamSpec *pspec)
+{
+  DroidLeds *self = DROID_LEDS (object);
+
+  switch ((DroidLedsProperty) property_id)
+    {
+    case PROP_FLAGS:
+      g_value_set_uint (value, self->flags);
+      break;
+
+    case N_PROPERTIES:
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+
 static void
 droid_leds_class_init (DroidLedsClass *klass)
 {
@@ -227,18 +1136,228 @@ droid_leds_class_init (DroidLedsClass *klass)
 
   object_class->constructed  = droid_leds_constructed;
   object_class->dispose      = droid_leds_dispose;
+  object_class->finalize     = droid_leds_finalize;
+  object_class->set_property = droid_leds_set_property;
+  object_class->get_property = droid_leds_get_property;
+
+  properties[PROP_FLAGS] =
+    g_param_spec_uint ("flags",
+                       "Flags",
+                       "DroidLedsFlags to create the instance with",
+                       0, G_MAXUINT, DROID_LEDS_FLAGS_NONE,
+                       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
 }
 
 
 static void
 droid_leds_init (DroidLeds *self)
 {
+  g_mutex_init (&self->flush_lock);
+  g_cond_init (&self->flush_cond);
 }
 
 
 DroidLeds *
 droid_leds_new (void)
+{
+  return droid_leds_new_full (DROID_LEDS_FLAGS_NONE);
+}
+
+
+/*
+ * With DROID_LEDS_FLAGS_THREADED, requests from any thread are queued
+ * and applied by a dedicated I/O thread, and the setters only report
+ * whether the request could be queued. Queued requests for the same
+ * light are coalesced, and they are dropped if the queue is full.
+ *
+ * With DROID_LEDS_FLAGS_ONEWAY, state changes don't wait for the HAL
+ * to reply, and thus only fail if they couldn't be sent.
+ *
+ * With DROID_LEDS_FLAGS_BROKER, lights are set through the session
+ * broker when it is running, so that it can arbitrate between clients.
+ * Otherwise, or if it isn't running, the HAL is used directly.
+ */
+DroidLeds *
+droid_leds_new_full (DroidLedsFlags flags)
 {
   return DROID_LEDS (
-    g_object_new (DROID_TYPE_LEDS, NULL));
+    g_object_new (DROID_TYPE_LEDS,
+      "flags", flags,
+      NULL));
+}
+
+
+static void
+droid_leds_batch_set (DroidLedsBatch *self,
+                      LightType       light_type,
+                      uint32_t        color,
+                      FlashType       flash_type,
+                      int32_t         flash_on_ms,
+                      int32_t         flash_off_ms)
+{
+  LightBatchEntry *entry = &self->entries[light_type];
+
+  /* Later updates to the same light replace earlier ones */
+  entry->type                 = light_type;
+  entry->state.color          = color;
+  entry->state.flashMode      = flash_type;
+  entry->state.flashOnMs      = flash_on_ms;
+  entry->state.flashOffMs     = flash_off_ms;
+  entry->state.brightnessMode = BRIGHTNESS_MODE_USER;
+
+  self->mask |= (1 << light_type);
+}
+
+
+gboolean
+droid_leds_batch_set_backlight (DroidLedsBatch *self,
+                                guint           level,
+                                gboolean        save)
+{
+  g_return_val_if_fail (DROID_IS_LEDS_BATCH (self), FALSE);
+
+  if (!droid_leds_supports (self->leds, LIGHT_TYPE_BACKLIGHT))
+    return FALSE;
+
+  level = MIN(level, BACKLIGHT_MAX);
+  droid_leds_batch_set (self, LIGHT_TYPE_BACKLIGHT,
+    droid_leds_backlight_to_color (self->leds, level), FLASH_TYPE_NONE, 0, 0);
+
+  self->backlight_level = level;
+  self->backlight_save  = save;
+
+  return TRUE;
+}
+
+
+gboolean
+droid_leds_batch_set_notification (DroidLedsBatch *self,
+                                   uint32_t        color,
+                                   int32_t         flash_on_ms,
+                                   int32_t         flash_off_ms)
+{
+  g_return_val_if_fail (DROID_IS_LEDS_BATCH (self), FALSE);
+
+  if (!droid_leds_supports (self->leds, LIGHT_TYPE_NOTIFICATIONS))
+    return FALSE;
+
+  droid_leds_batch_set (self, LIGHT_TYPE_NOTIFICATIONS, color, FLASH_TYPE_TIMED,
+    flash_on_ms, flash_off_ms);
+
+  return TRUE;
+}
+
+
+gboolean
+droid_leds_batch_clear_notification (DroidLedsBatch *self)
+{
+  g_return_val_if_fail (DROID_IS_LEDS_BATCH (self), FALSE);
+
+  if (!droid_leds_supports (self->leds, LIGHT_TYPE_NOTIFICATIONS))
+    return FALSE;
+
+  droid_leds_batch_set (self, LIGHT_TYPE_NOTIFICATIONS, 0, FLASH_TYPE_NONE, 0, 0);
+
+  return TRUE;
+}
+
+
+/*
+ * Sends all the queued updates in a single request, when the HAL
+ * supports it. The batch is empty and can be reused afterwards.
+ */
+gboolean
+droid_leds_batch_commit (DroidLedsBatch *self)
+{
+  LightBatchEntry entries[LIGHT_TYPE_COUNT];
+  guint n_entries = 0;
+  gboolean result;
+
+  g_return_val_if_fail (DROID_IS_LEDS_BATCH (self), FALSE);
+
+  if (self->mask == 0)
+    return TRUE;
+
+  for (int type=0; type < LIGHT_TYPE_COUNT; type++)
+    {
+      if (self->mask & (1 << type))
+        entries[n_entries++] = self->entries[type];
+    }
+
+  /* A single request, so that the I/O thread can't split the batch */
+  if (self->leds->queue)
+    {
+      DroidLedsRequest request = { 0, };
+
+      request.kind       = DROID_LEDS_REQUEST_BATCH;
+      request.entry.type = entries[0].type;
+      request.level      = self->backlight_level;
+      request.save_level = self->backlight_save ? (gint) self->backlight_level : -1;
+      request.entries    = g_memdup2 (entries, n_entries * sizeof (LightBatchEntry));
+      request.n_entries  = n_entries;
+
+      result = droid_leds_push (self->leds, &request);
+      if (!result)
+        g_free (request.entries);
+
+      self->mask = 0;
+
+      return result;
+    }
+
+  result = droid_leds_backend_set_batch (self->leds->backend, entries, n_entries);
+
+  for (guint i=0; result && i < n_entries; i++)
+    droid_leds_publish (self->leds, entries[i].type, &entries[i].state,
+      self->backlight_level, FALSE);
+
+  if (result && (self->mask & (1 << LIGHT_TYPE_BACKLIGHT)) && self->backlight_save)
+    g_settings_set_uint (droid_leds_get_settings (self->leds), LIBDROID_LEDS_BACKLIGHT_LEVEL_KEY,
+      self->backlight_level);
+
+  self->mask = 0;
+
+  return result;
+}
+
+
+static void
+droid_leds_batch_dispose (GObject *obj)
+{
+  DroidLedsBatch *self = DROID_LEDS_BATCH (obj);
+
+  g_clear_object (&self->leds);
+
+  G_OBJECT_CLASS (droid_leds_batch_parent_class)->dispose (obj);
+}
+
+
+static void
+droid_leds_batch_class_init (DroidLedsBatchClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose      = droid_leds_batch_dispose;
+}
+
+
+static void
+droid_leds_batch_init (DroidLedsBatch *self)
+{
+}
+
+
+DroidLedsBatch *
+droid_leds_batch_new (DroidLeds *leds)
+{
+  DroidLedsBatch *self;
+
+  g_return_val_if_fail (DROID_IS_LEDS (leds), NULL);
+
+  self = DROID_LEDS_BATCH (g_object_new (DROID_TYPE_LEDS_BATCH, NULL));
+  self->leds = g_object_ref (leds);
+
+  return self;
 }
@@ -36,10 +36,32 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#define G_LOG_DOMAIN "droid-settings"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
 #include "settings.h"
 
 #define LIBDROID_SCHEMA_NAME "eu.medesimo.Libdroid"
 
+/*
+ * Copy of the settings that are needed early, so that they can be read
+ * without loading the schema and connecting to dconf. It lives in the
+ * runtime directory, so it's gone on reboot. Values are in the GVariant
+ * text format, and can be overridden by hand.
+ *
+ * The cache is stamped with the modification times of the dconf
+ * databases, and ignored once they change, so that settings changed
+ * while no process is watching them aren't shadowed by stale values.
+ */
+#define LIBDROID_RUNTIME_CACHE_DIR   "libdroid"
+#define LIBDROID_RUNTIME_CACHE_FILE  "settings.ini"
+#define LIBDROID_RUNTIME_CACHE_GROUP "runtime-cache"
+#define LIBDROID_RUNTIME_CACHE_STAMP "stamp"
+#define DCONF_SYSTEM_DB_DIR          "/etc/dconf/db"
+
 GSettings *
 droid_settings_get_default (void)
 {
@@ -63,3 +85,129 @@ droid_settings_get_default (void)
 
   return global_settings_instance;
 }
+
+
+static gchar *
+droid_settings_get_runtime_cache_path (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), LIBDROID_RUNTIME_CACHE_DIR,
+    LIBDROID_RUNTIME_CACHE_FILE, NULL);
+}
+
+
+/* Both databases are replaced, rather than modified, when written to */
+static gchar *
+droid_settings_get_stamp (void)
+{
+  g_autofree gchar *user_db = g_build_filename (g_get_user_config_dir (), "dconf", "user", NULL);
+  const gchar *paths[] = { user_db, DCONF_SYSTEM_DB_DIR };
+  GString *stamp = g_string_new (NULL);
+  struct stat st;
+
+  for (guint i=0; i < G_N_ELEMENTS (paths); i++)
+    {
+      if (stat (paths[i], &st) < 0)
+        g_string_append (stamp, "0:");
+      else
+        g_string_append_printf (stamp, "%" G_GINT64_FORMAT ".%09ld:",
+          (gint64) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+
+  return g_string_free (stamp, FALSE);
+}
+
+
+/*
+ * Returns NULL if there's no cache yet, or if the settings might have
+ * changed since it was written.
+ */
+GKeyFile *
+droid_settings_load_runtime_cache (void)
+{
+  g_autofree gchar *path = droid_settings_get_runtime_cache_path ();
+  g_autoptr (GKeyFile) cache = g_key_file_new ();
+  g_autofree gchar *stamp = NULL;
+  g_autofree gchar *current_stamp = NULL;
+
+  if (!g_key_file_load_from_file (cache, path, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  stamp = g_key_file_get_string (cache, LIBDROID_RUNTIME_CACHE_GROUP,
+    LIBDROID_RUNTIME_CACHE_STAMP, NULL);
+  current_stamp = droid_settings_get_stamp ();
+  if (g_strcmp0 (stamp, current_stamp) != 0)
+    {
+      g_debug ("The runtime cache is stale, ignoring it");
+      return NULL;
+    }
+
+  return g_steal_pointer (&cache);
+}
+
+
+/*
+ * Returns NULL if the key is not cached, or if it can't be parsed.
+ */
+GVariant *
+droid_settings_get_cached_value (GKeyFile           *cache,
+                                 const gchar        *key,
+                                 const GVariantType *type)
+{
+  g_autofree gchar *text = NULL;
+  g_autoptr (GError) error = NULL;
+  GVariant *value;
+
+  text = g_key_file_get_string (cache, LIBDROID_SCHEMA_NAME, key, NULL);
+  if (text == NULL)
+    return NULL;
+
+  value = g_variant_parse (type, text, NULL, NULL, &error);
+  if (value == NULL)
+    g_warning ("Ignoring cached %s: %s", key, error->message);
+
+  return value;
+}
+
+
+/*
+ * Stores the current value of keys in the runtime cache.
+ */
+void
+droid_settings_update_runtime_cache (GSettings           *settings,
+                                     const gchar * const *keys)
+{
+  g_autofree gchar *path = droid_settings_get_runtime_cache_path ();
+  g_autofree gchar *dir = g_path_get_dirname (path);
+  g_autoptr (GKeyFile) cache = g_key_file_new ();
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *stamp = NULL;
+
+  /* Taken before reading, so that a concurrent change makes it stale */
+  stamp = droid_settings_get_stamp ();
+
+  /* Keep whatever else is there, unless it is stale as well */
+  if (g_key_file_load_from_file (cache, path, G_KEY_FILE_KEEP_COMMENTS, NULL))
+    {
+      g_autofree gchar *cached_stamp = g_key_file_get_string (cache,
+        LIBDROID_RUNTIME_CACHE_GROUP, LIBDROID_RUNTIME_CACHE_STAMP, NULL);
+
+      if (g_strcmp0 (cached_stamp, stamp) != 0)
+        g_key_file_remove_group (cache, LIBDROID_SCHEMA_NAME, NULL);
+    }
+
+  g_key_file_set_string (cache, LIBDROID_RUNTIME_CACHE_GROUP, LIBDROID_RUNTIME_CACHE_STAMP,
+    stamp);
+
+  for (guint i=0; keys[i] != NULL; i++)
+    {
+      g_autoptr (GVariant) value = g_settings_get_value (settings, keys[i]);
+      g_autofree gchar *text = g_variant_print (value, FALSE);
+
+      g_key_file_set_string (cache, LIBDROID_SCHEMA_NAME, keys[i], text);
+    }
+
+  if (g_mkdir_with_parents (dir, 0700) < 0 ||
+      !g_key_file_save_to_file (cache, path, &error))
+    g_debug ("Unable to update the runtime cache: %s",
+      error ? error->message : g_strerror (errno));
+}
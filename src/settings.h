@@ -41,3 +41,10 @@
 #include <gio/gio.h>
 
 GSettings * droid_settings_get_default (void);
+
+GKeyFile *  droid_settings_load_runtime_cache   (void);
+GVariant *  droid_settings_get_cached_value     (GKeyFile            *cache,
+                                                 const gchar         *key,
+                                                 const GVariantType  *type);
+void        droid_settings_update_runtime_cache (GSettings           *settings,
+                                                 const gchar * const *keys);
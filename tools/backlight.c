@@ -39,7 +39,329 @@
 #include <libdroid/libdroid.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+#include <gio/gunixsocketaddress.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RAMP_TICK_MS 16
+
+typedef struct
+{
+  DroidLeds *leds;
+  GMainLoop *loop;
+  guint      level;
+
+  guint      ramp_source;
+  guint      ramp_from;
+  guint      ramp_to;
+  gint64     ramp_start;
+  gint64     ramp_duration;
+  gboolean   ramp_save;
+} BacklightListener;
+
+typedef struct
+{
+  BacklightListener *listener;
+  GIOStream         *connection;  /* NULL for stdin */
+  GDataInputStream  *input;
+  GOutputStream     *output;
+} BacklightClient;
+
+static gboolean
+backlight_parse_uint (const gchar *str,
+                      guint        base,
+                      guint64      max,
+                      guint64     *out)
+{
+  return g_ascii_string_to_unsigned (str, base, 0, max, out, NULL);
+}
+
+/* Accepts AARRGGBB, or RRGGBB with full alpha, optionally prefixed with # or 0x */
+static gboolean
+backlight_parse_color (const gchar *str,
+                       guint64     *color)
+{
+  if (g_str_has_prefix (str, "#"))
+    str += 1;
+  else if (g_str_has_prefix (str, "0x"))
+    str += 2;
+
+  if (!backlight_parse_uint (str, 16, G_MAXUINT32, color))
+    return FALSE;
+
+  if (strlen (str) <= 6)
+    *color |= 0xff000000;
+
+  return TRUE;
+}
+
+static void
+backlight_listener_stop_ramp (BacklightListener *listener)
+{
+  g_clear_handle_id (&listener->ramp_source, g_source_remove);
+}
+
+static gboolean
+backlight_listener_ramp_tick (gpointer user_data)
+{
+  BacklightListener *listener = user_data;
+  gint64 elapsed = g_get_monotonic_time () - listener->ramp_start;
+  gboolean done = (elapsed >= listener->ramp_duration);
+
+  if (done)
+    listener->level = listener->ramp_to;
+  else
+    listener->level = listener->ramp_from + ((gint64) listener->ramp_to - listener->ramp_from) *
+      elapsed / listener->ramp_duration;
+
+  /* Only the final level is worth saving */
+  if (!droid_leds_set_backlight (listener->leds, listener->level, done && listener->ramp_save))
+    g_warning ("Unable to set backlight!");
+
+  if (done)
+    {
+      listener->ramp_source = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Handles a single command, and appends what should be sent back to
+ * reply. Returns FALSE if the listener should quit.
+ */
+static gboolean
+backlight_listener_handle (BacklightListener *listener,
+                           const gchar       *line,
+                           GString           *reply)
+{
+  g_auto (GStrv) argv = NULL;
+  const gchar *command;
+  guint64 level, duration, color, on_ms, off_ms;
+  gboolean save;
+  gint argc;
+
+  if (!g_shell_parse_argv (line, &argc, &argv, NULL))
+    {
+      g_string_append (reply, "error: unable to parse command\n");
+      return TRUE;
+    }
+
+  command = argv[0];
+  save = (argc > 1 && g_strcmp0 (argv[argc - 1], "save") == 0);
+
+  /* A bare number is a level */
+  if (backlight_parse_uint (command, 10, 255, &level) ||
+      (g_strcmp0 (command, "level") == 0 && argc >= 2 &&
+       backlight_parse_uint (argv[1], 10, 255, &level)))
+    {
+      backlight_listener_stop_ramp (listener);
+      listener->level = level;
+
+      if (!droid_leds_set_backlight (listener->leds, level, save))
+        g_string_append (reply, "error: unable to set backlight\n");
+    }
+  else if (g_strcmp0 (command, "ramp") == 0 && argc >= 3 &&
+           backlight_parse_uint (argv[1], 10, 255, &level) &&
+           backlight_parse_uint (argv[2], 10, G_MAXUINT32, &duration))
+    {
+      backlight_listener_stop_ramp (listener);
+      listener->ramp_from     = listener->level;
+      listener->ramp_to       = level;
+      listener->ramp_start    = g_get_monotonic_time ();
+      listener->ramp_duration = MAX (duration, 1) * 1000;
+      listener->ramp_save     = save;
+
+      if (backlight_listener_ramp_tick (listener))
+        listener->ramp_source = g_timeout_add (RAMP_TICK_MS, backlight_listener_ramp_tick,
+          listener);
+    }
+  else if (g_strcmp0 (command, "notify") == 0 && argc >= 2 &&
+           backlight_parse_color (argv[1], &color))
+    {
+      on_ms = 1000;
+      off_ms = 1000;
+
+      if ((argc >= 3 && !backlight_parse_uint (argv[2], 10, G_MAXINT32, &on_ms)) ||
+          (argc >= 4 && !backlight_parse_uint (argv[3], 10, G_MAXINT32, &off_ms)))
+        g_string_append (reply, "error: invalid flash timings\n");
+      else if (!droid_leds_set_notification (listener->leds, color, on_ms, off_ms))
+        g_string_append (reply, "error: unable to set notification light\n");
+    }
+  else if (g_strcmp0 (command, "clear") == 0)
+    {
+      if (!droid_leds_clear_notification (listener->leds))
+        g_string_append (reply, "error: unable to clear notification light\n");
+    }
+  else if (g_strcmp0 (command, "get") == 0)
+    {
+      g_string_append_printf (reply, "%u\n", listener->level);
+    }
+  else if (g_strcmp0 (command, "quit") == 0)
+    {
+      return FALSE;
+    }
+  else
+    {
+      g_string_append_printf (reply, "error: unknown command %s\n", command);
+    }
+
+  return TRUE;
+}
+
+static void
+backlight_client_free (BacklightClient *client)
+{
+  g_clear_object (&client->input);
+  g_clear_object (&client->output);
+  g_clear_object (&client->connection);
+  g_free (client);
+}
+
+static void
+backlight_client_read_line (GObject      *source,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+  BacklightClient *client = user_data;
+  g_autofree gchar *line = NULL;
+  g_autoptr (GString) reply = g_string_new (NULL);
+  g_autoptr (GError) error = NULL;
+  gboolean keep_going = TRUE;
+
+  line = g_data_input_stream_read_line_finish_utf8 (client->input, result, NULL, &error);
+
+  if (line == NULL)
+    {
+      if (error != NULL)
+        g_warning ("Unable to read command: %s", error->message);
+
+      /* Closing stdin stops the tool, sockets only drop the client */
+      if (client->connection == NULL)
+        g_main_loop_quit (client->listener->loop);
+
+      backlight_client_free (client);
+      return;
+    }
+
+  g_strstrip (line);
+  if (*line != '\0')
+    keep_going = backlight_listener_handle (client->listener, line, reply);
+
+  if (reply->len > 0 &&
+      !g_output_stream_write_all (client->output, reply->str, reply->len, NULL, NULL, &error))
+    g_warning ("Unable to send reply: %s", error->message);
+
+  if (!keep_going)
+    {
+      g_main_loop_quit (client->listener->loop);
+      backlight_client_free (client);
+      return;
+    }
+
+  g_data_input_stream_read_line_async (client->input, G_PRIORITY_DEFAULT, NULL,
+    backlight_client_read_line, client);
+}
+
+static void
+backlight_client_new (BacklightListener *listener,
+                      GIOStream         *connection,
+                      GInputStream      *input,
+                      GOutputStream     *output)
+{
+  BacklightClient *client = g_new0 (BacklightClient, 1);
+
+  client->listener   = listener;
+  client->connection = connection ? g_object_ref (connection) : NULL;
+  client->input      = g_data_input_stream_new (input);
+  client->output     = g_object_ref (output);
+
+  g_data_input_stream_read_line_async (client->input, G_PRIORITY_DEFAULT, NULL,
+    backlight_client_read_line, client);
+}
+
+static gboolean
+backlight_listener_incoming (GSocketService    *service,
+                             GSocketConnection *connection,
+                             GObject           *source_object,
+                             gpointer           user_data)
+{
+  backlight_client_new (user_data, G_IO_STREAM (connection),
+    g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+    g_io_stream_get_output_stream (G_IO_STREAM (connection)));
+
+  return TRUE;
+}
+
+/*
+ * Keeps running and reads commands, one per line, from stdin or from
+ * clients connecting to socket_path, reusing the same DroidLeds.
+ */
+static int
+backlight_listen (DroidLeds   *leds,
+                  const gchar *socket_path)
+{
+  g_autoptr (GSocketService) service = NULL;
+  g_autoptr (GSocketAddress) address = NULL;
+  g_autoptr (GInputStream) input = NULL;
+  g_autoptr (GOutputStream) output = NULL;
+  g_autoptr (GError) error = NULL;
+  BacklightListener listener = { 0, };
+
+  listener.leds  = leds;
+  listener.loop  = g_main_loop_new (NULL, FALSE);
+
+  /* Start from where the panel actually is, ramps would jump otherwise */
+  if (!droid_leds_read_backlight (leds, 0, &listener.level))
+    listener.level = droid_leds_get_backlight (leds);
+
+  if (socket_path != NULL)
+    {
+      /* Remove stale sockets from previous runs */
+      g_unlink (socket_path);
+
+      service = g_socket_service_new ();
+      address = g_unix_socket_address_new (socket_path);
+
+      if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error))
+        {
+          g_warning ("Unable to listen on %s: %s", socket_path, error->message);
+          g_main_loop_unref (listener.loop);
+          return EXIT_FAILURE;
+        }
+
+      g_signal_connect (service, "incoming", G_CALLBACK (backlight_listener_incoming),
+        &listener);
+      g_socket_service_start (service);
+    }
+  else
+    {
+      input = g_unix_input_stream_new (STDIN_FILENO, FALSE);
+      output = g_unix_output_stream_new (STDOUT_FILENO, FALSE);
+      backlight_client_new (&listener, NULL, input, output);
+    }
+
+  g_main_loop_run (listener.loop);
+
+  backlight_listener_stop_ramp (&listener);
+
+  if (service != NULL)
+    {
+      g_socket_service_stop (service);
+      g_unlink (socket_path);
+    }
+
+  g_main_loop_unref (listener.loop);
+
+  return EXIT_SUCCESS;
+}
 
 int
 main (int argc, char** argv)
@@ -48,6 +370,8 @@ main (int argc, char** argv)
   gboolean save = FALSE;
   gboolean restore = FALSE;
   gboolean info = FALSE;
+  gboolean listen = FALSE;
+  g_autofree gchar *socket_path = NULL;
   g_autoptr (GError) err = NULL;
   g_autoptr (GOptionContext) context = NULL;
   g_autoptr (DroidLeds) leds = NULL;
@@ -68,6 +392,14 @@ main (int argc, char** argv)
       "info", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &info,
       "Show info on supported lights, and exit", NULL,
     },
+    {
+      "listen", 'L', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &listen,
+      "Keep running and read commands from stdin, one per line", NULL,
+    },
+    {
+      "socket", 'S', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &socket_path,
+      "With --listen, read commands from clients of this UNIX socket instead", NULL,
+    },
     {NULL},
   };
 
@@ -85,6 +417,8 @@ main (int argc, char** argv)
 
   if (info)
     {
+      guint actual;
+
       printf ("Backlight supported: %d\n"
               "Backlight stored level: %d\n"
               "Notification light supported: %d\n",
@@ -92,8 +426,15 @@ main (int argc, char** argv)
               droid_leds_get_backlight (leds),
               droid_leds_is_kind_supported (leds, DROID_LEDS_KIND_NOTIFICATION));
 
+      if (droid_leds_read_backlight (leds, 0, &actual))
+        printf ("Backlight actual level: %u\n", actual);
+
       return EXIT_SUCCESS;
     }
+  else if (listen)
+    {
+      return backlight_listen (leds, socket_path);
+    }
   else if (restore)
     {
       save = FALSE;
@@ -0,0 +1,366 @@
+/* bench.c
+ *
+ * Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Load generator for the lights stack: sets lights at a given rate from
+ * a number of threads, and reports throughput and latencies.
+ */
+
+#include <libdroid/libdroid.h>
+
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+
+typedef enum
+{
+  BENCH_TARGET_BACKLIGHT = 0,
+  BENCH_TARGET_NOTIFICATION,
+  BENCH_TARGET_BOTH,
+} BenchTarget;
+
+typedef struct
+{
+  DroidLeds   *leds;
+  BenchTarget  target;
+  guint64      count;
+  gint64       start_time;
+  gint64       end_time;
+  gint64       interval;   /* Between requests of this worker, 0 means unthrottled */
+
+  GArray      *latencies;  /* gint64, in microseconds */
+  guint64      failures;
+  gdouble      jitter_sum;
+} BenchWorker;
+
+static gboolean
+bench_request (BenchWorker *worker,
+               guint64      index)
+{
+  gboolean notification;
+
+  switch (worker->target)
+    {
+    case BENCH_TARGET_NOTIFICATION:
+      notification = TRUE;
+      break;
+
+    case BENCH_TARGET_BOTH:
+      notification = (index % 2);
+      break;
+
+    case BENCH_TARGET_BACKLIGHT:
+    default:
+      notification = FALSE;
+      break;
+    }
+
+  if (!notification)
+    /* Sweep through every level, so that nothing can be skipped */
+    return droid_leds_set_backlight (worker->leds, index % 256, FALSE);
+  else if ((index / 2) % 2)
+    return droid_leds_clear_notification (worker->leds);
+  else
+    return droid_leds_set_notification (worker->leds, 0xffffffff, 1000, 1000);
+}
+
+static gpointer
+bench_worker_run (gpointer user_data)
+{
+  BenchWorker *worker = user_data;
+  gint64 scheduled = worker->start_time;
+  gint64 now, latency, previous = -1;
+
+  for (guint64 i=0; worker->count == 0 || i < worker->count; i++)
+    {
+      now = g_get_monotonic_time ();
+
+      if (worker->interval > 0)
+        {
+          /* Keep to the schedule, regardless of how long requests took */
+          if (scheduled > now)
+            {
+              g_usleep (scheduled - now);
+              now = g_get_monotonic_time ();
+            }
+
+          scheduled += worker->interval;
+        }
+
+      if (now >= worker->end_time)
+        break;
+
+      if (!bench_request (worker, i))
+        worker->failures++;
+
+      latency = g_get_monotonic_time () - now;
+      g_array_append_val (worker->latencies, latency);
+
+      if (previous >= 0)
+        worker->jitter_sum += ABS (latency - previous);
+      previous = latency;
+    }
+
+  return NULL;
+}
+
+static gint
+bench_compare_latencies (gconstpointer a,
+                         gconstpointer b)
+{
+  gint64 latency_a = *(const gint64 *) a;
+  gint64 latency_b = *(const gint64 *) b;
+
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static gint64
+bench_percentile (GArray  *latencies,
+                  gdouble  percentile)
+{
+  guint rank;
+
+  if (latencies->len == 0)
+    return 0;
+
+  /* Nearest rank */
+  rank = ceil (percentile / 100.0 * latencies->len);
+  rank = CLAMP(rank, 1, latencies->len);
+
+  return g_array_index (latencies, gint64, rank - 1);
+}
+
+int
+main (int argc, char** argv)
+{
+  g_autofree gchar *mode = NULL;
+  g_autofree gchar *target = NULL;
+  gint rate = 0;
+  gint threads = 1;
+  gint duration = 10;
+  gint64 count = 0;
+  gboolean json = FALSE;
+  g_autoptr (GError) err = NULL;
+  g_autoptr (GOptionContext) context = NULL;
+  g_autoptr (GArray) latencies = NULL;
+  g_autoptr (DroidLeds) shared_leds = NULL;
+  g_autofree BenchWorker *workers = NULL;
+  g_autofree GThread **worker_threads = NULL;
+  DroidLedsFlags flags;
+  BenchTarget bench_target;
+  DroidLedsKind kind;
+  guint64 failures = 0, jitter_samples = 0;
+  gdouble jitter_sum = 0, elapsed, mean = 0;
+  gint64 start_time;
+  const GOptionEntry entries[] = {
+    {
+      "mode", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &mode,
+      "How requests are sent: sync (default), async or oneway", "MODE",
+    },
+    {
+      "target", 'T', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &target,
+      "The lights to set: backlight (default), notification or both", "TARGET",
+    },
+    {
+      "rate", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &rate,
+      "Requests per second across all threads, 0 for as fast as possible", "RATE",
+    },
+    {
+      "threads", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &threads,
+      "The number of threads sending requests", "THREADS",
+    },
+    {
+      "duration", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &duration,
+      "How long to run for, in seconds", "SECONDS",
+    },
+    {
+      "count", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT64, &count,
+      "Stop after this many requests per thread", "COUNT",
+    },
+    {
+      "json", 'j', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &json,
+      "Print the results as JSON", NULL,
+    },
+    {NULL},
+  };
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries(context, entries, NULL);
+  g_option_context_parse(context, &argc, &argv, &err);
+
+  if (err != NULL)
+    {
+      g_error ("Unable to parse arguments: %s", err->message);
+      return EXIT_FAILURE;
+    }
+
+  if (mode == NULL || g_strcmp0 (mode, "sync") == 0)
+    flags = DROID_LEDS_FLAGS_NONE;
+  else if (g_strcmp0 (mode, "async") == 0)
+    flags = DROID_LEDS_FLAGS_THREADED;
+  else if (g_strcmp0 (mode, "oneway") == 0)
+    flags = DROID_LEDS_FLAGS_ONEWAY;
+  else
+    g_error ("Unknown mode %s", mode);
+
+  if (target == NULL || g_strcmp0 (target, "backlight") == 0)
+    bench_target = BENCH_TARGET_BACKLIGHT;
+  else if (g_strcmp0 (target, "notification") == 0)
+    bench_target = BENCH_TARGET_NOTIFICATION;
+  else if (g_strcmp0 (target, "both") == 0)
+    bench_target = BENCH_TARGET_BOTH;
+  else
+    g_error ("Unknown target %s", target);
+
+  if (threads < 1 || rate < 0 || duration < 1 || count < 0)
+    g_error ("Invalid arguments");
+
+  /* In async mode, every thread shares the same queue */
+  if (flags & DROID_LEDS_FLAGS_THREADED)
+    shared_leds = droid_leds_new_full (flags);
+
+  workers = g_new0 (BenchWorker, threads);
+  worker_threads = g_new0 (GThread *, threads);
+
+  for (gint i=0; i < threads; i++)
+    {
+      workers[i].leds      = shared_leds ? g_object_ref (shared_leds) : droid_leds_new_full (flags);
+      workers[i].target    = bench_target;
+      workers[i].count     = count;
+      workers[i].interval  = (rate > 0) ? (G_USEC_PER_SEC * threads / rate) : 0;
+      workers[i].latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+    }
+
+  kind = (bench_target == BENCH_TARGET_NOTIFICATION) ?
+    DROID_LEDS_KIND_NOTIFICATION : DROID_LEDS_KIND_BACKLIGHT;
+  if (!droid_leds_is_kind_supported (workers[0].leds, kind) ||
+      (bench_target == BENCH_TARGET_BOTH &&
+       !droid_leds_is_kind_supported (workers[0].leds, DROID_LEDS_KIND_NOTIFICATION)))
+    g_error ("The requested lights are not supported");
+
+  start_time = g_get_monotonic_time ();
+
+  for (gint i=0; i < threads; i++)
+    {
+      /* Spread the workers evenly across the interval */
+      workers[i].start_time = start_time + workers[i].interval * i / threads;
+      workers[i].end_time   = start_time + (gint64) duration * G_USEC_PER_SEC;
+      worker_threads[i] = g_thread_new ("bench-worker", bench_worker_run, &workers[i]);
+    }
+
+  latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  for (gint i=0; i < threads; i++)
+    {
+      g_thread_join (worker_threads[i]);
+
+      g_array_append_vals (latencies, workers[i].latencies->data, workers[i].latencies->len);
+      failures += workers[i].failures;
+      jitter_sum += workers[i].jitter_sum;
+      if (workers[i].latencies->len > 1)
+        jitter_samples += workers[i].latencies->len - 1;
+    }
+
+  /* Queued requests are only done once they reach the HAL */
+  if (shared_leds)
+    droid_leds_flush (shared_leds);
+
+  elapsed = (gdouble) (g_get_monotonic_time () - start_time) / G_USEC_PER_SEC;
+
+  for (gint i=0; i < threads; i++)
+    {
+      g_object_unref (workers[i].leds);
+      g_array_unref (workers[i].latencies);
+    }
+
+  g_array_sort (latencies, bench_compare_latencies);
+  for (guint i=0; i < latencies->len; i++)
+    mean += (gdouble) g_array_index (latencies, gint64, i) / latencies->len;
+
+  if (json)
+    {
+      printf ("{\n"
+              "  \"mode\": \"%s\",\n"
+              "  \"target\": \"%s\",\n"
+              "  \"threads\": %d,\n"
+              "  \"rate\": %d,\n"
+              "  \"requests\": %u,\n"
+              "  \"failures\": %" G_GUINT64_FORMAT ",\n"
+              "  \"elapsed_s\": %.3f,\n"
+              "  \"throughput\": %.1f,\n"
+              "  \"latency_us\": {\n"
+              "    \"min\": %" G_GINT64_FORMAT ",\n"
+              "    \"mean\": %.1f,\n"
+              "    \"p50\": %" G_GINT64_FORMAT ",\n"
+              "    \"p90\": %" G_GINT64_FORMAT ",\n"
+              "    \"p99\": %" G_GINT64_FORMAT ",\n"
+              "    \"p999\": %" G_GINT64_FORMAT ",\n"
+              "    \"max\": %" G_GINT64_FORMAT "\n"
+              "  },\n"
+              "  \"jitter_us\": %.1f\n"
+              "}\n",
+              mode ? mode : "sync", target ? target : "backlight", threads, rate,
+              latencies->len, failures, elapsed, latencies->len / elapsed,
+              bench_percentile (latencies, 0), mean,
+              bench_percentile (latencies, 50), bench_percentile (latencies, 90),
+              bench_percentile (latencies, 99), bench_percentile (latencies, 99.9),
+              bench_percentile (latencies, 100),
+              jitter_samples ? jitter_sum / jitter_samples : 0);
+    }
+  else
+    {
+      printf ("Mode: %s, target: %s, threads: %d, rate: %d/s\n"
+              "Requests: %u (%" G_GUINT64_FORMAT " failed) in %.3fs, %.1f/s\n"
+              "Latency (us): min %" G_GINT64_FORMAT ", mean %.1f, p50 %" G_GINT64_FORMAT
+              ", p90 %" G_GINT64_FORMAT ", p99 %" G_GINT64_FORMAT ", p99.9 %" G_GINT64_FORMAT
+              ", max %" G_GINT64_FORMAT "\n"
+              "Jitter (us): %.1f\n",
+              mode ? mode : "sync", target ? target : "backlight", threads, rate,
+              latencies->len, failures, elapsed, latencies->len / elapsed,
+              bench_percentile (latencies, 0), mean,
+              bench_percentile (latencies, 50), bench_percentile (latencies, 90),
+              bench_percentile (latencies, 99), bench_percentile (latencies, 99.9),
+              bench_percentile (latencies, 100),
+              jitter_samples ? jitter_sum / jitter_samples : 0);
+
+      if (flags & DROID_LEDS_FLAGS_THREADED)
+        printf ("Latencies only cover queueing, the elapsed time includes applying the queue\n");
+    }
+
+  return (failures > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
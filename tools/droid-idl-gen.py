@@ -0,0 +1,716 @@
+#!/usr/bin/env python3
+#
+# droid-idl-gen.py
+#
+# Copyright 2024 Eugenio "g7" Paolantonio <me@medesimo.eu>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Generates a C header with the binder marshalling of a HAL from a
+# compact description of its types and methods:
+#
+#   // Comments before a declaration or a method end up in the header
+#   enum LightType : LIGHT_TYPE {
+#     BACKLIGHT = 0,
+#   }
+#
+#   struct LightState = 20 {
+#     int32 color;
+#     FlashType flashMode;
+#   }
+#
+#   interface LightHidl hidl "android.hardware.light@2.0::ILight" {
+#     1 setLight (LightType type, LightState state);
+#     2 getSupportedTypes () -> (vec<LightType> types);
+#   }
+#
+# Types are int32, the declared enums and structs, vec<T> on HIDL and
+# T[] for AIDL returns. Struct sizes are checked here and again by the
+# compiler. Interfaces are hidl or aidl, optionally followed by vintf
+# to mark AIDL requests as such.
+#
+# For each interface the header has the transaction codes, request
+# builders and reply readers for clients, request readers, reply writers
+# and a dispatch function with a handler table for services. Everything
+# is static inline and dispatch is a switch on the code.
+
+import re
+import sys
+import textwrap
+
+TOKEN_RE = re.compile(r'\s*(?://([^\n]*)|(0x[0-9a-fA-F]+|\d+)|([A-Za-z_]\w*)|("[^"]*")|(->|[{}()<>\[\];:,=]))')
+
+
+class IdlError(Exception):
+    pass
+
+
+class Enum:
+    def __init__(self, name, prefix, values, comment):
+        self.name = name
+        self.prefix = prefix
+        self.values = values
+        self.comment = comment
+
+
+class Struct:
+    def __init__(self, name, size, fields, comment):
+        self.name = name
+        self.size = size
+        self.fields = fields
+        self.comment = comment
+
+
+class Method:
+    def __init__(self, code, name, params, returns, comment):
+        self.code = code
+        self.name = name
+        self.params = params
+        self.returns = returns
+        self.comment = comment
+
+
+class Interface:
+    def __init__(self, name, kind, vintf, descriptor, methods, comment):
+        self.name = name
+        self.kind = kind
+        self.vintf = vintf
+        self.descriptor = descriptor
+        self.methods = methods
+        self.comment = comment
+
+
+class Type:
+    """int32, a named enum or struct, or a vector of one of those"""
+
+    def __init__(self, name, vector=False):
+        self.name = name
+        self.vector = vector
+
+
+def snake(name):
+    return re.sub(r'(?<=[a-z0-9])([A-Z])', r'_\1', name).lower()
+
+
+class Parser:
+    def __init__(self, text, path):
+        self.tokens = []
+        self.path = path
+        pos = 0
+        line = 1
+        text = text.rstrip()
+        while pos < len(text):
+            match = TOKEN_RE.match(text, pos)
+            if match is None:
+                raise IdlError('%s:%d: unexpected input' % (path, line))
+            line += text.count('\n', pos, match.end())
+            pos = match.end()
+            comment, number, ident, string, punct = match.groups()
+            if comment is not None:
+                self.tokens.append(('comment', comment.strip(), line))
+            elif number is not None:
+                self.tokens.append(('number', int(number, 0), line))
+            elif ident is not None:
+                self.tokens.append(('ident', ident, line))
+            elif string is not None:
+                self.tokens.append(('string', string[1:-1], line))
+            else:
+                self.tokens.append(('punct', punct, line))
+        self.index = 0
+        self.types = {'int32': 'int32'}
+
+    def fail(self, message):
+        line = self.tokens[min(self.index, len(self.tokens) - 1)][2] if self.tokens else 0
+        raise IdlError('%s:%d: %s' % (self.path, line, message))
+
+    # The comment block right before the current token, if any
+    def comments(self):
+        lines = []
+        last = 0
+        while self.index < len(self.tokens) and self.tokens[self.index][0] == 'comment':
+            kind, text, line = self.tokens[self.index]
+            if line > last + 1:
+                lines = []
+            lines.append(text)
+            last = line
+            self.index += 1
+        if lines and self.index < len(self.tokens) and self.tokens[self.index][2] > last + 1:
+            lines = []
+        return lines
+
+    def peek(self):
+        self.comments()
+        if self.index >= len(self.tokens):
+            return (None, None, 0)
+        return self.tokens[self.index]
+
+    def next(self, kind, value=None):
+        token = self.peek()
+        if token[0] != kind or (value is not None and token[1] != value):
+            self.fail('expected %s' % (value or kind))
+        self.index += 1
+        return token[1]
+
+    def accept(self, value):
+        if self.peek()[1] == value:
+            self.index += 1
+            return True
+        return False
+
+    def parse(self):
+        decls = []
+        while True:
+            comment = self.comments()
+            if self.index >= len(self.tokens):
+                return decls
+            keyword = self.next('ident')
+            if keyword == 'enum':
+                decls.append(self.parse_enum(comment))
+            elif keyword == 'struct':
+                decls.append(self.parse_struct(comment))
+            elif keyword == 'interface':
+                decls.append(self.parse_interface(comment))
+            else:
+                self.fail('unknown declaration %s' % keyword)
+
+    def declare(self, name, what):
+        if name in self.types:
+            self.fail('%s declared twice' % name)
+        self.types[name] = what
+
+    def parse_type(self):
+        name = self.next('ident')
+        if name == 'vec':
+            self.next('punct', '<')
+            inner = self.parse_type()
+            self.next('punct', '>')
+            return Type(inner.name, vector=True)
+        if name not in self.types:
+            self.fail('unknown type %s' % name)
+        if self.accept('['):
+            self.next('punct', ']')
+            return Type(name, vector=True)
+        return Type(name)
+
+    def parse_enum(self, comment):
+        name = self.next('ident')
+        self.next('punct', ':')
+        prefix = self.next('ident')
+        values = []
+        self.next('punct', '{')
+        while not self.accept('}'):
+            member = self.next('ident')
+            self.next('punct', '=')
+            values.append((member, self.next('number')))
+            if not self.accept(','):
+                self.next('punct', '}')
+                break
+        self.declare(name, 'enum')
+        return Enum(name, prefix, values, comment)
+
+    def parse_struct(self, comment):
+        name = self.next('ident')
+        self.next('punct', '=')
+        size = self.next('number')
+        fields = []
+        self.next('punct', '{')
+        while not self.accept('}'):
+            field_type = self.parse_type()
+            if field_type.vector:
+                self.fail('vectors can not be struct fields')
+            fields.append((field_type, self.next('ident')))
+            self.next('punct', ';')
+        self.declare(name, 'struct')
+        return Struct(name, size, fields, comment)
+
+    def parse_params(self):
+        params = []
+        self.next('punct', '(')
+        while not self.accept(')'):
+            param_type = self.parse_type()
+            params.append((param_type, self.next('ident')))
+            if not self.accept(','):
+                self.next('punct', ')')
+                break
+        return params
+
+    def parse_interface(self, comment):
+        name = self.next('ident')
+        kind = self.next('ident')
+        if kind not in ('hidl', 'aidl'):
+            self.fail('interfaces are either hidl or aidl')
+        vintf = self.accept('vintf')
+        descriptor = self.next('string')
+        methods = []
+        self.next('punct', '{')
+        while True:
+            method_comment = self.comments()
+            if self.accept('}'):
+                break
+            code = self.next('number')
+            method = self.next('ident')
+            params = self.parse_params()
+            returns = self.parse_params() if self.accept('->') else []
+            self.next('punct', ';')
+            methods.append(Method(code, method, params, returns, method_comment))
+        return Interface(name, kind, vintf, descriptor, methods, comment)
+
+
+class Generator:
+    def __init__(self, decls, source):
+        self.decls = decls
+        self.source = source
+        self.kinds = {'int32': 'int32'}
+        self.sizes = {'int32': 4}
+        self.out = []
+
+    def emit(self, text=''):
+        self.out.append(text)
+
+    def comment(self, lines, indent=''):
+        if not lines:
+            return
+        if isinstance(lines, str):
+            lines = textwrap.wrap(lines, 72 - len(indent))
+        if len(lines) == 1:
+            self.emit('%s/* %s */' % (indent, lines[0]))
+            return
+        self.emit('%s/*' % indent)
+        for line in lines:
+            self.emit(('%s * %s' % (indent, line)).rstrip())
+        self.emit('%s */' % indent)
+
+    def ctype(self, name):
+        return 'gint32' if name == 'int32' else name
+
+    def is_struct(self, name):
+        return self.kinds[name] == 'struct'
+
+    def generate(self):
+        self.emit('/* Generated by droid-idl-gen.py from %s, do not edit */' % self.source)
+        self.emit()
+        self.emit('#pragma once')
+        self.emit()
+        self.emit('#include <string.h>')
+        self.emit('#include <glib.h>')
+        self.emit('#include <gbinder.h>')
+        self.emit()
+        self.emit('G_BEGIN_DECLS')
+        for decl in self.decls:
+            self.emit()
+            if isinstance(decl, Enum):
+                self.generate_enum(decl)
+            elif isinstance(decl, Struct):
+                self.generate_struct(decl)
+            else:
+                self.generate_interface(decl)
+        self.emit()
+        self.emit('G_END_DECLS')
+        return '\n'.join(self.out) + '\n'
+
+    def generate_enum(self, enum):
+        self.comment(enum.comment)
+        self.emit('typedef enum')
+        self.emit('{')
+        for member, value in enum.values:
+            self.emit('  %s_%s = %d,' % (enum.prefix, member, value))
+        self.emit('} %s;' % enum.name)
+        self.emit('G_STATIC_ASSERT (sizeof (%s) == 4);' % enum.name)
+        self.kinds[enum.name] = 'enum'
+        self.sizes[enum.name] = 4
+
+    def generate_struct(self, struct):
+        offsets = []
+        size = 0
+        self.comment(struct.comment)
+        self.emit('typedef struct')
+        self.emit('{')
+        for field_type, name in struct.fields:
+            offsets.append((name, size))
+            size += self.sizes[field_type.name]
+            # Enums travel as 32 bit words whatever the compiler picks
+            aligned = ' __attribute__ ((aligned (4)))' if self.kinds[field_type.name] == 'enum' else ''
+            self.emit('  %s %s%s;' % (self.ctype(field_type.name), name, aligned))
+        self.emit('} %s;' % struct.name)
+        if size != struct.size:
+            raise IdlError('%s is %d bytes, not %d' % (struct.name, size, struct.size))
+        self.emit('G_STATIC_ASSERT (sizeof (%s) == %d);' % (struct.name, struct.size))
+        for name, offset in offsets:
+            self.emit('G_STATIC_ASSERT (G_STRUCT_OFFSET (%s, %s) == %d);' % (struct.name, name, offset))
+        self.kinds[struct.name] = 'struct'
+        self.sizes[struct.name] = size
+
+    # Function arguments for values sent by the caller
+    def in_args(self, params):
+        args = []
+        for param_type, name in params:
+            ctype = self.ctype(param_type.name)
+            if param_type.vector:
+                args += ['const %s *%s' % (ctype, name), 'gsize n_%s' % name]
+            elif self.is_struct(param_type.name):
+                args.append('const %s *%s' % (ctype, name))
+            else:
+                args.append('%s %s' % (ctype, name))
+        return args
+
+    # Function arguments for values read back by the caller
+    def out_args(self, iface, params):
+        args = []
+        for param_type, name in params:
+            ctype = self.ctype(param_type.name)
+            if param_type.vector and iface.kind == 'hidl':
+                args += ['const %s **%s' % (ctype, name), 'gsize *n_%s' % name]
+            elif param_type.vector:
+                args += ['%s **%s' % (ctype, name), 'gsize *n_%s' % name]
+            else:
+                args.append('%s *%s' % (ctype, name))
+        return args
+
+    def signature(self, ret, name, args):
+        self.emit('static inline %s' % ret)
+        if not args:
+            self.emit('%s (void)' % name)
+            return
+        # Names are aligned, stars hang to their left
+        split = [self.split_arg(arg) for arg in args]
+        stars = max(len(var) - len(var.lstrip('*')) for _, var in split)
+        width = max(len(ctype) for ctype, _ in split) + 1 + stars
+        lines = []
+        for ctype, var in split:
+            pointer = len(var) - len(var.lstrip('*'))
+            lines.append('%s%s' % (ctype.ljust(width - pointer), var))
+        indent = ' ' * (len(name) + 2)
+        self.emit('%s (%s%s' % (name, lines[0], ',' if len(lines) > 1 else ')'))
+        for i, line in enumerate(lines[1:]):
+            self.emit('%s%s%s' % (indent, line, ',' if i < len(lines) - 2 else ')'))
+
+    def split_arg(self, arg):
+        var = re.search(r'\**\w+$', arg).group(0)
+        ctype = arg[:len(arg) - len(var)].rstrip()
+        return ctype, var
+
+    def generate_interface(self, iface):
+        prefix = 'droid_' + snake(iface.name)
+        type_prefix = 'Droid' + iface.name
+        const = prefix.upper()
+
+        self.comment(iface.comment)
+        self.emit('#define %s_IFACE "%s"' % (const, iface.descriptor))
+        self.emit()
+        self.emit('enum')
+        self.emit('{')
+        for method in iface.methods:
+            self.comment(method.comment, '  ')
+            code = ('0x%08x' if method.code > 0xffff else '%d') % method.code
+            self.emit('  %s_%s = %s,' % (const, snake(method.name).upper(), code))
+        self.emit('};')
+
+        for method in iface.methods:
+            for param_type, name in method.params:
+                if param_type.vector and iface.kind == 'aidl':
+                    raise IdlError('%s: AIDL arrays are only supported as returns' % method.name)
+            for param_type, name in method.returns:
+                if self.is_struct(param_type.name) and not param_type.vector:
+                    raise IdlError('%s: structs are only supported as arguments' % method.name)
+            self.generate_client(iface, prefix, method)
+            self.generate_server(iface, prefix, type_prefix, method)
+
+        self.generate_error(iface, prefix)
+        self.generate_dispatch(iface, prefix, type_prefix, const)
+
+    def generate_client(self, iface, prefix, method):
+        name = snake(method.name)
+
+        self.emit()
+        self.comment(['Builds a %s request%s' % (method.name,
+                      ', vectors are referenced until it is sent'
+                      if any(t.vector for t, _ in method.params) else '')])
+        self.signature('GBinderLocalRequest *', '%s_%s_request' % (prefix, name),
+                       ['GBinderClient *client'] + self.in_args(method.params))
+        self.emit('{')
+        self.emit('  GBinderLocalRequest *request = gbinder_client_new_request (client);')
+        self.emit('  GBinderWriter writer;')
+        self.emit()
+        self.emit('  gbinder_local_request_init_writer (request, &writer);')
+        for param_type, pname in method.params:
+            if param_type.vector:
+                self.emit('  gbinder_writer_append_hidl_vec (&writer, %s, n_%s, sizeof (%s));'
+                          % (pname, pname, self.ctype(param_type.name)))
+            elif self.is_struct(param_type.name) and iface.kind == 'hidl':
+                self.emit('  gbinder_writer_append_buffer_object (&writer,')
+                self.emit('    gbinder_writer_memdup (&writer, %s, sizeof (*%s)), sizeof (*%s));'
+                          % (pname, pname, pname))
+            elif self.is_struct(param_type.name):
+                self.emit('  gbinder_writer_append_parcelable (&writer, %s, sizeof (*%s));' % (pname, pname))
+                if iface.vintf:
+                    self.emit('  gbinder_writer_append_int32 (&writer, 0x3f); /* vintf stability */')
+            else:
+                self.emit('  gbinder_writer_append_int32 (&writer, %s);' % pname)
+        self.emit()
+        self.emit('  return request;')
+        self.emit('}')
+
+        self.emit()
+        summary = ['Returns TRUE if the %s reply is a success and has all the values' % method.name]
+        if any(t.vector and iface.kind == 'aidl' for t, _ in method.returns):
+            summary[0] += ','
+            summary.append('arrays are allocated and to be freed with g_free()')
+        self.comment(summary)
+        self.signature('gboolean', '%s_read_%s_reply' % (prefix, name),
+                       ['GBinderRemoteReply *reply'] + self.out_args(iface, method.returns))
+        self.emit('{')
+        self.emit('  GBinderReader reader;')
+        self.emit('  gint32 header;')
+        if any(t.vector for t, _ in method.returns):
+            self.emit('  gsize size = 0;')
+        if any(t.vector and iface.kind == 'aidl' for t, _ in method.returns):
+            self.emit('  gint32 count;')
+        for param_type, pname in method.returns:
+            if param_type.vector and iface.kind == 'aidl':
+                self.emit('  g_autoptr (GArray) %s_array = NULL;' % pname)
+        if any(self.kinds[t.name] == 'enum' and not t.vector for t, _ in method.returns):
+            self.emit('  gint32 value;')
+        self.emit()
+        self.emit('  if (reply == NULL)')
+        self.emit('    return FALSE;')
+        self.emit()
+        self.emit('  gbinder_remote_reply_init_reader (reply, &reader);')
+        self.emit()
+        self.emit('  /* The %s, 0 on success */' % ('status' if iface.kind == 'hidl' else 'exception'))
+        self.emit('  if (!gbinder_reader_read_int32 (&reader, &header) || header != 0)')
+        self.emit('    return FALSE;')
+        for param_type, pname in method.returns:
+            ctype = self.ctype(param_type.name)
+            self.emit()
+            if param_type.vector and iface.kind == 'hidl':
+                self.emit('  *n_%s = 0;' % pname)
+                self.emit('  *%s = gbinder_reader_read_hidl_vec (&reader, n_%s, &size);' % (pname, pname))
+                self.emit('  if (*n_%s > 0 && (*%s == NULL || size != sizeof (%s)))' % (pname, pname, ctype))
+                self.emit('    return FALSE;')
+            elif param_type.vector:
+                self.emit('  /* Grown as items are read, the count is not trusted */')
+                self.emit('  if (!gbinder_reader_read_int32 (&reader, &count) || count < 0)')
+                self.emit('    return FALSE;')
+                self.emit()
+                self.emit('  %s_array = g_array_new (FALSE, FALSE, sizeof (%s));' % (pname, ctype))
+                self.emit('  for (gint32 i=0; i < count; i++)')
+                self.emit('    {')
+                self.emit('      const void *item = gbinder_reader_read_parcelable (&reader, &size);')
+                self.emit()
+                self.emit('      if (item == NULL || size < sizeof (%s))' % ctype)
+                self.emit('        return FALSE;')
+                self.emit()
+                self.emit('      g_array_append_vals (%s_array, item, 1);' % pname)
+                self.emit('    }')
+                self.emit()
+                self.emit('  *n_%s = %s_array->len;' % (pname, pname))
+                self.emit('  *%s = (%s *) g_array_free (g_steal_pointer (&%s_array), FALSE);'
+                          % (pname, ctype, pname))
+            elif self.kinds[param_type.name] == 'enum':
+                self.emit('  if (!gbinder_reader_read_int32 (&reader, &value))')
+                self.emit('    return FALSE;')
+                self.emit('  *%s = (%s) value;' % (pname, ctype))
+            else:
+                self.emit('  if (!gbinder_reader_read_int32 (&reader, %s))' % pname)
+                self.emit('    return FALSE;')
+        self.emit()
+        self.emit('  return TRUE;')
+        self.emit('}')
+
+    def generate_server(self, iface, prefix, type_prefix, method):
+        name = snake(method.name)
+        args_type = '%s%sArgs' % (type_prefix, method.name[0].upper() + method.name[1:])
+
+        self.emit()
+        self.comment(['%s arguments, vectors point into the request' % method.name]
+                     if any(t.vector for t, _ in method.params) else
+                     ['%s arguments' % method.name])
+        self.emit('typedef struct')
+        self.emit('{')
+        if not method.params:
+            self.emit('  guint8 unused;')
+        for param_type, pname in method.params:
+            ctype = self.ctype(param_type.name)
+            if param_type.vector:
+                self.emit('  const %s *%s;' % (ctype, pname))
+                self.emit('  gsize n_%s;' % pname)
+            else:
+                self.emit('  %s %s;' % (ctype, pname))
+        self.emit('} %s;' % args_type)
+
+        self.emit()
+        self.signature('gboolean', '%s_read_%s' % (prefix, name),
+                       ['GBinderRemoteRequest *request', '%s *args' % args_type])
+        self.emit('{')
+        self.emit('  GBinderReader reader;')
+        if any(self.is_struct(t.name) and not t.vector for t, _ in method.params):
+            if iface.kind == 'hidl':
+                self.emit('  GBinderBuffer *buffer;')
+            else:
+                self.emit('  const void *parcelable;')
+        if any(t.vector or (self.is_struct(t.name) and iface.kind == 'aidl') for t, _ in method.params):
+            self.emit('  gsize size = 0;')
+        if any(self.kinds[t.name] == 'enum' and not t.vector for t, _ in method.params):
+            self.emit('  gint32 value;')
+        self.emit()
+        self.emit('  gbinder_remote_request_init_reader (request, &reader);')
+        for param_type, pname in method.params:
+            ctype = self.ctype(param_type.name)
+            self.emit()
+            if param_type.vector:
+                self.emit('  args->n_%s = 0;' % pname)
+                self.emit('  args->%s = gbinder_reader_read_hidl_vec (&reader, &args->n_%s, &size);'
+                          % (pname, pname))
+                self.emit('  if (args->n_%s > 0 && (args->%s == NULL || size != sizeof (%s)))'
+                          % (pname, pname, ctype))
+                self.emit('    return FALSE;')
+            elif self.is_struct(param_type.name) and iface.kind == 'hidl':
+                self.emit('  buffer = gbinder_reader_read_buffer (&reader);')
+                self.emit('  if (buffer == NULL || buffer->size < sizeof (%s))' % ctype)
+                self.emit('    {')
+                self.emit('      g_clear_pointer (&buffer, gbinder_buffer_free);')
+                self.emit('      return FALSE;')
+                self.emit('    }')
+                self.emit()
+                self.emit('  memcpy (&args->%s, buffer->data, sizeof (%s));' % (pname, ctype))
+                self.emit('  gbinder_buffer_free (buffer);')
+            elif self.is_struct(param_type.name):
+                self.emit('  parcelable = gbinder_reader_read_parcelable (&reader, &size);')
+                self.emit('  if (parcelable == NULL || size < sizeof (%s))' % ctype)
+                self.emit('    return FALSE;')
+                self.emit()
+                self.emit('  memcpy (&args->%s, parcelable, sizeof (%s));' % (pname, ctype))
+            elif self.kinds[param_type.name] == 'enum':
+                self.emit('  if (!gbinder_reader_read_int32 (&reader, &value))')
+                self.emit('    return FALSE;')
+                self.emit('  args->%s = (%s) value;' % (pname, ctype))
+            else:
+                self.emit('  if (!gbinder_reader_read_int32 (&reader, &args->%s))' % pname)
+                self.emit('    return FALSE;')
+        self.emit()
+        self.emit('  return TRUE;')
+        self.emit('}')
+
+        self.emit()
+        args = ['GBinderLocalReply *reply']
+        if iface.kind == 'hidl':
+            args.append('gint32 status')
+        self.signature('void', '%s_write_%s_reply' % (prefix, name),
+                       args + self.in_args(method.returns))
+        self.emit('{')
+        self.emit('  GBinderWriter writer;')
+        self.emit()
+        self.emit('  gbinder_local_reply_init_writer (reply, &writer);')
+        if iface.kind == 'hidl':
+            self.emit('  gbinder_writer_append_int32 (&writer, status);')
+        else:
+            self.emit('  gbinder_writer_append_int32 (&writer, 0); /* no exception */')
+        for param_type, pname in method.returns:
+            ctype = self.ctype(param_type.name)
+            if param_type.vector and iface.kind == 'hidl':
+                self.emit('  gbinder_writer_append_hidl_vec (&writer, %s, n_%s, sizeof (%s));'
+                          % (pname, pname, ctype))
+            elif param_type.vector:
+                self.emit('  gbinder_writer_append_int32 (&writer, n_%s);' % pname)
+                self.emit('  for (gsize i=0; i < n_%s; i++)' % pname)
+                self.emit('    gbinder_writer_append_parcelable (&writer, &%s[i], sizeof (%s));'
+                          % (pname, ctype))
+            else:
+                self.emit('  gbinder_writer_append_int32 (&writer, %s);' % pname)
+        self.emit('}')
+
+    def generate_error(self, iface, prefix):
+        self.emit()
+        if iface.kind == 'hidl':
+            self.comment(['A failure status reply'])
+        else:
+            self.comment(['An IllegalArgumentException reply'])
+        self.signature('GBinderLocalReply *', '%s_error_reply' % prefix,
+                       ['GBinderLocalObject *object'])
+        self.emit('{')
+        self.emit('  GBinderLocalReply *reply = gbinder_local_object_new_reply (object);')
+        self.emit('  GBinderWriter writer;')
+        self.emit()
+        self.emit('  gbinder_local_reply_init_writer (reply, &writer);')
+        if iface.kind == 'hidl':
+            self.emit('  gbinder_writer_append_int32 (&writer, GBINDER_STATUS_FAILED);')
+        else:
+            self.emit('  gbinder_writer_append_int32 (&writer, -3);  /* EX_ILLEGAL_ARGUMENT */')
+            self.emit('  gbinder_writer_append_string16 (&writer, NULL);  /* message */')
+            self.emit('  gbinder_writer_append_int32 (&writer, 0);        /* no stack trace */')
+        self.emit()
+        self.emit('  return reply;')
+        self.emit('}')
+
+    def generate_dispatch(self, iface, prefix, type_prefix, const):
+        self.emit()
+        self.comment('Handlers return the reply, or NULL when it is deferred or not '
+                     'wanted. Unset handlers make their method unknown.')
+        self.emit('typedef struct')
+        self.emit('{')
+        for method in iface.methods:
+            args_type = '%s%sArgs' % (type_prefix, method.name[0].upper() + method.name[1:])
+            self.emit('  GBinderLocalReply *(*%s) (gpointer user_data, GBinderLocalObject *object,'
+                      % snake(method.name))
+            self.emit('    GBinderRemoteRequest *request, const %s *args);' % args_type)
+        self.emit('} %sHandlers;' % type_prefix)
+
+        self.emit()
+        self.comment('Reads the arguments of %s requests and passes them to '
+                     'their handler, malformed requests get an error reply. Sets known '
+                     'to FALSE for methods without a handler.' % iface.descriptor)
+        self.signature('GBinderLocalReply *', '%s_dispatch' % prefix,
+                       ['const %sHandlers *handlers' % type_prefix, 'gpointer user_data',
+                        'GBinderLocalObject *object', 'GBinderRemoteRequest *request',
+                        'guint code', 'gboolean *known'])
+        self.emit('{')
+        self.emit('  *known = TRUE;')
+        self.emit()
+        self.emit('  switch (code)')
+        self.emit('    {')
+        for method in iface.methods:
+            name = snake(method.name)
+            args_type = '%s%sArgs' % (type_prefix, method.name[0].upper() + method.name[1:])
+            self.emit('    case %s_%s:' % (const, name.upper()))
+            self.emit('      {')
+            self.emit('        %s args;' % args_type)
+            self.emit()
+            self.emit('        if (handlers->%s == NULL)' % name)
+            self.emit('          break;')
+            self.emit()
+            self.emit('        if (!%s_read_%s (request, &args))' % (prefix, name))
+            self.emit('          return %s_error_reply (object);' % prefix)
+            self.emit()
+            self.emit('        return handlers->%s (user_data, object, request, &args);' % name)
+            self.emit('      }')
+            self.emit()
+        self.emit('    default:')
+        self.emit('      break;')
+        self.emit('    }')
+        self.emit()
+        self.emit('  *known = FALSE;')
+        self.emit('  return NULL;')
+        self.emit('}')
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write('usage: %s INPUT.idl OUTPUT.h\n' % argv[0])
+        return 2
+
+    try:
+        with open(argv[1]) as f:
+            decls = Parser(f.read(), argv[1]).parse()
+        header = Generator(decls, argv[1].split('/')[-1]).generate()
+    except IdlError as e:
+        sys.stderr.write('%s\n' % e)
+        return 1
+
+    with open(argv[2], 'w') as f:
+        f.write(header)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))